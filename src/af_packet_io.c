@@ -152,6 +152,9 @@ enum status capture_loop(struct thread_context *ts) {
     
     while (1) {
 	struct tpacket_hdr* tphdr = (struct tpacket_hdr*)frame_ptr;
+	if (!(tphdr->tp_status & TP_STATUS_USER)) {
+	    frame_handler_flush(&ts->handler, false);  /* ring is drained */
+	}
 	while (!(tphdr->tp_status & TP_STATUS_USER)) {
 	    if (poll(fds, 1, -1) == -1) {
 		perror("error in poll");
@@ -164,6 +167,7 @@ enum status capture_loop(struct thread_context *ts) {
 	pi.ts.tv_nsec = tphdr->tp_usec * 1000;
 	pi.len = tphdr->tp_len;
 	pi.caplen = tphdr->tp_snaplen;
+	pi.flow_hash = 0;
 	
 	frame_handler(frame_handler_context, &pi, frame_ptr + tphdr->tp_mac);
 	tphdr->tp_status = TP_STATUS_KERNEL;
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sched.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <poll.h>
@@ -25,12 +26,20 @@
 #include <sys/ioctl.h>
 #include <sys/sysinfo.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <net/if.h>
 #include <net/ethernet.h> /* the L2 protocols */
+#include <netinet/in.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include "af_packet_io.h"
 #include "af_packet_v3.h"
 #include "utils.h"
+#include "analysis_pool.h"
+#include "affinity.h"
+#include "thread_stats.h"
+#include "af_xdp.h"
 
 
 /*
@@ -69,17 +78,59 @@ void af_packet_stats(int sockfd, struct stats_tracking *statst) {
   }
 }
 
+/*
+ * process_all_packets_in_block() prefetches the first
+ * BLOCK_PREFETCH_LINES cache lines of each packet (its Ethernet, IP,
+ * and TCP headers, and the start of its payload) BLOCK_PREFETCH_AHEAD
+ * packets before the handler gets to it.  The headers are usually not
+ * in cache, since the kernel wrote them, often on another CPU, and the
+ * handler reads them as soon as it is called.  The look-ahead pointer
+ * walks tp_next_offset in step with the handler, so that its loads
+ * overlap with the handler's work; collecting the offsets of a batch
+ * of packets first would put those loads, which depend on each other,
+ * back to back.
+ */
+#ifndef BLOCK_PREFETCH_AHEAD
+#define BLOCK_PREFETCH_AHEAD   8
+#endif
+#ifndef BLOCK_PREFETCH_LINES
+#define BLOCK_PREFETCH_LINES   4   /* zero turns prefetching off */
+#endif
+
+static inline struct tpacket3_hdr *prefetch_packet(struct tpacket3_hdr *pkt_hdr) {
+  const uint8_t *eth = (uint8_t *)pkt_hdr + pkt_hdr->tp_mac;
+#if BLOCK_PREFETCH_LINES > 0
+  for (unsigned int line = 0; line < BLOCK_PREFETCH_LINES; line++) {
+    __builtin_prefetch(eth + line * 64, 0, 3);
+  }
+#else
+  (void)eth;
+#endif
+  return (struct tpacket3_hdr *) ((uint8_t *)pkt_hdr + pkt_hdr->tp_next_offset);
+}
+
 void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
-				  struct stats_tracking *statst,
+				  struct thread_stats *stats,
 				  struct frame_handler *handler) {
-  int num_pkts = block_hdr->hdr.bh1.num_pkts, i;
+  unsigned int num_pkts = block_hdr->hdr.bh1.num_pkts;
   unsigned long byte_count = 0;
   struct tpacket3_hdr *pkt_hdr;
   //struct timespec ts;
   struct packet_info pi;
 
   pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *) block_hdr + block_hdr->hdr.bh1.offset_to_first_pkt);
-  for (i = 0; i < num_pkts; ++i) {
+
+  struct tpacket3_hdr *ahead = pkt_hdr;
+  unsigned int num_ahead = num_pkts < BLOCK_PREFETCH_AHEAD ? num_pkts : BLOCK_PREFETCH_AHEAD;
+  for (unsigned int i = 0; i < num_ahead; i++) {
+    ahead = prefetch_packet(ahead);
+  }
+
+  for (unsigned int i = 0; i < num_pkts; ++i) {
+    if (num_ahead < num_pkts) {
+      ahead = prefetch_packet(ahead);
+      num_ahead++;
+    }
     byte_count += pkt_hdr->tp_snaplen;
 
     /* Grab the times */
@@ -88,20 +139,128 @@ void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
 
     pi.caplen = pkt_hdr->tp_snaplen;
     pi.len = pkt_hdr->tp_snaplen; // Is this right??
+    pi.flow_hash = pkt_hdr->hv1.tp_rxhash;
 
     uint8_t *eth = (uint8_t *)pkt_hdr + pkt_hdr->tp_mac;
     handler->func(&handler->context, &pi, eth);
     
     pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *)pkt_hdr + pkt_hdr->tp_next_offset);
   }
+  frame_handler_flush(handler, false);
 
-  /* Atomic operations
-   * https://gcc.gnu.org/onlinedocs/gcc-4.1.0/gcc/Atomic-Builtins.html
-   */
-  __sync_add_and_fetch(&(statst->received_packets), num_pkts);
-  __sync_add_and_fetch(&(statst->received_bytes), byte_count);
+  thread_stats_add(stats, thread_stat_packets, num_pkts);
+  thread_stats_add(stats, thread_stat_bytes, byte_count);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+/*
+ * == Ring autotuning ==
+ *
+ * With --autotune, the rings start out with the geometry computed by
+ * af_packet_bind_and_dispatch() from the ring limits, and after the
+ * warmup period the stats thread computes a new geometry for each
+ * thread from the load that the thread saw, which the thread applies
+ * to its own ring (see rebuild_ring()).  The total size of the rings
+ * does not grow; it is divided between the threads in proportion to
+ * the bytes that each was offered (the bytes that it received, scaled
+ * up by the packets that the socket dropped), so that a thread that
+ * the fanout gives more traffic gets a bigger ring, though each thread
+ * keeps at least a quarter of an even share.  The block size is chosen
+ * so that a block fills in about AUTOTUNE_FILL_MS at the observed rate,
+ * within the block size limits and as long as there are at least
+ * af_target_blocks blocks; a thread whose queue froze gets blocks of
+ * half that size, so that a block held by the thread ties up less of
+ * the ring.  When blocks fill in less than half of the block timeout,
+ * the timeout is lowered to twice the fill time, so that a block left
+ * partly full by a lull is not held for much longer than it takes to
+ * fill one.
+ */
+#define AUTOTUNE_FILL_MS       10
+#define AUTOTUNE_MIN_SHARE_DIV  4
+
+static uint32_t autotune_block_size(const struct ring_limits *rlp, double rate, uint64_t memory, bool froze) {
+  uint32_t block_size = rlp->af_min_blocksize;
+  while (block_size < rlp->af_blocksize && block_size < rate * AUTOTUNE_FILL_MS / 1000) {
+    block_size <<= 1;
+  }
+  while (block_size > rlp->af_min_blocksize && memory / block_size < rlp->af_target_blocks) {
+    block_size >>= 1;
+  }
+  if (froze && block_size > rlp->af_min_blocksize) {
+    block_size >>= 1;
+  }
+  return block_size;
 }
 
+static void autotune_rings(struct stats_tracking *statst) {
+  const struct ring_limits *rlp = statst->rlp;
+  int num_threads = statst->num_threads;
+
+  double *offered = (double *)malloc(num_threads * sizeof(double));
+  if (offered == NULL) {
+    fprintf(stderr, "error: could not allocate memory for ring autotuning\n");
+    return;
+  }
+  double total_offered = 0.0;
+  for (int thread = 0; thread < num_threads; thread++) {
+    struct thread_storage *t = &statst->tstor[thread];
+    uint64_t packets = t->stats ? thread_stats_load(t->stats, thread_stat_packets) : 0;
+    uint64_t bytes = t->stats ? thread_stats_load(t->stats, thread_stat_bytes) : 0;
+    offered[thread] = packets ? (double)bytes * (packets + t->socket_drops) / packets : 0.0;
+    total_offered += offered[thread];
+  }
+  if (total_offered == 0.0) {
+    fprintf(stderr, "autotune: no packets during warmup; ring geometry unchanged\n");
+    free(offered);
+    return;
+  }
+
+  uint64_t min_memory = (uint64_t)rlp->af_min_blocks * rlp->af_min_blocksize;
+  uint64_t min_share = statst->ring_memory / num_threads / AUTOTUNE_MIN_SHARE_DIV;
+  if (min_share < min_memory) {
+    min_share = min_memory;
+  }
+  uint64_t shared = statst->ring_memory > min_share * num_threads ? statst->ring_memory - min_share * num_threads : 0;
+
+  for (int thread = 0; thread < num_threads; thread++) {
+    struct thread_storage *t = &statst->tstor[thread];
+    double rate = offered[thread] / statst->autotune_secs;
+    uint64_t memory = min_share + (uint64_t)(shared * (offered[thread] / total_offered));
+    if (memory > rlp->af_ring_limit) {
+      memory = rlp->af_ring_limit;
+    }
+    uint32_t block_size = autotune_block_size(rlp, rate, memory, t->socket_freezes > 0);
+    uint32_t block_count = memory / block_size;
+    if (block_count < rlp->af_min_blocks) {
+      block_count = rlp->af_min_blocks;
+    }
+    uint32_t timeout = rlp->af_blocktimeout;
+    if (rate > 0.0 && 2000.0 * block_size / rate < timeout) {
+      timeout = 2000.0 * block_size / rate;
+      if (timeout < 1) {
+	timeout = 1;
+      }
+    }
+
+    t->retune_params = t->ring_params;
+    t->retune_params.tp_block_size = block_size;
+    t->retune_params.tp_block_nr = block_count;
+    t->retune_params.tp_frame_nr = ((uint64_t)block_size * block_count) / rlp->af_framesize;
+    t->retune_params.tp_retire_blk_tov = timeout;
+
+    fprintf(stderr, "autotune: thread %d: %.1f%% of traffic, %lu drops, %lu freezes; %u blocks of size %u, block timeout %u ms\n",
+	    thread, 100.0 * offered[thread] / total_offered, t->socket_drops, t->socket_freezes,
+	    block_count, block_size, timeout);
+
+    if (memcmp(&t->retune_params, &t->ring_params, sizeof(t->ring_params)) != 0) {
+      t->retune.store(true, std::memory_order_release);
+    }
+  }
+  free(offered);
+}
 
 void *stats_thread_func(void *statst_arg) {
 
@@ -130,20 +289,36 @@ void *stats_thread_func(void *statst_arg) {
     exit(255);
   }
 
+  uint64_t before[thread_stat_count], after[thread_stat_count], delta[thread_stat_count];
+  unsigned int seconds = 0;
   while (sig_close_flag == 0) {
-    uint64_t packets_before = statst->received_packets;
-    uint64_t bytes_before = statst->received_bytes;
     uint64_t socket_packets_before = statst->socket_packets;
     uint64_t socket_drops_before = statst->socket_drops;
     uint64_t socket_freezes_before = statst->socket_freezes;
+    struct analysis_pool_stats analysis_before;
+    bool have_analysis_pool = analysis_pool_get_stats(&analysis_before);
+    thread_stats_sum(before);
 
     sleep(1);
     for (int thread = 0; thread < statst->num_threads; thread++) {
-      af_packet_stats(statst->tstor[thread].sockfd, statst);
+      struct thread_storage *t = &statst->tstor[thread];
+      uint64_t packets = statst->socket_packets, drops = statst->socket_drops, freezes = statst->socket_freezes;
+      statst->backend->socket_stats(t, statst);
+      t->socket_packets += statst->socket_packets - packets;
+      t->socket_drops += statst->socket_drops - drops;
+      t->socket_freezes += statst->socket_freezes - freezes;
+    }
+    if (statst->autotune_secs && ++seconds == statst->autotune_secs) {
+      autotune_rings(statst);
+    }
+
+    thread_stats_sum(after);
+    for (unsigned int i = 0; i < thread_stat_count; i++) {
+      delta[i] = after[i] - before[i];
     }
 
-    uint64_t pps = statst->received_packets - packets_before;
-    uint64_t bps = statst->received_bytes - bytes_before;
+    uint64_t pps = delta[thread_stat_packets];
+    uint64_t bps = delta[thread_stat_bytes];
     uint64_t spps = statst->socket_packets - socket_packets_before;
     uint64_t sdps = statst->socket_drops - socket_drops_before;
     uint64_t sfps = statst->socket_freezes - socket_freezes_before;
@@ -153,6 +328,44 @@ void *stats_thread_func(void *statst_arg) {
 	    "recieved packets %8lu; recieved bytes %10lu; "
 	    "socket packets %8lu; socket drops %8lu; socket freezes %2lu\n",
 	    pps, bps, spps, sdps, sfps);
+
+    uint64_t wait_ns = delta[thread_stat_wait_ns];
+    uint64_t process_ns = delta[thread_stat_process_ns];
+    fprintf(stderr,
+	    "Per second capture stats: "
+	    "waiting %5.1f%%; processing %5.1f%%; blocks %8lu; polls %8lu\n",
+	    percent(wait_ns, wait_ns + process_ns), percent(process_ns, wait_ns + process_ns),
+	    delta[thread_stat_blocks], delta[thread_stat_polls]);
+
+    if (statst->pipelined) {
+      uint64_t dequeued = delta[thread_stat_chunks_dequeued];
+      fprintf(stderr,
+	      "Per second pipeline stats: "
+	      "queue depth %6lu chunks; time in queue %8.3f ms; chunks %8lu; stalls %8lu\n",
+	      after[thread_stat_chunks_queued] - after[thread_stat_chunks_dequeued],
+	      dequeued ? delta[thread_stat_queue_ns] / 1e6 / dequeued : 0.0,
+	      dequeued, delta[thread_stat_queue_stalls]);
+    }
+
+    fprintf(stderr,
+	    "Per second output stats: "
+	    "fingerprints tcp %6lu, tls %6lu, tls server %6lu, http %6lu, http server %6lu, none %8lu; "
+	    "records %8lu; bytes %10lu; analysis cache hits %6lu, misses %6lu\n",
+	    delta[thread_stat_fingerprint_tcp], delta[thread_stat_fingerprint_tls],
+	    delta[thread_stat_fingerprint_tls_server], delta[thread_stat_fingerprint_http],
+	    delta[thread_stat_fingerprint_http_server], delta[thread_stat_no_fingerprint],
+	    delta[thread_stat_records_written], delta[thread_stat_bytes_written],
+	    delta[thread_stat_analysis_hits], delta[thread_stat_analysis_misses]);
+
+    struct analysis_pool_stats analysis_after;
+    if (have_analysis_pool && analysis_pool_get_stats(&analysis_after)) {
+      fprintf(stderr,
+	      "Per second analysis stats: "
+	      "batches %8lu; deferred flushes %8lu; dropped records %8lu\n",
+	      analysis_after.batches - analysis_before.batches,
+	      analysis_after.deferred_flushes - analysis_before.deferred_flushes,
+	      analysis_after.dropped_records - analysis_before.dropped_records);
+    }
   }
 
   return NULL;
@@ -168,6 +381,470 @@ void *stats_thread_func(void *statst_arg) {
  *  https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
  */
 
+/*
+ * == Select filter ==
+ *
+ * With --select, only packets from which the extractor can obtain
+ * fingerprint metadata are written out.  To keep all of the other
+ * packets out of the ring, each socket gets a classic BPF program
+ * that passes only the packets that parser_extractor_process_packet()
+ * would look into: TCP SYNs, and TCP segments whose data starts with
+ * one of the signatures in proto_identify_tcp() (TLS ClientHello or
+ * ServerHello, HTTP GET request, or HTTP/1 response).  IPv6 packets
+ * with extension headers are passed without looking further, since
+ * the program cannot walk the header chain.  VLAN-tagged frames are
+ * also passed without looking further: the kernel strips only the
+ * outer tag before the filter runs, so an 802.1ad (QinQ) frame still
+ * has a tag at the ethertype offset, and the IP header is not where
+ * the program looks for it.  The frame handler still parses every
+ * packet that the filter passes, so the filter only needs to pass a
+ * superset of the packets that are written out.
+ */
+enum select_filter_label {
+  sf_ethertype = 0,
+  sf_is_ipv4,
+  sf_is_ipv6,
+  sf_is_vlan,
+  sf_is_qinq,
+  sf_ipv4,
+  sf_ipv4_is_tcp,
+  sf_ipv4_hdr_len,
+  sf_ipv4_hdr_len_to_a,
+  sf_ipv4_hdr_len_valid,
+  sf_ipv6,
+  sf_ipv6_is_tcp,
+  sf_ipv6_hopopts,
+  sf_ipv6_routing,
+  sf_ipv6_fragment,
+  sf_ipv6_esp,
+  sf_ipv6_ah,
+  sf_ipv6_dstopts,
+  sf_ipv6_hdr_len,
+  sf_tcp,
+  sf_tcp_is_syn,
+  sf_tcp_offrsv,
+  sf_tcp_hdr_len_mask,
+  sf_tcp_hdr_len_shift,
+  sf_tcp_hdr_len_add,
+  sf_tcp_hdr_len_to_x,
+  sf_data_second_word,
+  sf_data_second_word_store,
+  sf_data_first_word,
+  sf_is_http_request,
+  sf_is_http_response,
+  sf_tls_mask,
+  sf_is_tls_handshake,
+  sf_tls_second_word,
+  sf_tls_msg_type_mask,
+  sf_is_tls_client_hello,
+  sf_is_tls_server_hello,
+  sf_http_response,
+  sf_http_version_mask,
+  sf_is_http_1,
+  sf_accept,
+  sf_drop,
+  sf_num_insns
+};
+
+/* relative offset of a jump from instruction 'from' to instruction 'to' */
+#define SF_JUMP(from, to) ((to) - (from) - 1)
+
+/*
+ * offsets are from the start of the ethernet header; the indirect
+ * loads are relative to X, which holds the length of the IP header,
+ * and then the combined length of the IP and TCP headers
+ */
+#define SF_ETH_HDR_LEN 14
+
+#define SF_ETHERTYPE_VLAN 0x8100
+#define SF_ETHERTYPE_QINQ 0x88a8
+
+static struct sock_filter select_filter[sf_num_insns] = {
+  /* sf_ethertype */
+  BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, 12),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP,   SF_JUMP(sf_is_ipv4, sf_ipv4), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, SF_JUMP(sf_is_ipv6, sf_ipv6), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SF_ETHERTYPE_VLAN, SF_JUMP(sf_is_vlan, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SF_ETHERTYPE_QINQ, SF_JUMP(sf_is_qinq, sf_accept), SF_JUMP(sf_is_qinq, sf_drop)),
+
+  /* sf_ipv4 */
+  BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, SF_ETH_HDR_LEN + 9),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, SF_JUMP(sf_ipv4_is_tcp, sf_drop)),
+  BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SF_ETH_HDR_LEN),
+  BPF_STMT(BPF_MISC | BPF_TXA, 0),
+  BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 20, SF_JUMP(sf_ipv4_hdr_len_valid, sf_tcp), SF_JUMP(sf_ipv4_hdr_len_valid, sf_drop)),
+
+  /* sf_ipv6 */
+  BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, SF_ETH_HDR_LEN + 6),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP,      SF_JUMP(sf_ipv6_is_tcp, sf_ipv6_hdr_len), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_HOPOPTS,  SF_JUMP(sf_ipv6_hopopts, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ROUTING,  SF_JUMP(sf_ipv6_routing, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_FRAGMENT, SF_JUMP(sf_ipv6_fragment, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ESP,      SF_JUMP(sf_ipv6_esp, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_AH,       SF_JUMP(sf_ipv6_ah, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_DSTOPTS,  SF_JUMP(sf_ipv6_dstopts, sf_accept), SF_JUMP(sf_ipv6_dstopts, sf_drop)),
+  BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 40),
+
+  /* sf_tcp: a SYN with no other flags set */
+  BPF_STMT(BPF_LD  | BPF_B | BPF_IND, SF_ETH_HDR_LEN + 13),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x02, SF_JUMP(sf_tcp_is_syn, sf_accept), 0),
+  BPF_STMT(BPF_LD  | BPF_B | BPF_IND, SF_ETH_HDR_LEN + 12),
+  BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf0),
+  BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 2),
+  BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+
+  /*
+   * sf_data_second_word: proto_identify_tcp() needs eight bytes of
+   * data, and a load past the end of the packet drops it
+   */
+  BPF_STMT(BPF_LD  | BPF_W | BPF_IND, SF_ETH_HDR_LEN + 4),
+  BPF_STMT(BPF_ST, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_IND, SF_ETH_HDR_LEN),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x47455420, SF_JUMP(sf_is_http_request, sf_accept), 0),  /* "GET " */
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x48545450, SF_JUMP(sf_is_http_response, sf_http_response), 0),  /* "HTTP" */
+  BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xfffffc00),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x16030000, 0, SF_JUMP(sf_is_tls_handshake, sf_drop)),
+  BPF_STMT(BPF_LD  | BPF_MEM, 0),
+  BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x00ff0000),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x00010000, SF_JUMP(sf_is_tls_client_hello, sf_accept), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x00020000, SF_JUMP(sf_is_tls_server_hello, sf_accept), SF_JUMP(sf_is_tls_server_hello, sf_drop)),
+
+  /* sf_http_response: "HTTP/1" */
+  BPF_STMT(BPF_LD  | BPF_MEM, 0),
+  BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff0000),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x2f310000, SF_JUMP(sf_is_http_1, sf_accept), SF_JUMP(sf_is_http_1, sf_drop)),
+
+  /* sf_accept, sf_drop */
+  BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+  BPF_STMT(BPF_RET | BPF_K, 0)
+};
+
+static int attach_select_filter(int sockfd) {
+  struct sock_fprog prog;
+  prog.len = sf_num_insns;
+  prog.filter = select_filter;
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+/*
+ * == Symmetric fanout ==
+ *
+ * With --fanout symmetric, the sockets form a PACKET_FANOUT_CBPF
+ * group, and the kernel runs the program below on each packet to
+ * select a socket (the value that it returns, modulo the number of
+ * sockets).  The program hashes the IP addresses and, for TCP and UDP
+ * packets that are not fragments, the ports, combining the source and
+ * destination values with XOR so that both directions of a flow get
+ * the same hash; the ClientHello and ServerHello of a session are thus
+ * handled by the same thread, regardless of how the NIC distributes
+ * packets over its queues.  Packets that are not IP go to the first
+ * socket.
+ *
+ * The kernel runs the program before it pushes the link layer header
+ * of a received packet back onto it, so the program gets the protocol
+ * from the packet metadata, and loads data relative to the network
+ * header (SKF_NET_OFF), which works for packets in either direction.
+ */
+#define SH_PROTOCOL    ((uint32_t)(SKF_AD_OFF + SKF_AD_PROTOCOL))
+#define SH_NET_OFF(k)  ((uint32_t)(SKF_NET_OFF + (k)))
+
+enum symmetric_hash_label {
+  sh_ethertype = 0,
+  sh_is_ipv4,
+  sh_is_ipv6,
+  sh_ipv4,
+  sh_ipv4_dst_to_x,
+  sh_ipv4_src,
+  sh_ipv4_addr_xor,
+  sh_ipv4_addr_store,
+  sh_ipv4_protocol,
+  sh_ipv4_is_tcp,
+  sh_ipv4_is_udp,
+  sh_ipv4_frag,
+  sh_ipv4_is_frag,
+  sh_ipv4_hdr_len,
+  sh_ipv4_to_ports,
+  sh_ipv6,
+  sh_ipv6_to_x_1,
+  sh_ipv6_word_1,
+  sh_ipv6_xor_1,
+  sh_ipv6_to_x_2,
+  sh_ipv6_word_2,
+  sh_ipv6_xor_2,
+  sh_ipv6_to_x_3,
+  sh_ipv6_word_3,
+  sh_ipv6_xor_3,
+  sh_ipv6_to_x_4,
+  sh_ipv6_word_4,
+  sh_ipv6_xor_4,
+  sh_ipv6_to_x_5,
+  sh_ipv6_word_5,
+  sh_ipv6_xor_5,
+  sh_ipv6_to_x_6,
+  sh_ipv6_word_6,
+  sh_ipv6_xor_6,
+  sh_ipv6_to_x_7,
+  sh_ipv6_word_7,
+  sh_ipv6_xor_7,
+  sh_ipv6_addr_store,
+  sh_ipv6_next_header,
+  sh_ipv6_is_tcp,
+  sh_ipv6_is_udp,
+  sh_ipv6_hdr_len,
+  sh_ports,
+  sh_ports_store,
+  sh_ports_src,
+  sh_ports_src_to_x,
+  sh_ports_both,
+  sh_ports_dst,
+  sh_ports_xor,
+  sh_ports_to_x,
+  sh_ports_addr,
+  sh_ports_addr_xor,
+  sh_ports_hash_store,
+  sh_mix,
+  sh_mix_mul,
+  sh_mix_store,
+  sh_mix_shift,
+  sh_mix_to_x,
+  sh_mix_load,
+  sh_mix_xor,
+  sh_return,
+  sh_other,
+  sh_num_insns
+};
+
+static struct sock_filter symmetric_hash[sh_num_insns] = {
+  /* sh_ethertype */
+  BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, SH_PROTOCOL),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP,   SF_JUMP(sh_is_ipv4, sh_ipv4), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, SF_JUMP(sh_is_ipv6, sh_ipv6), SF_JUMP(sh_is_ipv6, sh_other)),
+
+  /* sh_ipv4: M[0] = source address ^ destination address */
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(16)),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(12)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_ST, 0),
+  BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, SH_NET_OFF(9)),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, SF_JUMP(sh_ipv4_is_tcp, sh_ipv4_frag), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, SF_JUMP(sh_ipv4_is_udp, sh_ipv4_frag), SF_JUMP(sh_ipv4_is_udp, sh_mix)),
+  BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, SH_NET_OFF(6)),
+  BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, SF_JUMP(sh_ipv4_is_frag, sh_mix), 0),  /* MF or offset */
+  BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, SH_NET_OFF(0)),
+  BPF_STMT(BPF_JMP | BPF_JA, SF_JUMP(sh_ipv4_to_ports, sh_ports)),
+
+  /* sh_ipv6: M[0] = xor of the words of both addresses */
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(8)),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(12)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(16)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(20)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(24)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(28)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(32)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SH_NET_OFF(36)),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_ST, 0),
+  BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, SH_NET_OFF(6)),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, SF_JUMP(sh_ipv6_is_tcp, sh_ipv6_hdr_len), 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, SF_JUMP(sh_ipv6_is_udp, sh_ipv6_hdr_len), SF_JUMP(sh_ipv6_is_udp, sh_mix)),
+  BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 40),
+
+  /* sh_ports: M[0] ^= source port ^ destination port */
+  BPF_STMT(BPF_LD  | BPF_W | BPF_IND, SH_NET_OFF(0)),
+  BPF_STMT(BPF_ST, 1),
+  BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_MEM, 1),
+  BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_MEM, 0),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_ST, 0),
+
+  /* sh_mix: spread the entropy into the low bits, which select the socket */
+  BPF_STMT(BPF_LD  | BPF_MEM, 0),
+  BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+  BPF_STMT(BPF_ST, 0),
+  BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),
+  BPF_STMT(BPF_LD  | BPF_MEM, 0),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+  BPF_STMT(BPF_RET | BPF_A, 0),
+
+  /* sh_other */
+  BPF_STMT(BPF_RET | BPF_K, 0)
+};
+
+/*
+ * attach_symmetric_hash(sockfd) installs the program of the fanout
+ * group that sockfd has joined; it need only be called for one socket
+ * in the group
+ */
+static int attach_symmetric_hash(int sockfd) {
+  struct sock_fprog prog;
+  prog.len = sh_num_insns;
+  prog.filter = symmetric_hash;
+  return setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog));
+}
+
+int fanout_mode_get_type(enum fanout_mode mode) {
+  switch(mode) {
+  case fanout_mode_hash:
+    return PACKET_FANOUT_HASH;
+  case fanout_mode_symmetric:
+    return PACKET_FANOUT_CBPF;
+  case fanout_mode_lb:
+    return PACKET_FANOUT_LB;
+  case fanout_mode_cpu:
+    return PACKET_FANOUT_CPU;
+  case fanout_mode_qm:
+    return PACKET_FANOUT_QM;
+  case fanout_mode_rnd:
+    return PACKET_FANOUT_RND;
+  case fanout_mode_rollover:
+    return PACKET_FANOUT_ROLLOVER;
+  }
+  return PACKET_FANOUT_HASH;
+}
+
+/*
+ * interface_num_rx_queues(if_name) returns the number of receive
+ * queues of the interface, or -1 if it cannot be determined
+ */
+int interface_num_rx_queues(const char *if_name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/queues", if_name);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  int num_queues = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "rx-", 3) == 0) {
+      num_queues++;
+    }
+  }
+  closedir(dir);
+  return num_queues;
+}
+
+/*
+ * setup_ring(thread_stor) allocates the RX_RING described by
+ * thread_stor->ring_params, maps it, and fills in the block pointers;
+ * if the ring cannot be mapped, it is freed again.  MAP_LOCKED needs
+ * CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK, which a ring that is
+ * rebuilt after privileges are dropped may not have, so the ring is
+ * mapped without it in that case; the ring is kernel memory, which is
+ * never swapped out in any event.
+ */
+static int setup_ring(struct thread_storage *thread_stor) {
+  int sockfd = thread_stor->sockfd;
+  size_t ring_size = (size_t)thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr;
+
+  fprintf(stderr, "Requesting PACKET_RX_RING with %zu bytes (%d blocks of size %d) for thread %d\n",
+	  ring_size, thread_stor->ring_params.tp_block_nr, thread_stor->ring_params.tp_block_size, thread_stor->tnum);
+  int err = setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, (void*)&(thread_stor->ring_params), sizeof(thread_stor->ring_params));
+  if (err == -1) {
+    perror("could not enable RX_RING for AF_PACKET socket");
+    return -1;
+  }
+
+  /*
+   * each thread has its own mmaped buffer
+   */
+  uint8_t *mapped_buffer = (uint8_t*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sockfd, 0);
+  if (mapped_buffer == MAP_FAILED && (errno == EAGAIN || errno == EPERM)) {
+    mapped_buffer = (uint8_t*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0);
+  }
+  if (mapped_buffer == MAP_FAILED) {
+    fprintf(stderr, "%s: mmap failed for thread %d\n", strerror(errno), thread_stor->tnum);
+    struct tpacket_req3 no_ring;
+    memset(&no_ring, 0, sizeof(no_ring));
+    setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, (void*)&no_ring, sizeof(no_ring));
+    return -1;
+  }
+
+  /* Now store this mmap()'d region in the thread storage */
+  thread_stor->mapped_buffer = mapped_buffer;
+
+  /*
+   * The start of each block is a struct tpacket_block_desc so make
+   * array of pointers to the start of each block struct
+   */
+  struct tpacket_block_desc **block_header = (struct tpacket_block_desc**)malloc(thread_stor->ring_params.tp_block_nr * sizeof(struct tpacket_hdr_v1 *));
+  if (block_header == NULL) {
+    fprintf(stderr, "error: could not allocate block_header pointer array for thread %d\n", thread_stor->tnum);
+    return -1;
+  }
+
+  /* Now store this block pointer array the thread storage */
+  thread_stor->block_header = block_header;
+
+  for (unsigned int i = 0; i < thread_stor->ring_params.tp_block_nr; ++i) {
+    block_header[i] = (struct tpacket_block_desc *)(mapped_buffer + (i * thread_stor->ring_params.tp_block_size));
+  }
+
+  return 0;
+}
+
+/*
+ * release_ring(thread_stor) unmaps the ring and frees the block
+ * pointers; the kernel frees the ring itself when the socket is
+ * closed, or when an empty ring is requested
+ */
+static void release_ring(struct thread_storage *thread_stor) {
+  free(thread_stor->block_header);
+  thread_stor->block_header = NULL;
+  munmap(thread_stor->mapped_buffer, (size_t)thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr);
+  thread_stor->mapped_buffer = NULL;
+}
+
+/*
+ * rebuild_ring(thread_stor) replaces the ring of a running socket
+ * with one described by thread_stor->retune_params.  The kernel
+ * unhooks the socket from its fanout group while the ring is replaced
+ * and then hooks it back in, so the socket keeps its place in the
+ * group; packets that arrive in the meantime go to the other sockets
+ * in the group.  If the new ring cannot be allocated, the previous
+ * geometry is restored.
+ */
+static int rebuild_ring(struct thread_storage *thread_stor) {
+  struct tpacket_req3 previous = thread_stor->ring_params;
+
+  release_ring(thread_stor);
+  struct tpacket_req3 no_ring;
+  memset(&no_ring, 0, sizeof(no_ring));
+  if (setsockopt(thread_stor->sockfd, SOL_PACKET, PACKET_RX_RING, (void*)&no_ring, sizeof(no_ring)) == -1) {
+    perror("error: could not free RX_RING for resizing");
+    return -1;
+  }
+
+  thread_stor->ring_params = thread_stor->retune_params;
+  if (setup_ring(thread_stor) == 0) {
+    return 0;
+  }
+  fprintf(stderr, "error: could not resize ring for thread %d; restoring its previous size\n", thread_stor->tnum);
+  thread_stor->ring_params = previous;
+  return setup_ring(thread_stor);
+}
+
 int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg) {
   int err;
   int sockfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
@@ -178,6 +855,18 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg)
   /* Now store this socket file descriptor in the thread storage */
   thread_stor->sockfd = sockfd;
 
+  /*
+   * attach the select filter before the socket is bound, so that no
+   * unfiltered packets are queued to it
+   */
+  if (thread_stor->select_filter) {
+    err = attach_select_filter(sockfd);
+    if (err) {
+      perror("error: could not attach select filter (SO_ATTACH_FILTER)");
+      return -1;
+    }
+  }
+
   /*
    * set AF_PACKET version to V3, which is more performant, as it
    * reads in blocks of packets, not single packets
@@ -214,46 +903,10 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg)
   /*
    * set up RX_RING
    */
-  fprintf(stderr, "Requesting PACKET_RX_RING with %u bytes (%d blocks of size %d) for thread %d\n",
-	  thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr,
-	  thread_stor->ring_params.tp_block_nr, thread_stor->ring_params.tp_block_size, thread_stor->tnum);
-  err = setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, (void*)&(thread_stor->ring_params), sizeof(thread_stor->ring_params));
-  if (err == -1) {
-    perror("could not enable RX_RING for AF_PACKET socket");
+  if (setup_ring(thread_stor) != 0) {
     return -1;
   }
 
-  /*
-   * each thread has its own mmaped buffer
-   */
-  uint8_t *mapped_buffer = (uint8_t*)mmap(NULL, thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr,
-					  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
-					  sockfd, 0);
-  if (mapped_buffer == MAP_FAILED) {
-      fprintf(stderr, "%s: mmap failed for thread %d\n", strerror(errno), thread_stor->tnum);
-    return -1;
-  }
-
-  /* Now store this mmap()'d region in the thread storage */
-  thread_stor->mapped_buffer = mapped_buffer;
-
-  /*
-   * The start of each block is a struct tpacket_block_desc so make
-   * array of pointers to the start of each block struct
-   */
-  struct tpacket_block_desc **block_header = (struct tpacket_block_desc**)malloc(thread_stor->ring_params.tp_block_nr * sizeof(struct tpacket_hdr_v1 *));
-  if (block_header == NULL) {
-    fprintf(stderr, "error: could not allocate block_header pointer array for thread %d\n", thread_stor->tnum);
-  }
-
-  /* Now store this block pointer array the thread storage */
-  thread_stor->block_header = block_header;
-
-
-  for (unsigned int i = 0; i < thread_stor->ring_params.tp_block_nr; ++i) {
-    block_header[i] = (struct tpacket_block_desc *)(mapped_buffer + (i * thread_stor->ring_params.tp_block_size));
-  }
-
   /*
    * bind to interface
    */
@@ -293,14 +946,41 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg)
     perror("error: could not configure fanout");
     return -1;
   }
+  if (((fanout_arg >> 16) & 0xff) == PACKET_FANOUT_CBPF && thread_stor->tnum == 0) {
+    err = attach_symmetric_hash(sockfd);
+    if (err) {
+      perror("error: could not attach symmetric fanout program (PACKET_FANOUT_DATA)");
+      return -1;
+    }
+  }
+
+  /*
+   * with busy polling, poll() spins on the device queue for up to
+   * wait_budget microseconds before it sleeps; this must be set while
+   * we still have CAP_NET_ADMIN
+   */
+  if (thread_stor->wait_strategy == wait_strategy_busy_poll) {
+    int busy_poll_usec = thread_stor->wait_budget;
+    err = setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(busy_poll_usec));
+    if (err) {
+      perror("error: could not enable busy polling (SO_BUSY_POLL)");
+      return -1;
+    }
+  }
 
   return 0;
 }
 
+/*
+ * a spinning thread calls poll() with no timeout this often, so that
+ * it can tell when it is out of sync with the kernel (see below)
+ */
+#define SPIN_RESYNC_NS 1000000
 
-int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
 
+void capture_wait_for_start(struct thread_storage *thread_stor) {
   int err;
+
   /* At this point this thread is ready to go
    * but we need to wait for all the other threads to be ready too
    * so we'll wait on a condition broadcast from the main thread to
@@ -323,14 +1003,30 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
     fprintf(stderr, "%s: error unlocking clean start mutex for thread %lu\n", strerror(err), thread_stor->tid);
     exit(255);
   }
+}
+
+int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
+
+  /*
+   * this thread's counters are allocated here, so that they are on
+   * its NUMA node
+   */
+  struct thread_stats *stats = thread_stats_get();
+  thread_stor->stats = stats;
+
+  capture_wait_for_start(thread_stor);
 
   /* get local copies from the thread_stor struct so we can skip
    * pointer dereferences each time we access one
    */
   int sockfd = thread_stor->sockfd;
   struct tpacket_block_desc **block_header = thread_stor->block_header;
-  struct stats_tracking *statst = thread_stor->statst;
+  struct frame_handler pipeline_handler;
   struct frame_handler *handler = &thread_stor->handler;
+  if (thread_stor->pipeline) {
+    frame_handler_pipeline_init(&pipeline_handler, thread_stor->pipeline);
+    handler = &pipeline_handler;
+  }
   
   /* We got the clean start all clear so we can get started but
    * while we were waiting our socket was filling up with packets
@@ -393,14 +1089,74 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
   psockfd.events = POLLIN | POLLERR;
   psockfd.revents = 0;
 
+  /*
+   * How we wait for the current block depends on the wait strategy.
+   * The poll and busy-poll strategies wait in poll(); the spin
+   * strategy checks the block continuously, calling poll() without a
+   * timeout every SPIN_RESYNC_NS so that pstreak still works; and the
+   * spin-poll strategy spins for up to wait_budget microseconds
+   * after the last block, and then waits in poll().  The time spent
+   * waiting and processing is accumulated in the thread's counters.
+   */
+  enum wait_strategy wait_strategy = thread_stor->wait_strategy;
+  uint64_t spin_budget_ns = (uint64_t)thread_stor->wait_budget * 1000;
+  uint64_t mark = monotonic_ns();   /* end of the last interval that was accounted for */
+  uint64_t wait_start = mark;       /* start of the current wait                       */
+
   int pstreak = 0;
   int polret;
   unsigned int cb = 0;
   while (sig_close_workers == 0) {
 
+    if (thread_stor->retune.load(std::memory_order_acquire)) {
+      /*
+       * process the blocks that the kernel has already handed over,
+       * and then replace the ring; the kernel starts over at block 0
+       */
+      while (block_header[cb]->hdr.bh1.block_status & TP_STATUS_USER) {
+	process_all_packets_in_block(block_header[cb], stats, handler);
+	block_header[cb]->hdr.bh1.block_status = TP_STATUS_KERNEL;
+	thread_stats_add(stats, thread_stat_blocks, 1);
+	cb = (cb + 1) % thread_block_count;
+      }
+      if (rebuild_ring(thread_stor) != 0) {
+	fprintf(stderr, "error: thread %d has no ring\n", thread_stor->tnum);
+	return -1;
+      }
+      block_header = thread_stor->block_header;
+      thread_block_count = thread_stor->ring_params.tp_block_nr;
+      cb = 0;
+      pstreak = 0;
+      thread_stor->retune.store(false, std::memory_order_relaxed);
+    }
+
     if ((block_header[cb]->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
 
-      polret = poll(&psockfd, 1, 1000); /* Let poll wait up to a second */
+      uint64_t now;
+      polret = 0;
+      switch (wait_strategy) {
+      case wait_strategy_spin:
+	cpu_relax();
+	now = monotonic_ns();
+	if (now - wait_start >= SPIN_RESYNC_NS) {
+	  polret = poll(&psockfd, 1, 0);
+	  thread_stats_add(stats, thread_stat_polls, 1);
+	  wait_start = now;
+	}
+	break;
+      case wait_strategy_spin_poll:
+	if (monotonic_ns() - wait_start < spin_budget_ns) {
+	  cpu_relax();
+	  break;
+	}
+	/* fall through */
+      case wait_strategy_poll:
+      case wait_strategy_busy_poll:
+      default:
+	polret = poll(&psockfd, 1, 1000); /* Let poll wait up to a second */
+	thread_stats_add(stats, thread_stat_polls, 1);
+	break;
+      }
       if (polret < 0) {
 	perror("poll returned error");
       } else if (polret > 0) {
@@ -411,15 +1167,27 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
       if (pstreak > 2) {
 	cb = (cb + 1) % thread_block_count; /* Go find the block the kernel is stuck on */
       }
+
+      now = monotonic_ns();
+      thread_stats_add(stats, thread_stat_wait_ns, now - mark);
+      mark = now;
       continue;
     }
 
     /* We found data! */
+    uint64_t start = monotonic_ns();
+    thread_stats_add(stats, thread_stat_wait_ns, start - mark);
+
     pstreak = 0; /* Reset the poll streak tracking */
-    process_all_packets_in_block(block_header[cb], statst, handler);
+    process_all_packets_in_block(block_header[cb], stats, handler);
     block_header[cb]->hdr.bh1.block_status = TP_STATUS_KERNEL;
 
     cb = (cb + 1) % thread_block_count;
+
+    mark = monotonic_ns();
+    wait_start = mark;
+    thread_stats_add(stats, thread_stat_process_ns, mark - start);
+    thread_stats_add(stats, thread_stat_blocks, 1);
   }
 
   fprintf(stderr, "Thread %d with thread id %lu exiting...\n", thread_stor->tnum, thread_stor->tid);
@@ -427,10 +1195,58 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
 }
 
 
+static int af_packet_setup(struct thread_storage *thread_stor) {
+  return create_dedicated_socket(thread_stor, thread_stor->fanout_arg);
+}
+
+static void af_packet_socket_stats(struct thread_storage *thread_stor, struct stats_tracking *statst) {
+  af_packet_stats(thread_stor->sockfd, statst);
+}
+
+static void af_packet_release(struct thread_storage *thread_stor) {
+  release_ring(thread_stor);
+  close(thread_stor->sockfd);
+}
+
+const struct capture_ops af_packet_backend = {
+  "tpacket",
+  NULL,
+  af_packet_setup,
+  NULL,
+  af_packet_rx_ring_fanout_capture,
+  af_packet_socket_stats,
+  af_packet_release,
+  NULL
+};
+
 void *packet_capture_thread_func(void *arg)  {
   struct thread_storage *thread_stor = (struct thread_storage *)arg;
 
-  if (af_packet_rx_ring_fanout_capture(thread_stor) < 0) {
+  /*
+   * each thread creates its own socket and ring, on its own CPU (if
+   * it is pinned) and in parallel with the other threads, so that the
+   * kernel allocates and locks the ring on the thread's NUMA node, and
+   * startup takes about as long as setting up the largest ring; the
+   * main thread waits until every thread has reported in
+   */
+  uint64_t start = monotonic_ns();
+  int setup_err = thread_stor->backend->setup(thread_stor);
+  thread_stor->setup_ns = monotonic_ns() - start;
+
+  int err = pthread_mutex_lock(thread_stor->t_start_m);
+  if (err != 0) {
+    fprintf(stderr, "%s: error locking clean start mutex for thread %d\n", strerror(err), thread_stor->tnum);
+    exit(255);
+  }
+  thread_stor->setup_err = setup_err;
+  (*thread_stor->t_setup_p)++;
+  pthread_cond_signal(thread_stor->t_setup_c);
+  pthread_mutex_unlock(thread_stor->t_start_m);
+  if (setup_err != 0) {
+    return NULL;  /* the main thread exits */
+  }
+
+  if (thread_stor->backend->capture(thread_stor) < 0) {
     fprintf(stdout, "error: could not perform packet capture\n");
     exit(255);
   }
@@ -443,6 +1259,23 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
   int err;
   int num_threads = cfg->num_threads;
   int fanout_arg = ((getpid() & 0xffff) | (rlp->af_fanout_type << 16));
+  const struct capture_ops *backend = &af_packet_backend;
+  if (cfg->capture_backend == capture_backend_af_xdp) {
+    backend = &af_xdp_backend;
+  }
+
+  /*
+   * with PACKET_FANOUT_QM, thread n receives the packets from the
+   * receive queues q with q % num_threads == n, so each thread gets one
+   * queue when there are as many threads as queues
+   */
+  if (backend == &af_packet_backend && rlp->af_fanout_type == PACKET_FANOUT_QM) {
+    int num_queues = interface_num_rx_queues(cfg->capture_interface);
+    if (num_queues > 0 && num_queues != num_threads) {
+      fprintf(stderr, "Notice: %d threads for %d receive queues on %s; use --threads %d to map threads to queues one to one\n",
+	      num_threads, num_queues, cfg->capture_interface, num_queues);
+    }
+  }
 
   /* We need all our threads to get a clean start at the same time or
    * else some threads will start working before other threads are ready
@@ -454,6 +1287,8 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
   int t_start_p = 0;
   pthread_cond_t t_start_c  = PTHREAD_COND_INITIALIZER;
   pthread_mutex_t t_start_m = PTHREAD_MUTEX_INITIALIZER;
+  int t_setup_p = 0;       /* The number of threads that have set up their sockets */
+  pthread_cond_t t_setup_c = PTHREAD_COND_INITIALIZER;
 
   struct stats_tracking statst;
   memset(&statst, 0, sizeof(statst));
@@ -468,6 +1303,7 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
     perror("could not allocate memory for strocut thread_storage array\n");
   }
   statst.tstor = tstor; // The stats thread needs to know how to access the socket for each packet worker
+  statst.backend = backend;
 
   /* Now that we know how many threads we will have, we need
    * to figure out what our ring parameters will be */
@@ -504,6 +1340,13 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
 	    (uint64_t)num_threads * (uint64_t)thread_ring_blockcount * (uint64_t)thread_ring_blocksize, rlp->af_desired_memory);
   }
 
+  statst.autotune_secs = (backend == &af_packet_backend) ? cfg->autotune : 0;
+  if (cfg->autotune && statst.autotune_secs == 0) {
+    fprintf(stderr, "Notice: --autotune applies only to the tpacket backend, and will be ignored\n");
+  }
+  statst.rlp = rlp;
+  statst.ring_memory = (uint64_t)num_threads * thread_ring_blockcount * thread_ring_blocksize;
+
   /* Fill out the ring request struct */
   struct tpacket_req3 thread_ring_req;
   memset(&thread_ring_req, 0, sizeof(thread_ring_req));
@@ -514,29 +1357,127 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
   thread_ring_req.tp_retire_blk_tov = rlp->af_blocktimeout;
   thread_ring_req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
   
-  /* Get all the thread storage ready and allocate the sockets */
+  /*
+   * Select the CPUs for the capture threads, if requested.  Each
+   * capture thread sets up its own ring on its CPU, so that the kernel
+   * allocates the ring on that CPU's NUMA node; while this thread sets
+   * up the frame handler of each capture thread, it runs on that
+   * thread's CPU, so that the memory of the handler is first touched
+   * (and thus allocated) there as well.
+   */
+  int *affinity_cpu = NULL;
+  int num_affinity_cpus = 0;
+  cpu_set_t original_affinity;
+  if (cfg->affinity) {
+    affinity_cpu = (int *)malloc(MAX_AFFINITY_CPUS * sizeof(int));
+    if (affinity_cpu == NULL) {
+      fprintf(stderr, "error: could not allocate CPU list\n");
+      exit(255);
+    }
+    num_affinity_cpus = affinity_get_cpus(cfg->affinity, cfg->capture_interface, affinity_cpu, MAX_AFFINITY_CPUS);
+    if (num_affinity_cpus < 0) {
+      exit(255);
+    }
+    if (num_threads > num_affinity_cpus) {
+      fprintf(stderr, "Notice: %d threads will share %d CPU(s)\n", num_threads, num_affinity_cpus);
+    }
+    int node = interface_numa_node(cfg->capture_interface);
+    if (node >= 0) {
+      fprintf(stderr, "interface %s is on NUMA node %d\n", cfg->capture_interface, node);
+    }
+    pthread_getaffinity_np(pthread_self(), sizeof(original_affinity), &original_affinity);
+  }
+
+  /* Get all the thread storage ready and start the threads, which allocate the sockets */
+  uint64_t setup_start = monotonic_ns();
   for (int thread = 0; thread < num_threads; thread++) {
     /* Init the thread storage for this thread */
       tstor[thread].tnum = thread;
+      tstor[thread].cpu = num_affinity_cpus ? affinity_cpu[thread % num_affinity_cpus] : -1;
+      if (tstor[thread].cpu >= 0) {
+	fprintf(stderr, "thread %d will run on CPU %d\n", thread, tstor[thread].cpu);
+      }
       tstor[thread].tid = 0;
+      tstor[thread].backend = backend;
       tstor[thread].sockfd = -1;
+      tstor[thread].xsk = NULL;
+      tstor[thread].fanout_arg = fanout_arg;
       tstor[thread].if_name = cfg->capture_interface;
       tstor[thread].statst = &statst;
       tstor[thread].t_start_p = &t_start_p;
       tstor[thread].t_start_c = &t_start_c;
       tstor[thread].t_start_m = &t_start_m;
+      tstor[thread].t_setup_p = &t_setup_p;
+      tstor[thread].t_setup_c = &t_setup_c;
+      tstor[thread].setup_err = 0;
+      tstor[thread].setup_ns = 0;
+      tstor[thread].wait_strategy = cfg->wait_strategy;
+      tstor[thread].wait_budget = cfg->wait_budget;
+      tstor[thread].select_filter = (cfg->filter && cfg->write_filename);
+      tstor[thread].stats = NULL;
+      tstor[thread].pipeline = NULL;
+      tstor[thread].retune.store(false);
+      tstor[thread].socket_packets = 0;
+      tstor[thread].socket_drops = 0;
+      tstor[thread].socket_freezes = 0;
 
       memcpy(&(tstor[thread].ring_params), &thread_ring_req, sizeof(thread_ring_req));
+  }
 
-      err = create_dedicated_socket(&(tstor[thread]), fanout_arg);
+  if (backend->start && backend->start(cfg, num_threads) != 0) {
+    fprintf(stderr, "error: could not start %s capture\n", backend->name);
+    exit(255);
+  }
 
-      if (err != 0) {
-	  fprintf(stderr, "error creating dedicated socket for thread %d\n", thread);
-	  exit(255);
+  for (int thread = 0; thread < num_threads; thread++) {
+    pthread_attr_t thread_attributes;
+    err = pthread_attr_init(&thread_attributes);
+    if (err) {
+      fprintf(stderr, "%s: error initializing attributes for thread %d\n", strerror(err), thread);
+      exit(255);
+    }
+    if (tstor[thread].cpu >= 0) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      CPU_SET(tstor[thread].cpu, &cpu_set);
+      err = pthread_attr_setaffinity_np(&thread_attributes, sizeof(cpu_set), &cpu_set);
+      if (err) {
+	fprintf(stderr, "%s: error setting CPU affinity for thread %d\n", strerror(err), thread);
+	exit(255);
       }
+    }
+
+    err = pthread_create(&(tstor[thread].tid), &thread_attributes, packet_capture_thread_func, &(tstor[thread]));
+    if (err) {
+      fprintf(stderr, "%s: error creating af_packet capture thread %d\n", strerror(err), thread);
+      exit(255);
+    }
+  }
+
+  /* Wait until every thread has set up its socket and ring */
+  err = pthread_mutex_lock(&t_start_m);
+  if (err != 0) {
+    fprintf(stderr, "%s: error locking clean start mutex\n", strerror(err));
+    exit(255);
+  }
+  while (t_setup_p < num_threads) {
+    pthread_cond_wait(&t_setup_c, &t_start_m);
+  }
+  pthread_mutex_unlock(&t_start_m);
+  uint64_t setup_ns = monotonic_ns() - setup_start;
+  for (int thread = 0; thread < num_threads; thread++) {
+    if (tstor[thread].setup_err != 0) {
+      fprintf(stderr, "error creating dedicated socket for thread %d\n", thread);
+      exit(255);
+    }
+  }
+  if (backend->activate && backend->activate(cfg) != 0) {
+    fprintf(stderr, "error: could not activate %s capture\n", backend->name);
+    exit(255);
   }
 
   /* drop privileges from root to normal user */
+  uint64_t output_start = monotonic_ns();
   if (drop_root_privileges(cfg->user, NULL) != status_ok) {
       return status_err;
   }
@@ -566,32 +1507,53 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
 	  snprintf(hexname, MAX_HEX, "%x", thread);
 	  fileset_id = hexname;
       } 
+      if (tstor[thread].cpu >= 0) {
+	  set_thread_affinity(tstor[thread].cpu);
+      }
       enum status status = frame_handler_init_from_config(&tstor[thread].handler, cfg, thread, fileset_id);
       if (status) {
 	  return status;
       }
+      if (cfg->pipeline) {
+	  /*
+	   * the pipeline can hold as many packets as the ring, since
+	   * a record takes less space than a frame in a block; chunks
+	   * are as large as the largest block that --autotune can
+	   * choose, rather than the initial block size, and only the
+	   * part of a chunk that a block fills is ever touched
+	   */
+	  tstor[thread].pipeline = pipeline_start(&tstor[thread].handler,
+						  rlp->af_blocksize,
+						  tstor[thread].ring_params.tp_block_nr);
+	  if (tstor[thread].pipeline == NULL) {
+	      fprintf(stderr, "error: could not start pipeline for thread %d\n", thread);
+	      exit(255);
+	  }
+	  statst.pipelined = true;
+      }
   }
+  uint64_t output_ns = monotonic_ns() - output_start;
 
-  /* Start up the threads */
-  pthread_t stats_thread;
-  err = pthread_create(&stats_thread, NULL, stats_thread_func, &statst);
-  if (err != 0) {
-    perror("error creating stats thread");
+  if (affinity_cpu) {
+    pthread_setaffinity_np(pthread_self(), sizeof(original_affinity), &original_affinity);
+    free(affinity_cpu);
   }
 
+  /* report how long each phase of startup took */
+  uint64_t slowest_ns = 0, fastest_ns = UINT64_MAX;
   for (int thread = 0; thread < num_threads; thread++) {
-    pthread_attr_t thread_attributes;
-    err = pthread_attr_init(&thread_attributes);
-    if (err) {
-      fprintf(stderr, "%s: error initializing attributes for thread %d\n", strerror(err), thread);
-      exit(255);
-    }
+    slowest_ns = tstor[thread].setup_ns > slowest_ns ? tstor[thread].setup_ns : slowest_ns;
+    fastest_ns = tstor[thread].setup_ns < fastest_ns ? tstor[thread].setup_ns : fastest_ns;
+  }
+  fprintf(stderr, "Startup: sockets and rings %.3f s (per thread %.3f s to %.3f s); output %.3f s; total %.3f s\n",
+	  setup_ns / 1e9, fastest_ns / 1e9, slowest_ns / 1e9, output_ns / 1e9,
+	  (monotonic_ns() - setup_start) / 1e9);
 
-    err = pthread_create(&(tstor[thread].tid), &thread_attributes, packet_capture_thread_func, &(tstor[thread]));
-    if (err) {
-      fprintf(stderr, "%s: error creating af_packet capture thread %d\n", strerror(err), thread);
-      exit(255);
-    }
+  /* Start up the stats thread */
+  pthread_t stats_thread;
+  err = pthread_create(&stats_thread, NULL, stats_thread_func, &statst);
+  if (err != 0) {
+    perror("error creating stats thread");
   }
 
   /* At this point all threads are started but they're waiting on
@@ -614,22 +1576,44 @@ int af_packet_bind_and_dispatch(struct mercury_config *cfg,
   for (int thread = 0; thread < num_threads; thread++) {
     pthread_join(tstor[thread].tid, NULL);
   }
+  for (int thread = 0; thread < num_threads; thread++) {
+    if (tstor[thread].pipeline) {
+      pipeline_stop(tstor[thread].pipeline);
+    }
+  }
+
+  /* report how each thread divided its time */
+  for (int thread = 0; thread < num_threads; thread++) {
+    const struct thread_stats *ts = tstor[thread].stats;
+    if (ts == NULL) {
+      continue;
+    }
+    uint64_t wait_ns = thread_stats_load(ts, thread_stat_wait_ns);
+    uint64_t process_ns = thread_stats_load(ts, thread_stat_process_ns);
+    fprintf(stderr, "thread %d: waiting %.1f%%, processing %.1f%%, %lu blocks, %lu polls, %lu packets, %lu records\n",
+	    thread, percent(wait_ns, wait_ns + process_ns), percent(process_ns, wait_ns + process_ns),
+	    thread_stats_load(ts, thread_stat_blocks), thread_stats_load(ts, thread_stat_polls),
+	    thread_stats_load(ts, thread_stat_packets), thread_stats_load(ts, thread_stat_records_written));
+  }
 
   /* free up resources */
   for (int thread = 0; thread < num_threads; thread++) {
-    free(tstor[thread].block_header);
-    munmap(tstor[thread].mapped_buffer, tstor[thread].ring_params.tp_block_size * tstor[thread].ring_params.tp_block_nr);
-    close(tstor[thread].sockfd);
+    backend->release(&tstor[thread]);
+  }
+  if (backend->stop) {
+    backend->stop();
   }
   free(tstor);
 
+  uint64_t total[thread_stat_count];
+  thread_stats_sum(total);
   fprintf(stderr, "--\n"
 	  "%lu packets captured\n"
 	  "%lu bytes captured\n"
 	  "%lu packets seen by socket\n"
 	  "%lu packets dropped\n"
 	  "%lu socket queue freezes\n",
-	  statst.received_packets, statst.received_bytes, statst.socket_packets, statst.socket_drops, statst.socket_freezes);
+	  total[thread_stat_packets], total[thread_stat_bytes], statst.socket_packets, statst.socket_drops, statst.socket_freezes);
 
   return 0;
 }
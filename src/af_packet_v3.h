@@ -18,6 +18,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sched.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <poll.h>
@@ -29,8 +30,12 @@
 #include <net/if.h>
 #include <net/ethernet.h> /* the L2 protocols */
 
+#include <atomic>
+
 #include "mercury.h"
 #include "af_packet_io.h"
+#include "thread_stats.h"
+#include "pipeline.h"
 
 /* The struct that describes the limits on allocating ring memory */
 struct ring_limits {
@@ -48,6 +53,33 @@ struct ring_limits {
 
 typedef void (*packet_callback_t)(const struct packet_info *,
 				  const uint8_t *);
+
+struct thread_storage;
+struct stats_tracking;
+
+/*
+ * struct capture_ops holds the functions through which
+ * af_packet_bind_and_dispatch() drives a kind of capture socket.
+ * start() is called before the capture threads are created, and
+ * activate() after they have all set up their sockets, both in the
+ * main thread and while it still has its privileges; setup() and
+ * capture() are called in each capture thread, on its own CPU;
+ * socket_stats() adds the counters of a thread's socket to statst; and
+ * release() and stop() undo setup() and start() once capture is over.
+ * start, activate, and stop may be NULL.
+ */
+struct capture_ops {
+  const char *name;
+  int (*start)(struct mercury_config *cfg, int num_threads);
+  int (*setup)(struct thread_storage *thread_stor);
+  int (*activate)(struct mercury_config *cfg);
+  int (*capture)(struct thread_storage *thread_stor);
+  void (*socket_stats)(struct thread_storage *thread_stor, struct stats_tracking *statst);
+  void (*release)(struct thread_storage *thread_stor);
+  void (*stop)();
+};
+
+extern const struct capture_ops af_packet_backend;
 /*
  * Our stats tracking function will get a pointer to a struct
  * that has the info it needs to track stats for each thread
@@ -55,12 +87,15 @@ typedef void (*packet_callback_t)(const struct packet_info *,
  */
 struct stats_tracking {
   struct thread_storage *tstor;
+  const struct capture_ops *backend;
   int num_threads;
-  uint64_t received_packets;
-  uint64_t received_bytes;
   uint64_t socket_packets;
   uint64_t socket_drops;
   uint64_t socket_freezes;
+  bool pipelined;             /* Capture threads hand packets to writers */
+  unsigned int autotune_secs; /* Warmup before the rings are resized, or 0 */
+  const struct ring_limits *rlp; /* The limits on ring geometry */
+  uint64_t ring_memory;       /* The total size of the rings */
   int *t_start_p;             /* The clean start predicate */
   pthread_cond_t *t_start_c;  /* The clean start condition */
   pthread_mutex_t *t_start_m; /* The clean start mutex */
@@ -73,17 +108,35 @@ struct stats_tracking {
 struct thread_storage {
     packet_callback_t p_callback; /* The packet callback function */
     struct frame_handler handler;
+    struct pipeline *pipeline;  /* Runs handler in a writer thread, or NULL */
     int tnum;                 /* Thread Number */
+    int cpu;                  /* CPU to which the thread is pinned, or -1 */
     pthread_t tid;            /* Thread ID */
+    const struct capture_ops *backend; /* The kind of socket */
     int sockfd;               /* Socket owned by this thread */
+    struct xsk *xsk;          /* AF_XDP state of the socket, if it is one */
+    int fanout_arg;           /* The fanout group and type that the socket joins */
     const char *if_name;      /* The name of the interface to bind the socket to */
     uint8_t *mapped_buffer;   /* The pointer to the mmap()'d region */
     struct tpacket_block_desc **block_header; /* The pointer to each block in the mmap()'d region */
     struct tpacket_req3 ring_params; /* The ring allocation params to setsockopt() */
+    struct tpacket_req3 retune_params; /* The params with which to rebuild the ring */
+    std::atomic<bool> retune;   /* Set when retune_params are ready for the thread */
+    uint64_t socket_packets;    /* Socket counters of this thread, kept by the stats thread */
+    uint64_t socket_drops;
+    uint64_t socket_freezes;
     struct stats_tracking *statst;   /* A pointer to the struct with the stats counters */
+    enum wait_strategy wait_strategy; /* How to wait for the next block */
+    unsigned int wait_budget;   /* usec of spinning or busy polling */
+    struct thread_stats *stats; /* Counters of this thread, set by the thread */
+    bool select_filter;         /* Pass only packets with metadata to the ring */
     int *t_start_p;             /* The clean start predicate */
     pthread_cond_t *t_start_c;  /* The clean start condition */
     pthread_mutex_t *t_start_m; /* The clean start mutex */
+    int *t_setup_p;             /* The number of threads with sockets, under t_start_m */
+    pthread_cond_t *t_setup_c;  /* Signaled when a thread has set up its socket */
+    int setup_err;              /* Nonzero if the socket could not be set up */
+    uint64_t setup_ns;          /* Time taken to set up the socket and ring */
 };
 
 
@@ -94,4 +147,48 @@ int af_packet_bind_and_dispatch(//const char *if_name,
 
 void ring_limits_init(struct ring_limits *rl, float frac);
 
+/*
+ * helpers shared by the capture backends: capture_wait_for_start()
+ * blocks a capture thread until all of the threads are ready (the
+ * clean start barrier); interface_num_rx_queues() returns the number
+ * of receive queues of an interface, or -1 if it cannot be determined
+ */
+void capture_wait_for_start(struct thread_storage *thread_stor);
+
+int interface_num_rx_queues(const char *if_name);
+
+/*
+ * process_all_packets_in_block(block_hdr, stats, handler) passes each
+ * packet in a TPACKET_V3 ring block to handler, and counts them in
+ * stats
+ */
+void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
+				  struct thread_stats *stats,
+				  struct frame_handler *handler);
+
+extern int sig_close_workers;
+
+/*
+ * helper functions for the wait strategies
+ */
+static inline uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * fanout_mode_get_type(mode) returns the PACKET_FANOUT_* type that
+ * implements the fanout mode, for use as af_fanout_type
+ */
+int fanout_mode_get_type(enum fanout_mode mode);
+
 #endif /* AF_PACKET_V3 */
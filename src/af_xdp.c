@@ -0,0 +1,599 @@
+/*
+ * af_xdp.c
+ *
+ * packet capture with AF_XDP sockets
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+
+#include "af_xdp.h"
+
+#ifdef USE_AF_XDP
+
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/*
+ * == Overview ==
+ *
+ * Each capture thread has an AF_XDP socket bound to the receive queue
+ * whose number is that of the thread, and a UMEM: an area of memory
+ * divided into XSK_FRAME_SIZE frames into which packets are received.
+ * The thread and the kernel pass frames back and forth through two
+ * single-producer single-consumer rings that are shared with the
+ * kernel: the thread puts free frames on the fill ring, and the
+ * kernel puts frames holding packets on the rx ring.  There is also a
+ * completion ring, which is used only for transmission, but which the
+ * kernel requires.  The UMEM takes the place of the TPACKET_V3 ring,
+ * and gets the same amount of memory.
+ *
+ * An XDP program, attached to the interface once all of the sockets
+ * have been set up, looks up the socket for the packet's receive
+ * queue in an XSKMAP and redirects the packet to it; packets from
+ * queues without a socket are passed to the network stack.  Packets
+ * that are redirected to a socket are NOT passed to the network stack
+ * of the host, so this backend is meant for interfaces that are
+ * dedicated to capture (such as those attached to a SPAN port or a
+ * network tap).
+ *
+ * The program, the map, and the link that attaches the program are
+ * created with the bpf() system call directly, so that mercury does
+ * not need libbpf; the program is small enough to write out by hand,
+ * like the classic BPF programs in af_packet_v3.c.  The link is
+ * released, and the program detached, when mercury exits, even if it
+ * does not exit cleanly.
+ */
+
+#define XSK_FRAME_SIZE        2048      /* a power of two, at least 2048  */
+#define XSK_MIN_FRAMES        4096
+#define XSK_MAX_FRAMES        (1 << 20)
+#define XSK_COMPLETION_SIZE   64        /* not used for receiving         */
+#define XSK_BATCH_SIZE        64        /* packets processed per flush    */
+
+struct xsk_ring {
+  uint32_t *producer;
+  uint32_t *consumer;
+  uint32_t *flags;
+  void *desc;
+  uint32_t mask;
+  void *map;                 /* the mmap()'d region holding the ring */
+  size_t map_size;
+};
+
+struct xsk {
+  uint8_t *umem;
+  size_t umem_size;
+  uint32_t num_frames;
+  struct xsk_ring rx;
+  struct xsk_ring fill;
+  struct xsk_ring completion;
+  bool zerocopy;
+  struct xdp_statistics last;   /* counters at the last call of af_xdp_socket_stats() */
+  uint64_t last_packets;
+};
+
+static int xsk_map_fd = -1;
+static int xdp_prog_fd = -1;
+static int xdp_link_fd = -1;
+static int xdp_ifindex = 0;
+
+static long sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * xsk_redirect is the XDP program:
+ *
+ *   return bpf_redirect_map(&xsk_map, ctx->rx_queue_index, XDP_PASS);
+ *
+ * where the last argument is the action to take if the map holds no
+ * socket for the queue.  The file descriptor of the map is filled in
+ * before the program is loaded.
+ */
+enum xsk_redirect_label {
+  xr_queue,
+  xr_map,
+  xr_map_hi,                  /* second half of the 64-bit load */
+  xr_action,
+  xr_redirect,
+  xr_exit,
+  xr_num_insns
+};
+
+static struct bpf_insn xsk_redirect[xr_num_insns] = {
+  /* xr_queue:    r2 = ctx->rx_queue_index   */ { BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0 },
+  /* xr_map:      r1 = map                   */ { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, 0 },
+  /* xr_map_hi:                              */ { 0, 0, 0, 0, 0 },
+  /* xr_action:   r3 = XDP_PASS              */ { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+  /* xr_redirect: r0 = bpf_redirect_map()    */ { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+  /* xr_exit:     return r0                  */ { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+};
+
+static int xsk_map_create(unsigned int max_entries) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size = sizeof(uint32_t);
+  attr.value_size = sizeof(uint32_t);
+  attr.max_entries = max_entries;
+  strncpy(attr.map_name, "mercury_xsks", sizeof(attr.map_name) - 1);
+  return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int xsk_redirect_load(int map_fd) {
+  static char log[4096];
+  static const char license[] = "Dual BSD/GPL";
+
+  xsk_redirect[xr_map].imm = map_fd;
+
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.expected_attach_type = BPF_XDP;
+  attr.insns = (uint64_t)(uintptr_t)xsk_redirect;
+  attr.insn_cnt = xr_num_insns;
+  attr.license = (uint64_t)(uintptr_t)license;
+  attr.log_buf = (uint64_t)(uintptr_t)log;
+  attr.log_size = sizeof(log);
+  attr.log_level = 1;
+  strncpy(attr.prog_name, "mercury_xsk", sizeof(attr.prog_name) - 1);
+  int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+  if (fd < 0) {
+    fprintf(stderr, "%s: could not load XDP program\n%s", strerror(errno), log);
+  }
+  return fd;
+}
+
+static int xdp_link_create(int prog_fd, int ifindex, uint32_t flags) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.link_create.prog_fd = prog_fd;
+  attr.link_create.target_ifindex = ifindex;
+  attr.link_create.attach_type = BPF_XDP;
+  attr.link_create.flags = flags;
+  return sys_bpf(BPF_LINK_CREATE, &attr);
+}
+
+static int xsk_map_update(int map_fd, uint32_t key, uint32_t value) {
+  union bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = (uint64_t)(uintptr_t)&key;
+  attr.value = (uint64_t)(uintptr_t)&value;
+  attr.flags = BPF_ANY;
+  return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int af_xdp_start(struct mercury_config *cfg, int num_threads) {
+
+  xdp_ifindex = if_nametoindex(cfg->capture_interface);
+  if (xdp_ifindex == 0) {
+    fprintf(stderr, "%s: could not find interface %s\n", strerror(errno), cfg->capture_interface);
+    return -1;
+  }
+
+  /*
+   * thread n captures the packets from receive queue n, so there must
+   * be at least as many queues as threads
+   */
+  int num_queues = interface_num_rx_queues(cfg->capture_interface);
+  if (num_queues > 0 && num_threads > num_queues) {
+    fprintf(stderr, "error: AF_XDP needs a receive queue for each thread, and %s has %d; use --threads %d\n",
+	    cfg->capture_interface, num_queues, num_queues);
+    return -1;
+  }
+  if (num_queues > num_threads) {
+    fprintf(stderr, "Notice: packets from receive queues %d to %d of %s will not be captured; use --threads %d\n",
+	    num_threads, num_queues - 1, cfg->capture_interface, num_queues);
+  }
+  if (cfg->fanout_mode != fanout_mode_hash) {
+    fprintf(stderr, "Notice: with AF_XDP, packets are divided between threads by receive queue; --fanout is ignored\n");
+  }
+
+  xsk_map_fd = xsk_map_create(num_queues > num_threads ? num_queues : num_threads);
+  if (xsk_map_fd < 0) {
+    fprintf(stderr, "%s: could not create XSKMAP\n", strerror(errno));
+    return -1;
+  }
+  xdp_prog_fd = xsk_redirect_load(xsk_map_fd);
+  if (xdp_prog_fd < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * the sockets are all in the map before the program is attached, so
+ * that no packet is passed to the stack for want of a socket
+ */
+static int af_xdp_activate(struct mercury_config *cfg) {
+  xdp_link_fd = xdp_link_create(xdp_prog_fd, xdp_ifindex, XDP_FLAGS_DRV_MODE);
+  if (xdp_link_fd >= 0) {
+    fprintf(stderr, "XDP program attached to %s in native mode\n", cfg->capture_interface);
+    return 0;
+  }
+  xdp_link_fd = xdp_link_create(xdp_prog_fd, xdp_ifindex, XDP_FLAGS_SKB_MODE);
+  if (xdp_link_fd >= 0) {
+    fprintf(stderr, "XDP program attached to %s in generic (skb) mode\n", cfg->capture_interface);
+    return 0;
+  }
+  fprintf(stderr, "%s: could not attach XDP program to %s (BPF links need Linux 5.9 or later)\n",
+	  strerror(errno), cfg->capture_interface);
+  return -1;
+}
+
+static int xsk_ring_map(int fd, struct xsk_ring *r, const struct xdp_ring_offset *off,
+			uint32_t entries, size_t desc_size, off_t pgoff) {
+  r->map_size = off->desc + entries * desc_size;
+  r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (r->map == MAP_FAILED) {
+    r->map = NULL;
+    return -1;
+  }
+  r->producer = (uint32_t *)((uint8_t *)r->map + off->producer);
+  r->consumer = (uint32_t *)((uint8_t *)r->map + off->consumer);
+  r->flags = (uint32_t *)((uint8_t *)r->map + off->flags);
+  r->desc = (uint8_t *)r->map + off->desc;
+  r->mask = entries - 1;
+  return 0;
+}
+
+static void xsk_ring_unmap(struct xsk_ring *r) {
+  if (r->map) {
+    munmap(r->map, r->map_size);
+    r->map = NULL;
+  }
+}
+
+static void xsk_free(struct xsk *x) {
+  xsk_ring_unmap(&x->rx);
+  xsk_ring_unmap(&x->fill);
+  xsk_ring_unmap(&x->completion);
+  if (x->umem) {
+    munmap(x->umem, x->umem_size);
+  }
+  free(x);
+}
+
+/*
+ * af_xdp_setup() runs in the capture thread, on its own CPU, so the
+ * UMEM (which it touches first) is on the thread's NUMA node; its size
+ * is that of the ring that the thread would have had with the
+ * tpacket backend, rounded down to a power of two frames
+ */
+static int af_xdp_setup(struct thread_storage *thread_stor) {
+  int tnum = thread_stor->tnum;
+  uint64_t budget = (uint64_t)thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr;
+  uint32_t num_frames = XSK_MIN_FRAMES;
+  while (num_frames < XSK_MAX_FRAMES && (uint64_t)num_frames * 2 * XSK_FRAME_SIZE <= budget) {
+    num_frames *= 2;
+  }
+
+  struct xsk *x = (struct xsk *)calloc(1, sizeof(struct xsk));
+  if (x == NULL) {
+    fprintf(stderr, "error: could not allocate AF_XDP state for thread %d\n", tnum);
+    return -1;
+  }
+  x->num_frames = num_frames;
+  x->umem_size = (size_t)num_frames * XSK_FRAME_SIZE;
+  x->umem = (uint8_t *)mmap(NULL, x->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (x->umem == MAP_FAILED) {
+    fprintf(stderr, "%s: could not allocate UMEM for thread %d\n", strerror(errno), tnum);
+    x->umem = NULL;
+    xsk_free(x);
+    return -1;
+  }
+
+  int fd = socket(AF_XDP, SOCK_RAW, 0);
+  if (fd < 0) {
+    fprintf(stderr, "%s: could not create AF_XDP socket for thread %d\n", strerror(errno), tnum);
+    xsk_free(x);
+    return -1;
+  }
+
+  struct xdp_umem_reg umem_reg;
+  memset(&umem_reg, 0, sizeof(umem_reg));
+  umem_reg.addr = (uint64_t)(uintptr_t)x->umem;
+  umem_reg.len = x->umem_size;
+  umem_reg.chunk_size = XSK_FRAME_SIZE;
+  umem_reg.headroom = 0;
+  uint32_t fill_size = num_frames, completion_size = XSK_COMPLETION_SIZE, rx_size = num_frames;
+  if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg))
+      || setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size))
+      || setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_size, sizeof(completion_size))
+      || setsockopt(fd, SOL_XDP, XDP_RX_RING, &rx_size, sizeof(rx_size))) {
+    fprintf(stderr, "%s: could not set up UMEM and rings for thread %d\n", strerror(errno), tnum);
+    close(fd);
+    xsk_free(x);
+    return -1;
+  }
+
+  struct xdp_mmap_offsets off;
+  socklen_t optlen = sizeof(off);
+  if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)
+      || xsk_ring_map(fd, &x->rx, &off.rx, rx_size, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING)
+      || xsk_ring_map(fd, &x->fill, &off.fr, fill_size, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING)
+      || xsk_ring_map(fd, &x->completion, &off.cr, completion_size, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)) {
+    fprintf(stderr, "%s: could not map rings for thread %d\n", strerror(errno), tnum);
+    close(fd);
+    xsk_free(x);
+    return -1;
+  }
+
+  /* hand all of the frames to the kernel */
+  uint64_t *fill = (uint64_t *)x->fill.desc;
+  for (uint32_t i = 0; i < num_frames; i++) {
+    fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+  }
+  __atomic_store_n(x->fill.producer, num_frames, __ATOMIC_RELEASE);
+
+  /* use zero-copy mode if the driver supports it */
+  struct sockaddr_xdp addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sxdp_family = AF_XDP;
+  addr.sxdp_ifindex = if_nametoindex(thread_stor->if_name);
+  addr.sxdp_queue_id = tnum;
+  addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+  x->zerocopy = true;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+    x->zerocopy = false;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      fprintf(stderr, "%s: could not bind AF_XDP socket to queue %d of %s for thread %d\n",
+	      strerror(errno), tnum, thread_stor->if_name, tnum);
+      close(fd);
+      xsk_free(x);
+      return -1;
+    }
+  }
+
+  if (thread_stor->wait_strategy == wait_strategy_busy_poll) {
+    int busy_poll_usec = thread_stor->wait_budget;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(busy_poll_usec))) {
+      perror("error: could not enable busy polling (SO_BUSY_POLL)");
+      close(fd);
+      xsk_free(x);
+      return -1;
+    }
+  }
+
+  if (xsk_map_update(xsk_map_fd, tnum, fd)) {
+    fprintf(stderr, "%s: could not add AF_XDP socket for thread %d to XSKMAP\n", strerror(errno), tnum);
+    close(fd);
+    xsk_free(x);
+    return -1;
+  }
+
+  fprintf(stderr, "AF_XDP socket for thread %d on queue %d with %zu bytes (%u frames of size %u), %s mode\n",
+	  tnum, tnum, x->umem_size, num_frames, XSK_FRAME_SIZE, x->zerocopy ? "zero-copy" : "copy");
+
+  thread_stor->sockfd = fd;
+  thread_stor->xsk = x;
+  return 0;
+}
+
+/*
+ * xsk_kick_fill_ring(x, sockfd) wakes the driver if it has stopped
+ * taking frames from the fill ring; since the socket is bound with
+ * XDP_USE_NEED_WAKEUP, it stays stopped until it is woken, so a thread
+ * that spins on an empty rx ring must check this, as well as one that
+ * has just refilled the ring
+ */
+static inline void xsk_kick_fill_ring(struct xsk *x, int sockfd) {
+  if (__atomic_load_n(x->fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+    recvfrom(sockfd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+  }
+}
+
+/*
+ * af_xdp_capture() takes up to XSK_BATCH_SIZE packets at a time from
+ * the rx ring, runs the handler on each, flushes the handler, and only
+ * then returns their frames to the fill ring, since the handler may
+ * refer to packet data until it has been flushed.  AF_XDP does not
+ * provide timestamps, so each packet in a batch gets the time at which
+ * the batch was taken, and it does not provide the rxhash, so the flow
+ * hash is computed in software.
+ */
+static int af_xdp_capture(struct thread_storage *thread_stor) {
+  struct thread_stats *stats = thread_stats_get();
+  thread_stor->stats = stats;
+
+  capture_wait_for_start(thread_stor);
+
+  struct xsk *x = thread_stor->xsk;
+  int sockfd = thread_stor->sockfd;
+  struct frame_handler pipeline_handler;
+  struct frame_handler *handler = &thread_stor->handler;
+  if (thread_stor->pipeline) {
+    frame_handler_pipeline_init(&pipeline_handler, thread_stor->pipeline);
+    handler = &pipeline_handler;
+  }
+
+  fprintf(stderr, "Thread %d with thread id %lu started...\n", thread_stor->tnum, thread_stor->tid);
+
+  struct pollfd psockfd;
+  memset(&psockfd, 0, sizeof(psockfd));
+  psockfd.fd = sockfd;
+  psockfd.events = POLLIN;
+
+  enum wait_strategy wait_strategy = thread_stor->wait_strategy;
+  uint64_t spin_budget_ns = (uint64_t)thread_stor->wait_budget * 1000;
+  uint64_t mark = monotonic_ns();
+  uint64_t wait_start = mark;
+
+  struct xdp_desc *rx_desc = (struct xdp_desc *)x->rx.desc;
+  uint64_t *fill_desc = (uint64_t *)x->fill.desc;
+  uint64_t frames[XSK_BATCH_SIZE];
+  struct packet_info pi;
+  pi.flow_hash = 0;  /* XDP provides no rxhash */
+
+  while (sig_close_workers == 0) {
+    uint32_t rx_cons = *x->rx.consumer;
+    uint32_t available = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE) - rx_cons;
+
+    if (available == 0) {
+      int polret = 0;
+      switch (wait_strategy) {
+      case wait_strategy_spin:
+	xsk_kick_fill_ring(x, sockfd);
+	cpu_relax();
+	break;
+      case wait_strategy_spin_poll:
+	if (monotonic_ns() - wait_start < spin_budget_ns) {
+	  xsk_kick_fill_ring(x, sockfd);
+	  cpu_relax();
+	  break;
+	}
+	/* fall through */
+      case wait_strategy_poll:
+      case wait_strategy_busy_poll:
+      default:
+	polret = poll(&psockfd, 1, 1000);
+	thread_stats_add(stats, thread_stat_polls, 1);
+	break;
+      }
+      if (polret < 0 && errno != EINTR) {
+	perror("poll returned error");
+      }
+      uint64_t now = monotonic_ns();
+      thread_stats_add(stats, thread_stat_wait_ns, now - mark);
+      mark = now;
+      continue;
+    }
+
+    uint64_t start = monotonic_ns();
+    thread_stats_add(stats, thread_stat_wait_ns, start - mark);
+
+    uint32_t batch_size = available < XSK_BATCH_SIZE ? available : XSK_BATCH_SIZE;
+    unsigned long byte_count = 0;
+    clock_gettime(CLOCK_REALTIME, &pi.ts);
+    for (uint32_t i = 0; i < batch_size; i++) {
+      const struct xdp_desc *desc = &rx_desc[(rx_cons + i) & x->rx.mask];
+      uint8_t *eth = x->umem + desc->addr;
+      frames[i] = desc->addr & ~(uint64_t)(XSK_FRAME_SIZE - 1);
+      byte_count += desc->len;
+
+      pi.caplen = desc->len;
+      pi.len = desc->len;
+      handler->func(&handler->context, &pi, eth);
+    }
+    frame_handler_flush(handler, false);
+    __atomic_store_n(x->rx.consumer, rx_cons + batch_size, __ATOMIC_RELEASE);
+
+    /*
+     * the fill ring has room for all of the frames, so it has room for
+     * these; the kernel may need to be woken up to refill its queue
+     */
+    uint32_t fill_prod = *x->fill.producer;
+    for (uint32_t i = 0; i < batch_size; i++) {
+      fill_desc[(fill_prod + i) & x->fill.mask] = frames[i];
+    }
+    __atomic_store_n(x->fill.producer, fill_prod + batch_size, __ATOMIC_RELEASE);
+    xsk_kick_fill_ring(x, sockfd);
+
+    mark = monotonic_ns();
+    wait_start = mark;
+    thread_stats_add(stats, thread_stat_process_ns, mark - start);
+    thread_stats_add(stats, thread_stat_blocks, 1);
+    thread_stats_add(stats, thread_stat_packets, batch_size);
+    thread_stats_add(stats, thread_stat_bytes, byte_count);
+  }
+
+  fprintf(stderr, "Thread %d with thread id %lu exiting...\n", thread_stor->tnum, thread_stor->tid);
+  return 0;
+}
+
+/*
+ * the AF_XDP counters are cumulative; a packet that the socket saw is
+ * one that it either received or dropped
+ */
+static void af_xdp_socket_stats(struct thread_storage *thread_stor, struct stats_tracking *statst) {
+  struct xsk *x = thread_stor->xsk;
+  struct xdp_statistics xs;
+  socklen_t optlen = sizeof(xs);
+  memset(&xs, 0, sizeof(xs));
+  if (getsockopt(thread_stor->sockfd, SOL_XDP, XDP_STATISTICS, &xs, &optlen)) {
+    perror("error: could not get AF_XDP statistics");
+    return;
+  }
+  uint64_t drops = (xs.rx_dropped - x->last.rx_dropped)
+    + (xs.rx_invalid_descs - x->last.rx_invalid_descs)
+    + (xs.rx_ring_full - x->last.rx_ring_full)
+    + (xs.rx_fill_ring_empty_descs - x->last.rx_fill_ring_empty_descs);
+  uint64_t packets = thread_stor->stats ? thread_stats_load(thread_stor->stats, thread_stat_packets) : 0;
+
+  statst->socket_packets += (packets - x->last_packets) + drops;
+  statst->socket_drops += drops;
+  x->last = xs;
+  x->last_packets = packets;
+}
+
+static void af_xdp_release(struct thread_storage *thread_stor) {
+  close(thread_stor->sockfd);
+  xsk_free(thread_stor->xsk);
+  thread_stor->xsk = NULL;
+}
+
+static void af_xdp_stop() {
+  if (xdp_link_fd >= 0) {
+    close(xdp_link_fd);   /* detaches the program */
+  }
+  if (xdp_prog_fd >= 0) {
+    close(xdp_prog_fd);
+  }
+  if (xsk_map_fd >= 0) {
+    close(xsk_map_fd);
+  }
+  xdp_link_fd = xdp_prog_fd = xsk_map_fd = -1;
+}
+
+const struct capture_ops af_xdp_backend = {
+  "AF_XDP",
+  af_xdp_start,
+  af_xdp_setup,
+  af_xdp_activate,
+  af_xdp_capture,
+  af_xdp_socket_stats,
+  af_xdp_release,
+  af_xdp_stop
+};
+
+#else /* USE_AF_XDP */
+
+static int af_xdp_start(struct mercury_config *, int) {
+  fprintf(stderr, "error: AF_XDP is not available in this build of mercury\n");
+  return -1;
+}
+
+const struct capture_ops af_xdp_backend = {
+  "AF_XDP",
+  af_xdp_start,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+#endif /* USE_AF_XDP */
@@ -0,0 +1,37 @@
+/*
+ * af_xdp.h
+ *
+ * packet capture with AF_XDP sockets
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef AF_XDP_H
+#define AF_XDP_H
+
+#include "af_packet_v3.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/if_xdp.h>)
+#include <linux/if_xdp.h>
+#endif
+#endif
+
+#ifdef XDP_USE_NEED_WAKEUP
+#define USE_AF_XDP
+#endif
+
+/*
+ * af_xdp_backend captures packets through AF_XDP sockets, one per
+ * capture thread, each bound to one receive queue of the interface;
+ * an XDP program attached to the interface redirects the packets from
+ * each queue to its socket.  The program is attached in native
+ * (driver) mode if the driver supports it, and in generic (skb) mode
+ * otherwise, and the sockets use zero-copy mode if the driver
+ * supports it.  If AF_XDP is not available at compile time, starting
+ * this backend fails with an error.
+ */
+extern const struct capture_ops af_xdp_backend;
+
+#endif /* AF_XDP_H */
@@ -0,0 +1,153 @@
+/*
+ * affinity.c
+ *
+ * selection of the processors on which capture threads run
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "affinity.h"
+#include "mercury.h"
+
+int cpu_list_parse(const char *s, int *cpu, int max) {
+    int num_cpus = 0;
+
+    while (*s != '\0' && *s != '\n') {
+	char *end;
+	errno = 0;
+	long first = strtol(s, &end, 10);
+	if (errno || end == s || first < 0) {
+	    return -1;
+	}
+	long last = first;
+	s = end;
+	if (*s == '-') {
+	    s++;
+	    last = strtol(s, &end, 10);
+	    if (errno || end == s || last < first) {
+		return -1;
+	    }
+	    s = end;
+	}
+	for (long c = first; c <= last; c++) {
+	    if (num_cpus == max) {
+		return -1;
+	    }
+	    cpu[num_cpus++] = c;
+	}
+	if (*s == ',') {
+	    s++;
+	} else if (*s != '\0' && *s != '\n') {
+	    return -1;
+	}
+    }
+    return num_cpus;
+}
+
+/*
+ * read_sysfs_line(path, buf, len) reads the first line of a sysfs
+ * file into buf, and returns status_err if it cannot be read
+ */
+static enum status read_sysfs_line(const char *path, char *buf, size_t len) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+	return status_err;
+    }
+    char *line = fgets(buf, len, f);
+    fclose(f);
+    return line ? status_ok : status_err;
+}
+
+int interface_numa_node(const char *if_name) {
+    char path[MAX_FILENAME];
+    char line[32];
+
+    if ((size_t)snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", if_name) >= sizeof(path)) {
+	return -1;
+    }
+    if (read_sysfs_line(path, line, sizeof(line)) != status_ok) {
+	return -1;
+    }
+    return atoi(line);
+}
+
+#define SYSFS_CPU_LIST_LEN 8192
+
+int affinity_get_cpus(const char *spec, const char *if_name, int *cpu, int max) {
+    char path[MAX_FILENAME];
+    char line[SYSFS_CPU_LIST_LEN];
+    int num_cpus;
+
+    if (strcmp(spec, "isolated") == 0) {
+	if (read_sysfs_line("/sys/devices/system/cpu/isolated", line, sizeof(line)) != status_ok) {
+	    fprintf(stderr, "error: could not read the list of isolated CPUs\n");
+	    return -1;
+	}
+	num_cpus = cpu_list_parse(line, cpu, max);
+	if (num_cpus == 0) {
+	    fprintf(stderr, "error: there are no isolated CPUs (see the isolcpus kernel parameter)\n");
+	    return -1;
+	}
+
+    } else if (strcmp(spec, "nic") == 0) {
+	int node = if_name ? interface_numa_node(if_name) : -1;
+	if (node < 0) {
+	    fprintf(stderr, "error: the NUMA node of interface %s is not known\n", if_name ? if_name : "(none)");
+	    return -1;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (read_sysfs_line(path, line, sizeof(line)) != status_ok) {
+	    fprintf(stderr, "error: could not read the CPU list of NUMA node %d\n", node);
+	    return -1;
+	}
+	num_cpus = cpu_list_parse(line, cpu, max);
+
+    } else {
+	num_cpus = cpu_list_parse(spec, cpu, max);
+	if (num_cpus <= 0) {
+	    fprintf(stderr, "error: \"%s\" is not a valid CPU list\n", spec);
+	    return -1;
+	}
+    }
+    if (num_cpus < 0) {
+	return -1;
+    }
+
+    /*
+     * omit the processors that we are not allowed to use
+     */
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+	int n = 0;
+	for (int i = 0; i < num_cpus; i++) {
+	    if (cpu[i] < CPU_SETSIZE && CPU_ISSET(cpu[i], &allowed)) {
+		cpu[n++] = cpu[i];
+	    }
+	}
+	num_cpus = n;
+    }
+    if (num_cpus == 0) {
+	fprintf(stderr, "error: none of the CPUs selected by \"%s\" are available\n", spec);
+	return -1;
+    }
+    return num_cpus;
+}
+
+int set_thread_affinity(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+	fprintf(stderr, "%s: could not set affinity to CPU %d\n", strerror(err), cpu);
+	return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * affinity.h
+ *
+ * selection of the processors on which capture threads run
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+
+#define MAX_AFFINITY_CPUS 4096
+
+/*
+ * cpu_list_parse(s, cpu, max) parses a list of processor numbers and
+ * ranges in the format used by the kernel (e.g. "0-3,8,10-11") into
+ * the array cpu, which holds up to max entries; it returns the number
+ * of processors, or -1 if s is not a valid list
+ */
+int cpu_list_parse(const char *s, int *cpu, int max);
+
+/*
+ * interface_numa_node(if_name) returns the NUMA node to which the
+ * network device if_name is attached, or -1 if it is not known (as
+ * for virtual devices, and on machines with a single node)
+ */
+int interface_numa_node(const char *if_name);
+
+/*
+ * affinity_get_cpus(spec, if_name, cpu, max) writes the processors
+ * selected by spec into the array cpu, and returns their number, or
+ * -1 on failure.  The spec is one of
+ *
+ *    a CPU list, such as "0-3,8"
+ *    "isolated", the processors isolated from the scheduler (isolcpus=)
+ *    "nic", the processors on the NUMA node of the interface if_name
+ *
+ * Processors that the process is not allowed to use are omitted.
+ */
+int affinity_get_cpus(const char *spec, const char *if_name, int *cpu, int max);
+
+/*
+ * set_thread_affinity(cpu) restricts the calling thread to the
+ * processor cpu, so that the memory that it touches first is
+ * allocated on the NUMA node of that processor; it returns 0 on
+ * success and -1 on failure
+ */
+int set_thread_affinity(int cpu);
+
+#endif /* AFFINITY_H */
@@ -7,31 +7,129 @@
 
 
 #include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <atomic>
+#include <new>
 #include "analysis.h"
+#include "analysis_cache.h"
+#include "analysis_pool.h"
+#include "epoch.h"
+#include "thread_stats.h"
 #include "ept.h"
+#include "utils.h"
 
 /* 
  * analysis_cfg is a global variable that configures the analysis
  */
 enum analysis_cfg analysis_cfg = analysis_off;
 
-#ifdef HAVE_PYTHON3
+/*
+ * analysis_cache holds the results of recent analyses, so that each
+ * distinct (fingerprint, server name, destination) observation need
+ * only be analyzed once while it remains in the cache
+ */
+struct analysis_cache *analysis_cache = NULL;
 
-#include "python_interface.h"
+/*
+ * struct analysis_db is the data used by the engine, as loaded at
+ * startup or by the latest reload.  It is reached through the atomic
+ * pointer analysis_db, and each reader holds an epoch read lock (see
+ * epoch.h) while it uses the data, so that a reload can replace it
+ * without blocking the readers, and free the old data once they are
+ * done with it.  The generation, which increases with each reload,
+ * is mixed into the keys of the result cache, so that the results
+ * computed from an old database are not served after a reload.
+ */
+struct fingerprint_db;
 
-int analysis_init() {
-    extern enum analysis_cfg analysis_cfg;
-    analysis_cfg = analysis_on;
-    return init_python();
+struct analysis_db {
+    struct fingerprint_db *fpdb;   /* NULL for the python engine */
+    uint64_t generation;
+};
+
+static std::atomic<struct analysis_db *> analysis_db(NULL);
+
+#define MAX_FP_STR_LEN 4096
+#define SNI_HEADER_LEN 9
+#define MAX_RESULT_LEN 1024
+
+/*
+ * struct analysis_request holds the inputs to a single analysis; the
+ * fingerprint is a binary EPT, and the server name need not be
+ * null-terminated
+ */
+struct analysis_request {
+    const uint8_t *fp;
+    size_t fp_len;
+    const uint8_t *sni;
+    size_t sni_len;
+    struct flow_key key;
+};
+
+static void analysis_request_init_from_extractor(struct analysis_request *r,
+						 const struct extractor *x,
+						 const struct flow_key *key) {
+    r->fp = x->output_start;
+    r->fp_len = extractor_get_output_length(x);
+    r->sni = NULL;
+    r->sni_len = 0;
+    if (x->packet_data.type == packet_data_type_tls_sni && x->packet_data.length >= SNI_HEADER_LEN) {
+	r->sni = x->packet_data.value + SNI_HEADER_LEN;
+	r->sni_len = x->packet_data.length - SNI_HEADER_LEN;
+    }
+    r->key = *key;
 }
 
-int analysis_finalize() {
-    extern enum analysis_cfg analysis_cfg;
-    analysis_cfg = analysis_off;
-    return finalize_python();
+struct analysis_batch {
+    unsigned int count;
+    size_t data_len;
+    struct analysis_request request[ANALYSIS_BATCH_SIZE];
+    bool has_result[ANALYSIS_BATCH_SIZE];
+    char result[ANALYSIS_BATCH_SIZE][MAX_RESULT_LEN];
+    uint8_t data[ANALYSIS_BATCH_DATA_LEN];   /* copies of fingerprints and names */
+};
+
+/*
+ * the native inference engine (fingerprint_db.c) is used by default;
+ * the embedded python engine can be selected at compile time with
+ * "make OPTFLAGS=-DPYTHON_ANALYSIS" when python3 is available
+ */
+#if defined(HAVE_PYTHON3) && defined(PYTHON_ANALYSIS)
+
+#include "python_interface.h"
+
+/*
+ * the python module reads its own resources once, so the python
+ * engine cannot be reloaded
+ */
+static struct analysis_db *analysis_engine_load() {
+    static bool loaded = false;
+
+    if (loaded) {
+	fprintf(stderr, "error: the python analysis engine cannot be reloaded\n");
+	return NULL;
+    }
+    struct analysis_db *d = new (std::nothrow) struct analysis_db;
+    if (d == NULL || init_python() != 0) {
+	delete d;
+	return NULL;
+    }
+    d->fpdb = NULL;
+    d->generation = 0;
+    loaded = true;
+    return d;
 }
 
-#define SNI_HEADER_LEN 9
+static void analysis_engine_unload(struct analysis_db *d) {
+    finalize_python();
+    delete d;
+}
 
 #define MAX_DST_ADDR_LEN 40
 void flow_key_sprintf_dst_addr(const struct flow_key *key,
@@ -52,64 +150,568 @@ void flow_key_sprintf_dst_addr(const struct flow_key *key,
     }
 }
 
-#define MAX_FP_STR_LEN 4096
 #define MAX_SNI_LEN     257
-#define FP_BUF_LEN     2048				  
+
+/*
+ * struct py_request holds the string forms of the inputs to an
+ * analysis, as used by the python module
+ */
+struct py_request {
+    char fp_string[MAX_FP_STR_LEN];
+    char sni[MAX_SNI_LEN];
+    char dst_addr_string[MAX_DST_ADDR_LEN];
+};
+
+static enum status py_request_init(struct py_request *p, const struct analysis_request *r) {
+    if (sprintf_binary_ept_as_paren_ept((uint8_t *)r->fp, r->fp_len, (unsigned char *)p->fp_string, MAX_FP_STR_LEN) == 0) {
+	return status_err;
+    }
+    flow_key_sprintf_dst_addr(&r->key, p->dst_addr_string);
+    size_t sni_len = r->sni_len > MAX_SNI_LEN-1 ? MAX_SNI_LEN-1 : r->sni_len;
+    if (sni_len) {
+	memcpy(p->sni, r->sni, sni_len);
+    }
+    p->sni[sni_len] = 0; /* null termination */
+    return status_ok;
+}
+
+/*
+ * copy_result(buf, len, r_p) copies the malloc()ed result r_p into
+ * buf, if it fits, and frees it
+ */
+static enum status copy_result(char *buf, size_t len, char *r_p) {
+    size_t r_len = strlen(r_p);
+    if (r_len < len) {
+	memcpy(buf, r_p, r_len + 1);
+    }
+    free(r_p);
+
+    return r_len < len ? status_ok : status_err;
+}
+
+/*
+ * analysis_engine_write_result(d, buf, len, r) analyzes the TLS
+ * fingerprint, server name, and destination in the request r with
+ * the data d, and writes the JSON result into buf; it returns
+ * status_err if the result could not be computed or did not fit
+ */
+static enum status analysis_engine_write_result(const struct analysis_db *d,
+						char *buf,
+						size_t len,
+						const struct analysis_request *r) {
+    (void)d;
+    char *r_p;
+    struct py_request p;
+    uint16_t dest_port = 0;
+
+    if (py_request_init(&p, r) != status_ok) {
+	return status_err;
+    }
+    py_process_detection(&r_p, p.fp_string, p.sni, p.dst_addr_string, dest_port);
+
+    return copy_result(buf, len, r_p);
+}
+
+/*
+ * analysis_engine_write_results(d, b, index, n) computes the results
+ * of the n requests in b whose indices are in the array index,
+ * holding the interpreter lock only once
+ */
+static void analysis_engine_write_results(const struct analysis_db *d,
+					  struct analysis_batch *b,
+					  const unsigned int *index,
+					  unsigned int n) {
+    (void)d;
+    struct py_request *p = (struct py_request *)malloc(n * sizeof(struct py_request));
+    char **args = (char **)malloc(n * 4 * sizeof(char *));
+    int *dest_ports = (int *)calloc(n, sizeof(int));
+    unsigned int *request_index = (unsigned int *)malloc(n * sizeof(unsigned int));
+    if (p == NULL || args == NULL || dest_ports == NULL || request_index == NULL) {
+	fprintf(stderr, "error: could not allocate memory for analysis batch\n");
+	free(p);
+	free(args);
+	free(dest_ports);
+	free(request_index);
+	return;
+    }
+    char **results = args;
+    char **fp_strings = args + n;
+    char **snis = args + 2 * n;
+    char **dst_addr_strings = args + 3 * n;
+
+    unsigned int num_valid = 0;
+    for (unsigned int i = 0; i < n; i++) {
+	if (py_request_init(&p[num_valid], &b->request[index[i]]) == status_ok) {
+	    fp_strings[num_valid] = p[num_valid].fp_string;
+	    snis[num_valid] = p[num_valid].sni;
+	    dst_addr_strings[num_valid] = p[num_valid].dst_addr_string;
+	    request_index[num_valid] = index[i];
+	    num_valid++;
+	}
+    }
+
+    py_process_detection_batch(results, fp_strings, snis, dst_addr_strings, dest_ports, num_valid);
+
+    for (unsigned int i = 0; i < num_valid; i++) {
+	unsigned int k = request_index[i];
+	b->has_result[k] = (copy_result(b->result[k], MAX_RESULT_LEN, results[i]) == status_ok);
+    }
+    free(p);
+    free(args);
+    free(dest_ports);
+    free(request_index);
+}
+
+static uint32_t analysis_engine_get_asn(const struct analysis_db *d, const struct flow_key *key) {
+    (void)d;
+    (void)key;
+    return 0;  /* not available from the python engine */
+}
+
+static size_t analysis_engine_get_registered_domain(const struct analysis_db *d, const uint8_t *name, size_t len) {
+    (void)d;
+    (void)name;
+    return len;  /* not available from the python engine */
+}
+
+#else /* native inference engine */
+
+#include "fingerprint_db.h"
+
+/*
+ * get_resource_dir(dir, len) writes the path of the resources
+ * directory, which is located relative to the mercury executable
+ * (e.g. mercury/src/mercury uses mercury/resources), into dir
+ */
+static enum status get_resource_dir(char *dir, size_t len) {
+    char exe[MAX_FILENAME] = { 0 };
+
+    ssize_t num_bytes_read = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if (num_bytes_read == -1) {
+        perror("readlink failed");
+        return status_err;
+    }
+    char *last_slash = strrchr(exe, '/');
+    if (last_slash == NULL) {
+	return status_err;
+    }
+    *last_slash = '\0';
+    if ((size_t)snprintf(dir, len, "%s/../resources", exe) >= len) {
+	return status_err;
+    }
+    return status_ok;
+}
+
+/*
+ * analysis_engine_load() loads the fingerprint database from the
+ * resource directory, which may be done again at any time to pick up
+ * updated resource files
+ */
+static struct analysis_db *analysis_engine_load() {
+    char resource_dir[MAX_FILENAME];
+
+    if (get_resource_dir(resource_dir, sizeof(resource_dir)) != status_ok) {
+	fprintf(stderr, "error: could not find analysis resource directory\n");
+	return NULL;
+    }
+    struct fingerprint_db *fpdb = fingerprint_db_load(resource_dir);
+    if (fpdb == NULL) {
+	fprintf(stderr, "error: could not initialize analysis engine from %s\n", resource_dir);
+	return NULL;
+    }
+    struct analysis_db *d = new (std::nothrow) struct analysis_db;
+    if (d == NULL) {
+	fingerprint_db_free(fpdb);
+	return NULL;
+    }
+    d->fpdb = fpdb;
+    d->generation = 0;
+    return d;
+}
+
+static void analysis_engine_unload(struct analysis_db *d) {
+    fingerprint_db_free(d->fpdb);
+    delete d;
+}
+
+static enum status analysis_engine_write_result(const struct analysis_db *d,
+						char *buf,
+						size_t len,
+						const struct analysis_request *r) {
+    struct analysis_result result = analysis_result_init();
+
+    fingerprint_db_classify(d->fpdb, &result, r->fp, r->fp_len, r->sni, r->sni_len, &r->key);
+
+    if (snprintf_analysis_result(buf, len, d->fpdb, &result) >= len) {
+	return status_err;
+    }
+    return status_ok;
+}
+
+/*
+ * the native engine needs no locks, so a batch is simply processed
+ * one request at a time
+ */
+static void analysis_engine_write_results(const struct analysis_db *d,
+					  struct analysis_batch *b,
+					  const unsigned int *index,
+					  unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) {
+	unsigned int k = index[i];
+	b->has_result[k] = (analysis_engine_write_result(d, b->result[k], MAX_RESULT_LEN, &b->request[k]) == status_ok);
+    }
+}
+
+static uint32_t analysis_engine_get_asn(const struct analysis_db *d, const struct flow_key *key) {
+    return fingerprint_db_get_asn(d->fpdb, key, NULL);
+}
+
+static size_t analysis_engine_get_registered_domain(const struct analysis_db *d, const uint8_t *name, size_t len) {
+    return fingerprint_db_get_registered_domain(d->fpdb, name, len);
+}
+
+#endif /* HAVE_PYTHON3 && PYTHON_ANALYSIS */
+
+/*
+ * analysis_cache_key_for_request(d, r) returns the cache key of the
+ * request r, for results computed with the data d
+ */
+static inline uint64_t analysis_cache_key_for_request(const struct analysis_db *d,
+						      const struct analysis_request *r) {
+    uint64_t k = analysis_cache_key(r->fp, r->fp_len, r->sni, r->sni_len, &r->key);
+    return k ^ (d->generation * 0x9e3779b97f4a7c15ULL);
+}
+
+/*
+ * reloads are performed by a background thread, which waits on a
+ * semaphore so that it can be woken from a signal handler; the mutex
+ * serializes reloads and shutdown
+ */
+static sem_t analysis_reload_sem;
+static pthread_t analysis_reload_thread;
+static bool analysis_reload_thread_started = false;
+static std::atomic<bool> analysis_reload_stop(false);
+static pthread_mutex_t analysis_reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define RELOAD_WAIT_USEC 100
+
+int analysis_reload() {
+    pthread_mutex_lock(&analysis_reload_mutex);
+
+    struct analysis_db *old_db = analysis_db.load();
+    if (old_db == NULL || analysis_reload_stop.load()) {
+	pthread_mutex_unlock(&analysis_reload_mutex);
+	return -1;  /* not initialized, or shutting down */
+    }
+    struct analysis_db *new_db = analysis_engine_load();
+    if (new_db == NULL) {
+	pthread_mutex_unlock(&analysis_reload_mutex);
+	fprintf(stderr, "error: could not reload analysis database; keeping the current one\n");
+	return -1;
+    }
+    uint64_t generation = old_db->generation + 1;
+    new_db->generation = generation;
+    analysis_db.store(new_db);
+
+    /*
+     * wait until no reader can still be using the old database; if
+     * we are shutting down, a reader may never leave its read section
+     * (it may have been interrupted by the signal handler that is
+     * shutting us down), so the old database is abandoned instead
+     */
+    uint64_t e = epoch_advance();
+    while (!epoch_readers_done(e)) {
+	if (analysis_reload_stop.load()) {
+	    pthread_mutex_unlock(&analysis_reload_mutex);
+	    return 0;
+	}
+	usleep(RELOAD_WAIT_USEC);
+    }
+    analysis_engine_unload(old_db);
+
+    pthread_mutex_unlock(&analysis_reload_mutex);
+    fprintf(stderr, "reloaded analysis database (generation %" PRIu64 ")\n", generation);
+    return 0;
+}
+
+static void *analysis_reload_func(void *arg) {
+    (void)arg;
+    sigset_t mask;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);  /* leave signals to the other threads */
+
+    while (true) {
+	if (sem_wait(&analysis_reload_sem) != 0) {
+	    continue;  /* interrupted */
+	}
+	while (sem_trywait(&analysis_reload_sem) == 0) {
+	    ;          /* coalesce requests that arrived in the meantime */
+	}
+	if (analysis_reload_stop.load()) {
+	    break;
+	}
+	analysis_reload();
+    }
+    return NULL;
+}
+
+void analysis_request_reload() {
+    if (analysis_reload_thread_started) {
+	sem_post(&analysis_reload_sem);
+    }
+}
+
+int analysis_init(size_t cache_size) {
+    extern enum analysis_cfg analysis_cfg;
+
+    if (analysis_db.load() != NULL) {
+	return -1; /* already initialized */
+    }
+    struct analysis_db *d = analysis_engine_load();
+    if (d == NULL) {
+	return -1;
+    }
+    if (cache_size) {
+	analysis_cache = analysis_cache_alloc(cache_size);
+	if (analysis_cache == NULL) {
+	    fprintf(stderr, "error: could not allocate analysis cache\n");
+	    analysis_engine_unload(d);
+	    return -1;
+	}
+    }
+    analysis_db.store(d);
+
+    analysis_reload_stop.store(false);
+    if (sem_init(&analysis_reload_sem, 0, 0) == 0) {
+	int err = pthread_create(&analysis_reload_thread, NULL, analysis_reload_func, NULL);
+	if (err) {
+	    fprintf(stderr, "%s: could not create analysis reload thread; reloading is disabled\n", strerror(err));
+	    sem_destroy(&analysis_reload_sem);
+	} else {
+	    analysis_reload_thread_started = true;
+	}
+    }
+
+    analysis_cfg = analysis_on;
+    return 0;
+}
+
+int analysis_finalize() {
+    extern enum analysis_cfg analysis_cfg;
+
+    analysis_pool_stop();  /* complete any outstanding work */
+    analysis_cfg = analysis_off;
+
+    if (analysis_reload_thread_started) {
+	analysis_reload_stop.store(true);
+	sem_post(&analysis_reload_sem);
+	pthread_join(analysis_reload_thread, NULL);
+	analysis_reload_thread_started = false;
+    }
+
+    pthread_mutex_lock(&analysis_reload_mutex);
+    struct analysis_db *d = analysis_db.exchange(NULL);
+    pthread_mutex_unlock(&analysis_reload_mutex);
+
+    analysis_cache_free(analysis_cache);
+    analysis_cache = NULL;
+    if (d == NULL) {
+	return -1;
+    }
+    analysis_engine_unload(d);
+    return 0;
+}
+
 void fprintf_analysis_from_extractor_and_flow_key(FILE *file,
 						  const struct extractor *x,
 						  const struct flow_key *key) {
-    //struct results_obj *r_p;
-    char *r_p;
     extern enum analysis_cfg analysis_cfg;
 
     if (analysis_cfg == analysis_off) {
 	return; /* do not perform any analysis */
     }
-    
+
     if (x->fingerprint_type == fingerprint_type_tls) {
-	char dst_addr_string[MAX_DST_ADDR_LEN];
-	unsigned char fp_string[MAX_FP_STR_LEN];
-	char tmp_sni[MAX_SNI_LEN];
-	uint16_t dest_port = 0;
-	
-	uint8_t *extractor_buffer = x->output_start;
-	size_t bytes_extracted = extractor_get_output_length(x);
-	sprintf_binary_ept_as_paren_ept(extractor_buffer, bytes_extracted, fp_string, MAX_FP_STR_LEN); /* should check return result */
-	flow_key_sprintf_dst_addr(key, dst_addr_string);
-	if (x->packet_data.type == packet_data_type_tls_sni) {
-	    size_t sni_len = x->packet_data.length - SNI_HEADER_LEN;
-	    sni_len = sni_len > MAX_SNI_LEN-1 ? MAX_SNI_LEN-1 : sni_len;
-	    memcpy(tmp_sni, x->packet_data.value + SNI_HEADER_LEN, sni_len);
-	    tmp_sni[sni_len] = 0; /* null termination */
+	char result[MAX_RESULT_LEN];
+	uint64_t cache_key = 0;
+	struct analysis_request r;
+	bool have_result = false;
+
+	analysis_request_init_from_extractor(&r, x, key);
+
+	epoch_read_lock();
+	const struct analysis_db *d = analysis_db.load();
+	if (d) {
+	    if (analysis_cache) {
+		cache_key = analysis_cache_key_for_request(d, &r);
+		have_result = analysis_cache_lookup(analysis_cache, cache_key, result);
+	    }
+	    thread_stats_add(thread_stats_get(), have_result ? thread_stat_analysis_hits : thread_stat_analysis_misses, 1);
+	    if (!have_result && analysis_engine_write_result(d, result, sizeof(result), &r) == status_ok) {
+		have_result = true;
+		if (analysis_cache) {
+		    analysis_cache_insert(analysis_cache, cache_key, result);
+		}
+	    }
+	}
+	epoch_read_unlock();
+
+	if (have_result) {
+	    fprintf(file, "\"analysis\":%s,", result);
 	}
-	
-	fprintf(file, "\"analysis\":");
-	py_process_detection(&r_p, (char *)fp_string, tmp_sni, dst_addr_string, dest_port);
-	fprintf(file, "%s", r_p);
-	fprintf(file, ",");
     }
 
 }
 
-#else /* HAVE_PYTHON3 is not defined */
+struct analysis_batch *analysis_batch_alloc() {
+    struct analysis_batch *b = (struct analysis_batch *)malloc(sizeof(struct analysis_batch));
+    if (b) {
+	analysis_batch_clear(b);
+    }
+    return b;
+}
 
-int analysis_init() {
-    fprintf(stderr, "error: analysis requested, but analysis engine not present\n"); 
-    return -1; 
+void analysis_batch_free(struct analysis_batch *b) {
+    free(b);
 }
 
-int analysis_finalize() {
-    /* nothing to do */
-    return -1;
+void analysis_batch_clear(struct analysis_batch *b) {
+    b->count = 0;
+    b->data_len = 0;
 }
 
-void fprintf_analysis_from_extractor_and_flow_key(FILE *file,
-						  const struct extractor *x,
-						  const struct flow_key *key) {
-    (void)file; /* unused */
-    (void)x;    /* unused */
-    (void)key;  /* unused */
+int analysis_batch_add(struct analysis_batch *b,
+		       const uint8_t *fp,
+		       size_t fp_len,
+		       const uint8_t *sni,
+		       size_t sni_len,
+		       const struct flow_key *key) {
+    if (b->count == ANALYSIS_BATCH_SIZE || fp_len + sni_len > ANALYSIS_BATCH_DATA_LEN - b->data_len) {
+	return -1;
+    }
+    struct analysis_request *r = &b->request[b->count];
+    uint8_t *data = b->data + b->data_len;
+    memcpy(data, fp, fp_len);
+    if (sni_len) {
+	memcpy(data + fp_len, sni, sni_len);
+    }
+    b->data_len += fp_len + sni_len;
+
+    r->fp = data;
+    r->fp_len = fp_len;
+    r->sni = data + fp_len;
+    r->sni_len = sni_len;
+    r->key = *key;
+    b->has_result[b->count] = false;
+
+    return b->count++;
+}
+
+int analysis_batch_add_from_extractor(struct analysis_batch *b,
+				      const struct extractor *x,
+				      const struct flow_key *key) {
+    if (x->fingerprint_type != fingerprint_type_tls) {
+	return -1;
+    }
+    struct analysis_request r;
+    analysis_request_init_from_extractor(&r, x, key);
+    return analysis_batch_add(b, r.fp, r.fp_len, r.sni, r.sni_len, key);
+}
+
+void analysis_batch_process(struct analysis_batch *b) {
+    extern enum analysis_cfg analysis_cfg;
+    uint64_t cache_key[ANALYSIS_BATCH_SIZE];
+    unsigned int miss[ANALYSIS_BATCH_SIZE];
+    unsigned int num_misses = 0;
+
+    if (analysis_cfg == analysis_off) {
+	return;
+    }
+
+    epoch_read_lock();
+    const struct analysis_db *d = analysis_db.load();
+    if (d == NULL) {
+	epoch_read_unlock();
+	return;
+    }
+
+    /*
+     * serve what we can from the cache, then pass all of the misses
+     * to the engine at once
+     */
+    for (unsigned int i = 0; i < b->count; i++) {
+	const struct analysis_request *r = &b->request[i];
+	if (analysis_cache) {
+	    cache_key[i] = analysis_cache_key_for_request(d, r);
+	    if (analysis_cache_lookup(analysis_cache, cache_key[i], b->result[i])) {
+		b->has_result[i] = true;
+		continue;
+	    }
+	}
+	miss[num_misses++] = i;
+    }
+
+    struct thread_stats *stats = thread_stats_get();
+    thread_stats_add(stats, thread_stat_analysis_hits, b->count - num_misses);
+    thread_stats_add(stats, thread_stat_analysis_misses, num_misses);
+
+    if (num_misses) {
+	analysis_engine_write_results(d, b, miss, num_misses);
+
+	if (analysis_cache) {
+	    for (unsigned int i = 0; i < num_misses; i++) {
+		if (b->has_result[miss[i]]) {
+		    analysis_cache_insert(analysis_cache, cache_key[miss[i]], b->result[miss[i]]);
+		}
+	    }
+	}
+    }
+    epoch_read_unlock();
+}
+
+int fprintf_analysis_batch_result(FILE *file,
+				  const struct analysis_batch *b,
+				  unsigned int i) {
+    if (i < b->count && b->has_result[i]) {
+	return fprintf(file, "\"analysis\":%s,", b->result[i]);
+    }
+    return 0;
+}
+
+void fprintf_asn_from_flow_key(FILE *file, const struct flow_key *key) {
+    extern enum analysis_cfg analysis_cfg;
+
+    if (analysis_cfg == analysis_off) {
+	return;
+    }
+    uint32_t asn = 0;
+    epoch_read_lock();
+    const struct analysis_db *d = analysis_db.load();
+    if (d) {
+	asn = analysis_engine_get_asn(d, key);
+    }
+    epoch_read_unlock();
+    if (asn) {
+	fprintf(file, "\"da_asn\":%u,", asn);
+    }
 }
 
+void fprintf_domain_from_server_name(FILE *file, const uint8_t *name, size_t len) {
+    extern enum analysis_cfg analysis_cfg;
 
-#endif /* HAVE_PYTHON3 */
+    if (analysis_cfg == analysis_off) {
+	return;
+    }
+    size_t domain = len;
+    epoch_read_lock();
+    const struct analysis_db *d = analysis_db.load();
+    if (d) {
+	domain = analysis_engine_get_registered_domain(d, name, len);
+    }
+    epoch_read_unlock();
+    if (domain < len) {
+	fprintf(file, ",");
+	fprintf_json_string(file, "domain", name + domain, len - domain);
+    }
+}
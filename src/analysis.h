@@ -15,12 +15,119 @@
 
 enum analysis_cfg { analysis_off = 0, analysis_on = 1 };
 
-int analysis_init();
+#define ANALYSIS_CACHE_DEFAULT_SIZE  (32 * 1024 * 1024)
+
+/*
+ * analysis_init(cache_size) initializes the analysis engine and a
+ * result cache that uses at most cache_size bytes (or no cache, if
+ * cache_size is zero), and returns 0 on success or -1 on failure
+ */
+int analysis_init(size_t cache_size);
 
 int analysis_finalize();
 
+/*
+ * analysis_reload() loads the analysis database again from the
+ * resource files, and replaces the current database with it; the
+ * threads that are performing analysis keep running throughout, and
+ * use the new database as soon as it has been swapped in.  It
+ * returns 0 on success, or -1 on failure, in which case the current
+ * database is kept.
+ *
+ * analysis_request_reload() asks a background thread to call
+ * analysis_reload(), and returns at once; it is async-signal-safe,
+ * so that it can be called from a signal handler.
+ */
+int analysis_reload();
+
+void analysis_request_reload();
+
 void fprintf_analysis_from_extractor_and_flow_key(FILE *file,
 						  const struct extractor *x,
 						  const struct flow_key *key);
 
+/*
+ * struct analysis_batch holds a set of analysis requests, each of
+ * which is a (TLS fingerprint, server name, destination address and
+ * port) tuple, so that they can all be analyzed with a single call
+ * to analysis_batch_process().  The costs that the engine pays once
+ * per call (such as acquiring the python interpreter lock) are then
+ * amortized over the whole batch; a capture thread typically
+ * accumulates the requests from one block of packets.  The fingerprint
+ * and server name are copied into the batch, so the packet from which
+ * they were taken need not remain valid.  A batch must be used by one
+ * thread at a time.
+ */
+struct analysis_batch;
+
+#define ANALYSIS_BATCH_SIZE       256
+#define ANALYSIS_BATCH_DATA_LEN   (ANALYSIS_BATCH_SIZE * 1024)
+
+/*
+ * analysis_batch_alloc() returns a newly allocated, empty batch, or
+ * NULL if memory could not be allocated
+ */
+struct analysis_batch *analysis_batch_alloc();
+
+void analysis_batch_free(struct analysis_batch *b);
+
+/*
+ * analysis_batch_add(b, fp, fp_len, sni, sni_len, key) adds a request
+ * for the analysis of the binary TLS fingerprint fp with the server
+ * name sni (which may be NULL if sni_len is zero) and the destination
+ * in key; it returns the index of the request, or -1 if the batch
+ * has no room for it
+ */
+int analysis_batch_add(struct analysis_batch *b,
+		       const uint8_t *fp,
+		       size_t fp_len,
+		       const uint8_t *sni,
+		       size_t sni_len,
+		       const struct flow_key *key);
+
+/*
+ * analysis_batch_add_from_extractor(b, x, key) adds a request for the
+ * TLS fingerprint and server name in x, as above; it returns -1 if x
+ * does not hold a TLS fingerprint
+ */
+int analysis_batch_add_from_extractor(struct analysis_batch *b,
+				      const struct extractor *x,
+				      const struct flow_key *key);
+
+/*
+ * analysis_batch_process(b) computes the results of all of the
+ * requests in b, using the result cache where possible
+ */
+void analysis_batch_process(struct analysis_batch *b);
+
+/*
+ * fprintf_analysis_batch_result(file, b, i) writes the result of
+ * request i in the same format as
+ * fprintf_analysis_from_extractor_and_flow_key(), or nothing if that
+ * result could not be computed, and returns the number of bytes
+ * written
+ */
+int fprintf_analysis_batch_result(FILE *file,
+				  const struct analysis_batch *b,
+				  unsigned int i);
+
+/*
+ * analysis_batch_clear(b) removes all of the requests from b
+ */
+void analysis_batch_clear(struct analysis_batch *b);
+
+/*
+ * fprintf_asn_from_flow_key(file, key) writes the number of the
+ * autonomous system that holds the destination address of key as the
+ * JSON field "da_asn", if analysis is on and that number is known
+ */
+void fprintf_asn_from_flow_key(FILE *file, const struct flow_key *key);
+
+/*
+ * fprintf_domain_from_server_name(file, name, len) writes the
+ * registered domain of the server name as the JSON field "domain",
+ * preceded by a comma, if analysis is on
+ */
+void fprintf_domain_from_server_name(FILE *file, const uint8_t *name, size_t len);
+
 #endif /* ANALYSIS_H */
@@ -0,0 +1,166 @@
+/*
+ * analysis_cache.c
+ *
+ * bounded, concurrent cache of fingerprint analysis results
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <string.h>
+#include <atomic>
+#include <new>
+#include "analysis_cache.h"
+#include "hash.h"
+
+/*
+ * an entry occupies ANALYSIS_CACHE_ENTRY_SIZE bytes (two cache lines),
+ * so that a set of entries never shares a cache line with another
+ * set.  The sequence number is odd while the entry is being written;
+ * a reader copies the entry and then checks that the sequence number
+ * is even and unchanged.  A key of zero marks an empty entry.
+ */
+struct alignas(64) analysis_cache_entry {
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint8_t> referenced;
+    uint8_t unused[3];
+    std::atomic<uint64_t> key;
+    char value[ANALYSIS_CACHE_VALUE_LEN];
+};
+
+static_assert(sizeof(struct analysis_cache_entry) == ANALYSIS_CACHE_ENTRY_SIZE,
+	      "analysis_cache_entry has an unexpected size");
+
+struct analysis_cache_set {
+    struct analysis_cache_entry entry[ANALYSIS_CACHE_WAYS];
+};
+
+struct analysis_cache {
+    struct analysis_cache_set *set;
+    std::atomic<uint8_t> *clock_hand;  /* one per set */
+    uint64_t set_mask;
+};
+
+struct analysis_cache *analysis_cache_alloc(size_t max_bytes) {
+    size_t num_sets = 1;
+    while (num_sets * 2 * sizeof(struct analysis_cache_set) <= max_bytes) {
+	num_sets *= 2;
+    }
+
+    struct analysis_cache *c = new (std::nothrow) struct analysis_cache;
+    if (c == NULL) {
+	return NULL;
+    }
+    c->set = new (std::nothrow) struct analysis_cache_set[num_sets]();
+    c->clock_hand = new (std::nothrow) std::atomic<uint8_t>[num_sets]();
+    if (c->set == NULL || c->clock_hand == NULL) {
+	analysis_cache_free(c);
+	return NULL;
+    }
+    c->set_mask = num_sets - 1;
+
+    return c;
+}
+
+void analysis_cache_free(struct analysis_cache *c) {
+    if (c) {
+	delete[] c->set;
+	delete[] c->clock_hand;
+	delete c;
+    }
+}
+
+uint64_t analysis_cache_key(const uint8_t *fp,
+			    size_t fp_len,
+			    const uint8_t *sni,
+			    size_t sni_len,
+			    const struct flow_key *key) {
+    uint64_t h = 0x6d65726375727931ULL;  /* arbitrary seed */
+
+    h = hash64_bytes(h, fp, fp_len);
+    h = hash64_bytes(h, sni, sni_len);
+    if (key->type == ipv4) {
+	h = hash64_mix(h, ((uint64_t)key->value.v4.dst_addr << 16) | key->value.v4.dst_port);
+    } else if (key->type == ipv6) {
+	h = hash64_bytes(h, key->value.v6.dst_addr, IPV6_ADDR_LEN);
+	h = hash64_mix(h, key->value.v6.dst_port);
+    }
+    h = hash64_final(h);
+
+    return h ? h : 1;  /* zero denotes an empty entry */
+}
+
+unsigned int analysis_cache_lookup(struct analysis_cache *c,
+				   uint64_t key,
+				   char *value) {
+    struct analysis_cache_set *s = &c->set[key & c->set_mask];
+
+    for (struct analysis_cache_entry &e : s->entry) {
+	uint32_t seq = e.sequence.load(std::memory_order_acquire);
+	if ((seq & 1) || e.key.load(std::memory_order_relaxed) != key) {
+	    continue;
+	}
+	memcpy(value, e.value, ANALYSIS_CACHE_VALUE_LEN);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (e.sequence.load(std::memory_order_relaxed) != seq) {
+	    return 0;   /* entry was overwritten while being read */
+	}
+	value[ANALYSIS_CACHE_VALUE_LEN - 1] = '\0';
+	if (e.referenced.load(std::memory_order_relaxed) == 0) {
+	    e.referenced.store(1, std::memory_order_relaxed);
+	}
+	return 1;
+    }
+    return 0;
+}
+
+void analysis_cache_insert(struct analysis_cache *c,
+			   uint64_t key,
+			   const char *value) {
+    size_t len = strlen(value);
+    if (len >= ANALYSIS_CACHE_VALUE_LEN) {
+	return;
+    }
+    uint64_t set_index = key & c->set_mask;
+    struct analysis_cache_set *s = &c->set[set_index];
+
+    /*
+     * use an empty entry if there is one; otherwise, advance the
+     * clock hand past referenced entries, clearing their reference
+     * bits, until an unreferenced entry is found
+     */
+    struct analysis_cache_entry *victim = NULL;
+    for (struct analysis_cache_entry &e : s->entry) {
+	uint64_t k = e.key.load(std::memory_order_relaxed);
+	if (k == key) {
+	    return;  /* already cached */
+	}
+	if (k == 0 && victim == NULL) {
+	    victim = &e;
+	}
+    }
+    if (victim == NULL) {
+	std::atomic<uint8_t> &hand = c->clock_hand[set_index];
+	for (unsigned int i = 0; i < 2 * ANALYSIS_CACHE_WAYS; i++) {
+	    struct analysis_cache_entry *e = &s->entry[hand.fetch_add(1, std::memory_order_relaxed) % ANALYSIS_CACHE_WAYS];
+	    if (e->referenced.load(std::memory_order_relaxed) == 0) {
+		victim = e;
+		break;
+	    }
+	    e->referenced.store(0, std::memory_order_relaxed);
+	}
+	if (victim == NULL) {
+	    return;
+	}
+    }
+
+    uint32_t seq = victim->sequence.load(std::memory_order_relaxed);
+    if ((seq & 1) || !victim->sequence.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) {
+	return;  /* another thread is writing this entry */
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    victim->key.store(key, std::memory_order_relaxed);
+    memcpy(victim->value, value, len + 1);
+    victim->referenced.store(0, std::memory_order_relaxed);
+    victim->sequence.store(seq + 2, std::memory_order_release);
+}
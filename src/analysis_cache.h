@@ -0,0 +1,80 @@
+/*
+ * analysis_cache.h
+ *
+ * bounded, concurrent cache of fingerprint analysis results
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "packet.h"
+
+/*
+ * struct analysis_cache maps a 64-bit hash of an observation (binary
+ * fingerprint, server name, destination address and port) to the
+ * JSON text of its analysis result.  The cache is a fixed-size
+ * set-associative table that is allocated once; each set holds
+ * ANALYSIS_CACHE_WAYS entries, and when a set is full, an entry is
+ * evicted with the CLOCK (second chance) algorithm.  Each entry is
+ * protected by its own sequence lock, so lookups never block and
+ * never write to shared memory other than the entry's reference
+ * bit; an insert that finds its victim entry locked by another
+ * thread is simply dropped.  No global lock is used.
+ *
+ * Entries are identified by their 64-bit hash alone, so two distinct
+ * observations collide with probability about 2^-64 per lookup.
+ */
+struct analysis_cache;
+
+#define ANALYSIS_CACHE_WAYS            8
+#define ANALYSIS_CACHE_ENTRY_SIZE    128
+#define ANALYSIS_CACHE_VALUE_LEN     (ANALYSIS_CACHE_ENTRY_SIZE - 16)
+
+/*
+ * analysis_cache_alloc(max_bytes) returns a newly allocated, empty
+ * cache that uses no more than max_bytes of memory (rounded down to a
+ * power of two number of sets, with at least one set), or NULL if
+ * memory could not be allocated
+ */
+struct analysis_cache *analysis_cache_alloc(size_t max_bytes);
+
+void analysis_cache_free(struct analysis_cache *c);
+
+/*
+ * analysis_cache_key(fp, fp_len, sni, sni_len, key) returns the hash
+ * of a binary fingerprint, a server name (which may be NULL if
+ * sni_len is zero), and the destination address and port in the
+ * flow key
+ */
+uint64_t analysis_cache_key(const uint8_t *fp,
+			    size_t fp_len,
+			    const uint8_t *sni,
+			    size_t sni_len,
+			    const struct flow_key *key);
+
+/*
+ * analysis_cache_lookup(c, key, value) copies the null-terminated
+ * string associated with key into the buffer value, which must hold
+ * at least ANALYSIS_CACHE_VALUE_LEN bytes, and returns 1 if key is in
+ * the cache; otherwise, it returns 0
+ */
+unsigned int analysis_cache_lookup(struct analysis_cache *c,
+				   uint64_t key,
+				   char *value);
+
+/*
+ * analysis_cache_insert(c, key, value) associates the null-terminated
+ * string value with key; strings that are ANALYSIS_CACHE_VALUE_LEN
+ * bytes or longer (including the null) are not cached
+ */
+void analysis_cache_insert(struct analysis_cache *c,
+			   uint64_t key,
+			   const char *value);
+
+#endif /* ANALYSIS_CACHE_H */
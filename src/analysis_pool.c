@@ -0,0 +1,232 @@
+/*
+ * analysis_pool.c
+ *
+ * pool of threads that perform fingerprint analysis on behalf of the
+ * packet capture threads
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
+#include <new>
+#include "analysis_pool.h"
+#include "spsc_ring.h"
+
+struct analysis_queue {
+    struct spsc_ring work;        /* producer to worker */
+    struct spsc_ring completed;   /* worker to producer */
+};
+
+#define MAX_QUEUES_PER_WORKER 1024
+
+/*
+ * a worker serves a fixed set of queues; queues are added (under the
+ * pool's mutex) by publishing the new count with release semantics,
+ * so that the worker never sees a partially initialized queue
+ */
+struct analysis_worker {
+    pthread_t tid;
+    std::atomic<unsigned int> num_queues;
+    struct analysis_queue *queue[MAX_QUEUES_PER_WORKER];
+    std::atomic<uint64_t> batches;
+};
+
+struct analysis_pool {
+    unsigned int num_workers;
+    struct analysis_worker *worker;
+    unsigned int next_worker;
+    pthread_mutex_t mutex;
+    std::atomic<bool> stop;
+    std::atomic<uint64_t> deferred_flushes;
+    std::atomic<uint64_t> dropped_records;
+};
+
+static struct analysis_pool *analysis_pool = NULL;
+
+/*
+ * analysis_worker_drain(w) completes all of the work in the worker's
+ * queues, and returns the number of units completed
+ */
+static unsigned int analysis_worker_drain(struct analysis_worker *w) {
+    unsigned int count = 0;
+    unsigned int num_queues = w->num_queues.load(std::memory_order_acquire);
+
+    for (unsigned int i = 0; i < num_queues; i++) {
+	struct analysis_queue *q = w->queue[i];
+	struct analysis_work *work;
+	while ((work = (struct analysis_work *)spsc_ring_pop(&q->work)) != NULL) {
+	    analysis_batch_process(work->batch);
+	    work->complete(work);
+	    spsc_ring_push(&q->completed, work);  /* cannot fail; rings have the same capacity */
+	    count++;
+	}
+    }
+    if (count) {
+	w->batches.fetch_add(count, std::memory_order_relaxed);
+    }
+    return count;
+}
+
+/*
+ * workers poll their queues, yielding the processor when there is no
+ * work, and sleeping when there has been none for a while
+ */
+#define SPIN_LIMIT  64
+#define IDLE_USEC  100
+
+static void *analysis_worker_func(void *arg) {
+    struct analysis_worker *w = (struct analysis_worker *)arg;
+    unsigned int idle = 0;
+
+    while (true) {
+	if (analysis_worker_drain(w)) {
+	    idle = 0;
+	    continue;
+	}
+	if (analysis_pool->stop.load(std::memory_order_acquire)) {
+	    analysis_worker_drain(w);  /* work pushed before stop was set */
+	    break;
+	}
+	if (++idle < SPIN_LIMIT) {
+	    sched_yield();
+	} else {
+	    usleep(IDLE_USEC);
+	}
+    }
+    return NULL;
+}
+
+int analysis_pool_start(unsigned int num_workers) {
+    if (analysis_pool != NULL || num_workers == 0) {
+	return -1;
+    }
+    struct analysis_pool *p = new (std::nothrow) struct analysis_pool;
+    if (p == NULL) {
+	return -1;
+    }
+    p->worker = new (std::nothrow) struct analysis_worker[num_workers];
+    if (p->worker == NULL) {
+	delete p;
+	return -1;
+    }
+    p->num_workers = num_workers;
+    p->next_worker = 0;
+    pthread_mutex_init(&p->mutex, NULL);
+    p->stop.store(false);
+    p->deferred_flushes.store(0);
+    p->dropped_records.store(0);
+    for (unsigned int i = 0; i < num_workers; i++) {
+	p->worker[i].num_queues.store(0);
+	p->worker[i].batches.store(0);
+    }
+    analysis_pool = p;
+
+    for (unsigned int i = 0; i < num_workers; i++) {
+	int err = pthread_create(&p->worker[i].tid, NULL, analysis_worker_func, &p->worker[i]);
+	if (err) {
+	    fprintf(stderr, "%s: error creating analysis thread\n", strerror(err));
+	    p->num_workers = i;
+	    analysis_pool_stop();
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+void analysis_pool_stop() {
+    struct analysis_pool *p = analysis_pool;
+    if (p == NULL) {
+	return;
+    }
+    p->stop.store(true, std::memory_order_release);
+    for (unsigned int i = 0; i < p->num_workers; i++) {
+	pthread_join(p->worker[i].tid, NULL);
+    }
+
+    struct analysis_pool_stats stats;
+    analysis_pool_get_stats(&stats);
+    if (stats.dropped_records) {
+	fprintf(stderr, "warning: analysis fell behind; %lu record(s) were dropped\n", stats.dropped_records);
+    }
+
+    /*
+     * the pool and its queues are not freed, since producers and the
+     * stats thread may still refer to them; the process is about to
+     * exit
+     */
+    analysis_pool = NULL;
+}
+
+struct analysis_queue *analysis_pool_attach(unsigned int capacity) {
+    struct analysis_pool *p = analysis_pool;
+    if (p == NULL) {
+	return NULL;
+    }
+    struct analysis_queue *q = new (std::nothrow) struct analysis_queue;
+    if (q == NULL) {
+	return NULL;
+    }
+    if (!spsc_ring_init(&q->work, capacity) || !spsc_ring_init(&q->completed, capacity)) {
+	spsc_ring_free(&q->work);
+	spsc_ring_free(&q->completed);
+	delete q;
+	return NULL;
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    struct analysis_worker *w = &p->worker[p->next_worker];
+    unsigned int n = w->num_queues.load(std::memory_order_relaxed);
+    if (n < MAX_QUEUES_PER_WORKER) {
+	w->queue[n] = q;
+	w->num_queues.store(n + 1, std::memory_order_release);
+	p->next_worker = (p->next_worker + 1) % p->num_workers;
+    } else {
+	spsc_ring_free(&q->work);
+	spsc_ring_free(&q->completed);
+	delete q;
+	q = NULL;
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    return q;
+}
+
+bool analysis_queue_push(struct analysis_queue *q, struct analysis_work *w) {
+    return spsc_ring_push(&q->work, w);
+}
+
+struct analysis_work *analysis_queue_get_completed(struct analysis_queue *q) {
+    return (struct analysis_work *)spsc_ring_pop(&q->completed);
+}
+
+void analysis_pool_count_deferred_flush() {
+    if (analysis_pool) {
+	analysis_pool->deferred_flushes.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void analysis_pool_count_dropped_record() {
+    if (analysis_pool) {
+	analysis_pool->dropped_records.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool analysis_pool_get_stats(struct analysis_pool_stats *s) {
+    struct analysis_pool *p = analysis_pool;
+    if (p == NULL) {
+	return false;
+    }
+    s->batches = 0;
+    for (unsigned int i = 0; i < p->num_workers; i++) {
+	s->batches += p->worker[i].batches.load(std::memory_order_relaxed);
+    }
+    s->deferred_flushes = p->deferred_flushes.load(std::memory_order_relaxed);
+    s->dropped_records = p->dropped_records.load(std::memory_order_relaxed);
+    return true;
+}
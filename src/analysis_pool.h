@@ -0,0 +1,92 @@
+/*
+ * analysis_pool.h
+ *
+ * pool of threads that perform fingerprint analysis on behalf of the
+ * packet capture threads
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef ANALYSIS_POOL_H
+#define ANALYSIS_POOL_H
+
+#include <stdint.h>
+#include "analysis.h"
+
+/*
+ * struct analysis_work is a unit of work for the pool: a batch of
+ * analysis requests, and a function that the worker calls once the
+ * batch has been processed (for instance, to write out the records
+ * that the results belong to).  It is typically embedded in a larger
+ * structure.
+ */
+struct analysis_work {
+    struct analysis_batch *batch;
+    void (*complete)(struct analysis_work *w);
+};
+
+/*
+ * struct analysis_queue connects one producer (such as a capture
+ * thread) to the pool, through a pair of single-producer
+ * single-consumer rings: one carries work to a worker, and the other
+ * returns completed work to the producer, so that its memory can be
+ * reused.  Each queue is served by exactly one worker, so the work
+ * from a queue is completed in the order in which it was pushed.
+ */
+struct analysis_queue;
+
+/*
+ * analysis_pool_start(num_workers) starts num_workers analysis
+ * threads, and returns 0 on success or -1 on failure; it must be
+ * called after analysis_init()
+ */
+int analysis_pool_start(unsigned int num_workers);
+
+/*
+ * analysis_pool_stop() waits for the workers to complete all of the
+ * work that has been pushed to them, and then stops them
+ */
+void analysis_pool_stop();
+
+/*
+ * analysis_pool_attach(capacity) returns a new queue that can hold
+ * up to capacity units of work in each direction, or NULL if the pool
+ * has not been started or memory could not be allocated
+ */
+struct analysis_queue *analysis_pool_attach(unsigned int capacity);
+
+/*
+ * analysis_queue_push(q, w) hands w to the worker that serves q, and
+ * returns false if the queue is full; analysis_queue_get_completed(q)
+ * returns a unit of work that the worker has completed, or NULL if
+ * there is none.  Only the producer that owns q may call these
+ * functions.
+ */
+bool analysis_queue_push(struct analysis_queue *q, struct analysis_work *w);
+
+struct analysis_work *analysis_queue_get_completed(struct analysis_queue *q);
+
+/*
+ * backpressure: when the workers fall behind, producers count the
+ * flushes that they had to postpone because all of their buffers were
+ * in use, and the records that they had to discard because the
+ * current buffer was also full
+ */
+struct analysis_pool_stats {
+    uint64_t batches;             /* batches completed by the workers */
+    uint64_t deferred_flushes;    /* hand-offs postponed              */
+    uint64_t dropped_records;     /* records discarded                */
+};
+
+void analysis_pool_count_deferred_flush();
+
+void analysis_pool_count_dropped_record();
+
+/*
+ * analysis_pool_get_stats(s) returns the totals of the counters since
+ * the pool was started; it returns false if there is no pool
+ */
+bool analysis_pool_get_stats(struct analysis_pool_stats *s);
+
+#endif /* ANALYSIS_POOL_H */
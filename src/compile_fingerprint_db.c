@@ -0,0 +1,43 @@
+/*
+ * compile_fingerprint_db.c
+ *
+ * compiles the fingerprint database and contextual data in the
+ * resources directory into the image that mercury maps at startup
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mercury.h"
+#include "fingerprint_db.h"
+#include "fingerprint_db_image.h"
+
+int main(int argc, char *argv[]) {
+    char output_filename[MAX_FILENAME];
+
+    if (argc < 2 || argc > 3) {
+	printf("usage: %s resource_dir [image_file]\n", argv[0]);
+	printf("compiles the analysis resource files in resource_dir into an image, which\n"
+	       "is written to image_file (default: resource_dir/%s)\n", FPDB_FILENAME);
+	return EXIT_FAILURE;
+    }
+    const char *resource_dir = argv[1];
+    int len;
+    if (argc == 3) {
+	len = snprintf(output_filename, sizeof(output_filename), "%s", argv[2]);
+    } else {
+	len = snprintf(output_filename, sizeof(output_filename), "%s/%s", resource_dir, FPDB_FILENAME);
+    }
+    if (len < 0 || (size_t)len >= sizeof(output_filename)) {
+	fprintf(stderr, "error: image filename too long\n");
+	return EXIT_FAILURE;
+    }
+
+    if (fingerprint_db_write_image(resource_dir, output_filename) != status_ok) {
+	fprintf(stderr, "error: could not compile %s into %s\n", resource_dir, output_filename);
+	return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/*
+ * epoch.c
+ *
+ * epoch-based reclamation of data that is shared with lock-free
+ * readers
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <unistd.h>
+#include <atomic>
+#include "epoch.h"
+
+#define EPOCH_MAX_READERS 1024
+
+/*
+ * a slot holds the epoch in which its reader entered its current read
+ * section, or zero if the reader is not in a read section
+ */
+struct epoch_slot {
+    alignas(64) std::atomic<uint64_t> epoch;
+    std::atomic<bool> in_use;
+};
+
+static struct epoch_slot epoch_slot[EPOCH_MAX_READERS];
+
+static std::atomic<unsigned int> epoch_num_slots(0);      /* high water mark of claimed slots */
+
+alignas(64) static std::atomic<uint64_t> global_epoch(1);
+
+alignas(64) static std::atomic<uint64_t> overflow_readers(0);  /* readers without a slot */
+
+/*
+ * struct epoch_reader is the per-thread state of a reader; its slot
+ * is released when the thread exits
+ */
+struct epoch_reader {
+    struct epoch_slot *slot;   /* NULL if none has been claimed, or none was free */
+    bool claimed;              /* true once a claim has been attempted            */
+    unsigned int depth;        /* nesting depth of read sections                  */
+
+    ~epoch_reader() {
+	if (slot) {
+	    slot->in_use.store(false, std::memory_order_release);
+	}
+    }
+};
+
+static thread_local struct epoch_reader epoch_reader = { NULL, false, 0 };
+
+static void epoch_reader_claim(struct epoch_reader *r) {
+    r->claimed = true;
+    for (unsigned int i = 0; i < EPOCH_MAX_READERS; i++) {
+	bool expected = false;
+	if (!epoch_slot[i].in_use.load(std::memory_order_relaxed)
+	    && epoch_slot[i].in_use.compare_exchange_strong(expected, true)) {
+	    r->slot = &epoch_slot[i];
+
+	    unsigned int n = epoch_num_slots.load();
+	    while (n < i + 1 && !epoch_num_slots.compare_exchange_weak(n, i + 1)) {
+		;
+	    }
+	    return;
+	}
+    }
+}
+
+/*
+ * the store of the reader's epoch and the loads of shared pointers
+ * that follow it are sequentially consistent, so that a writer that
+ * scans the slots after replacing a pointer either sees the reader,
+ * or is certain that the reader will see the new pointer
+ */
+void epoch_read_lock() {
+    struct epoch_reader *r = &epoch_reader;
+
+    if (r->depth++) {
+	return;
+    }
+    if (!r->claimed) {
+	epoch_reader_claim(r);
+    }
+    if (r->slot) {
+	r->slot->epoch.store(global_epoch.load());
+    } else {
+	overflow_readers.fetch_add(1);
+    }
+}
+
+void epoch_read_unlock() {
+    struct epoch_reader *r = &epoch_reader;
+
+    if (--r->depth) {
+	return;
+    }
+    if (r->slot) {
+	r->slot->epoch.store(0, std::memory_order_release);
+    } else {
+	overflow_readers.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+uint64_t epoch_advance() {
+    return global_epoch.fetch_add(1) + 1;
+}
+
+bool epoch_readers_done(uint64_t e) {
+    unsigned int n = epoch_num_slots.load();
+    for (unsigned int i = 0; i < n; i++) {
+	uint64_t reader_epoch = epoch_slot[i].epoch.load();
+	if (reader_epoch != 0 && reader_epoch < e) {
+	    return false;
+	}
+    }
+    return overflow_readers.load() == 0;
+}
+
+#define EPOCH_WAIT_USEC 100
+
+void epoch_synchronize() {
+    uint64_t e = epoch_advance();
+    while (!epoch_readers_done(e)) {
+	usleep(EPOCH_WAIT_USEC);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * epoch.h
+ *
+ * epoch-based reclamation of data that is shared with lock-free
+ * readers
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+/*
+ * A reader brackets its use of shared data (reached through an atomic
+ * pointer) with epoch_read_lock() and epoch_read_unlock().  A writer
+ * replaces the pointer, calls epoch_synchronize(), and can then free
+ * the old data, since every reader that might have seen it has since
+ * left its read section.
+ *
+ * Each reader thread announces the epoch in which it entered its read
+ * section in a slot of its own (in its own cache line), so that the
+ * read side writes no shared memory and takes no lock; the writer
+ * advances the global epoch and waits until no slot holds an epoch
+ * older than the new one.  Slots are claimed by threads on first use
+ * and released when they exit; if there are more reader threads than
+ * slots, the extra threads share a counter instead.  Read sections
+ * may be nested, but must not block for long, since writers wait for
+ * them.
+ */
+void epoch_read_lock();
+
+void epoch_read_unlock();
+
+/*
+ * epoch_advance() starts a new epoch and returns it;
+ * epoch_readers_done(e) returns true if no reader is still in a read
+ * section that it entered before epoch e
+ */
+uint64_t epoch_advance();
+
+bool epoch_readers_done(uint64_t e);
+
+/*
+ * epoch_synchronize() waits until every read section that was in
+ * progress when it was called has completed
+ */
+void epoch_synchronize();
+
+#endif /* EPOCH_H */
@@ -6,9 +6,13 @@
  */
 
 #include <string.h>   /* for memcpy()   */
+#include <stdlib.h>   /* for malloc()   */
 #include <ctype.h>    /* for tolower()  */
 #include <stdio.h>
 #include <arpa/inet.h>  /* for htons()  */
+#if defined(__SSE2__)
+#include <immintrin.h>  /* for SSE2 and AVX2 intrinsics */
+#endif
 
 #include "ept.h"
 #include "extractor.h"
@@ -365,26 +369,89 @@ enum status extractor_strip_last_capture(struct extractor *x) {
     return status_err;
 }
 
+/*
+ * find_delim(data, data_end, delim, length) returns a pointer to the
+ * first occurrence of the delimiter (of length bytes) in the data
+ * between data and data_end, or NULL if there is none; it never reads
+ * at or beyond data_end.
+ *
+ * Candidate positions are found 32 (with AVX2) or 16 (with SSE2)
+ * bytes at a time, by comparing a block of data with the first byte
+ * of the delimiter and the block that starts length-1 bytes later
+ * with its last byte; only the positions at which both match are
+ * then compared with the rest of the delimiter (there is no rest for
+ * the one- and two-byte delimiters of HTTP and SSH).  A vector loop
+ * runs only while all of the bytes that it loads are in bounds, and
+ * the scalar loop completes the search.
+ */
+static inline const unsigned char *find_delim(const unsigned char *data,
+					      const unsigned char *data_end,
+					      const unsigned char *delim,
+					      size_t length) {
+    if (length == 0) {
+	return data;
+    }
+    if (data_end - data < (ptrdiff_t)length) {
+	return NULL;
+    }
+    const unsigned char *last = data_end - length;   /* last possible start of the delimiter */
+
+#if defined(__AVX2__)
+    const __m256i first_32 = _mm256_set1_epi8(delim[0]);
+    const __m256i final_32 = _mm256_set1_epi8(delim[length - 1]);
+    while (last - data >= 31) {
+	__m256i block_first = _mm256_loadu_si256((const __m256i *)data);
+	__m256i block_final = _mm256_loadu_si256((const __m256i *)(data + length - 1));
+	uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first_32),
+							      _mm256_cmpeq_epi8(block_final, final_32)));
+	while (mask) {
+	    unsigned int i = __builtin_ctz(mask);
+	    if (length <= 2 || memcmp(data + i + 1, delim + 1, length - 2) == 0) {
+		return data + i;
+	    }
+	    mask &= mask - 1;
+	}
+	data += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i first_16 = _mm_set1_epi8(delim[0]);
+    const __m128i final_16 = _mm_set1_epi8(delim[length - 1]);
+    while (last - data >= 15) {
+	__m128i block_first = _mm_loadu_si128((const __m128i *)data);
+	__m128i block_final = _mm_loadu_si128((const __m128i *)(data + length - 1));
+	uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first_16),
+							_mm_cmpeq_epi8(block_final, final_16)));
+	while (mask) {
+	    unsigned int i = __builtin_ctz(mask);
+	    if (length <= 2 || memcmp(data + i + 1, delim + 1, length - 2) == 0) {
+		return data + i;
+	    }
+	    mask &= mask - 1;
+	}
+	data += 16;
+    }
+#endif
+
+    for ( ; data <= last; data++) {
+	if (data[0] == delim[0] && memcmp(data + 1, delim + 1, length - 1) == 0) {
+	    return data;
+	}
+    }
+    return NULL;
+}
+
 enum status parser_extractor_copy_append_upto_delim(struct parser *p,
 						    struct extractor *x,
 						    const unsigned char delim[2]) {
-    const unsigned char *data = p->data;
     ptrdiff_t len;
 
     /* find delimiter, if present */
-    while (1) {
-	if (data >= p->data_end) {
-	    return status_err;
-	}
-	if (*data == delim[0]) {
-	    data++;
-	    if (*data == delim[1]) {
-		break;
-	    }
-	}
-	data++;
+    const unsigned char *data = find_delim(p->data, p->data_end, delim, 2);
+    if (data == NULL) {
+	return status_err;
     }
-    len = data - p->data - 1;
+    len = data - p->data;
 
     /* copy_append data up to delimiter */
     if (parser_extractor_copy_append(p, x, len) == status_err) {
@@ -400,24 +467,14 @@ int parser_find_delim(struct parser *p,
 		      const unsigned char *delim,
 		      size_t length) {
 
-    /* find delimiter, if present */
-    const unsigned char *data = p->data;
-    const unsigned char *pattern = delim;
-    const unsigned char *pattern_end = delim + length;
-    while (pattern < pattern_end && data < p->data_end) {
-	extractor_debug("%s: data index: %lu\tpattern index: %lu\n", __func__, data - p->data, pattern - delim);
-	extractor_debug("%s: data: %02x, pattern: %02x\n", __func__, *data, *pattern);
-	if (*data != *pattern) {
-	    pattern = delim - 1; /* reset pattern to the start of the delimeter string */
-	} 
-	data++;
-	pattern++;
-    } 
-    if (pattern == pattern_end) {
-	return data - p->data;
+    /* find delimiter, if present, and return the index of the byte that follows it */
+    const unsigned char *data = find_delim(p->data, p->data_end, delim, length);
+    if (data) {
+	extractor_debug("%s: delimiter index: %zd\n", __func__, data - p->data);
+	return data + length - p->data;
     }
     return -1;
-    
+
 }
 
 enum status parser_skip_upto_delim(struct parser *p,
@@ -522,15 +579,22 @@ unsigned int parser_match(struct parser *p,
 }
 
 /*
- * keyword_matcher performs multiple string matching the
- * straightforward way.  It should be robust and maintainable, and
- * possibly useful for very short keyword lists, but its worst-case
- * and average case performance are not great (linear in the number of
- * keywords).
- *
- * This code will be replaced with a finite automaton keyword matcher
- * in the near future (once that code is tuned, tested, and debugged).
+ * keyword_matcher classifies a string (such as an HTTP header name)
+ * by matching it against sets of keywords, in a single pass over the
+ * string.  Each set has a nonzero tag, and holds keywords that are
+ * matched either case-insensitively (which must be written in lower
+ * case) or exactly.
  *
+ * The keyword sets are compiled into a deterministic finite
+ * automaton, once, before packets are processed.  The automaton is
+ * the product of a trie of the case-insensitive keywords (over
+ * lowercase bytes) and a trie of the case-sensitive keywords, so each
+ * of its states tracks the progress of the input through both tries.
+ * Bytes that no keyword can distinguish are merged into a single
+ * class, and case folding is done by giving both cases of a letter
+ * the same class where possible, so the matcher makes one table
+ * lookup per byte, without calling tolower(), and stops at the first
+ * byte that cannot lead to a match.  State 0 is the dead state.
  */
 
 #define keyword_init(s) { s, sizeof(s)-1 }
@@ -540,60 +604,257 @@ typedef struct keyword {
     size_t len;
 } keyword_t;
 
+/*
+ * a keyword set; each list is terminated by a keyword with length
+ * zero, and either list may be NULL
+ */
+struct keyword_set {
+    const keyword_t *case_insensitive;
+    const keyword_t *case_sensitive;
+    unsigned int tag;
+};
+
 typedef struct keyword_matcher {
-    keyword_t *case_insensitive;
-    keyword_t *case_sensitive;
+    uint8_t byte_class[256];
+    unsigned int num_classes;
+    unsigned int num_states;
+    uint16_t *next;             /* next[state * num_classes + class] */
+    uint8_t *tag;               /* tag[state], or zero               */
 } keyword_matcher_t;
 
+#define KEYWORD_MATCHER_DEAD     0
+#define KEYWORD_MATCHER_START    1
+#define KEYWORD_MATCHER_MAX_STATES  65536
+
 #define match_all_keywords NULL
 
-enum status keyword_matcher_check(const keyword_matcher_t *keywords,
-				  unsigned char *string,
-				  size_t len) {
-    keyword_t *k;
-    size_t i;
+/*
+ * struct keyword_trie is used only during compilation
+ */
+struct keyword_trie_node {
+    int child[256];
+    unsigned int tag;
+};
+
+struct keyword_trie {
+    struct keyword_trie_node *node;
+    unsigned int num_nodes;
+    unsigned int max_nodes;
+    bool used[256];             /* bytes that appear in some keyword */
+};
+
+static enum status keyword_trie_init(struct keyword_trie *t, unsigned int max_nodes) {
+    t->node = (struct keyword_trie_node *)malloc(max_nodes * sizeof(struct keyword_trie_node));
+    if (t->node == NULL) {
+	return status_err;
+    }
+    memset(t->node[0].child, 0xff, sizeof(t->node[0].child));   /* -1 denotes no child */
+    t->node[0].tag = 0;
+    t->num_nodes = 1;
+    t->max_nodes = max_nodes;
+    memset(t->used, 0, sizeof(t->used));
+    return status_ok;
+}
 
-    if (keywords == match_all_keywords) {
-	return status_ok;  /* by convention, NULL pointer corresponds to 'match all keywords' */
+static void keyword_trie_insert(struct keyword_trie *t,
+				const keyword_t *k,
+				unsigned int tag,
+				bool fold_case) {
+    int n = 0;
+    for (size_t i = 0; i < k->len; i++) {
+	uint8_t c = fold_case ? tolower((uint8_t)k->value[i]) : (uint8_t)k->value[i];
+	t->used[c] = true;
+	if (t->node[n].child[c] < 0) {
+	    struct keyword_trie_node *child = &t->node[t->num_nodes];  /* max_nodes is large enough */
+	    memset(child->child, 0xff, sizeof(child->child));
+	    child->tag = 0;
+	    t->node[n].child[c] = t->num_nodes++;
+	}
+	n = t->node[n].child[c];
+    }
+    if (t->node[n].tag == 0) {
+	t->node[n].tag = tag;     /* the first set that holds a keyword wins */
     }
-    
-    k = keywords->case_insensitive;
-    while (k->len != 0) {
-	if (len == k->len) {
-	    for (i = 0; i < len; i++) {
-		if (tolower(string[i]) != k->value[i]) {
-		    break;
-		}
-	    }
-	    if (i >= len) {       /* end of string; match found */
-		return status_ok;
+}
+
+/*
+ * keyword_matcher_compile(set, num_sets) returns a newly allocated
+ * matcher for the keyword sets, or NULL if memory could not be
+ * allocated
+ */
+static keyword_matcher_t *keyword_matcher_compile(const struct keyword_set *set,
+						  unsigned int num_sets) {
+    struct keyword_trie ci, cs;
+    unsigned int max_nodes = 1;
+    keyword_matcher_t *m = NULL;
+    int (*pair)[2] = NULL;           /* (ci node, cs node) of each state */
+    size_t num_slots;
+
+    for (unsigned int i = 0; i < num_sets; i++) {
+	for (const keyword_t *k = set[i].case_insensitive; k && k->len; k++) {
+	    max_nodes += k->len;
+	}
+	for (const keyword_t *k = set[i].case_sensitive; k && k->len; k++) {
+	    max_nodes += k->len;
+	}
+    }
+    if (keyword_trie_init(&ci, max_nodes) != status_ok) {
+	return NULL;
+    }
+    if (keyword_trie_init(&cs, max_nodes) != status_ok) {
+	free(ci.node);
+	return NULL;
+    }
+    for (unsigned int i = 0; i < num_sets; i++) {
+	for (const keyword_t *k = set[i].case_insensitive; k && k->len; k++) {
+	    keyword_trie_insert(&ci, k, set[i].tag, true);
+	}
+	for (const keyword_t *k = set[i].case_sensitive; k && k->len; k++) {
+	    keyword_trie_insert(&cs, k, set[i].tag, false);
+	}
+    }
+
+    m = (keyword_matcher_t *)calloc(1, sizeof(keyword_matcher_t));
+    if (m == NULL) {
+	goto done;
+    }
+
+    /*
+     * byte classes: two bytes are in the same class if they lead to
+     * the same node in both tries; class 0 holds the bytes that
+     * appear in no keyword
+     */
+    int class_key[256][2];
+    int representative[256];
+    m->num_classes = 1;
+    class_key[0][0] = class_key[0][1] = -1;
+    representative[0] = -1;
+    for (unsigned int b = 0; b < 256; b++) {
+	int key[2] = {
+	    ci.used[tolower(b)] ? tolower(b) : -1,
+	    cs.used[b] ? (int)b : -1
+	};
+	unsigned int c;
+	for (c = 0; c < m->num_classes; c++) {
+	    if (class_key[c][0] == key[0] && class_key[c][1] == key[1]) {
+		break;
 	    }
 	}
-	k++;
+	if (c == m->num_classes) {
+	    class_key[c][0] = key[0];
+	    class_key[c][1] = key[1];
+	    representative[c] = b;
+	    m->num_classes++;
+	}
+	m->byte_class[b] = c;
     }
 
-    k = keywords->case_sensitive;
-    while (k->len != 0) {
-	if (len == k->len) {
-	    for (i = 0; i < len; i++) {
-		if (string[i] != k->value[i]) {
+    /*
+     * states: the dead state, then the pairs of trie nodes that can
+     * be reached from the roots, in breadth-first order
+     */
+    num_slots = (size_t)(ci.num_nodes + cs.num_nodes + 2);
+    if (num_slots > KEYWORD_MATCHER_MAX_STATES) {
+	free(m);
+	m = NULL;
+	goto done;
+    }
+    pair = (int (*)[2])malloc(num_slots * sizeof(*pair));
+    m->next = (uint16_t *)calloc(num_slots * m->num_classes, sizeof(uint16_t));
+    m->tag = (uint8_t *)calloc(num_slots, sizeof(uint8_t));
+    if (pair == NULL || m->next == NULL || m->tag == NULL) {
+	free(m->next);
+	free(m->tag);
+	free(m);
+	m = NULL;
+	goto done;
+    }
+    pair[KEYWORD_MATCHER_DEAD][0] = pair[KEYWORD_MATCHER_DEAD][1] = -1;
+    pair[KEYWORD_MATCHER_START][0] = pair[KEYWORD_MATCHER_START][1] = 0;
+    m->num_states = 2;
+    for (unsigned int s = KEYWORD_MATCHER_START; s < m->num_states; s++) {
+	int ci_node = pair[s][0];
+	int cs_node = pair[s][1];
+	unsigned int ci_tag = ci_node >= 0 ? ci.node[ci_node].tag : 0;
+	unsigned int cs_tag = cs_node >= 0 ? cs.node[cs_node].tag : 0;
+	m->tag[s] = ci_tag ? ci_tag : cs_tag;
+
+	for (unsigned int c = 1; c < m->num_classes; c++) {
+	    int b = representative[c];
+	    int ci_next = ci_node >= 0 ? ci.node[ci_node].child[tolower(b)] : -1;
+	    int cs_next = cs_node >= 0 ? cs.node[cs_node].child[b] : -1;
+	    if (ci_next < 0 && cs_next < 0) {
+		continue;   /* dead */
+	    }
+	    unsigned int t;
+	    for (t = KEYWORD_MATCHER_START; t < m->num_states; t++) {
+		if (pair[t][0] == ci_next && pair[t][1] == cs_next) {
 		    break;
 		}
 	    }
-	    if (i >= len) {       /* end of string; match found */
-		return status_ok;
+	    if (t == m->num_states) {
+		/*
+		 * each new state advances a node in at least one trie,
+		 * and trie nodes are never revisited, so there are
+		 * fewer than num_slots states
+		 */
+		pair[t][0] = ci_next;
+		pair[t][1] = cs_next;
+		m->num_states++;
 	    }
+	    m->next[s * m->num_classes + c] = t;
 	}
-	k++;
     }
 
-    return status_err;
+ done:
+    free(pair);
+    free(ci.node);
+    free(cs.node);
+    return m;
+}
+
+/*
+ * keyword_matcher_init(set, num_sets) returns a matcher for the
+ * keyword sets, for use in a static initializer; a failure to compile
+ * it is fatal, since a NULL matcher would match every string (see
+ * match_all_keywords)
+ */
+static keyword_matcher_t *keyword_matcher_init(const struct keyword_set *set,
+					       unsigned int num_sets) {
+    keyword_matcher_t *m = keyword_matcher_compile(set, num_sets);
+    if (m == NULL) {
+	fprintf(stderr, "error: could not compile keyword matcher\n");
+	exit(EXIT_FAILURE);
+    }
+    return m;
+}
+
+/*
+ * keyword_matcher_classify(m, string, len) returns the tag of the
+ * keyword set that holds string, or zero if there is none; by
+ * convention, the NULL matcher match_all_keywords matches every
+ * string, with tag 1
+ */
+static inline unsigned int keyword_matcher_classify(const keyword_matcher_t *m,
+						    const unsigned char *string,
+						    size_t len) {
+    if (m == match_all_keywords) {
+	return 1;
+    }
+    unsigned int s = KEYWORD_MATCHER_START;
+    for (size_t i = 0; i < len; i++) {
+	s = m->next[s * m->num_classes + m->byte_class[string[i]]];
+	if (s == KEYWORD_MATCHER_DEAD) {
+	    return 0;
+	}
+    }
+    return m->tag[s];
 }
 
 /*
- * extractor_keyword_match_last_capture_lowercase(x, value, value_len) returns
- * status_ok if lower(x->data) == value, and returns status_err
- * otherwise
+ * extractor_keyword_match_last_capture(x, keywords) returns the tag
+ * of the keyword set that holds the last string captured by x, or
+ * zero if there is none
  */
 unsigned int extractor_keyword_match_last_capture(struct extractor *x,
 						  const keyword_matcher_t *keywords) {
@@ -602,14 +863,14 @@ unsigned int extractor_keyword_match_last_capture(struct extractor *x,
     size_t last_capture_len;
 
     if (last_capture == NULL) {
-	return status_err;
+	return 0;
     }
 
     /* read length of capture, then advance over length field */
     last_capture_len = decode_uint16(last_capture);  /* cache this length? */
     last_capture += 2;
 
-    return keyword_matcher_check(keywords, last_capture, last_capture_len);
+    return keyword_matcher_classify(keywords, last_capture, last_capture_len);
 }
 
 unsigned int uint16_match(uint16_t x,
@@ -1289,18 +1550,62 @@ unsigned int parser_extractor_process_tls_server(struct parser *p, struct extrac
 
 #define http_value_len 4
 
+/*
+ * the header names that are included in the HTTP request fingerprint
+ * (the static headers), and the header whose value is reported as
+ * the user agent
+ */
+enum http_request_header {
+    http_request_header_other      = 0,
+    http_request_header_static     = 1,
+    http_request_header_user_agent = 2
+};
+
+static const keyword_t http_request_case_insensitive_static_headers[13] = {
+    // keyword_init("user-agent"),
+    keyword_init("upgrade-insecure-requests"),
+    keyword_init("dnt"),
+    keyword_init("accept-language"),
+    keyword_init("connection"),
+    keyword_init("x-requested-with"),
+    keyword_init("accept-encoding"),
+    keyword_init("content-length"),
+    keyword_init("accept"),
+    keyword_init("viewport-width"),
+    keyword_init("intervention"),
+    keyword_init("dpr"),
+    keyword_init("cache-control"),
+    keyword_init("")
+};
+
+static const keyword_t http_request_case_sensitive_static_headers[3] = {
+    keyword_init("content-type"),
+    keyword_init("origin"),
+    keyword_init("")
+};
+
+static const keyword_t http_request_user_agent_header[2] = {
+    keyword_init("user-agent"),
+    keyword_init("")
+};
+
+static const struct keyword_set http_request_header_keywords[2] = {
+    {
+	http_request_case_insensitive_static_headers,
+	http_request_case_sensitive_static_headers,
+	http_request_header_static
+    },
+    {
+	http_request_user_agent_header,
+	NULL,
+	http_request_header_user_agent
+    }
+};
+
+static const keyword_matcher_t *http_request_header_matcher =
+    keyword_matcher_init(http_request_header_keywords, 2);
+
 unsigned int parser_extractor_process_http(struct parser *p, struct extractor *x) {
-    keyword_t user_agent_keyword[2] = {
-	keyword_init("user-agent"),
-	keyword_init("")
-    };
-    keyword_t nil_keyword[1] = {
-	keyword_init("")
-    };
-    keyword_matcher_t user_agent_keyword_matcher = {
-	user_agent_keyword,
-	nil_keyword
-    };
     //unsigned char http_mask[http_value_len] = {
     //	0xff, 0xff, 0xff, 0xff
     //};
@@ -1311,31 +1616,6 @@ unsigned int parser_extractor_process_http(struct parser *p, struct extractor *x
     unsigned char sp[1] = { ' ' };
     unsigned char crlf[2] = { '\r', '\n' };
     unsigned char csp[2] = { ':', ' ' };
-    keyword_t case_insensitive_static_headers[13] = {
-	// keyword_init("user-agent"),
-	keyword_init("upgrade-insecure-requests"),
-	keyword_init("dnt"),
-	keyword_init("accept-language"),
-	keyword_init("connection"),
-	keyword_init("x-requested-with"),
-	keyword_init("accept-encoding"),
-	keyword_init("content-length"),
-	keyword_init("accept"),
-	keyword_init("viewport-width"),
-	keyword_init("intervention"),
-	keyword_init("dpr"),
-	keyword_init("cache-control"),
-        keyword_init("")
-    };
-    keyword_t case_sensitive_static_headers[3] = {
-        keyword_init("content-type"),
-	keyword_init("origin"),
-        keyword_init("")
-    };
-    keyword_matcher_t static_header_keywords = {
-	case_insensitive_static_headers,
-	case_sensitive_static_headers
-    };
 
     extractor_debug("%s: processing packet\n", __func__);
 
@@ -1381,13 +1661,14 @@ unsigned int parser_extractor_process_http(struct parser *p, struct extractor *x
 	if (parser_extractor_copy_upto_delim(p, x, csp, sizeof(csp)) == status_err) {
 	    return extractor_get_output_length(x);   
 	}
-	if (extractor_keyword_match_last_capture(x, &static_header_keywords) == status_ok) {
+	unsigned int header = extractor_keyword_match_last_capture(x, http_request_header_matcher);
+	if (header == http_request_header_static) {
 	    if (parser_extractor_copy_append_upto_delim(p, x, crlf) == status_err) {
 		return extractor_get_output_length(x);
 	    }
 	} else {
 	    const uint8_t *user_agent_string = NULL;
-	    if (extractor_keyword_match_last_capture(x, &user_agent_keyword_matcher) == status_ok) {
+	    if (header == http_request_header_user_agent) {
 		user_agent_string = p->data;
 	    } 
 	    if (parser_skip_upto_delim(p, crlf, sizeof(crlf)) == status_err) {
@@ -1409,7 +1690,7 @@ unsigned int parser_extractor_process_http(struct parser *p, struct extractor *x
     return extractor_get_output_length(x);
 }
 
-keyword_t http_response_case_insensitive_static_headers[16] = {
+static const keyword_t http_response_case_insensitive_static_headers[16] = {
     keyword_init("access-control-allow-headers"), 
     keyword_init("access-control-allow-methods"), 
     keyword_init("code"), 
@@ -1427,41 +1708,42 @@ keyword_t http_response_case_insensitive_static_headers[16] = {
     keyword_init("x-xss-protection"), 
     keyword_init("")
 };
-keyword_t http_response_case_sensitive_static_headers[3] = {
+static const keyword_t http_response_case_sensitive_static_headers[3] = {
     keyword_init("")
 };
-keyword_matcher_t http_response_static_header_keywords = {
-    http_response_case_insensitive_static_headers,
-    http_response_case_sensitive_static_headers
-};
-
-struct parser_spec_http_server {
-    keyword_matcher_t static_header_keywords;
-};
 
-struct parser_spec_http_server parser_spec_http_server_default = {
+static const struct keyword_set http_response_static_header_keywords[1] = {
     {
 	http_response_case_insensitive_static_headers,
-	http_response_case_sensitive_static_headers    
+	http_response_case_sensitive_static_headers,
+	1
     }
 };
 
-keyword_t empty_keyword_list[1] = {
-    keyword_init("")
+/*
+ * a parser_spec_http_server selects the response headers that are
+ * included in the fingerprint; since each matcher is compiled in
+ * advance, switching between them costs nothing at match time
+ */
+struct parser_spec_http_server {
+    const keyword_matcher_t *static_header_keywords;
+};
+
+struct parser_spec_http_server parser_spec_http_server_default = {
+    keyword_matcher_init(http_response_static_header_keywords, 1)
 };
 
 struct parser_spec_http_server parser_spec_http_server_no_headers = {
-    {
-	empty_keyword_list,
-	empty_keyword_list
-    }
+    keyword_matcher_init(NULL, 0)
 };
 
-#define parser_spec_http_server_all_headers match_all_keywords
+struct parser_spec_http_server parser_spec_http_server_all_headers = {
+    match_all_keywords
+};
 
 // struct parser_spec_http_server *parser_spec_http_server = &parser_spec_http_server_default;
 //struct parser_spec_http_server *parser_spec_http_server = &parser_spec_http_server_no_headers;
-struct parser_spec_http_server *parser_spec_http_server = parser_spec_http_server_all_headers;
+struct parser_spec_http_server *parser_spec_http_server = &parser_spec_http_server_all_headers;
 
 unsigned int parser_extractor_process_http_server(struct parser *p, struct extractor *x) {
     unsigned char sp[1] = { ' ' };
@@ -1512,7 +1794,7 @@ unsigned int parser_extractor_process_http_server(struct parser *p, struct extra
 	if (parser_extractor_copy_upto_delim(p, x, csp, sizeof(csp)) == status_err) {
 	    return extractor_get_output_length(x);   
 	}
-	if (extractor_keyword_match_last_capture(x, &parser_spec_http_server->static_header_keywords) == status_ok) {
+	if (extractor_keyword_match_last_capture(x, parser_spec_http_server->static_header_keywords)) {
 	    if (parser_extractor_copy_append_upto_delim(p, x, crlf) == status_err) {
 		return extractor_get_output_length(x);
 	    }
@@ -0,0 +1,784 @@
+/*
+ * fingerprint_db.c
+ *
+ * native fingerprint database and process inference engine; this
+ * code computes the same results as identify_embed() in the python
+ * module python-inference/tls_fingerprint_min.pyx, without needing an
+ * interpreter (or its global lock), from the precompiled image
+ * described in fingerprint_db_image.h
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <string>
+#include "fingerprint_db.h"
+#include "fingerprint_db_image.h"
+
+/*
+ * struct phf_view provides access to a perfect hash function and its
+ * keys within an image
+ */
+struct phf_view {
+    uint64_t seed;
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    const uint32_t *displacement;
+    const uint32_t *slot;
+    const struct fpdb_string *key;
+};
+
+struct fingerprint_db {
+    const uint8_t *image;
+    size_t image_len;
+    bool mapped;                   /* image is mmap()ed, rather than malloc()ed */
+    bool malware_db;
+    uint32_t unknown_feature_id;
+    const char *strings;
+    struct phf_view fingerprint_phf;
+    const struct fpdb_fingerprint *fingerprints;
+    const struct fpdb_process *processes;
+    const struct fpdb_feature *features;
+    struct phf_view feature_phf;
+    const struct fpdb_as *as_table;
+    size_t num_as;
+    const uint32_t *ipv4_tbl24;
+    const uint32_t *ipv4_tbl8;
+    size_t num_tbl8_groups;
+    const struct fpdb_ipv6_node *ipv6_trie;
+    size_t num_ipv6_nodes;
+    const struct fpdb_suffix_node *suffix_trie;
+};
+
+/*
+ * phf_lookup(db, phf, key, length) returns the index of key, or
+ * FPDB_NONE if it is not in the set
+ */
+static inline uint32_t phf_lookup(const struct fingerprint_db *db,
+				  const struct phf_view *phf,
+				  const uint8_t *key,
+				  size_t length) {
+    uint64_t h = fpdb_hash(phf->seed, key, length);
+    uint32_t d = phf->displacement[h % phf->num_buckets];
+    uint32_t index = phf->slot[fpdb_slot(h, d) % phf->num_slots];
+    if (index == FPDB_NONE) {
+	return FPDB_NONE;
+    }
+    const struct fpdb_string *k = &phf->key[index];
+    if (k->length != length || memcmp(db->strings + k->offset, key, length) != 0) {
+	return FPDB_NONE;
+    }
+    return index;
+}
+
+/*
+ * image validation: every section must lie within the image, and
+ * every index and string offset within the image must lie within the
+ * section that it refers to, so that a truncated or corrupted file is
+ * rejected rather than read out of bounds.  The sections are checked
+ * first, and then the indices, in one pass over each section, so that
+ * the lookups need no checks of their own.
+ */
+static bool section_is_valid(const struct fpdb_section *s, size_t element_size, size_t image_len) {
+    return s->offset % FPDB_ALIGN == 0
+	&& s->offset <= image_len
+	&& s->count <= (image_len - s->offset) / element_size;
+}
+
+static bool phf_is_valid(const struct fpdb_phf *phf, size_t image_len) {
+    return phf->num_buckets > 0 && phf->num_slots > 0
+	&& phf->displacement.count == phf->num_buckets
+	&& phf->slot.count == phf->num_slots
+	&& section_is_valid(&phf->displacement, sizeof(uint32_t), image_len)
+	&& section_is_valid(&phf->slot, sizeof(uint32_t), image_len)
+	&& section_is_valid(&phf->key, sizeof(struct fpdb_string), image_len);
+}
+
+/*
+ * string_is_valid(s, num_strings) returns true if the string s lies
+ * within a string section of num_strings bytes; name_is_valid() does
+ * the same for a null-terminated string given by its offset, which is
+ * terminated by the null byte at the end of the section if not before
+ */
+static inline bool string_is_valid(const struct fpdb_string *s, uint64_t num_strings) {
+    return s->offset <= num_strings && s->length <= num_strings - s->offset;
+}
+
+static inline bool name_is_valid(uint32_t name, uint64_t num_strings) {
+    return name < num_strings;
+}
+
+static bool phf_indices_are_valid(const struct fpdb_phf *phf, const uint8_t *image, uint64_t num_strings) {
+    const uint32_t *slot = (const uint32_t *)(image + phf->slot.offset);
+    for (uint64_t i = 0; i < phf->slot.count; i++) {
+	if (slot[i] != FPDB_NONE && slot[i] >= phf->key.count) {
+	    return false;
+	}
+    }
+    const struct fpdb_string *key = (const struct fpdb_string *)(image + phf->key.offset);
+    for (uint64_t i = 0; i < phf->key.count; i++) {
+	if (!string_is_valid(&key[i], num_strings)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * image_indices_are_valid(hdr, image) checks the indices in an image
+ * whose sections have already been checked
+ */
+static bool image_indices_are_valid(const struct fpdb_header *hdr, const uint8_t *image) {
+    uint64_t num_strings = hdr->strings.count;
+
+    if (!phf_indices_are_valid(&hdr->fingerprint_phf, image, num_strings)
+	|| !phf_indices_are_valid(&hdr->feature_phf, image, num_strings)
+	|| hdr->fingerprints.count != hdr->fingerprint_phf.key.count) {
+	return false;
+    }
+
+    const struct fpdb_fingerprint *fp = (const struct fpdb_fingerprint *)(image + hdr->fingerprints.offset);
+    for (uint64_t i = 0; i < hdr->fingerprints.count; i++) {
+	if (fp[i].first_process > hdr->processes.count
+	    || fp[i].num_processes > hdr->processes.count - fp[i].first_process) {
+	    return false;
+	}
+    }
+
+    const struct fpdb_process *p = (const struct fpdb_process *)(image + hdr->processes.offset);
+    for (uint64_t i = 0; i < hdr->processes.count; i++) {
+	if (!name_is_valid(p[i].name, num_strings)) {
+	    return false;
+	}
+	for (unsigned int t = 0; t < fpdb_num_feature_types; t++) {
+	    if (p[i].first_feature[t] > p[i].first_feature[t + 1]) {
+		return false;
+	    }
+	}
+	if (p[i].first_feature[fpdb_num_feature_types] > hdr->features.count) {
+	    return false;
+	}
+    }
+
+    const struct fpdb_as *as = (const struct fpdb_as *)(image + hdr->as_table.offset);
+    for (uint64_t i = 0; i < hdr->as_table.count; i++) {
+	if (as[i].name != FPDB_NONE && !name_is_valid(as[i].name, num_strings)) {
+	    return false;
+	}
+    }
+
+    /*
+     * the IPv6 trie is laid out in preorder, so each child follows its
+     * parent; requiring that ensures that a lookup terminates
+     */
+    const struct fpdb_ipv6_node *v6 = (const struct fpdb_ipv6_node *)(image + hdr->ipv6_trie.offset);
+    for (uint64_t i = 0; i < hdr->ipv6_trie.count; i++) {
+	if (v6[i].prefix_len > 128) {
+	    return false;
+	}
+	for (unsigned int bit = 0; bit < 2; bit++) {
+	    uint32_t c = v6[i].child[bit];
+	    if (c != FPDB_NONE && (c <= i || c >= hdr->ipv6_trie.count)) {
+		return false;
+	    }
+	}
+    }
+
+    const struct fpdb_suffix_node *sfx = (const struct fpdb_suffix_node *)(image + hdr->public_suffix_trie.offset);
+    for (uint64_t i = 0; i < hdr->public_suffix_trie.count; i++) {
+	if (!string_is_valid(&sfx[i].label, num_strings)
+	    || sfx[i].first_child > hdr->public_suffix_trie.count
+	    || sfx[i].num_children > hdr->public_suffix_trie.count - sfx[i].first_child) {
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+static void phf_view_init(struct phf_view *v, const struct fpdb_phf *phf, const uint8_t *image) {
+    v->seed = phf->seed;
+    v->num_buckets = phf->num_buckets;
+    v->num_slots = phf->num_slots;
+    v->displacement = (const uint32_t *)(image + phf->displacement.offset);
+    v->slot = (const uint32_t *)(image + phf->slot.offset);
+    v->key = (const struct fpdb_string *)(image + phf->key.offset);
+}
+
+static struct fingerprint_db *fingerprint_db_from_image(const uint8_t *image, size_t image_len, bool mapped) {
+    const struct fpdb_header *hdr = (const struct fpdb_header *)image;
+
+    if (image_len < sizeof(*hdr)
+	|| memcmp(hdr->magic, FPDB_MAGIC, FPDB_MAGIC_LEN) != 0
+	|| hdr->version != FPDB_VERSION
+	|| hdr->byte_order != FPDB_BYTE_ORDER
+	|| hdr->size != image_len
+	|| !section_is_valid(&hdr->strings, 1, image_len)
+	|| hdr->strings.count == 0
+	|| image[hdr->strings.offset + hdr->strings.count - 1] != '\0'
+	|| !phf_is_valid(&hdr->fingerprint_phf, image_len)
+	|| !section_is_valid(&hdr->fingerprints, sizeof(struct fpdb_fingerprint), image_len)
+	|| !section_is_valid(&hdr->processes, sizeof(struct fpdb_process), image_len)
+	|| !section_is_valid(&hdr->features, sizeof(struct fpdb_feature), image_len)
+	|| !phf_is_valid(&hdr->feature_phf, image_len)
+	|| !section_is_valid(&hdr->as_table, sizeof(struct fpdb_as), image_len)
+	|| hdr->as_table.count == 0
+	|| !section_is_valid(&hdr->ipv4_tbl24, sizeof(uint32_t), image_len)
+	|| hdr->ipv4_tbl24.count != FPDB_TBL24_SIZE
+	|| !section_is_valid(&hdr->ipv4_tbl8, sizeof(uint32_t), image_len)
+	|| hdr->ipv4_tbl8.count % 256 != 0
+	|| !section_is_valid(&hdr->ipv6_trie, sizeof(struct fpdb_ipv6_node), image_len)
+	|| !section_is_valid(&hdr->public_suffix_trie, sizeof(struct fpdb_suffix_node), image_len)
+	|| hdr->public_suffix_trie.count == 0
+	|| !image_indices_are_valid(hdr, image)) {
+	return NULL;
+    }
+
+    struct fingerprint_db *db = new fingerprint_db;
+    db->image = image;
+    db->image_len = image_len;
+    db->mapped = mapped;
+    db->malware_db = hdr->flags & FPDB_FLAG_MALWARE;
+    db->unknown_feature_id = hdr->unknown_feature_id;
+    db->strings = (const char *)image + hdr->strings.offset;
+    phf_view_init(&db->fingerprint_phf, &hdr->fingerprint_phf, image);
+    db->fingerprints = (const struct fpdb_fingerprint *)(image + hdr->fingerprints.offset);
+    db->processes = (const struct fpdb_process *)(image + hdr->processes.offset);
+    db->features = (const struct fpdb_feature *)(image + hdr->features.offset);
+    phf_view_init(&db->feature_phf, &hdr->feature_phf, image);
+    db->as_table = (const struct fpdb_as *)(image + hdr->as_table.offset);
+    db->num_as = hdr->as_table.count;
+    db->ipv4_tbl24 = (const uint32_t *)(image + hdr->ipv4_tbl24.offset);
+    db->ipv4_tbl8 = (const uint32_t *)(image + hdr->ipv4_tbl8.offset);
+    db->num_tbl8_groups = hdr->ipv4_tbl8.count / 256;
+    db->ipv6_trie = (const struct fpdb_ipv6_node *)(image + hdr->ipv6_trie.offset);
+    db->num_ipv6_nodes = hdr->ipv6_trie.count;
+    db->suffix_trie = (const struct fpdb_suffix_node *)(image + hdr->public_suffix_trie.offset);
+
+    return db;
+}
+
+/*
+ * fingerprint_db_map(filename) maps a precompiled image read-only, so
+ * that its pages are shared with any other process that maps it
+ */
+static struct fingerprint_db *fingerprint_db_map(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+	return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+	close(fd);
+	return NULL;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+	perror("could not map fingerprint database image");
+	return NULL;
+    }
+    struct fingerprint_db *db = fingerprint_db_from_image((const uint8_t *)image, st.st_size, true);
+    if (db == NULL) {
+	fprintf(stderr, "warning: ignoring invalid or outdated fingerprint database image %s\n", filename);
+	munmap(image, st.st_size);
+    }
+    return db;
+}
+
+/*
+ * image_is_current(resource_dir, image_filename) returns true if the
+ * image file exists and is newer than all of the resource files it
+ * was compiled from
+ */
+static bool image_is_current(const char *resource_dir, const char *image_filename) {
+    static const char *source_files[] = {
+	"fingerprint_db.json.gz",
+	"pyasn.db.gz",
+	"asn_info.db.gz",
+	"public_suffix_list.dat.gz"
+    };
+    struct stat image_st;
+    if (stat(image_filename, &image_st) != 0) {
+	return false;
+    }
+    for (const char *source : source_files) {
+	struct stat st;
+	std::string path = std::string(resource_dir) + "/" + source;
+	if (stat(path.c_str(), &st) == 0 && st.st_mtime > image_st.st_mtime) {
+	    fprintf(stderr, "warning: %s is older than %s; run compile_fingerprint_db to update it\n", image_filename, path.c_str());
+	    return false;
+	}
+    }
+    return true;
+}
+
+struct fingerprint_db *fingerprint_db_load(const char *resource_dir) {
+    std::string image_filename = std::string(resource_dir) + "/" + FPDB_FILENAME;
+
+    if (image_is_current(resource_dir, image_filename.c_str())) {
+	struct fingerprint_db *db = fingerprint_db_map(image_filename.c_str());
+	if (db) {
+	    return db;
+	}
+    }
+
+    /*
+     * no usable image; compile one in memory, which is much slower
+     */
+    uint8_t *image;
+    size_t image_len;
+    if (fingerprint_db_build_image(resource_dir, &image, &image_len) != status_ok) {
+	return NULL;
+    }
+    struct fingerprint_db *db = fingerprint_db_from_image(image, image_len, false);
+    if (db == NULL) {
+	free(image);
+    }
+    return db;
+}
+
+void fingerprint_db_free(struct fingerprint_db *db) {
+    if (db) {
+	if (db->mapped) {
+	    munmap((void *)db->image, db->image_len);
+	} else {
+	    free((void *)db->image);
+	}
+	delete db;
+    }
+}
+
+unsigned int fingerprint_db_has_malware_info(const struct fingerprint_db *db) {
+    return db->malware_db;
+}
+
+/*
+ * destination features; each is represented by its feature id, which
+ * is FPDB_NONE for a value that was never observed with any process
+ */
+
+/*
+ * longest prefix match of destination addresses, which returns an
+ * index into the AS table (zero if there is no match); addresses are
+ * taken directly from the flow key, in network byte order
+ */
+static inline uint32_t ipv4_lookup(const struct fingerprint_db *db, uint32_t addr) {
+    uint32_t a = ntohl(addr);
+    uint32_t index = db->ipv4_tbl24[a >> 8];
+    if (index & FPDB_TBL8_GROUP) {
+	uint32_t group = index & ~FPDB_TBL8_GROUP;
+	if (group >= db->num_tbl8_groups) {
+	    return 0;
+	}
+	index = db->ipv4_tbl8[group * 256 + (a & 0xff)];
+    }
+    return index < db->num_as ? index : 0;
+}
+
+static inline bool ipv6_prefix_matches(const uint8_t *addr, const struct fpdb_ipv6_node *node) {
+    unsigned int bytes = node->prefix_len / 8;
+    unsigned int bits = node->prefix_len % 8;
+    if (memcmp(addr, node->prefix, bytes) != 0) {
+	return false;
+    }
+    if (bits) {
+	uint8_t mask = 0xff << (8 - bits);
+	return (addr[bytes] & mask) == node->prefix[bytes];
+    }
+    return true;
+}
+
+static uint32_t ipv6_lookup(const struct fingerprint_db *db, const uint8_t *addr) {
+    uint32_t best = 0;
+    uint32_t n = 0;
+    while (n < db->num_ipv6_nodes) {
+	const struct fpdb_ipv6_node *node = &db->ipv6_trie[n];
+	if (!ipv6_prefix_matches(addr, node)) {
+	    break;
+	}
+	if (node->as_index) {
+	    best = node->as_index;
+	}
+	if (node->prefix_len == 128) {
+	    break;
+	}
+	unsigned int bit = (addr[node->prefix_len / 8] >> (7 - node->prefix_len % 8)) & 1;
+	n = node->child[bit];
+    }
+    return best < db->num_as ? best : 0;
+}
+
+static inline uint32_t as_lookup(const struct fingerprint_db *db, const struct flow_key *key) {
+    if (key->type == ipv4) {
+	return ipv4_lookup(db, key->value.v4.dst_addr);
+    } else if (key->type == ipv6) {
+	return ipv6_lookup(db, key->value.v6.dst_addr);
+    }
+    return 0;
+}
+
+uint32_t fingerprint_db_get_asn(const struct fingerprint_db *db,
+				const struct flow_key *key,
+				const char **name) {
+    const struct fpdb_as *as = &db->as_table[as_lookup(db, key)];
+    if (name) {
+	*name = (as->name == FPDB_NONE) ? NULL : db->strings + as->name;
+    }
+    return as->asn;
+}
+
+static uint32_t fingerprint_db_get_asn_feature(const struct fingerprint_db *db,
+					       const struct flow_key *key) {
+    return db->as_table[as_lookup(db, key)].feature_id;
+}
+
+/*
+ * suffix_trie_child(db, node, label, length) returns the child of node
+ * with the given label, or NULL if there is none
+ */
+static inline const struct fpdb_suffix_node *suffix_trie_child(const struct fingerprint_db *db,
+							       const struct fpdb_suffix_node *node,
+							       const uint8_t *label,
+							       size_t length) {
+    size_t lo = node->first_child;
+    size_t hi = lo + node->num_children;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	const struct fpdb_string *s = &db->suffix_trie[mid].label;
+	int cmp = memcmp(db->strings + s->offset, label, s->length < length ? s->length : length);
+	if (cmp == 0) {
+	    if (s->length == length) {
+		return &db->suffix_trie[mid];
+	    }
+	    cmp = s->length < length ? -1 : 1;
+	}
+	if (cmp < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * fingerprint_db_get_registered_domain(db, hostname, length) finds
+ * the registered domain of hostname, that is, its public suffix along
+ * with one more label, considering suffixes with two to six labels,
+ * exactly as get_tld_info() does in the python module.  The labels of
+ * hostname are matched in place against the suffix trie, from the
+ * last one to the first.
+ */
+#define MAX_SUFFIX_LABELS 6
+
+size_t fingerprint_db_get_registered_domain(const struct fingerprint_db *db,
+					    const uint8_t *hostname,
+					    size_t length) {
+    /*
+     * label_start[k] is the offset of the suffix of hostname that
+     * consists of its last k labels
+     */
+    size_t label_start[MAX_SUFFIX_LABELS + 2];
+    size_t num_labels = 1;
+    label_start[1] = length;
+    while (label_start[1] > 0 && hostname[label_start[1] - 1] != '.') {
+	label_start[1]--;
+    }
+    while (num_labels < MAX_SUFFIX_LABELS + 1 && label_start[num_labels] > 0) {
+	size_t i = label_start[num_labels] - 1;   /* position of a dot */
+	while (i > 0 && hostname[i - 1] != '.') {
+	    i--;
+	}
+	label_start[++num_labels] = i;
+    }
+    /* num_labels is now min(total number of labels, MAX_SUFFIX_LABELS + 1) */
+
+    size_t domain = label_start[num_labels > 1 ? 2 : 1];
+    const struct fpdb_suffix_node *node = &db->suffix_trie[0];
+    size_t label_end = length;
+    for (size_t i = 1; i <= MAX_SUFFIX_LABELS && i <= num_labels; i++) {
+	node = suffix_trie_child(db, node, hostname + label_start[i], label_end - label_start[i]);
+	if (node == NULL) {
+	    break;
+	}
+	if (i > 1 && node->is_suffix) {
+	    domain = label_start[i < num_labels ? i + 1 : i];
+	}
+	if (label_start[i] == 0) {
+	    break;
+	}
+	label_end = label_start[i] - 1;
+    }
+    return domain;
+}
+
+static uint32_t fingerprint_db_get_domain_feature(const struct fingerprint_db *db,
+						  const uint8_t *hostname,
+						  size_t length) {
+    size_t domain = fingerprint_db_get_registered_domain(db, hostname, length);
+    return phf_lookup(db, &db->feature_phf, hostname + domain, length - domain);
+}
+
+static const char *port_application(uint16_t port) {
+    switch (port) {
+    case 443:  return "https";
+    case 448:  return "database";
+    case 465:  return "email";
+    case 563:  return "nntp";
+    case 585:  return "email";
+    case 614:  return "shell";
+    case 636:  return "ldap";
+    case 989:  return "ftp";
+    case 990:  return "ftp";
+    case 991:  return "nas";
+    case 992:  return "telnet";
+    case 993:  return "email";
+    case 994:  return "irc";
+    case 995:  return "email";
+    case 1443: return "alt-https";
+    case 2376: return "docker";
+    case 8001: return "tor";
+    case 8443: return "alt-https";
+    case 9000: return "tor";
+    case 9001: return "tor";
+    case 9002: return "tor";
+    case 9101: return "tor";
+    }
+    return "unknown";
+}
+
+static uint32_t fingerprint_db_get_port_feature(const struct fingerprint_db *db,
+						const struct flow_key *key) {
+    uint16_t port = 0;
+    if (key->type == ipv4) {
+	port = ntohs(key->value.v4.dst_port);
+    } else if (key->type == ipv6) {
+	port = ntohs(key->value.v6.dst_port);
+    }
+    const char *app = port_application(port);
+    return phf_lookup(db, &db->feature_phf, (const uint8_t *)app, strlen(app));
+}
+
+/*
+ * feature_score(db, p, type, id) returns the precomputed score term
+ * of the feature value id for process p, or BASE_PRIOR if that value
+ * was not observed with p
+ */
+static inline double feature_score(const struct fingerprint_db *db,
+				   const struct fpdb_process *p,
+				   unsigned int type,
+				   uint32_t id) {
+    if (id != FPDB_NONE) {
+	uint32_t lo = p->first_feature[type];
+	uint32_t hi = p->first_feature[type + 1];
+	while (lo < hi) {
+	    uint32_t mid = lo + (hi - lo) / 2;
+	    if (db->features[mid].id < id) {
+		lo = mid + 1;
+	    } else {
+		hi = mid;
+	    }
+	}
+	if (lo < p->first_feature[type + 1] && db->features[lo].id == id) {
+	    return db->features[lo].log_prob;
+	}
+    }
+    return FPDB_BASE_PRIOR;
+}
+
+static const char unknown_process[] = "Unknown";
+static const char generic_dmz_process[] = "Generic DMZ Traffic";
+
+/*
+ * scoring, as in identify_embed(): each process gets a naive Bayes
+ * log-score from the fingerprint prevalence and from each of the
+ * destination features, with missing features given the base prior
+ */
+void fingerprint_db_classify(const struct fingerprint_db *db,
+			     struct analysis_result *r,
+			     const uint8_t *fp,
+			     size_t fp_len,
+			     const uint8_t *sni,
+			     size_t sni_len,
+			     const struct flow_key *key) {
+
+    r->process = unknown_process;
+    r->score = 0.0;
+    r->malware = 0;
+    r->p_malware = 0.0;
+
+    uint32_t fp_index = phf_lookup(db, &db->fingerprint_phf, fp, fp_len);
+    if (fp_index == FPDB_NONE) {
+	return;
+    }
+    const struct fpdb_fingerprint *entry = &db->fingerprints[fp_index];
+
+    uint32_t feature_id[fpdb_num_feature_types];
+    feature_id[fpdb_feature_ip_as] = fingerprint_db_get_asn_feature(db, key);
+    feature_id[fpdb_feature_hostname_domain] = fingerprint_db_get_domain_feature(db, sni, sni_len);
+    feature_id[fpdb_feature_port_application] = fingerprint_db_get_port_feature(db, key);
+
+    double score_sum = 0.0;
+    double max_score = 0.0;
+    double sec_score = 0.0;
+    const struct fpdb_process *max_proc = NULL;
+    const struct fpdb_process *sec_proc = NULL;
+    double malware_prob = 0.0;
+
+    const struct fpdb_process *p = &db->processes[entry->first_process];
+    const struct fpdb_process *p_end = p + entry->num_processes;
+    for ( ; p < p_end; p++) {
+	double score = p->log_prior;
+	for (unsigned int t = 0; t < fpdb_num_feature_types; t++) {
+	    score += feature_score(db, p, t, feature_id[t]);
+	}
+	score = exp(score);
+	score_sum += score;
+
+	if (db->malware_db) {
+	    if (p->malware && score > 0.0) {
+		malware_prob += score;
+	    }
+	    if (score > max_score) {
+		sec_score = max_score;
+		sec_proc = max_proc;
+		max_score = score;
+		max_proc = p;
+	    } else if (score > sec_score) {
+		sec_score = score;
+		sec_proc = p;
+	    }
+	} else {
+	    if (score > max_score) {
+		max_score = score;
+		max_proc = p;
+	    }
+	}
+    }
+
+    /*
+     * note: the malware flag reported is that of the highest scoring
+     * process, even when a generic process is replaced by the next
+     * best one
+     */
+    if (max_proc) {
+	r->malware = max_proc->malware;
+	r->process = db->strings + max_proc->name;
+    }
+    if (db->malware_db && max_proc && strcmp(r->process, generic_dmz_process) == 0 && (sec_proc == NULL || sec_proc->malware == false)) {
+	r->process = sec_proc ? db->strings + sec_proc->name : unknown_process;
+    }
+
+    if (score_sum > 0.0) {
+	max_score /= score_sum;
+	malware_prob /= score_sum;
+    }
+
+    r->score = max_score;
+    r->p_malware = malware_prob;
+}
+
+/*
+ * struct output_buffer accumulates a null-terminated string in a
+ * fixed-size buffer; the length field counts every byte appended,
+ * including those that did not fit, so that truncation can be
+ * detected by comparing it to the buffer size
+ */
+struct output_buffer {
+    char *data;
+    size_t size;
+    size_t length;
+};
+
+static void output_buffer_putc(struct output_buffer *b, char c) {
+    if (b->length + 1 < b->size) {
+	b->data[b->length] = c;
+	b->data[b->length + 1] = '\0';
+    }
+    b->length++;
+}
+
+static void output_buffer_puts(struct output_buffer *b, const char *s) {
+    while (*s) {
+	output_buffer_putc(b, *s++);
+    }
+}
+
+/*
+ * output_buffer_json_double(b, x) appends x with at most nine digits
+ * after the decimal point, and with trailing zeros removed, as ujson
+ * does
+ */
+static void output_buffer_json_double(struct output_buffer *b, double x) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%.9f", x);
+    if (len <= 0 || (size_t)len >= sizeof(buf)) {
+	output_buffer_puts(b, "0.0");
+	return;
+    }
+    while (len > 2 && buf[len-1] == '0' && buf[len-2] != '.') {
+	buf[--len] = 0;
+    }
+    output_buffer_puts(b, buf);
+}
+
+static void output_buffer_json_escaped(struct output_buffer *b, const char *s) {
+    for ( ; *s; s++) {
+	unsigned char c = *s;
+	if (c == '"' || c == '\\') {
+	    output_buffer_putc(b, '\\');
+	    output_buffer_putc(b, c);
+	} else if (c < 0x20) {
+	    char hex[8];
+	    snprintf(hex, sizeof(hex), "\\u%04x", c);
+	    output_buffer_puts(b, hex);
+	} else {
+	    output_buffer_putc(b, c);
+	}
+    }
+}
+
+size_t snprintf_analysis_result(char *buf,
+				size_t len,
+				const struct fingerprint_db *db,
+				const struct analysis_result *r) {
+    struct output_buffer b = { buf, len, 0 };
+    if (len > 0) {
+	buf[0] = '\0';
+    }
+    output_buffer_puts(&b, "{\"process\":\"");
+    output_buffer_json_escaped(&b, r->process);
+    output_buffer_puts(&b, "\",\"score\":");
+    output_buffer_json_double(&b, r->score);
+    if (db->malware_db) {
+	output_buffer_puts(&b, ",\"malware\":");
+	output_buffer_puts(&b, r->malware ? "true" : "false");
+	output_buffer_puts(&b, ",\"p_malware\":");
+	output_buffer_json_double(&b, r->p_malware);
+    }
+    output_buffer_putc(&b, '}');
+    return b.length;
+}
+
+#define MAX_ANALYSIS_RESULT_LEN 1024
+
+void fprintf_analysis_result(FILE *f,
+			     const struct fingerprint_db *db,
+			     const struct analysis_result *r) {
+    char buf[MAX_ANALYSIS_RESULT_LEN];
+    if (snprintf_analysis_result(buf, sizeof(buf), db, r) < sizeof(buf)) {
+	fputs(buf, f);
+    } else {
+	fprintf(f, "{\"process\":\"Unknown\",\"score\":0.0}");
+    }
+}
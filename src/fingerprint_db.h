@@ -0,0 +1,133 @@
+/*
+ * fingerprint_db.h
+ *
+ * native fingerprint database and process inference engine
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef FINGERPRINT_DB_H
+#define FINGERPRINT_DB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mercury.h"
+#include "packet.h"
+
+/*
+ * struct analysis_result holds the outcome of the classification of
+ * a single (fingerprint, destination) observation; the process string
+ * points into the database that produced it, and remains valid as
+ * long as that database is loaded
+ */
+struct analysis_result {
+    const char *process;    /* most probable process, or "Unknown"      */
+    double score;           /* normalized score of that process         */
+    unsigned int malware;   /* true if that process is malware          */
+    double p_malware;       /* total probability of malware processes   */
+};
+
+#define analysis_result_init() { "Unknown", 0.0, 0, 0.0 }
+
+/*
+ * struct fingerprint_db is opaque; it holds the fingerprint/process
+ * database and the contextual data (autonomous systems and public
+ * suffixes) used to compute the destination features.  After it has
+ * been loaded, it is read-only, and any number of threads can use it
+ * concurrently without locking.
+ */
+struct fingerprint_db;
+
+/*
+ * fingerprint_db_load(resource_dir) maps the precompiled image
+ * fingerprint_db.bin in the directory resource_dir, if it is present
+ * and up to date, and otherwise compiles an image in memory from the
+ * resource files in that directory (which takes much longer); it
+ * returns a newly allocated database, or NULL on failure
+ */
+struct fingerprint_db *fingerprint_db_load(const char *resource_dir);
+
+void fingerprint_db_free(struct fingerprint_db *db);
+
+/*
+ * fingerprint_db_has_malware_info(db) returns a nonzero value if
+ * every process in the database has malware information, in which
+ * case the malware and p_malware fields of a result are meaningful
+ */
+unsigned int fingerprint_db_has_malware_info(const struct fingerprint_db *db);
+
+/*
+ * fingerprint_db_classify(db, r, fp, fp_len, sni, sni_len, key)
+ * computes the most probable process for the TLS fingerprint fp (a
+ * binary EPT, as produced by the extractor), given the server name
+ * sni (which need not be null-terminated) and the destination address
+ * and port in key, and writes the result into r
+ */
+void fingerprint_db_classify(const struct fingerprint_db *db,
+			     struct analysis_result *r,
+			     const uint8_t *fp,
+			     size_t fp_len,
+			     const uint8_t *sni,
+			     size_t sni_len,
+			     const struct flow_key *key);
+
+/*
+ * fingerprint_db_get_asn(db, key, name) returns the number of the
+ * autonomous system that holds the destination address of the flow
+ * key, or zero if it is not known; if name is not NULL, then *name is
+ * set to the name of that system, or NULL if it has no name
+ */
+uint32_t fingerprint_db_get_asn(const struct fingerprint_db *db,
+				const struct flow_key *key,
+				const char **name);
+
+/*
+ * fingerprint_db_get_registered_domain(db, hostname, length) returns
+ * the offset within hostname (which need not be null-terminated) of
+ * its registered domain, that is, its longest public suffix along
+ * with the label that precedes it (e.g. "example.co.uk" for
+ * "www.example.co.uk"); it neither allocates nor copies memory
+ */
+size_t fingerprint_db_get_registered_domain(const struct fingerprint_db *db,
+					    const uint8_t *hostname,
+					    size_t length);
+
+/*
+ * snprintf_analysis_result(buf, len, db, r) writes the result r as a
+ * null-terminated JSON object, in the format used by the python
+ * analysis module, into buf; like snprintf(), it returns the length
+ * of the complete output, which is len or greater if it was truncated
+ */
+size_t snprintf_analysis_result(char *buf,
+				size_t len,
+				const struct fingerprint_db *db,
+				const struct analysis_result *r);
+
+/*
+ * fprintf_analysis_result(f, db, r) writes the result r to the file f
+ */
+void fprintf_analysis_result(FILE *f,
+			     const struct fingerprint_db *db,
+			     const struct analysis_result *r);
+
+/*
+ * fingerprint_db_build_image(resource_dir, image, image_len) reads
+ * fingerprint_db.json.gz, pyasn.db.gz, asn_info.db.gz, and
+ * public_suffix_list.dat.gz from the directory resource_dir, and
+ * compiles them into a newly malloc()ed image (see
+ * fingerprint_db_image.h)
+ */
+enum status fingerprint_db_build_image(const char *resource_dir,
+				       uint8_t **image,
+				       size_t *image_len);
+
+/*
+ * fingerprint_db_write_image(resource_dir, filename) compiles an
+ * image and writes it to filename, replacing any existing file
+ * atomically
+ */
+enum status fingerprint_db_write_image(const char *resource_dir,
+				       const char *filename);
+
+#endif /* FINGERPRINT_DB_H */
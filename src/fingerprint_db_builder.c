@@ -0,0 +1,1086 @@
+/*
+ * fingerprint_db_builder.c
+ *
+ * compiler for the fingerprint database image: reads the resource
+ * files used by the python module python-inference/tls_fingerprint_min.pyx
+ * (fingerprint_db.json.gz, pyasn.db.gz, asn_info.db.gz, and
+ * public_suffix_list.dat.gz) and writes the image described in
+ * fingerprint_db_image.h
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include "fingerprint_db.h"
+#include "fingerprint_db_image.h"
+#include "ept.h"
+
+/*
+ * a minimal JSON reader, which is sufficient for the line-oriented
+ * fingerprint database; it reads objects, strings, and numbers, and
+ * skips over any other values
+ */
+
+struct json_reader {
+    const char *data;
+    const char *data_end;
+};
+
+static void json_reader_init(struct json_reader *r, const char *data, size_t length) {
+    r->data = data;
+    r->data_end = data + length;
+}
+
+static void json_skip_whitespace(struct json_reader *r) {
+    while (r->data < r->data_end && (*r->data == ' ' || *r->data == '\t' || *r->data == '\n' || *r->data == '\r')) {
+	r->data++;
+    }
+}
+
+static bool json_accept(struct json_reader *r, char c) {
+    json_skip_whitespace(r);
+    if (r->data < r->data_end && *r->data == c) {
+	r->data++;
+	return true;
+    }
+    return false;
+}
+
+static void utf8_append(std::string &s, unsigned int codepoint) {
+    if (codepoint < 0x80) {
+	s += (char)codepoint;
+    } else if (codepoint < 0x800) {
+	s += (char)(0xc0 | (codepoint >> 6));
+	s += (char)(0x80 | (codepoint & 0x3f));
+    } else {
+	s += (char)(0xe0 | (codepoint >> 12));
+	s += (char)(0x80 | ((codepoint >> 6) & 0x3f));
+	s += (char)(0x80 | (codepoint & 0x3f));
+    }
+}
+
+static bool json_read_string(struct json_reader *r, std::string &s) {
+    if (json_accept(r, '"') == false) {
+	return false;
+    }
+    s.clear();
+    while (r->data < r->data_end) {
+	char c = *r->data++;
+	if (c == '"') {
+	    return true;
+	}
+	if (c != '\\') {
+	    s += c;
+	    continue;
+	}
+	if (r->data >= r->data_end) {
+	    return false;
+	}
+	c = *r->data++;
+	switch (c) {
+	case 'b': s += '\b'; break;
+	case 'f': s += '\f'; break;
+	case 'n': s += '\n'; break;
+	case 'r': s += '\r'; break;
+	case 't': s += '\t'; break;
+	case 'u':
+	    {
+		if (r->data + 4 > r->data_end) {
+		    return false;
+		}
+		char hex[5] = { r->data[0], r->data[1], r->data[2], r->data[3], 0 };
+		utf8_append(s, strtoul(hex, NULL, 16));
+		r->data += 4;
+	    }
+	    break;
+	default:
+	    s += c;     /* handles '"', '\\', and '/' */
+	}
+    }
+    return false;
+}
+
+static bool json_read_number(struct json_reader *r, double *x) {
+    json_skip_whitespace(r);
+    char *end;
+    *x = strtod(r->data, &end);
+    if (end == r->data || end > r->data_end) {
+	return false;
+    }
+    r->data = end;
+    return true;
+}
+
+static bool json_skip_value(struct json_reader *r) {
+    std::string ignore;
+    double ignore_number;
+
+    json_skip_whitespace(r);
+    if (r->data >= r->data_end) {
+	return false;
+    }
+    switch (*r->data) {
+    case '"':
+	return json_read_string(r, ignore);
+    case '{':
+    case '[':
+	{
+	    char close = (*r->data == '{') ? '}' : ']';
+	    bool is_object = (close == '}');
+	    r->data++;
+	    if (json_accept(r, close)) {
+		return true;
+	    }
+	    do {
+		if (is_object && (json_read_string(r, ignore) == false || json_accept(r, ':') == false)) {
+		    return false;
+		}
+		if (json_skip_value(r) == false) {
+		    return false;
+		}
+	    } while (json_accept(r, ','));
+	    return json_accept(r, close);
+	}
+    case 't':
+    case 'f':
+    case 'n':
+	while (r->data < r->data_end && isalpha(*r->data)) {
+	    r->data++;
+	}
+	return true;
+    default:
+	return json_read_number(r, &ignore_number);
+    }
+}
+
+static bool json_read_bool(struct json_reader *r, bool *b) {
+    json_skip_whitespace(r);
+    if (r->data + 4 <= r->data_end && strncmp(r->data, "true", 4) == 0) {
+	*b = true;
+	r->data += 4;
+	return true;
+    }
+    if (r->data + 5 <= r->data_end && strncmp(r->data, "false", 5) == 0) {
+	*b = false;
+	r->data += 5;
+	return true;
+    }
+    return false;
+}
+
+/*
+ * json_read_next_key(r, key, first) reads the next key of an object,
+ * along with the colon that follows it; it returns false at the end
+ * of the object (or on error)
+ */
+static bool json_read_next_key(struct json_reader *r, std::string &key, bool *first) {
+    if (*first) {
+	*first = false;
+	if (json_accept(r, '}')) {
+	    return false;
+	}
+    } else if (json_accept(r, ',') == false) {
+	json_accept(r, '}');
+	return false;
+    }
+    return json_read_string(r, key) && json_accept(r, ':');
+}
+
+typedef std::unordered_map<std::string, double> feature_counts;
+
+static bool json_read_feature_counts(struct json_reader *r, feature_counts &counts) {
+    if (json_accept(r, '{') == false) {
+	return false;
+    }
+    std::string key;
+    bool first = true;
+    while (json_read_next_key(r, key, &first)) {
+	double count;
+	if (json_read_number(r, &count) == false) {
+	    return false;
+	}
+	counts[key] = count;
+    }
+    return true;
+}
+
+/*
+ * in-memory representation of the fingerprint database source files
+ */
+
+struct process_info {
+    std::string name;
+    double count;
+    bool malware;
+    bool has_malware;
+    feature_counts ip_as;
+    feature_counts hostname_domains;
+    feature_counts port_applications;
+};
+
+struct fingerprint_entry {
+    double total_count;
+    std::vector<struct process_info> processes;
+};
+
+struct fingerprint_db_source {
+    std::unordered_map<std::string, struct fingerprint_entry> fingerprints;
+    bool malware_db;
+
+    /*
+     * autonomous system data: ipv4 prefixes, indexed by prefix length,
+     * and ipv6 prefixes (as address, length) pairs
+     */
+    std::vector<std::unordered_map<uint32_t, uint32_t>> as_prefix;
+    std::map<std::pair<std::string, unsigned int>, uint32_t> as_prefix6;
+    std::unordered_map<uint32_t, std::string> as_name;
+
+    std::unordered_set<std::string> public_suffixes;
+};
+
+static bool process_info_read(struct json_reader *r, struct process_info &p) {
+    if (json_accept(r, '{') == false) {
+	return false;
+    }
+    p.count = 0.0;
+    p.malware = false;
+    p.has_malware = false;
+
+    std::string key;
+    bool first = true;
+    while (json_read_next_key(r, key, &first)) {
+	bool ok;
+	if (key == "process") {
+	    ok = json_read_string(r, p.name);
+	} else if (key == "count") {
+	    ok = json_read_number(r, &p.count);
+	} else if (key == "malware") {
+	    ok = json_read_bool(r, &p.malware);
+	    p.has_malware = true;
+	} else if (key == "classes_ip_as") {
+	    ok = json_read_feature_counts(r, p.ip_as);
+	} else if (key == "classes_hostname_domains") {
+	    ok = json_read_feature_counts(r, p.hostname_domains);
+	} else if (key == "classes_port_applications") {
+	    ok = json_read_feature_counts(r, p.port_applications);
+	} else {
+	    ok = json_skip_value(r);
+	}
+	if (!ok) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * remove_empty_parens(s) removes each occurrence of "()" from s, to
+ * match the normalization that the python module performs
+ */
+static void remove_empty_parens(std::string &s) {
+    size_t i = 0;
+    while ((i = s.find("()", i)) != std::string::npos) {
+	s.erase(i, 2);
+    }
+}
+
+static bool fingerprint_db_read_line(struct fingerprint_db_source *db, const char *line, size_t length) {
+    struct json_reader r;
+    json_reader_init(&r, line, length);
+
+    if (json_accept(&r, '{') == false) {
+	return false;
+    }
+    std::string str_repr;
+    struct fingerprint_entry entry;
+    entry.total_count = 0.0;
+
+    std::string key;
+    bool first = true;
+    while (json_read_next_key(&r, key, &first)) {
+	bool ok;
+	if (key == "str_repr") {
+	    ok = json_read_string(&r, str_repr);
+	} else if (key == "total_count") {
+	    ok = json_read_number(&r, &entry.total_count);
+	} else if (key == "process_info") {
+	    ok = json_accept(&r, '[');
+	    if (ok && json_accept(&r, ']') == false) {
+		do {
+		    struct process_info p;
+		    if (process_info_read(&r, p) == false) {
+			return false;
+		    }
+		    if (p.has_malware == false) {
+			db->malware_db = false;
+		    }
+		    entry.processes.push_back(std::move(p));
+		} while (json_accept(&r, ','));
+		ok = json_accept(&r, ']');
+	    }
+	} else {
+	    ok = json_skip_value(&r);
+	}
+	if (!ok) {
+	    return false;
+	}
+    }
+    remove_empty_parens(str_repr);
+    db->fingerprints[str_repr] = std::move(entry);
+    return true;
+}
+
+/*
+ * the resource files are gzipped; as in the python module, we read
+ * them through zcat, one line at a time
+ */
+typedef bool (*line_reader_func)(struct fingerprint_db_source *db, const char *line, size_t length);
+
+static enum status read_gz_file(struct fingerprint_db_source *db,
+				const char *resource_dir,
+				const char *filename,
+				line_reader_func read_line) {
+    std::string command = std::string("zcat ") + resource_dir + "/" + filename;
+    FILE *f = popen(command.c_str(), "r");
+    if (f == NULL) {
+	fprintf(stderr, "error: could not run \"%s\"\n", command.c_str());
+	return status_err;
+    }
+
+    char *line = NULL;
+    size_t line_buf_len = 0;
+    ssize_t line_len;
+    unsigned long int line_num = 0;
+    unsigned long int bad_lines = 0;
+    while ((line_len = getline(&line, &line_buf_len, f)) != -1) {
+	line_num++;
+	if (read_line(db, line, line_len) == false) {
+	    bad_lines++;
+	}
+    }
+    free(line);
+
+    int exit_status = pclose(f);
+    if (exit_status != 0 || line_num == 0) {
+	fprintf(stderr, "error: could not read resource file %s/%s\n", resource_dir, filename);
+	return status_err;
+    }
+    if (bad_lines) {
+	fprintf(stderr, "warning: ignored %lu malformed line(s) in %s\n", bad_lines, filename);
+    }
+    return status_ok;
+}
+
+/*
+ * pyasn.db lines have the form "1.0.4.0/22\t56203" or
+ * "2001:200::/32\t2500"; comment lines start with ';'
+ */
+static bool as_prefix_read_line(struct fingerprint_db_source *db, const char *line, size_t length) {
+    (void)length;
+    if (line[0] == ';' || line[0] == '\n') {
+	return true;   /* comment or empty line */
+    }
+    char addr_str[INET6_ADDRSTRLEN];
+    unsigned int prefix_len;
+    uint32_t asn;
+    if (sscanf(line, "%45[0-9a-fA-F.:]/%u %u", addr_str, &prefix_len, &asn) != 3) {
+	return false;
+    }
+    if (strchr(addr_str, ':') != NULL) {
+	uint8_t addr[16];
+	if (prefix_len > 128 || inet_pton(AF_INET6, addr_str, addr) != 1) {
+	    return false;
+	}
+	for (unsigned int i = 0; i < 128; i++) {
+	    if (i >= prefix_len) {
+		addr[i / 8] &= ~(0x80 >> (i % 8));
+	    }
+	}
+	db->as_prefix6[std::make_pair(std::string((const char *)addr, sizeof(addr)), prefix_len)] = asn;
+	return true;
+    }
+    struct in_addr addr;
+    if (prefix_len > 32 || inet_pton(AF_INET, addr_str, &addr) != 1) {
+	return false;
+    }
+    uint32_t mask = prefix_len ? 0xffffffff << (32 - prefix_len) : 0;
+    db->as_prefix[prefix_len][ntohl(addr.s_addr) & mask] = asn;
+    return true;
+}
+
+/*
+ * asn_info.db lines have the form "13335\t13335:Cloudflare"
+ */
+static bool as_name_read_line(struct fingerprint_db_source *db, const char *line, size_t length) {
+    (void)length;
+    uint32_t asn;
+    char name[256];
+    if (sscanf(line, "%u %255s", &asn, name) != 2) {
+	return false;
+    }
+    db->as_name[asn] = name;
+    return true;
+}
+
+/*
+ * public_suffix_list.dat holds one suffix per line; comments start
+ * with "//", and wildcard rules like "*.ck" are stored as "ck"
+ */
+static bool public_suffix_read_line(struct fingerprint_db_source *db, const char *line, size_t length) {
+    while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r' || line[length-1] == ' ')) {
+	length--;
+    }
+    if (length == 0 || (length > 1 && line[0] == '/' && line[1] == '/')) {
+	return true;
+    }
+    if (line[0] == '*') {
+	if (length < 2) {
+	    return true;
+	}
+	line += 2;
+	length -= 2;
+    }
+    db->public_suffixes.insert(std::string(line, length));
+    return true;
+}
+
+static struct fingerprint_db_source *fingerprint_db_source_load(const char *resource_dir) {
+    struct fingerprint_db_source *db = new fingerprint_db_source;
+    db->malware_db = true;
+    db->as_prefix.resize(33);
+
+    if (read_gz_file(db, resource_dir, "public_suffix_list.dat.gz", public_suffix_read_line) != status_ok ||
+	read_gz_file(db, resource_dir, "pyasn.db.gz", as_prefix_read_line) != status_ok ||
+	read_gz_file(db, resource_dir, "asn_info.db.gz", as_name_read_line) != status_ok ||
+	read_gz_file(db, resource_dir, "fingerprint_db.json.gz", fingerprint_db_read_line) != status_ok) {
+	delete db;
+	return NULL;
+    }
+    return db;
+}
+
+static void fingerprint_db_source_free(struct fingerprint_db_source *db) {
+    delete db;
+}
+
+
+/*
+ * image construction
+ */
+
+/*
+ * struct image_builder accumulates the sections of an image; each
+ * section is appended at the next FPDB_ALIGN-byte boundary
+ */
+struct image_builder {
+    std::vector<uint8_t> data;
+};
+
+static uint64_t image_builder_append(struct image_builder *b, const void *src, size_t length) {
+    while (b->data.size() % FPDB_ALIGN) {
+	b->data.push_back(0);
+    }
+    uint64_t offset = b->data.size();
+    const uint8_t *s = (const uint8_t *)src;
+    b->data.insert(b->data.end(), s, s + length);
+    return offset;
+}
+
+template <typename T>
+static struct fpdb_section image_builder_append_array(struct image_builder *b, const std::vector<T> &v) {
+    struct fpdb_section section;
+    section.offset = image_builder_append(b, v.data(), v.size() * sizeof(T));
+    section.count = v.size();
+    return section;
+}
+
+/*
+ * struct string_pool accumulates the string section; identical
+ * strings are stored once
+ */
+struct string_pool {
+    std::string data;
+    std::unordered_map<std::string, uint32_t> offsets;
+};
+
+static struct fpdb_string string_pool_add(struct string_pool *p, const std::string &s) {
+    struct fpdb_string str = { 0, (uint32_t)s.length() };
+    auto o = p->offsets.find(s);
+    if (o != p->offsets.end()) {
+	str.offset = o->second;
+	return str;
+    }
+    str.offset = p->data.length();
+    p->data.append(s);
+    p->data.push_back('\0');
+    p->offsets[s] = str.offset;
+    return str;
+}
+
+/*
+ * struct phf_builder computes a perfect hash function over a set of
+ * distinct keys, using the hash and displace method: the keys are
+ * grouped into buckets, and for each bucket (largest first), the
+ * smallest displacement that sends all of its keys to empty slots is
+ * found.  With about four keys per bucket and a load factor of 0.8,
+ * a displacement is found after a few trials for nearly every bucket.
+ */
+#define PHF_MAX_DISPLACEMENT 0x00ffffff
+#define PHF_MAX_SEEDS        16
+
+struct phf_builder {
+    uint64_t seed;
+    std::vector<uint32_t> displacement;
+    std::vector<uint32_t> slot;
+};
+
+static bool phf_builder_try_seed(struct phf_builder *phf, const std::vector<std::string> &keys, uint64_t seed) {
+    uint32_t num_keys = keys.size();
+    uint32_t num_buckets = num_keys / 4 + 1;
+    uint32_t num_slots = num_keys + num_keys / 4 + 1;
+
+    std::vector<uint64_t> hash(num_keys);
+    std::vector<std::vector<uint32_t>> bucket(num_buckets);
+    for (uint32_t i = 0; i < num_keys; i++) {
+	hash[i] = fpdb_hash(seed, (const uint8_t *)keys[i].data(), keys[i].length());
+	bucket[hash[i] % num_buckets].push_back(i);
+    }
+    std::vector<uint32_t> order(num_buckets);
+    for (uint32_t b = 0; b < num_buckets; b++) {
+	order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&bucket](uint32_t x, uint32_t y) {
+	    return bucket[x].size() > bucket[y].size();
+	});
+
+    phf->seed = seed;
+    phf->displacement.assign(num_buckets, 0);
+    phf->slot.assign(num_slots, FPDB_NONE);
+    std::vector<uint32_t> position;
+    for (uint32_t b : order) {
+	if (bucket[b].empty()) {
+	    break;
+	}
+	uint32_t d;
+	for (d = 0; d <= PHF_MAX_DISPLACEMENT; d++) {
+	    position.clear();
+	    for (uint32_t i : bucket[b]) {
+		uint32_t s = fpdb_slot(hash[i], d) % num_slots;
+		if (phf->slot[s] != FPDB_NONE || std::find(position.begin(), position.end(), s) != position.end()) {
+		    break;
+		}
+		position.push_back(s);
+	    }
+	    if (position.size() == bucket[b].size()) {
+		break;
+	    }
+	}
+	if (d > PHF_MAX_DISPLACEMENT) {
+	    return false;
+	}
+	phf->displacement[b] = d;
+	for (size_t j = 0; j < position.size(); j++) {
+	    phf->slot[position[j]] = bucket[b][j];
+	}
+    }
+    return true;
+}
+
+static enum status image_builder_append_phf(struct image_builder *b,
+					    struct string_pool *pool,
+					    struct fpdb_phf *phf_out,
+					    const std::vector<std::string> &keys) {
+    struct phf_builder phf;
+    uint64_t seed = 0x6d65726375727932ULL;  /* arbitrary */
+    unsigned int attempt;
+    for (attempt = 0; attempt < PHF_MAX_SEEDS; attempt++) {
+	if (phf_builder_try_seed(&phf, keys, seed + attempt)) {
+	    break;
+	}
+    }
+    if (attempt == PHF_MAX_SEEDS) {
+	fprintf(stderr, "error: could not construct perfect hash function\n");
+	return status_err;
+    }
+
+    std::vector<struct fpdb_string> key_strings;
+    for (const std::string &k : keys) {
+	key_strings.push_back(string_pool_add(pool, k));
+    }
+    phf_out->seed = phf.seed;
+    phf_out->num_buckets = phf.displacement.size();
+    phf_out->num_slots = phf.slot.size();
+    phf_out->displacement = image_builder_append_array(b, phf.displacement);
+    phf_out->slot = image_builder_append_array(b, phf.slot);
+    phf_out->key = image_builder_append_array(b, key_strings);
+    return status_ok;
+}
+
+/*
+ * as_prefixes_to_ranges(db, ranges) flattens the (nested) prefixes
+ * into disjoint ranges, each of which maps to the AS of its longest
+ * matching prefix; the ranges are sorted, and adjacent ranges with
+ * the same AS are merged
+ */
+struct as_prefix {
+    uint32_t first;
+    uint64_t last;
+    uint32_t asn;
+};
+
+static void as_range_append(std::vector<struct as_prefix> &ranges, uint64_t first, uint64_t last, uint32_t asn) {
+    if (first > last) {
+	return;
+    }
+    if (!ranges.empty() && ranges.back().last + 1 == first && ranges.back().asn == asn) {
+	ranges.back().last = last;
+	return;
+    }
+    ranges.push_back({ (uint32_t)first, last, asn });
+}
+
+static void as_prefixes_to_ranges(const struct fingerprint_db_source *db, std::vector<struct as_prefix> &ranges) {
+    std::vector<struct as_prefix> prefixes;
+    for (unsigned int prefix_len = 0; prefix_len < db->as_prefix.size(); prefix_len++) {
+	for (const auto &p : db->as_prefix[prefix_len]) {
+	    uint64_t size = (uint64_t)1 << (32 - prefix_len);
+	    prefixes.push_back({ p.first, p.first + size - 1, p.second });
+	}
+    }
+    /* sort by first address, then with enclosing prefixes first */
+    std::sort(prefixes.begin(), prefixes.end(), [](const struct as_prefix &x, const struct as_prefix &y) {
+	    return x.first < y.first || (x.first == y.first && x.last > y.last);
+	});
+
+    std::vector<struct as_prefix> open;   /* stack of enclosing prefixes */
+    uint64_t next = 0;                     /* first address not yet assigned */
+    for (const struct as_prefix &p : prefixes) {
+	while (!open.empty() && open.back().last < p.first) {
+	    as_range_append(ranges, next, open.back().last, open.back().asn);
+	    next = open.back().last + 1;
+	    open.pop_back();
+	}
+	if (!open.empty()) {
+	    as_range_append(ranges, next, (uint64_t)p.first - 1, open.back().asn);
+	}
+	next = p.first;
+	open.push_back(p);
+    }
+    while (!open.empty()) {
+	as_range_append(ranges, next, open.back().last, open.back().asn);
+	next = open.back().last + 1;
+	open.pop_back();
+    }
+}
+
+/*
+ * dir_24_8_add_range(tbl24, tbl8, first, last, index) maps the IPv4
+ * addresses first through last to index; the ranges added must not
+ * overlap.  A /24 that is only partly covered by a range gets a tbl8
+ * group, whose entries default to zero (no match).
+ */
+static void dir_24_8_add_range(std::vector<uint32_t> &tbl24,
+			       std::vector<uint32_t> &tbl8,
+			       uint64_t first,
+			       uint64_t last,
+			       uint32_t index) {
+    uint64_t addr = first;
+    while (addr <= last) {
+	uint32_t block = addr >> 8;
+	uint64_t block_last = ((uint64_t)block << 8) | 0xff;
+	if ((addr & 0xff) == 0 && block_last <= last && (tbl24[block] & FPDB_TBL8_GROUP) == 0) {
+	    tbl24[block] = index;     /* entire /24 */
+	} else {
+	    if ((tbl24[block] & FPDB_TBL8_GROUP) == 0) {
+		uint32_t group = tbl8.size() / 256;
+		tbl8.resize(tbl8.size() + 256, tbl24[block]);
+		tbl24[block] = FPDB_TBL8_GROUP | group;
+	    }
+	    uint32_t *entry = &tbl8[(tbl24[block] & ~FPDB_TBL8_GROUP) * 256];
+	    for (uint64_t a = addr; a <= last && a <= block_last; a++) {
+		entry[a & 0xff] = index;
+	    }
+	}
+	addr = block_last + 1;
+    }
+}
+
+/*
+ * an uncompressed binary trie of IPv6 prefixes, which is compressed
+ * into the fpdb_ipv6_node representation by removing each node that
+ * is not a prefix and has only one child
+ */
+struct trie_node {
+    uint32_t as_index;
+    uint32_t child[2];
+};
+
+static inline unsigned int ipv6_bit(const uint8_t *addr, unsigned int i) {
+    return (addr[i / 8] >> (7 - (i % 8))) & 1;
+}
+
+static void trie_insert(std::vector<struct trie_node> &trie, const uint8_t *addr, unsigned int prefix_len, uint32_t as_index) {
+    uint32_t n = 0;
+    for (unsigned int i = 0; i < prefix_len; i++) {
+	unsigned int bit = ipv6_bit(addr, i);
+	if (trie[n].child[bit] == 0) {
+	    trie[n].child[bit] = trie.size();
+	    trie.push_back({ 0, { 0, 0 } });
+	}
+	n = trie[n].child[bit];
+    }
+    trie[n].as_index = as_index;
+}
+
+static void ipv6_set_bit(uint8_t *addr, unsigned int i) {
+    addr[i / 8] |= 0x80 >> (i % 8);
+}
+
+/*
+ * trie_compress(trie, n, depth, prefix, out) appends the compressed
+ * form of the subtrie rooted at node n, which is at the given depth
+ * and is reached by the path prefix, to out, and returns its index
+ */
+static uint32_t trie_compress(const std::vector<struct trie_node> &trie,
+			      uint32_t n,
+			      unsigned int depth,
+			      const uint8_t *path,
+			      std::vector<struct fpdb_ipv6_node> &out) {
+    struct fpdb_ipv6_node node;
+    memcpy(node.prefix, path, sizeof(node.prefix));
+
+    while (trie[n].as_index == 0 && ((trie[n].child[0] == 0) != (trie[n].child[1] == 0))) {
+	unsigned int bit = (trie[n].child[1] != 0);
+	if (bit) {
+	    ipv6_set_bit(node.prefix, depth);
+	}
+	n = trie[n].child[bit];
+	depth++;
+    }
+    node.prefix_len = depth;
+    node.as_index = trie[n].as_index;
+    node.child[0] = node.child[1] = FPDB_NONE;
+
+    uint32_t index = out.size();
+    out.push_back(node);
+    for (unsigned int bit = 0; bit < 2; bit++) {
+	if (trie[n].child[bit]) {
+	    uint8_t child_path[16];
+	    memcpy(child_path, node.prefix, sizeof(child_path));
+	    if (bit) {
+		ipv6_set_bit(child_path, depth);
+	    }
+	    uint32_t c = trie_compress(trie, trie[n].child[bit], depth + 1, child_path, out);
+	    out[index].child[bit] = c;
+	}
+    }
+    return index;
+}
+
+/*
+ * public suffix trie construction: suffixes are inserted label by
+ * label, from the last label to the first, and the trie is then laid
+ * out breadth-first, so that the children of each node are adjacent
+ * and (since std::map is ordered) sorted by label
+ */
+struct suffix_trie_node {
+    bool is_suffix;
+    std::map<std::string, size_t> child;
+};
+
+static void suffix_trie_insert(std::vector<struct suffix_trie_node> &trie, const std::string &suffix) {
+    size_t n = 0;
+    size_t end = suffix.length();
+    while (true) {
+	size_t start = end;
+	while (start > 0 && suffix[start - 1] != '.') {
+	    start--;
+	}
+	std::string label = suffix.substr(start, end - start);
+	auto c = trie[n].child.find(label);
+	if (c == trie[n].child.end()) {
+	    trie[n].child[label] = trie.size();
+	    n = trie.size();
+	    trie.push_back(suffix_trie_node{ false, {} });
+	} else {
+	    n = c->second;
+	}
+	if (start == 0) {
+	    break;
+	}
+	end = start - 1;
+    }
+    trie[n].is_suffix = true;
+}
+
+static void suffix_trie_layout(const std::vector<struct suffix_trie_node> &trie,
+			       struct string_pool *pool,
+			       std::vector<struct fpdb_suffix_node> &out) {
+    std::vector<size_t> queue;   /* trie index of each node in out */
+
+    out.push_back({ string_pool_add(pool, ""), 0, 0, 0, 0 });
+    queue.push_back(0);
+    for (size_t i = 0; i < queue.size(); i++) {
+	const struct suffix_trie_node &n = trie[queue[i]];
+	out[i].first_child = out.size();
+	out[i].num_children = n.child.size();
+	for (const auto &c : n.child) {
+	    out.push_back({ string_pool_add(pool, c.first), 0, 0, trie[c.second].is_suffix, 0 });
+	    queue.push_back(c.second);
+	}
+    }
+}
+
+/*
+ * binary_key_from_str_repr(s, key) converts a normalized fingerprint
+ * string into the binary EPT that the extractor produces for it; it
+ * returns false if s is not a valid EPT, or if its binary form does
+ * not print back as s (as is the case for an empty node, which has
+ * more than one binary form)
+ */
+#define MAX_FP_LEN 4096
+
+static bool binary_key_from_str_repr(const std::string &s, std::string &key) {
+    uint8_t binary[MAX_FP_LEN];
+    unsigned char check[MAX_FP_LEN * 2 + 1];
+
+    const uint8_t *str = (const uint8_t *)s.data();
+    size_t len = binary_ept_from_paren_ept(binary, binary + sizeof(binary), str, str + s.length());
+    if (len == 0) {
+	return false;
+    }
+    size_t check_len = sprintf_binary_ept_as_paren_ept(binary, len, check, sizeof(check));
+    if (check_len != s.length() || memcmp(check, s.data(), check_len) != 0) {
+	return false;
+    }
+    key.assign((const char *)binary, len);
+    return true;
+}
+
+static enum status fingerprint_db_source_to_image(const struct fingerprint_db_source *db,
+						  std::vector<uint8_t> &image) {
+    struct image_builder b;
+    struct string_pool pool;
+    struct fpdb_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    image_builder_append(&b, &hdr, sizeof(hdr));  /* placeholder */
+
+    /*
+     * assign ids to feature values in sorted order, so that the image
+     * does not depend on the order of hash table iteration
+     */
+    std::vector<std::string> feature_values;
+    std::unordered_map<std::string, uint32_t> feature_id;
+    {
+	std::set<std::string> values;
+	for (const auto &fp : db->fingerprints) {
+	    for (const struct process_info &p : fp.second.processes) {
+		for (const feature_counts *counts : { &p.ip_as, &p.hostname_domains, &p.port_applications }) {
+		    for (const auto &c : *counts) {
+			values.insert(c.first);
+		    }
+		}
+	    }
+	}
+	feature_values.assign(values.begin(), values.end());
+	for (uint32_t i = 0; i < feature_values.size(); i++) {
+	    feature_id[feature_values[i]] = i;
+	}
+    }
+    auto unknown = feature_id.find("unknown");
+    hdr.unknown_feature_id = (unknown == feature_id.end()) ? FPDB_NONE : unknown->second;
+
+    std::vector<std::string> fp_keys;
+    std::vector<struct fpdb_fingerprint> fingerprints;
+    std::vector<struct fpdb_process> processes;
+    std::vector<struct fpdb_feature> features;
+    std::vector<std::string> str_reprs;
+    for (const auto &fp : db->fingerprints) {
+	str_reprs.push_back(fp.first);
+    }
+    std::sort(str_reprs.begin(), str_reprs.end());
+    unsigned long int skipped = 0;
+    for (const std::string &str_repr : str_reprs) {
+	const struct fingerprint_entry &entry = db->fingerprints.at(str_repr);
+	std::string key;
+	if (binary_key_from_str_repr(str_repr, key) == false) {
+	    skipped++;
+	    continue;
+	}
+	fp_keys.push_back(key);
+	fingerprints.push_back({ (uint32_t)processes.size(), (uint32_t)entry.processes.size() });
+
+	/* processes must stay in their original order, which breaks ties */
+	for (const struct process_info &p : entry.processes) {
+	    struct fpdb_process proc;
+	    memset(&proc, 0, sizeof(proc));
+	    proc.name = string_pool_add(&pool, p.name).offset;
+	    proc.malware = p.malware;
+	    proc.log_prior = fmax(log(p.count / entry.total_count), FPDB_BASE_PRIOR) * 3;
+
+	    const feature_counts *counts[fpdb_num_feature_types] = { &p.ip_as, &p.hostname_domains, &p.port_applications };
+	    for (unsigned int t = 0; t < fpdb_num_feature_types; t++) {
+		proc.first_feature[t] = features.size();
+		std::vector<struct fpdb_feature> f;
+		for (const auto &c : *counts[t]) {
+		    f.push_back({ feature_id[c.first], 0, fmax(log(c.second / p.count), FPDB_PRIOR) });
+		}
+		std::sort(f.begin(), f.end(), [](const struct fpdb_feature &x, const struct fpdb_feature &y) {
+			return x.id < y.id;
+		    });
+		features.insert(features.end(), f.begin(), f.end());
+	    }
+	    proc.first_feature[fpdb_num_feature_types] = features.size();
+	    processes.push_back(proc);
+	}
+    }
+    if (skipped) {
+	fprintf(stderr, "warning: ignored %lu fingerprint(s) with no unique binary form\n", skipped);
+    }
+
+    /*
+     * autonomous systems: index zero is reserved for addresses that
+     * do not match any prefix
+     */
+    std::vector<struct fpdb_as> as_table;
+    std::unordered_map<uint32_t, uint32_t> as_index;
+    as_table.push_back({ 0, FPDB_NONE, hdr.unknown_feature_id });
+    auto get_as_index = [&](uint32_t asn) -> uint32_t {
+	auto a = as_index.find(asn);
+	if (a != as_index.end()) {
+	    return a->second;
+	}
+	struct fpdb_as as = { asn, FPDB_NONE, hdr.unknown_feature_id };
+	auto name = db->as_name.find(asn);
+	if (name != db->as_name.end()) {
+	    as.name = string_pool_add(&pool, name->second).offset;
+	    auto id = feature_id.find(name->second);
+	    as.feature_id = (id == feature_id.end()) ? FPDB_NONE : id->second;
+	}
+	as_index[asn] = as_table.size();
+	as_table.push_back(as);
+	return as_index[asn];
+    };
+
+    std::vector<struct as_prefix> prefix_ranges;
+    as_prefixes_to_ranges(db, prefix_ranges);
+    std::vector<uint32_t> tbl24(FPDB_TBL24_SIZE, 0);
+    std::vector<uint32_t> tbl8;
+    for (const struct as_prefix &r : prefix_ranges) {
+	dir_24_8_add_range(tbl24, tbl8, r.first, r.last, get_as_index(r.asn));
+    }
+
+    std::vector<struct fpdb_ipv6_node> ipv6_trie;
+    {
+	std::vector<struct trie_node> trie(1);
+	for (const auto &p : db->as_prefix6) {
+	    trie_insert(trie, (const uint8_t *)p.first.first.data(), p.first.second, get_as_index(p.second));
+	}
+	uint8_t root_path[16] = { 0 };
+	trie_compress(trie, 0, 0, root_path, ipv6_trie);
+    }
+
+    std::vector<struct fpdb_suffix_node> suffix_trie;
+    {
+	std::vector<struct suffix_trie_node> trie(1);
+	for (const std::string &suffix : db->public_suffixes) {
+	    suffix_trie_insert(trie, suffix);
+	}
+	suffix_trie_layout(trie, &pool, suffix_trie);
+    }
+
+    if (image_builder_append_phf(&b, &pool, &hdr.fingerprint_phf, fp_keys) != status_ok ||
+	image_builder_append_phf(&b, &pool, &hdr.feature_phf, feature_values) != status_ok) {
+	return status_err;
+    }
+    hdr.fingerprints = image_builder_append_array(&b, fingerprints);
+    hdr.processes = image_builder_append_array(&b, processes);
+    hdr.features = image_builder_append_array(&b, features);
+    hdr.as_table = image_builder_append_array(&b, as_table);
+    hdr.ipv4_tbl24 = image_builder_append_array(&b, tbl24);
+    hdr.ipv4_tbl8 = image_builder_append_array(&b, tbl8);
+    hdr.ipv6_trie = image_builder_append_array(&b, ipv6_trie);
+    hdr.public_suffix_trie = image_builder_append_array(&b, suffix_trie);
+    hdr.strings.offset = image_builder_append(&b, pool.data.data(), pool.data.length());
+    hdr.strings.count = pool.data.length();
+
+    memcpy(hdr.magic, FPDB_MAGIC, FPDB_MAGIC_LEN);
+    hdr.version = FPDB_VERSION;
+    hdr.byte_order = FPDB_BYTE_ORDER;
+    hdr.flags = db->malware_db ? FPDB_FLAG_MALWARE : 0;
+    hdr.size = b.data.size();
+    memcpy(b.data.data(), &hdr, sizeof(hdr));
+
+    image.swap(b.data);
+    return status_ok;
+}
+
+enum status fingerprint_db_build_image(const char *resource_dir,
+				       uint8_t **image,
+				       size_t *image_len) {
+    struct fingerprint_db_source *db = fingerprint_db_source_load(resource_dir);
+    if (db == NULL) {
+	return status_err;
+    }
+    std::vector<uint8_t> data;
+    enum status status = fingerprint_db_source_to_image(db, data);
+    fingerprint_db_source_free(db);
+    if (status != status_ok) {
+	return status;
+    }
+    *image = (uint8_t *)malloc(data.size());
+    if (*image == NULL) {
+	return status_err;
+    }
+    memcpy(*image, data.data(), data.size());
+    *image_len = data.size();
+    return status_ok;
+}
+
+enum status fingerprint_db_write_image(const char *resource_dir,
+				       const char *filename) {
+    uint8_t *image;
+    size_t image_len;
+    if (fingerprint_db_build_image(resource_dir, &image, &image_len) != status_ok) {
+	return status_err;
+    }
+
+    /*
+     * write to a temporary file, then rename it, so that running
+     * processes that have mapped the previous image are not affected
+     */
+    std::string tmp_filename = std::string(filename) + ".tmp";
+    FILE *f = fopen(tmp_filename.c_str(), "w");
+    if (f == NULL) {
+	perror("could not open file for writing");
+	free(image);
+	return status_err;
+    }
+    size_t items_written = fwrite(image, image_len, 1, f);
+    free(image);
+    if (fclose(f) != 0 || items_written != 1) {
+	perror("could not write fingerprint database image");
+	unlink(tmp_filename.c_str());
+	return status_err;
+    }
+    if (rename(tmp_filename.c_str(), filename) != 0) {
+	perror("could not rename fingerprint database image");
+	unlink(tmp_filename.c_str());
+	return status_err;
+    }
+    return status_ok;
+}
@@ -0,0 +1,219 @@
+/*
+ * fingerprint_db_image.h
+ *
+ * layout of the precompiled fingerprint database image, which is
+ * written by compile_fingerprint_db and memory-mapped by mercury
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef FINGERPRINT_DB_IMAGE_H
+#define FINGERPRINT_DB_IMAGE_H
+
+#include <stdint.h>
+#include "hash.h"
+
+/*
+ * The image is a single file that holds everything that the
+ * inference engine needs: the fingerprints (keyed by binary EPT),
+ * their processes with precomputed log-probabilities, the autonomous
+ * system prefix tables, and the public suffixes.  It contains no pointers;
+ * every reference is an offset from the start of the image, or an
+ * index into one of its arrays, so that the file can be mapped
+ * read-only at any address and shared by all mercury processes on a
+ * host.  The image is in host byte order; the byte_order field of
+ * the header guards against using an image from another platform.
+ *
+ * Any change to this layout, to the hash functions in hash.h, or to
+ * the way that the scores are precomputed must be accompanied by an
+ * increment of FPDB_VERSION.
+ */
+
+#define FPDB_MAGIC       "MERCFPDB"
+#define FPDB_MAGIC_LEN   8
+#define FPDB_VERSION     3
+#define FPDB_BYTE_ORDER  0x01020304
+
+#define FPDB_FLAG_MALWARE  0x01   /* every process has malware information */
+
+#define FPDB_NONE          0xffffffff   /* null index or offset */
+
+#define FPDB_ALIGN         8            /* alignment of each section */
+
+/*
+ * a section is an array of count elements, which begins offset
+ * bytes from the start of the image
+ */
+struct fpdb_section {
+    uint64_t offset;
+    uint64_t count;
+};
+
+/*
+ * a string is a byte sequence that begins offset bytes from the start
+ * of the string section; strings are also null-terminated, except
+ * for binary keys
+ */
+struct fpdb_string {
+    uint32_t offset;
+    uint32_t length;
+};
+
+/*
+ * struct fpdb_phf describes a perfect hash function
+ * (hash and displace) over a set of keys, which maps each key to a
+ * distinct slot.  For a key with hash h = fpdb_hash(seed, key), the
+ * bucket is h % num_buckets, and the slot is
+ *
+ *    fpdb_slot(h, displacement[bucket]) % num_slots
+ *
+ * The slot holds the index of the key (in the array of keys that
+ * accompanies the function), or FPDB_NONE if it is empty.  A string
+ * that is not in the set also maps to some slot, so the key at that
+ * index must be compared with the string.
+ */
+struct fpdb_phf {
+    uint64_t seed;
+    uint32_t num_buckets;
+    uint32_t num_slots;
+    struct fpdb_section displacement;   /* uint32_t[num_buckets]    */
+    struct fpdb_section slot;           /* uint32_t[num_slots]      */
+    struct fpdb_section key;            /* struct fpdb_string[]     */
+};
+
+static inline uint64_t fpdb_hash(uint64_t seed, const uint8_t *key, size_t length) {
+    return hash64_final(hash64_bytes(seed, key, length));
+}
+
+static inline uint64_t fpdb_slot(uint64_t h, uint32_t displacement) {
+    return hash64_final(h ^ (displacement * 0x9e3779b97f4a7c15ULL));
+}
+
+/*
+ * scoring constants, as in identify_embed(); a feature value that was
+ * not observed with a process contributes BASE_PRIOR to its score
+ */
+#define FPDB_BASE_PRIOR -18.42068  /* log(1e-8) */
+#define FPDB_PRIOR       -4.60517  /* log(1e-2) */
+
+/*
+ * the feature types, in the order in which identify_embed() adds
+ * their scores
+ */
+enum fpdb_feature_type {
+    fpdb_feature_ip_as             = 0,
+    fpdb_feature_hostname_domain   = 1,
+    fpdb_feature_port_application  = 2,
+    fpdb_num_feature_types         = 3
+};
+
+/*
+ * a fingerprint has the processes with indices first_process through
+ * first_process + num_processes - 1; its key is the binary EPT
+ */
+struct fpdb_fingerprint {
+    uint32_t first_process;
+    uint32_t num_processes;
+};
+
+/*
+ * a process has the precomputed score terms
+ *
+ *   log_prior = 3 * max(log(count / total_count), BASE_PRIOR)
+ *
+ * and, for each feature value observed with the process,
+ *
+ *   log_prob  = max(log(feature_count / count), PRIOR)
+ *
+ * The features of type t are those with indices first_feature[t]
+ * through first_feature[t+1] - 1, sorted by id.
+ */
+struct fpdb_process {
+    uint32_t name;         /* offset in string section */
+    uint32_t malware;
+    double log_prior;
+    uint32_t first_feature[fpdb_num_feature_types + 1];
+};
+
+struct fpdb_feature {
+    uint32_t id;          /* index of the feature value string */
+    uint32_t unused;
+    double log_prob;
+};
+
+/*
+ * autonomous systems: each destination address maps to an index into
+ * the AS table, through the longest prefix match with the prefixes
+ * in pyasn.db; index zero denotes an address with no matching prefix
+ */
+struct fpdb_as {
+    uint32_t asn;         /* AS number, or zero                        */
+    uint32_t name;        /* offset in string section, or FPDB_NONE    */
+    uint32_t feature_id;  /* feature id of the name, or FPDB_NONE      */
+};
+
+/*
+ * IPv4 prefixes are represented with the DIR-24-8 scheme: tbl24 has
+ * one entry for each /24, which holds either an AS index (for a /24
+ * that is covered by a single longest match), or FPDB_TBL8_GROUP plus
+ * the number of a group of 256 entries in tbl8 that holds the AS
+ * index of each address in that /24.  A lookup takes one or two
+ * memory accesses.
+ */
+#define FPDB_TBL24_SIZE  (1 << 24)
+#define FPDB_TBL8_GROUP  0x80000000
+
+/*
+ * IPv6 prefixes are held in a path-compressed binary trie; a node
+ * matches the addresses whose first prefix_len bits equal those of
+ * prefix, and its children (if any) are selected by the next bit.
+ * The root is node zero.
+ */
+struct fpdb_ipv6_node {
+    uint8_t prefix[16];
+    uint32_t prefix_len;
+    uint32_t as_index;    /* zero if the node is not itself a prefix */
+    uint32_t child[2];    /* FPDB_NONE if there is no child          */
+};
+
+/*
+ * public suffixes are held in a trie of labels, in reverse order
+ * ("co.uk" is the path "uk", "co"), so that the suffixes of a
+ * hostname can be matched in place with a single pass from its end.
+ * The children of a node are the nodes with indices first_child
+ * through first_child + num_children - 1, sorted by label (as with
+ * memcmp(), with a shorter label first when one is a prefix of
+ * another).  The root, which has an empty label, is node zero.
+ */
+struct fpdb_suffix_node {
+    struct fpdb_string label;
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t is_suffix;   /* the path to this node is a public suffix */
+    uint32_t unused;
+};
+
+struct fpdb_header {
+    char magic[FPDB_MAGIC_LEN];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t flags;
+    uint32_t unknown_feature_id;           /* id of "unknown", or FPDB_NONE */
+    uint64_t size;                         /* total size of image */
+    struct fpdb_section strings;           /* char[]                  */
+    struct fpdb_phf fingerprint_phf;       /* keys are binary EPTs    */
+    struct fpdb_section fingerprints;      /* struct fpdb_fingerprint */
+    struct fpdb_section processes;         /* struct fpdb_process     */
+    struct fpdb_section features;          /* struct fpdb_feature     */
+    struct fpdb_phf feature_phf;           /* keys are feature values */
+    struct fpdb_section as_table;          /* struct fpdb_as          */
+    struct fpdb_section ipv4_tbl24;        /* uint32_t[FPDB_TBL24_SIZE] */
+    struct fpdb_section ipv4_tbl8;         /* uint32_t[256 * groups]  */
+    struct fpdb_section ipv6_trie;         /* struct fpdb_ipv6_node   */
+    struct fpdb_section public_suffix_trie; /* struct fpdb_suffix_node */
+};
+
+#define FPDB_FILENAME "fingerprint_db.bin"
+
+#endif /* FINGERPRINT_DB_IMAGE_H */
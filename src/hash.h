@@ -0,0 +1,61 @@
+/*
+ * hash.h
+ *
+ * fast, non-cryptographic 64-bit hashing of byte strings
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * multiply-xorshift hashing, processing eight bytes at a time (as in
+ * MurmurHash64A); a hash is computed by starting from a seed, mixing
+ * in any number of byte strings and integers, and then calling
+ * hash64_final().  These functions are used for in-memory tables
+ * only; their output may change between versions, so it must not be
+ * stored, except along with a version number.
+ */
+
+#define HASH64_M 0xc6a4a7935bd1e995ULL
+#define HASH64_R 47
+
+static inline uint64_t hash64_mix(uint64_t h, uint64_t k) {
+    k *= HASH64_M;
+    k ^= k >> HASH64_R;
+    k *= HASH64_M;
+    h ^= k;
+    h *= HASH64_M;
+    return h;
+}
+
+static inline uint64_t hash64_bytes(uint64_t h, const uint8_t *data, size_t len) {
+    h = hash64_mix(h, len);
+    while (len >= sizeof(uint64_t)) {
+	uint64_t k;
+	memcpy(&k, data, sizeof(k));
+	h = hash64_mix(h, k);
+	data += sizeof(k);
+	len -= sizeof(k);
+    }
+    if (len) {
+	uint64_t k = 0;
+	memcpy(&k, data, len);
+	h = hash64_mix(h, k);
+    }
+    return h;
+}
+
+static inline uint64_t hash64_final(uint64_t h) {
+    h ^= h >> HASH64_R;
+    h *= HASH64_M;
+    h ^= h >> HASH64_R;
+    return h;
+}
+
+#endif /* HASH_H */
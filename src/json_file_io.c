@@ -5,8 +5,10 @@
  * https://github.com/cisco/mercury/blob/master/LICENSE 
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include "json_file_io.h"
@@ -15,6 +17,8 @@
 #include "ept.h"
 #include "utils.h"
 #include "analysis.h"
+#include "analysis_pool.h"
+#include "thread_stats.h"
 
 #define json_file_needs_rotation(jf) (--((jf)->record_countdown) == 0)
 
@@ -63,10 +67,103 @@ enum status json_file_rotate(struct json_file *jf) {
     return status_ok;
 }
 
+/*
+ * a pending record is split at the point where its analysis result
+ * belongs
+ */
+struct json_pending_record {
+    long analysis;   /* offset of analysis result in buffer       */
+    long end;        /* offset of the end of the record in buffer */
+    int request;     /* index of request in batch, or -1          */
+};
+
+#define JSON_SEGMENT_MAX_RECORDS   256
+#define JSON_SEGMENT_LEN           (1024 * 1024)
+#define JSON_MAX_RECORD_LEN        (64 * 1024)
+
+struct json_segment {
+    struct analysis_work work;   /* must be first */
+    struct json_file *jf;
+    FILE *pending;               /* writes into buffer */
+    char *buffer;
+    unsigned int num_pending;
+    struct json_pending_record record[JSON_SEGMENT_MAX_RECORDS];
+};
+
+static inline bool json_segment_is_full(struct json_segment *seg) {
+    return seg->num_pending == JSON_SEGMENT_MAX_RECORDS
+	|| ftell(seg->pending) > JSON_SEGMENT_LEN - JSON_MAX_RECORD_LEN;
+}
+
+/*
+ * json_segment_write(seg) writes out the records in seg, which has
+ * been flushed and whose batch has been processed, and empties it
+ */
+static void json_segment_write(struct json_segment *seg) {
+    struct json_file *jf = seg->jf;
+    uint64_t bytes_written = 0;
+
+    long start = 0;
+    for (unsigned int i = 0; i < seg->num_pending; i++) {
+	const struct json_pending_record *r = &seg->record[i];
+	bytes_written += fwrite(seg->buffer + start, 1, r->analysis - start, jf->file);
+	if (r->request >= 0) {
+	    bytes_written += fprintf_analysis_batch_result(jf->file, seg->work.batch, r->request);
+	}
+	bytes_written += fwrite(seg->buffer + r->analysis, 1, r->end - r->analysis, jf->file);
+	start = r->end;
+
+	if (json_file_needs_rotation(jf)) {
+	    json_file_rotate(jf);
+	}
+    }
+
+    /* counted by the thread that writes the segment, which may be a worker */
+    struct thread_stats *stats = thread_stats_get();
+    thread_stats_add(stats, thread_stat_records_written, seg->num_pending);
+    thread_stats_add(stats, thread_stat_bytes_written, bytes_written);
+
+    analysis_batch_clear(seg->work.batch);
+    seg->num_pending = 0;
+    fseek(seg->pending, 0, SEEK_SET);
+}
+
+static void json_segment_complete(struct analysis_work *w) {
+    json_segment_write((struct json_segment *)w);
+}
+
+static struct json_segment *json_segment_alloc(struct json_file *jf) {
+    struct json_segment *seg = (struct json_segment *)malloc(sizeof(struct json_segment));
+    if (seg == NULL) {
+	return NULL;
+    }
+    seg->jf = jf;
+    seg->num_pending = 0;
+    seg->work.complete = json_segment_complete;
+    seg->work.batch = analysis_batch_alloc();
+    seg->buffer = (char *)malloc(JSON_SEGMENT_LEN);
+    seg->pending = seg->buffer ? fmemopen(seg->buffer, JSON_SEGMENT_LEN, "w") : NULL;
+    if (seg->work.batch == NULL || seg->pending == NULL) {
+	analysis_batch_free(seg->work.batch);
+	free(seg->buffer);
+	free(seg);
+	return NULL;
+    }
+    return seg;
+}
+
+static void json_segment_free(struct json_segment *seg) {
+    fclose(seg->pending);
+    free(seg->buffer);
+    analysis_batch_free(seg->work.batch);
+    free(seg);
+}
+
 enum status json_file_init(struct json_file *jf,
 			   const char *outfile_name,
 			   const char *mode,
-			   uint64_t max_records) {
+			   uint64_t max_records,
+			   bool may_drop) {
     
     if (copy_string_into_buffer(jf->outfile_name, sizeof(jf->outfile_name), outfile_name, MAX_FILENAME) != 0) {
         return status_err;
@@ -76,10 +173,94 @@ enum status json_file_init(struct json_file *jf,
     jf->file_num = 0;
     jf->max_records = max_records; /* note: if 0, effectively no rotation */
     jf->file = NULL;               /* initialized in json_file_rotate()   */
+    jf->segment = NULL;
+    jf->queue = NULL;
+    jf->num_free = 0;
+    jf->may_drop = may_drop;
+
+    extern enum analysis_cfg analysis_cfg;
+    if (analysis_cfg == analysis_on) {
+	/*
+	 * with the worker pool, each segment can be in use by the
+	 * capture thread, waiting in the queue, or being completed by
+	 * a worker; otherwise, a single segment suffices
+	 */
+	jf->queue = analysis_pool_attach(JSON_FILE_NUM_SEGMENTS);
+	unsigned int num_segments = jf->queue ? JSON_FILE_NUM_SEGMENTS : 1;
+	for (unsigned int i = 0; i < num_segments; i++) {
+	    struct json_segment *seg = json_segment_alloc(jf);
+	    if (seg == NULL) {
+		fprintf(stderr, "error: could not allocate memory for analysis batch\n");
+		return status_err;
+	    }
+	    jf->free_segment[jf->num_free++] = seg;
+	}
+	jf->segment = jf->free_segment[--jf->num_free];
+    }
 
     return json_file_rotate(jf);
 }
 
+/*
+ * json_file_collect_segments(jf) reclaims the segments that the
+ * workers have written out, and returns the number of free segments
+ */
+static unsigned int json_file_collect_segments(struct json_file *jf) {
+    struct analysis_work *w;
+    while ((w = analysis_queue_get_completed(jf->queue)) != NULL) {
+	jf->free_segment[jf->num_free++] = (struct json_segment *)w;
+    }
+    return jf->num_free;
+}
+
+#define FLUSH_WAIT_USEC 100
+
+/*
+ * json_file_hand_off(jf, wait) hands the current segment to the
+ * worker pool, and continues with a free one; if there is none, then
+ * the workers have fallen behind, and it either waits for one (if
+ * wait is true) or returns without handing off the segment
+ */
+static void json_file_hand_off(struct json_file *jf, bool wait) {
+    struct json_segment *seg = jf->segment;
+
+    while (json_file_collect_segments(jf) == 0) {
+	if (!wait) {
+	    analysis_pool_count_deferred_flush();
+	    return;
+	}
+	usleep(FLUSH_WAIT_USEC);
+    }
+    fflush(seg->pending);
+    analysis_queue_push(jf->queue, &seg->work);  /* cannot fail; there are only JSON_FILE_NUM_SEGMENTS */
+    jf->segment = jf->free_segment[--jf->num_free];
+}
+
+void json_file_flush(struct json_file *jf, bool wait) {
+    struct json_segment *seg = jf->segment;
+    if (seg == NULL) {
+	return;
+    }
+    if (jf->queue == NULL) {
+	if (seg->num_pending) {
+	    fflush(seg->pending);
+	    analysis_batch_process(seg->work.batch);
+	    json_segment_write(seg);
+	}
+	return;
+    }
+
+    if (seg->num_pending) {
+	json_file_hand_off(jf, wait);
+    }
+    if (wait) {
+	/* wait until the workers have written out every segment */
+	while (json_file_collect_segments(jf) < JSON_FILE_NUM_SEGMENTS - 1) {
+	    usleep(FLUSH_WAIT_USEC);
+	}
+    }
+}
+
 void fprintf_timestamp(FILE *f, unsigned int sec, unsigned int usec) {
 
     fprintf(f, ",\"time_start\":%u.%06u", sec, usec); // not sure why usec has fewer than 6 digits, but appears to work
@@ -101,11 +282,33 @@ void json_file_write(struct json_file *jf,
     uint8_t extractor_buffer[FP_BUF_LEN]= { 0 };
     size_t bytes_extracted;
     FILE *file = jf->file;
+    struct json_segment *seg = jf->segment;
+    bool drop = false;
+
+    if (seg) {
+	if (json_segment_is_full(seg)) {
+	    if (jf->queue) {
+		json_file_hand_off(jf, !jf->may_drop);
+	    } else {
+		json_file_flush(jf, false);
+	    }
+	    seg = jf->segment;
+	    drop = json_segment_is_full(seg);  /* analysis has fallen behind */
+	}
+	file = seg->pending;
+    }
     
     extractor_init(&x, extractor_buffer, FP_BUF_LEN);
     parser_init(&p, packet, length);
     bytes_extracted = parser_extractor_process_packet(&p, &x);
+    struct thread_stats *stats = thread_stats_get();
+    thread_stats_count_extraction(stats, bytes_extracted, x.fingerprint_type);
     if (bytes_extracted > 16) {
+	long record_start = seg ? 0 : ftell(file);
+	if (drop) {
+	    analysis_pool_count_dropped_record();
+	    return;
+	}
 	switch(x.fingerprint_type) {
 	case fingerprint_type_tls:
 	    fprintf(file, "{\"fingerprints\":{");
@@ -119,6 +322,9 @@ void json_file_write(struct json_file *jf,
 					"sni",
 					x.packet_data.value  + SNI_HDR_LEN,
 					x.packet_data.length - SNI_HDR_LEN);
+		    fprintf_domain_from_server_name(file,
+						    x.packet_data.value  + SNI_HDR_LEN,
+						    x.packet_data.length - SNI_HDR_LEN);
 		    fprintf(file, "}");
 		}
 	    }
@@ -177,15 +383,53 @@ void json_file_write(struct json_file *jf,
 
 	struct flow_key key = flow_key_init();
 	flow_key_set_from_packet(&key, packet, length);
-	fprintf_analysis_from_extractor_and_flow_key(file, &x, &key);
+	struct json_pending_record *pending = NULL;
+	if (seg) {
+	    /*
+	     * defer the analysis until the batch is flushed, unless the
+	     * batch has no room for it
+	     */
+	    pending = &seg->record[seg->num_pending];
+	    pending->request = analysis_batch_add_from_extractor(seg->work.batch, &x, &key);
+	    if (pending->request < 0) {
+		fprintf_analysis_from_extractor_and_flow_key(file, &x, &key);
+	    }
+	    pending->analysis = ftell(file);
+	} else {
+	    fprintf_analysis_from_extractor_and_flow_key(file, &x, &key);
+	}
+	fprintf_asn_from_flow_key(file, &key);
 
 	packet_fprintf_flow_key(file, packet, length);
 	fprintf_timestamp(file, sec, usec);
 	fprintf(file, "}\n");
 
-	if (json_file_needs_rotation(jf)) {
-	    json_file_rotate(jf);
+	if (pending) {
+	    pending->end = ftell(file);
+	    seg->num_pending++;
+	} else {
+	    thread_stats_add(stats, thread_stat_records_written, 1);
+	    thread_stats_add(stats, thread_stat_bytes_written, ftell(file) - record_start);
+	    if (json_file_needs_rotation(jf)) {
+		json_file_rotate(jf);
+	    }
 	}
     }
 
 }
+
+void json_file_close(struct json_file *jf) {
+    if (jf->file) {
+	if (fclose(jf->file) != 0) {
+	    perror("could not close json file");
+	}
+	jf->file = NULL;
+    }
+    if (jf->segment) {
+	json_segment_free(jf->segment);
+	jf->segment = NULL;
+    }
+    while (jf->num_free) {
+	json_segment_free(jf->free_segment[--jf->num_free]);
+    }
+}
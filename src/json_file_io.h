@@ -13,6 +13,21 @@
 #include <stdint.h>
 #include "mercury.h"
 
+/*
+ * when analysis is on, records are not written to the output file
+ * immediately; instead, their text is accumulated in a buffer (a
+ * segment), and their analysis requests in a batch, until
+ * json_file_flush() is called (after each block of packets).  The
+ * whole batch is then analyzed, and the completed records are written
+ * out, either by the calling thread or, if the analysis worker pool
+ * is running, by a worker (see analysis_pool.h), in which case the
+ * capture thread continues with another segment.  Records are written
+ * in the order in which they were observed in either case.
+ */
+struct json_segment;
+
+#define JSON_FILE_NUM_SEGMENTS  4
+
 struct json_file {
     FILE *file;
     int64_t record_countdown;
@@ -20,6 +35,11 @@ struct json_file {
     uint32_t file_num;
     char outfile_name[MAX_FILENAME];
     const char *mode;
+    struct json_segment *segment;       /* NULL unless analysis is batched    */
+    struct analysis_queue *queue;       /* NULL unless analyzed by the pool   */
+    struct json_segment *free_segment[JSON_FILE_NUM_SEGMENTS];
+    unsigned int num_free;
+    bool may_drop;                      /* drop records if the pool is behind */
 };
 
 void json_file_write(struct json_file *jf,
@@ -28,9 +48,31 @@ void json_file_write(struct json_file *jf,
 		     unsigned int sec,
 		     unsigned int usec);
 
+/*
+ * json_file_flush(jf, wait) analyzes and writes out all pending
+ * records, or hands them to the analysis worker pool; if the pool's
+ * queue is full, the records remain pending, unless wait is true, in
+ * which case the call waits until the pool has written them all out
+ */
+void json_file_flush(struct json_file *jf, bool wait);
+
+/*
+ * json_file_init(jf, outfile_name, mode, max_records, may_drop)
+ * opens the output file; if may_drop is true, then records are
+ * dropped when the analysis worker pool falls behind, and otherwise,
+ * json_file_write() waits for the pool
+ */
 enum status json_file_init(struct json_file *js,
 			   const char *outfile_name,
 			   const char *mode,
-			   uint64_t max_records);
+			   uint64_t max_records,
+			   bool may_drop);
+
+/*
+ * json_file_close(jf) closes the output file and frees the segments
+ * of jf, whose records must all have been written out by a call of
+ * json_file_flush() with wait set to true
+ */
+void json_file_close(struct json_file *jf);
 
 #endif /* JSON_FILE_IO_H */
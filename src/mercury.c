@@ -22,9 +22,12 @@
 #include <dirent.h>
 #include "mercury.h"
 #include "pcap_file_io.h"
+#include "pcap_file_parallel.h"
+#include "pcap_file_merge.h"
 #include "af_packet_io.h"
 #include "af_packet_v3.h"
 #include "analysis.h"
+#include "analysis_pool.h"
 
 enum input_mode {
     input_mode_unknown        = 0,
@@ -57,6 +60,16 @@ static void sig_close (int signal_arg) {
     exit(0);
 }
 
+/*
+ * sig_reload() causes the analysis database to be reloaded in the
+ * background, after an update of the resource files
+ */
+static void sig_reload(int signal_arg) {
+    (void)signal_arg;
+
+    analysis_request_reload();
+}
+
 
 #define FLAGS_CLOBBER (O_TRUNC)
 
@@ -144,7 +157,8 @@ enum status frame_handler_init_from_config(struct frame_handler *handler,
 	    printf("initializing thread function %x with filename %s\n", pid, outfile);
 	}
 	
-	status = frame_handler_write_fingerprints_init(handler, outfile, cfg->mode, max_records);
+	bool may_drop = (cfg->capture_interface != NULL);  /* live capture must not wait */
+	status = frame_handler_write_fingerprints_init(handler, outfile, cfg->mode, max_records, may_drop);
 	if (status) {
 	    perror("error: could not open fingerprint output file");
 	    return status;
@@ -239,6 +253,7 @@ void *pcap_file_processing_thread_func(void *userdata) {
     enum status status;
     
     status = pcap_file_dispatch_frame_handler(&tc->rf, tc->handler.func, &tc->handler.context, tc->loop_count);
+    frame_handler_flush(&tc->handler, true);
     if (status) {
 	printf("error in pcap file dispatch (code: %d)\n", (int)status);
 	return NULL;
@@ -252,6 +267,146 @@ void *pcap_file_processing_thread_func(void *userdata) {
     return NULL;
 }
 
+/*
+ * frame_handler_init_from_output_id(handler, output_id, arg) sets up
+ * handler for the output named output_id, with the configuration arg;
+ * it is used by the pool of threads that reads a directory of files
+ */
+enum status frame_handler_init_from_output_id(struct frame_handler *handler,
+					      const char *output_id,
+					      void *arg) {
+    struct mercury_config *cfg = (struct mercury_config *)arg;
+
+    return frame_handler_init_from_config(handler, cfg, 0, (char *)output_id);
+}
+
+static int filename_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * read_directory_filenames(dirname, names) sets names to a sorted
+ * array of the names of the regular files in the directory dirname,
+ * each of which is allocated with strdup(), and returns the number of
+ * names, or -1 if the directory could not be read
+ */
+static int read_directory_filenames(const char *dirname, char ***names) {
+    struct stat statbuf;
+    struct dirent *dirent;
+    DIR *dir = opendir(dirname);
+    if (dir == NULL) {
+	printf("%s: could not open directory %s\n", strerror(errno), dirname);
+	return -1;
+    }
+
+    int num_files = 0;
+    int max_files = 0;
+    char **list = NULL;
+    while ((dirent = readdir(dir)) != NULL) {
+	char input_filename[MAX_FILENAME];
+	if (filename_append(input_filename, dirname, "/", dirent->d_name) != status_ok) {
+	    printf("error: file name %s/%s is too long\n", dirname, dirent->d_name);
+	    goto fail;
+	}
+	if (stat(input_filename, &statbuf) != 0) {
+	    perror("stat");
+	    continue;
+	}
+	if (!S_ISREG(statbuf.st_mode)) {
+	    continue;
+	}
+	if (num_files == max_files) {
+	    int new_max_files = max_files ? 2 * max_files : 64;
+	    char **new_list = (char **)realloc(list, new_max_files * sizeof(char *));
+	    if (new_list == NULL) {
+		perror("could not allocate memory for file names");
+		goto fail;
+	    }
+	    list = new_list;
+	    max_files = new_max_files;
+	}
+	list[num_files] = strdup(dirent->d_name);
+	if (list[num_files] == NULL) {
+	    perror("could not allocate memory for file names");
+	    goto fail;
+	}
+	num_files++;
+    }
+    closedir(dir);
+    qsort(list, num_files, sizeof(char *), filename_cmp);
+
+    *names = list;
+    return num_files;
+
+ fail:
+    closedir(dir);
+    for (int i = 0; i < num_files; i++) {
+	free(list[i]);
+    }
+    free(list);
+    return -1;
+}
+
+/*
+ * open_and_dispatch_parallel(cfg) processes the single capture file
+ * cfg->read_filename with cfg->num_threads threads, each of which
+ * writes its own file in the output file set
+ */
+enum status open_and_dispatch_parallel(struct mercury_config *cfg,
+				       u_int64_t *bytes_written,
+				       u_int64_t *packets_written) {
+    struct pcap_file rf;
+    enum status status = pcap_file_open(&rf, cfg->read_filename, io_direction_reader, cfg->flags);
+    if (status) {
+	printf("%s: could not open pcap input file %s\n", strerror(errno), cfg->read_filename);
+	return status;
+    }
+
+    char *outdir = cfg->fingerprint_filename ? cfg->fingerprint_filename : cfg->write_filename;
+    create_subdirectory(outdir, create_subdir_mode_do_not_overwrite);
+
+    struct frame_handler *handler = (struct frame_handler *)malloc(cfg->num_threads * sizeof(struct frame_handler));
+    if (!handler) {
+	perror("could not allocate memory for frame handlers\n");
+	pcap_file_close(&rf);
+	return status_err;
+    }
+    int num_handlers = 0;
+    for (int tnum = 0; tnum < cfg->num_threads; tnum++) {
+	char hexname[MAX_HEX];
+	snprintf(hexname, MAX_HEX, "%x", tnum);
+	status = frame_handler_init_from_config(&handler[tnum], cfg, tnum, hexname);
+	if (status) {
+	    break;
+	}
+	num_handlers++;
+    }
+
+    if (status == status_ok) {
+	status = pcap_file_dispatch_parallel(&rf, handler, cfg->num_threads);
+	if (status) {
+	    printf("error in pcap file dispatch (code: %d)\n", (int)status);
+	}
+    }
+    for (int tnum = 0; tnum < num_handlers; tnum++) {
+	frame_handler_flush(&handler[tnum], true);
+	frame_handler_close(&handler[tnum]);
+    }
+    free(handler);
+
+    *bytes_written = rf.bytes_written;
+    *packets_written = rf.packets_written;
+    enum status close_status = pcap_file_close(&rf);
+    if (close_status) {
+	printf("error closing pcap file (code: %d)\n", (int)close_status);
+	if (status == status_ok) {
+	    status = close_status;
+	}
+    }
+
+    return status;
+}
+
 #define BILLION 1000000000L
 
 static inline void get_clocktime_before (struct timespec *before) {
@@ -286,88 +441,72 @@ enum status open_and_dispatch(struct mercury_config *cfg) {
     get_clocktime_before(&before); // get timestamp before we start processing
 
     if (cfg->read_filename && stat(cfg->read_filename, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
-	DIR *dir = opendir(cfg->read_filename);
-	struct dirent *dirent;
-
 	/*
-	 * read_filename is a directory containing capture files created by separate threads
+	 * read_filename is a directory containing capture files created by
+	 * separate threads
 	 */
-
-	/*
-	 * count number of files in fileset
-	 */
-	int num_files = 0;
-	while ((dirent = readdir(dir)) != NULL) {
-		
-	    char input_filename[MAX_FILENAME];
-	    filename_append(input_filename, cfg->read_filename, "/", dirent->d_name);
-	    if (stat(input_filename, &statbuf) == 0) {
-		if (S_ISREG(statbuf.st_mode)) {
-		    
-		    num_files++;
-		}
-	    } 
-	}
-	    
-	/*
-	 * set up thread contexts
-	 */
-	struct pcap_reader_thread_context *tc = (struct pcap_reader_thread_context *)malloc(num_files * sizeof(struct pcap_reader_thread_context));
-	if (!tc) {
-	    perror("could not allocate memory for thread storage array\n");
+	char **names = NULL;
+	int num_files = read_directory_filenames(cfg->read_filename, &names);
+	if (num_files < 0) {
+	    return status_err;
 	}
 
-	char *outdir = cfg->fingerprint_filename ? cfg->fingerprint_filename : cfg->write_filename;
-	if (outdir) {
+	if (cfg->merge) {
+
 	    /*
-	     * create subdirectory into which each thread will write its output
+	     * merge the files into one stream of packets, in timestamp order
 	     */
-	    create_subdirectory(outdir, create_subdir_mode_do_not_overwrite);
-	}
-
-	/*
-	 * loop over all files in directory
-	 */
-	rewinddir(dir);
-	int tnum = 0;
-	while ((dirent = readdir(dir)) != NULL) {
-		
-	    char input_filename[MAX_FILENAME];
-	    filename_append(input_filename, cfg->read_filename, "/", dirent->d_name);
-	    if (stat(input_filename, &statbuf) == 0) {
-		if (S_ISREG(statbuf.st_mode)) {
-		    
-		    status = pcap_reader_thread_context_init_from_config(&tc[tnum], cfg, tnum, dirent->d_name);
-		    if (status) {
-			perror("could not initialize pcap reader thread context");
-			return status;
-		    }
-
-		    int err = pthread_create(&(tc[tnum].tid), NULL, pcap_file_processing_thread_func, &tc[tnum]);
-		    tnum++;
-		    if (err) {
-			printf("%s: error creating file reader thread\n", strerror(err));
-			exit(255);
-		    }
-
+	    struct frame_handler handler;
+	    status = frame_handler_init_from_config(&handler, cfg, 0, NULL);
+	    if (status == status_ok) {
+		status = pcap_file_merge_dispatch(cfg->read_filename, names, num_files, handler.func, &handler.context,
+						  &packets_written, &bytes_written);
+		frame_handler_flush(&handler, true);
+		frame_handler_close(&handler);
+		if (status) {
+		    printf("error in pcap file merge (code: %d)\n", (int)status);
 		}
+	    }
 
-	    } else {
-		perror("stat");
+	} else {
+
+	    char *outdir = cfg->fingerprint_filename ? cfg->fingerprint_filename : cfg->write_filename;
+	    if (outdir) {
+		/*
+		 * create subdirectory into which each thread will write its output
+		 */
+		create_subdirectory(outdir, create_subdir_mode_do_not_overwrite);
 	    }
 
+	    /*
+	     * process the files with a pool of threads
+	     */
+	    unsigned int num_workers = cfg->num_threads;
+	    if (num_workers > (unsigned int)num_files) {
+		num_workers = num_files ? num_files : 1;
+	    }
+	    status = pcap_file_set_dispatch(cfg->read_filename, names, num_files, num_workers, cfg->loop_count,
+					    frame_handler_init_from_output_id, cfg, &packets_written, &bytes_written);
 	}
 
-	if (tnum != num_files) {
-	    printf("warning: num_files (%d) != tnum (%d)\n", num_files, tnum);
+	for (int i = 0; i < num_files; i++) {
+	    free(names[i]);
 	}
+	free(names);
+	if (status) {
+	    return status;
+	}
+
+    } else if (cfg->num_threads > 1 && cfg->loop_count == 1) {
 
-	for (int i = 0; i < tnum; i++) {
-	    pthread_join(tc[i].tid, NULL);
-		bytes_written += tc[i].rf.bytes_written;
-		packets_written += tc[i].rf.packets_written;
+	/*
+	 * we have a single capture file, to be processed by several threads
+	 */
+	status = open_and_dispatch_parallel(cfg, &bytes_written, &packets_written);
+	if (status) {
+	    return status;
 	}
-		
+
     } else {
 
 	/*
@@ -411,10 +550,21 @@ char mercury_help[] =
     "   [-b or --buffer] b                    # set RX_RING size to (b * PHYS_MEM)\n"
     "   [-t or --threads] [num_threads | cpu] # set number of threads\n"
     "   [-u or --user] u                      # set UID and GID to those of user u\n"
+    "   [--wait-strategy] s                   # wait for packets with strategy s\n"
+    "   [--wait-budget] usec                  # spin or busy poll for usec per wait\n"
+    "   [--block-timeout] msec                # return partly full blocks after msec\n"
+    "   [--affinity] a                        # pin capture threads to CPUs a\n"
+    "   [--fanout] m                          # divide packets between threads by m\n"
+    "   [--pipeline]                          # process packets apart from capture\n"
+    "   [--autotune] secs                     # resize rings for the load after secs\n"
+    "   [--backend] b                         # capture with tpacket or af_xdp\n"
     "--read OPTIONS\n"
     "   [-m or --multiple] count              # loop over read_file count >= 1 times\n"
+    "   [--merge]                             # read a file set as one, in time order\n"
     "GENERAL OPTIONS\n"
     "   [-a or --analysis]                    # analyze fingerprints\n"
+    "   [--analysis-cache] m                  # use m MB for analysis result cache\n"
+    "   [--analysis-threads] n                # analyze in n threads, apart from capture\n"
     "   [-s or --select]                      # select only packets with metadata\n"
     "   [-l or --limit] l                     # rotate JSON files after l records\n"
     "   [-v or --verbose]                     # additional information sent to stdout\n"
@@ -434,21 +584,101 @@ char mercury_extended_help[] =
     "   configured, the output is a *file set*: a directory into which each thread\n"
     "   writes its own file; all packets in a flow are written to the same file.\n"
     "\n"
+    "   \"[--wait-strategy] s\" sets how each capture thread waits for the kernel to\n"
+    "   fill its next block of packets: \"poll\" (the default) sleeps in poll();\n"
+    "   \"spin\" checks the ring continuously, using a whole CPU per thread;\n"
+    "   \"spin-poll\" spins for up to usec microseconds after each block, and then\n"
+    "   sleeps in poll(); and \"busy-poll\" sleeps in poll() after the kernel has\n"
+    "   busy polled the device for up to usec microseconds (SO_BUSY_POLL), where\n"
+    "   usec is set by \"[--wait-budget] usec\" (default 50).  The kernel hands over a\n"
+    "   block when it is full, or after \"[--block-timeout] msec\" (default 100);\n"
+    "   lower values reduce latency at low packet rates.  The share of time that\n"
+    "   the threads spend waiting and processing is reported each second, along\n"
+    "   with the number of fingerprints of each type extracted, the records and\n"
+    "   bytes written, and the analysis cache hits and misses.\n"
+    "\n"
+    "   \"[--affinity] a\" pins each capture thread to a CPU, assigning the CPUs in\n"
+    "   the list a (such as \"0-3,8\") to the threads in turn; if a is \"isolated\",\n"
+    "   the CPUs isolated from the scheduler (with isolcpus=) are used, and if a is\n"
+    "   \"nic\", the CPUs on the NUMA node of the capture interface are used.  The\n"
+    "   ring and output buffers of each thread are allocated on the NUMA node of\n"
+    "   its CPU.\n"
+    "\n"
+    "   \"[--fanout] m\" sets how packets are divided between the capture threads:\n"
+    "   \"hash\" (the default) by a flow hash computed by the kernel; \"symmetric\" by\n"
+    "   a hash of the addresses and ports that is the same for both directions of a\n"
+    "   flow, so that both halves of each handshake are seen by the same thread;\n"
+    "   \"lb\" round robin; \"cpu\" by the CPU that received the packet; \"qm\" by the\n"
+    "   NIC receive queue, which maps threads one to one onto RSS queues when the\n"
+    "   number of threads equals the number of queues; \"rnd\" at random; and\n"
+    "   \"rollover\" to one thread until its ring is full.  With lb, rnd, and\n"
+    "   rollover, the packets of a flow may be written to different files.\n"
+    "\n"
+    "   With \"[--pipeline]\", each capture thread copies packets out of its ring and\n"
+    "   hands them to a writer thread of its own, which extracts, analyzes, and\n"
+    "   writes them, so that ring blocks are returned to the kernel without waiting\n"
+    "   for output.  The copies take as much memory again as the rings.  The queue\n"
+    "   depth and the average time that packets spend in it are reported each\n"
+    "   second, along with the number of times that capture waited for a writer.\n"
+    "\n"
+    "   With \"[--autotune] secs\", the packet rate, drops, and queue freezes of each\n"
+    "   thread are measured for secs seconds, and then each ring is rebuilt with a\n"
+    "   block size, block count, and block timeout suited to its load.  The memory\n"
+    "   set by [-b or --buffer] is divided between the threads in proportion to\n"
+    "   the traffic that the fanout gave each one, and the total does not grow.\n"
+    "\n"
+    "   \"[--backend] b\" sets how packets are captured: \"tpacket\" (the default) with\n"
+    "   AF_PACKET rings, or \"af_xdp\" with AF_XDP sockets, one per thread, each\n"
+    "   bound to the NIC receive queue with the same number as the thread, so\n"
+    "   there must be no more threads than queues.  An XDP program redirects the\n"
+    "   packets to the sockets, in native mode if the driver supports it and in\n"
+    "   generic mode otherwise.  PACKETS CAPTURED WITH AF_XDP ARE NOT DELIVERED TO\n"
+    "   THE HOST, so use it only on an interface dedicated to capture.  AF_XDP has\n"
+    "   no kernel timestamps or filters, and [--fanout] and [--autotune] do not\n"
+    "   apply to it.\n"
+    "\n"
     "   \"[-f or --fingerprint] f\" writes a JSON record for each fingerprint observed,\n"
     "   which incorporates the flow key and the time of observation, into the file or\n"
     "   file set f.  With [-a or --analysis], fingerprints and destinations are\n"
-    "   analyzed and the results are included in the JSON output.\n"
+    "   analyzed and the results are included in the JSON output, along with the\n"
+    "   autonomous system number of each destination address and the registered\n"
+    "   domain of each TLS server name.  The results for recently seen fingerprints\n"
+    "   and destinations are kept in a cache whose size is set to m megabytes with\n"
+    "   \"[--analysis-cache] m\" (default 32, and 0 disables the cache).  By default,\n"
+    "   analysis is performed by the threads that capture or read packets; with\n"
+    "   \"[--analysis-threads] n\", it is performed by n separate threads instead, so\n"
+    "   that capture never waits for analysis.  If those threads fall behind,\n"
+    "   records are dropped, and the number dropped is reported.  Sending SIGHUP\n"
+    "   to mercury reloads the fingerprint database from the resources directory in\n"
+    "   the background, without interrupting capture.\n"
     "\n"
     "   \"[-w or --write] w\" writes packets to the file or file set w, in PCAP format.\n"
     "   With [-s or --select], packets are filtered so that only ones with\n"
-    "   fingerprint metadata are written.\n"
+    "   fingerprint metadata are written.  In capture mode, a socket filter passes\n"
+    "   only TCP SYNs and segments that start with a TLS or HTTP signature to the\n"
+    "   ring, so that the other packets cost no ring space or processing.\n"
     "\n"
     "   \"[r or --read] r\" reads packets from the file or file set r, in PCAP format.\n"
-    "   A single worker thread is used to process each input file; if r is a file set\n"
-    "   then the output will be a file set as well.  With \"[-m or --multiple] m\", the\n"
+    "   If r is a file set, its files are processed by a pool of [-t or --threads]\n"
+    "   threads (by default, one per CPU) that take work from each other as they\n"
+    "   become idle, and the output is a file set with one output file for each\n"
+    "   input file; files larger than 512 MB are split into 256 MB chunks, and the\n"
+    "   output of chunk k of the file name goes to name-k.  If r is a single file, it is\n"
+    "   processed by the threads set with [-t or --threads], and the output is a\n"
+    "   file set in which all of the packets of a flow are in the same file, in\n"
+    "   their original order.  Input files are memory mapped\n"
+    "   and their packets are processed in place, whatever their length; pipes are\n"
+    "   read through a buffer.  With \"[-m or --multiple] m\", the\n"
     "   input file or file set is read and processed m times in sequence; this is\n"
     "   useful for testing.\n"
     "\n"
+    "   With \"[--merge]\", the files of the file set r are read all at once, and\n"
+    "   their packets are processed in timestamp order by a single thread, as if\n"
+    "   they were one file; the output is a single file, or stdout.  Each file is\n"
+    "   read in sequence with read-ahead, and memory use does not grow with the\n"
+    "   size of the files.  Packets with equal timestamps are taken from the files\n"
+    "   in the order of their names.\n"
+    "\n"
     "   \"[-u or --user] u\" sets the UID and GID to those of user u; output file(s)\n"
     "   are owned by this user.  With \"[-l or --limit] l\", each JSON output file has\n"
     "   at most l records; output files are rotated, and filenames include a sequence\n"
@@ -466,9 +696,28 @@ char mercury_extended_help[] =
     "   mercury -c eth0 -w foo.mcap -t cpu -s # as above, selecting packet metadata\n"
     "   mercury -r foo.mcap -f foo.json       # read foo.mcap, write fingerprints\n"
     "   mercury -r foo.mcap -f foo.json -a    # as above, with fingerprint analysis\n"
+    "   mercury -r foo -w foo.pcap --merge    # merge file set foo into foo.pcap\n"
     "   mercury -c eth0 -t cpu -f foo.json -a # capture and analyze fingerprints\n";
 
 
+/*
+ * options that have no single-character form use values outside of
+ * the range of characters
+ */
+enum long_only_option {
+    long_opt_analysis_cache = 256,
+    long_opt_analysis_threads,
+    long_opt_wait_strategy,
+    long_opt_wait_budget,
+    long_opt_block_timeout,
+    long_opt_affinity,
+    long_opt_fanout,
+    long_opt_pipeline,
+    long_opt_autotune,
+    long_opt_backend,
+    long_opt_merge
+};
+
 enum extended_help {
     extended_help_off = 0,
     extended_help_on  = 1
@@ -497,6 +746,17 @@ int main(int argc, char *argv[]) {
 	    { "capture",     required_argument, NULL, 'c' },
 	    { "fingerprint", required_argument, NULL, 'f' },
 	    { "analysis",    no_argument,       NULL, 'a' },
+	    { "analysis-cache", required_argument, NULL, long_opt_analysis_cache },
+	    { "analysis-threads", required_argument, NULL, long_opt_analysis_threads },
+	    { "wait-strategy", required_argument, NULL, long_opt_wait_strategy },
+	    { "wait-budget", required_argument, NULL, long_opt_wait_budget },
+	    { "block-timeout", required_argument, NULL, long_opt_block_timeout },
+	    { "affinity",    required_argument, NULL, long_opt_affinity },
+	    { "fanout",      required_argument, NULL, long_opt_fanout },
+	    { "pipeline",    no_argument,       NULL, long_opt_pipeline },
+	    { "autotune",    required_argument, NULL, long_opt_autotune },
+	    { "backend",     required_argument, NULL, long_opt_backend },
+	    { "merge",       no_argument,       NULL, long_opt_merge },
 	    { "threads",     required_argument, NULL, 't' },
 	    { "buffer",      required_argument, NULL, 'b' },
 	    { "limit",       required_argument, NULL, 'l' },
@@ -544,12 +804,148 @@ int main(int argc, char *argv[]) {
 	    if (optarg) {
 		usage(argv[0], "error: option a or analysis does not use an argument", extended_help_off);
 	    } else {
-		if (analysis_init() == -1) {
-		    return EXIT_FAILURE;  /* analysis engine could not be initialized */
-		};
 		cfg.analysis = analysis_on;
 	    }
 	    break;
+	case long_opt_analysis_cache:
+	    if (optarg) {
+		errno = 0;
+		long int megabytes = strtol(optarg, NULL, 10);
+		if (errno || megabytes < 0) {
+		    printf("%s: could not convert argument \"%s\" to a nonnegative number\n", strerror(errno), optarg);
+		    usage(argv[0], NULL, extended_help_off);
+		}
+		cfg.analysis_cache_size = (size_t)megabytes * 1024 * 1024;
+	    } else {
+		usage(argv[0], "error: option analysis-cache requires a numeric argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_analysis_threads:
+	    if (optarg) {
+		errno = 0;
+		long int threads = strtol(optarg, NULL, 10);
+		if (errno || threads < 0 || threads > 1024) {
+		    printf("%s: could not convert argument \"%s\" to a number of threads\n", strerror(errno), optarg);
+		    usage(argv[0], NULL, extended_help_off);
+		}
+		cfg.analysis_threads = threads;
+	    } else {
+		usage(argv[0], "error: option analysis-threads requires a numeric argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_wait_strategy:
+	    if (optarg) {
+		if (strcmp(optarg, "poll") == 0) {
+		    cfg.wait_strategy = wait_strategy_poll;
+		} else if (strcmp(optarg, "spin") == 0) {
+		    cfg.wait_strategy = wait_strategy_spin;
+		} else if (strcmp(optarg, "spin-poll") == 0) {
+		    cfg.wait_strategy = wait_strategy_spin_poll;
+		} else if (strcmp(optarg, "busy-poll") == 0) {
+		    cfg.wait_strategy = wait_strategy_busy_poll;
+		} else {
+		    usage(argv[0], "wait-strategy must be one of poll, spin, spin-poll, or busy-poll", extended_help_off);
+		}
+	    } else {
+		usage(argv[0], "error: option wait-strategy requires an argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_wait_budget:
+	    if (optarg) {
+		errno = 0;
+		long int usec = strtol(optarg, NULL, 10);
+		if (errno || usec < 0 || usec > 1000000) {
+		    printf("%s: could not convert argument \"%s\" to a number of microseconds\n", strerror(errno), optarg);
+		    usage(argv[0], NULL, extended_help_off);
+		}
+		cfg.wait_budget = usec;
+	    } else {
+		usage(argv[0], "error: option wait-budget requires a numeric argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_block_timeout:
+	    if (optarg) {
+		errno = 0;
+		long int msec = strtol(optarg, NULL, 10);
+		if (errno || msec < 1 || msec > 60000) {
+		    printf("%s: could not convert argument \"%s\" to a number of milliseconds\n", strerror(errno), optarg);
+		    usage(argv[0], NULL, extended_help_off);
+		}
+		cfg.block_timeout = msec;
+	    } else {
+		usage(argv[0], "error: option block-timeout requires a numeric argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_affinity:
+	    if (optarg) {
+		cfg.affinity = optarg;
+	    } else {
+		usage(argv[0], "error: option affinity requires an argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_fanout:
+	    if (optarg) {
+		if (strcmp(optarg, "hash") == 0) {
+		    cfg.fanout_mode = fanout_mode_hash;
+		} else if (strcmp(optarg, "symmetric") == 0) {
+		    cfg.fanout_mode = fanout_mode_symmetric;
+		} else if (strcmp(optarg, "lb") == 0) {
+		    cfg.fanout_mode = fanout_mode_lb;
+		} else if (strcmp(optarg, "cpu") == 0) {
+		    cfg.fanout_mode = fanout_mode_cpu;
+		} else if (strcmp(optarg, "qm") == 0) {
+		    cfg.fanout_mode = fanout_mode_qm;
+		} else if (strcmp(optarg, "rnd") == 0) {
+		    cfg.fanout_mode = fanout_mode_rnd;
+		} else if (strcmp(optarg, "rollover") == 0) {
+		    cfg.fanout_mode = fanout_mode_rollover;
+		} else {
+		    usage(argv[0], "fanout must be one of hash, symmetric, lb, cpu, qm, rnd, or rollover", extended_help_off);
+		}
+	    } else {
+		usage(argv[0], "error: option fanout requires an argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_pipeline:
+	    if (optarg) {
+		usage(argv[0], "error: option pipeline does not use an argument", extended_help_off);
+	    } else {
+		cfg.pipeline = 1;
+	    }
+	    break;
+	case long_opt_autotune:
+	    if (optarg) {
+		errno = 0;
+		long int secs = strtol(optarg, NULL, 10);
+		if (errno || secs < 1 || secs > 3600) {
+		    printf("%s: could not convert argument \"%s\" to a number of seconds\n", strerror(errno), optarg);
+		    usage(argv[0], NULL, extended_help_off);
+		}
+		cfg.autotune = secs;
+	    } else {
+		usage(argv[0], "error: option autotune requires a numeric argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_backend:
+	    if (optarg) {
+		if (strcmp(optarg, "tpacket") == 0) {
+		    cfg.capture_backend = capture_backend_tpacket;
+		} else if (strcmp(optarg, "af_xdp") == 0) {
+		    cfg.capture_backend = capture_backend_af_xdp;
+		} else {
+		    usage(argv[0], "backend must be tpacket or af_xdp", extended_help_off);
+		}
+	    } else {
+		usage(argv[0], "error: option backend requires an argument", extended_help_off);
+	    }
+	    break;
+	case long_opt_merge:
+	    if (optarg) {
+		usage(argv[0], "error: option merge does not use an argument", extended_help_off);
+	    } else {
+		cfg.merge = 1;
+	    }
+	    break;
 	case 'o':
 	    if (optarg) {
 		usage(argv[0], "error: option o or overwrite does not use an argument", extended_help_off);
@@ -661,7 +1057,23 @@ int main(int argc, char *argv[]) {
     if (cfg.fingerprint_filename && cfg.write_filename) {
 	usage(argv[0], "both fingerprint [f] and write [w] specified on command line", extended_help_off);
     }
-    if (cfg.num_threads != 1 && cfg.fingerprint_filename == NULL && cfg.write_filename == NULL) {
+
+    /*
+     * a directory of capture files is read by as many threads as there
+     * are cpus, by default, and anything else by one thread
+     */
+    struct stat statbuf;
+    bool read_dir = cfg.read_filename && stat(cfg.read_filename, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+    if (cfg.num_threads == 0) {
+	cfg.num_threads = (read_dir && !cfg.merge) ? -1 : 1;
+    }
+    if (cfg.merge && !read_dir) {
+	usage(argv[0], "merge [--merge] requested, but read [r] is not a directory", extended_help_off);
+    }
+    if (cfg.merge && cfg.loop_count != 1) {
+	usage(argv[0], "both merge [--merge] and multiple [m] specified on command line", extended_help_off);
+    }
+    if (cfg.num_threads != 1 && !read_dir && cfg.fingerprint_filename == NULL && cfg.write_filename == NULL) {
 	usage(argv[0], "multiple threads [t] requested, but neither fingerprint [f] no write [w] specified on command line", extended_help_off);
     }
     
@@ -676,11 +1088,24 @@ int main(int argc, char *argv[]) {
 	printf("Loop count: %d\n", cfg.loop_count);
     }
 	
+    if (cfg.analysis) {
+	if (analysis_init(cfg.analysis_cache_size) == -1) {
+	    return EXIT_FAILURE;  /* analysis engine could not be initialized */
+	}
+	if (cfg.analysis_threads && analysis_pool_start(cfg.analysis_threads) == -1) {
+	    fprintf(stderr, "error: could not start analysis threads\n");
+	    return EXIT_FAILURE;
+	}
+    }
+
     /*
      * set up signal handlers, so that output is flushed upon close
      */
     signal(SIGINT, sig_close);     /* Ctl-C causes graceful shutdown */
     signal(SIGTERM, sig_close);
+    if (cfg.analysis) {
+	signal(SIGHUP, sig_reload);  /* SIGHUP reloads the fingerprint database */
+    }
 
     /* process packets */
     
@@ -702,6 +1127,10 @@ int main(int argc, char *argv[]) {
 	    printf("initializing interface %s\n", cfg.capture_interface);
 	}
 	ring_limits_init(&rl, cfg.buffer_fraction);
+	if (cfg.block_timeout) {
+	    rl.af_blocktimeout = cfg.block_timeout;
+	}
+	rl.af_fanout_type = fanout_mode_get_type(cfg.fanout_mode);
 	
 	af_packet_bind_and_dispatch(&cfg, &rl);
 	
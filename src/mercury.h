@@ -35,6 +35,43 @@ enum status {
     status_err_no_more_data = 2
 };
 
+/*
+ * enum wait_strategy determines how a capture thread waits for the
+ * kernel to hand it the next block of packets, which trades CPU time
+ * for latency
+ */
+enum wait_strategy {
+    wait_strategy_poll      = 0,    /* sleep in poll() until data arrives          */
+    wait_strategy_spin      = 1,    /* check the ring continuously                 */
+    wait_strategy_spin_poll = 2,    /* spin for up to wait_budget usec, then poll() */
+    wait_strategy_busy_poll = 3     /* poll() with SO_BUSY_POLL of wait_budget usec */
+};
+
+#define WAIT_BUDGET_DEFAULT_USEC 50
+
+/*
+ * enum fanout_mode determines how the packets received on the capture
+ * interface are divided between the capture threads
+ */
+enum fanout_mode {
+    fanout_mode_hash      = 0,      /* by flow hash computed by the kernel          */
+    fanout_mode_symmetric = 1,      /* by hash that is the same in both directions  */
+    fanout_mode_lb        = 2,      /* round robin                                  */
+    fanout_mode_cpu       = 3,      /* by the CPU on which the packet arrived       */
+    fanout_mode_qm        = 4,      /* by the NIC receive queue (RSS)               */
+    fanout_mode_rnd       = 5,      /* pseudo-randomly                              */
+    fanout_mode_rollover  = 6       /* to one thread, until its ring is full        */
+};
+
+/*
+ * enum capture_backend selects the kind of socket through which
+ * packets are captured
+ */
+enum capture_backend {
+    capture_backend_tpacket = 0,    /* AF_PACKET with TPACKET_V3 rings              */
+    capture_backend_af_xdp  = 1     /* AF_XDP, with an XDP program on the interface */
+};
+
 /*
  * struct mercury_config holds the configuration information for a run
  * of the program
@@ -46,18 +83,29 @@ struct mercury_config {
     char *capture_interface;        /* base name of interface to capture from, if any */
     int filter;                     /* indicates that packets should be filtered      */
     int analysis;                   /* indicates that fingerprints should be analyzed */
+    size_t analysis_cache_size;     /* bytes of memory used for analysis result cache */
+    int analysis_threads;           /* number of analysis threads, or 0 for inline    */
     int flags;                      /* flags for open()                               */
     char *mode;                     /* mode for fopen()                               */
     int fanout_group;               /* identifies fanout group used by sockets        */
     float buffer_fraction;          /* fraction of phys mem used for RX_RING buffers  */
-    int num_threads;                /* number of worker threads                       */
+    int num_threads;                /* number of worker threads, or 0 for the default */
     uint64_t rotate;                /* number of records per file rotation, or 0      */
     char *user;                     /* username of account used for privilege drop    */
     int loop_count;                 /* loop count for repeat processing of read file  */
     int verbosity;                  /* 0=minimal output; 1=more detailed output       */
+    enum wait_strategy wait_strategy; /* how capture threads wait for packets         */
+    unsigned int wait_budget;       /* usec of spinning or busy polling per wait      */
+    unsigned int block_timeout;     /* msec before a partly full block is returned, or 0 for the default */
+    char *affinity;                 /* CPUs for capture threads (see affinity.h), or NULL */
+    enum fanout_mode fanout_mode;   /* how packets are divided between threads        */
+    int pipeline;                   /* capture threads hand packets to writer threads */
+    unsigned int autotune;          /* secs of warmup before rings are resized, or 0  */
+    enum capture_backend capture_backend; /* the kind of capture socket         */
+    int merge;                      /* read a file set as one file, in time order     */
 };
 
-#define mercury_config_init() { NULL, NULL, NULL, NULL, 0, 0, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0 }
+#define mercury_config_init() { NULL, NULL, NULL, NULL, 0, 0, ANALYSIS_CACHE_DEFAULT_SIZE, 0, O_EXCL, (char *)"w", 0, 8, 0, 0, NULL, 1, 0, wait_strategy_poll, WAIT_BUDGET_DEFAULT_USEC, 0, NULL, fanout_mode_hash, 0, 0, capture_backend_tpacket, 0 }
 
 
 enum create_subdir_mode {
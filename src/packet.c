@@ -10,8 +10,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include "eth.h"
 #include "packet.h"
+#include "hash.h"
 
 
 void eth_skip(uint8_t **packet, size_t *length, uint16_t *ether_type) {
@@ -443,3 +445,130 @@ void flow_key_set_from_packet(struct flow_key *k,
 
 
 }
+
+/*
+ * packet_flow_hash() hashes the two endpoints of the flow in a fixed
+ * order (the lesser address, or port if the addresses are equal,
+ * first), so that both directions of a flow get the same hash, as the
+ * kernel does when it computes the rxhash of a packet in software
+ * (see __flow_hash_consistentify() in net/core/flow_dissector.c).
+ * Like the kernel, it uses the ports only if the protocol has them and
+ * the packet is not a fragment.
+ */
+static bool protocol_has_ports(uint8_t protocol) {
+    switch (protocol) {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_DCCP:
+    case IPPROTO_SCTP:
+    case IPPROTO_UDPLITE:
+	return true;
+    default:
+	return false;
+    }
+}
+
+static uint32_t flow_hash_endpoints(uint8_t protocol,
+				    const uint8_t *src_addr,
+				    const uint8_t *dst_addr,
+				    size_t addr_len,
+				    const uint8_t *ports) {
+    uint16_t src_port = 0, dst_port = 0;
+    if (ports) {
+	memcpy(&src_port, ports, sizeof(src_port));
+	memcpy(&dst_port, ports + sizeof(src_port), sizeof(dst_port));
+    }
+    int cmp = memcmp(src_addr, dst_addr, addr_len);
+    if (cmp > 0 || (cmp == 0 && ntohs(src_port) > ntohs(dst_port))) {
+	const uint8_t *addr = src_addr;
+	src_addr = dst_addr;
+	dst_addr = addr;
+	uint16_t port = src_port;
+	src_port = dst_port;
+	dst_port = port;
+    }
+    uint64_t h = hash64_mix(0, protocol);
+    h = hash64_bytes(h, src_addr, addr_len);
+    h = hash64_bytes(h, dst_addr, addr_len);
+    h = hash64_mix(h, ((uint64_t)src_port << 16) | dst_port);
+    h = hash64_final(h);
+
+    uint32_t hash = (uint32_t)(h ^ (h >> 32));
+    return hash ? hash : 1;
+}
+
+static uint32_t ipv4_flow_hash(const uint8_t *packet, size_t length) {
+    if (length < sizeof(struct ipv4_hdr)) {
+	return 0;
+    }
+    const struct ipv4_hdr *ipv4 = (const struct ipv4_hdr *)packet;
+    size_t header_length = (ipv4->version_ihl & 0x0f) * 4;
+    if (header_length < sizeof(struct ipv4_hdr) || length < header_length) {
+	return 0;
+    }
+    const uint8_t *ports = NULL;
+    bool fragment = (ntohs(ipv4->flags_fragment_offset) & 0x3fff) != 0;  /* MF or offset */
+    if (!fragment && protocol_has_ports(ipv4->protocol) && length >= header_length + sizeof(struct ports)) {
+	ports = packet + header_length;
+    }
+    return flow_hash_endpoints(ipv4->protocol,
+			       (const uint8_t *)&ipv4->source_address,
+			       (const uint8_t *)&ipv4->destination_address,
+			       sizeof(ipv4->source_address),
+			       ports);
+}
+
+static uint32_t ipv6_flow_hash(const uint8_t *packet, size_t length) {
+    if (length < sizeof(struct ipv6_hdr)) {
+	return 0;
+    }
+    const struct ipv6_hdr *ipv6 = (const struct ipv6_hdr *)packet;
+    const uint8_t *data = packet + sizeof(struct ipv6_hdr);
+    const uint8_t *end = packet + length;
+    uint8_t next_header = ipv6->next_header;
+    bool fragment = false;
+
+    /* skip extension headers, whose lengths are in units of 8 bytes (4 for AH) */
+    while (next_header == IPPROTO_HOPOPTS || next_header == IPPROTO_ROUTING ||
+	   next_header == IPPROTO_DSTOPTS || next_header == IPPROTO_FRAGMENT ||
+	   next_header == IPPROTO_AH) {
+	if (end - data < (ptrdiff_t)sizeof(struct ipv6_header_extension)) {
+	    break;
+	}
+	const struct ipv6_header_extension *ext = (const struct ipv6_header_extension *)data;
+	size_t ext_length;
+	if (next_header == IPPROTO_FRAGMENT) {
+	    fragment = true;
+	    ext_length = 8;
+	} else if (next_header == IPPROTO_AH) {
+	    ext_length = (ext->length + 2) * 4;
+	} else {
+	    ext_length = (ext->length + 1) * 8;
+	}
+	next_header = ext->next_header;
+	data += ext_length;
+    }
+    const uint8_t *ports = NULL;
+    if (!fragment && protocol_has_ports(next_header) && end - data >= (ptrdiff_t)sizeof(struct ports)) {
+	ports = data;
+    }
+    return flow_hash_endpoints(next_header, ipv6->source_address, ipv6->destination_address, IPV6_ADDR_LEN, ports);
+}
+
+uint32_t packet_flow_hash(uint8_t *packet, size_t length) {
+    uint16_t ether_type;
+
+    if (length < sizeof(struct eth_hdr)) {
+	return 0;
+    }
+    eth_skip(&packet, &length, &ether_type);
+
+    switch(ether_type) {
+    case ETH_TYPE_IP:
+	return ipv4_flow_hash(packet, length);
+    case ETH_TYPE_IPV6:
+	return ipv6_flow_hash(packet, length);
+    default:
+	return 0;
+    }
+}
@@ -55,4 +55,15 @@ void packet_fprintf(FILE *f, uint8_t *packet, size_t length, unsigned int sec, u
 
 void packet_fprintf_flow_key(FILE *f, uint8_t *packet, size_t length);
 
+/*
+ * packet_flow_hash(packet, length) returns a 32-bit hash of the
+ * protocol, addresses, and ports of the IPv4 or IPv6 packet in the
+ * Ethernet frame packet, which is the same for both directions of a
+ * flow and is never zero, or returns zero if the frame is not an IP
+ * packet.  It is the software counterpart of the rxhash that the
+ * kernel provides for captured packets, and is used when there is no
+ * rxhash, as when one capture file is read by several threads.
+ */
+uint32_t packet_flow_hash(uint8_t *packet, size_t length);
+
 #endif /* PACKET_H */
@@ -21,6 +21,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
@@ -35,29 +36,6 @@
 static uint32_t magic = 0xa1b2c3d4;
 static uint32_t cagim = 0xd4c3b2a1;
 
-/*
- * global pcap header (one per file, at beginning)
- */
-struct pcap_file_hdr {
-    uint32_t magic_number;   /* magic number */
-    uint16_t version_major;  /* major version number */
-    uint16_t version_minor;  /* minor version number */
-    int32_t  thiszone;       /* GMT to local correction */
-    uint32_t sigfigs;        /* accuracy of timestamps */
-    uint32_t snaplen;        /* max length of captured packets, in octets */
-    uint32_t network;        /* data link type */
-};
-
-/*
- * packet header (one per packet, right before it)
- */
-struct pcap_packet_hdr {
-    uint32_t ts_sec;         /* timestamp seconds */
-    uint32_t ts_usec;        /* timestamp microseconds */
-    uint32_t incl_len;       /* number of octets of packet saved in file */
-    uint32_t orig_len;       /* actual length of packet */
-};
-
 #define ONE_KB (1024)
 #define ONE_MB (1024 * ONE_KB)
 #ifndef FBUFSIZE
@@ -67,6 +45,17 @@ struct pcap_packet_hdr {
 #endif
 #define PRE_ALLOCATE_DISK_SPACE  (100 * ONE_MB)
 
+/*
+ * files are read through a window of up to PCAP_MAP_WINDOW bytes that
+ * is mapped into memory and moved forward through the file, so that
+ * files of any size can be read without exhausting the address space;
+ * packets that are not in a mapped file are read into a buffer of
+ * PCAP_MAX_CAPLEN bytes
+ */
+#ifndef PCAP_MAP_WINDOW
+   #define PCAP_MAP_WINDOW (sizeof(void *) == 8 ? 1024 * (size_t)ONE_MB : 64 * (size_t)ONE_MB)
+#endif
+
 static inline void set_file_io_buffer(struct pcap_file *f, const char *fname) {
     f->buffer = (unsigned char *) malloc(STREAM_BUFFER_SIZE);
     if (f->buffer != NULL) {
@@ -82,6 +71,50 @@ static inline void set_file_io_buffer(struct pcap_file *f, const char *fname) {
     }
 }
 
+/*
+ * pcap_file_map_window(f, offset, min_len) maps the window of the
+ * file f that starts at the page containing offset, and is long enough
+ * to hold at least min_len bytes from offset, in place of the window
+ * that was mapped before.  The mapping is private and writable, since
+ * frame handlers get a non-const pointer to the packets in it.
+ */
+static enum status pcap_file_map_window(struct pcap_file *f, off_t offset, size_t min_len) {
+    static off_t page_size = 0;
+    if (page_size == 0) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    off_t start = offset & ~(page_size - 1);
+    size_t len = PCAP_MAP_WINDOW;
+    if (len < (size_t)(offset - start) + min_len) {
+        len = (size_t)(offset - start) + min_len;   /* a packet larger than the window */
+    }
+    if ((off_t)len > f->file_size - start) {
+        len = f->file_size - start;
+    }
+
+    if (f->map) {
+        munmap(f->map, f->map_len);
+        f->map = NULL;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, f->fd, start);
+    if (map == MAP_FAILED) {
+        return status_err;
+    }
+    /*
+     * the window is read once, in order; huge pages are used where the
+     * kernel supports them for file mappings, and otherwise the advice
+     * is ignored
+     */
+    madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, len, MADV_HUGEPAGE);
+#endif
+    f->map = (uint8_t *)map;
+    f->map_len = len;
+    f->map_offset = start;
+    return status_ok;
+}
+
 enum status pcap_file_open(struct pcap_file *f,
                const char *fname,
                enum io_direction dir,
@@ -89,6 +122,12 @@ enum status pcap_file_open(struct pcap_file *f,
     struct pcap_file_hdr file_header;
     ssize_t items_written, items_read;
 
+    f->file_ptr = NULL;
+    f->map = NULL;
+    f->map_len = 0;
+    f->packet_buffer = NULL;
+    f->buffer = NULL;
+
     switch(dir) {
     case io_direction_reader:
         f->flags = O_RDONLY;
@@ -172,17 +211,40 @@ enum status pcap_file_open(struct pcap_file *f,
 	if (posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
 	    printf("%s: Could not set file advisory for read file %s\n", strerror(errno), fname);
 	}
-
-	// set file i/o buffer
-	set_file_io_buffer(f, fname);
 	f->bytes_written = 0L;  // will never write any bytes to this file opened for reading
 
 	// printf("info: file %s opened\n", fname);
 
-	items_read = fread(&file_header, sizeof(file_header), 1, f->file_ptr);
-	if (items_read == 0) {
-	    perror("could not read file header");
-	    return status_err; /* could not read packet header from file */
+	/*
+	 * map a regular file into memory, and read anything else (or a
+	 * file that could not be mapped) through a stdio buffer
+	 */
+	struct stat statbuf;
+	f->file_size = 0;
+	f->read_offset = 0;
+	if (fstat(f->fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) && statbuf.st_size >= (off_t)sizeof(file_header)) {
+	    f->file_size = statbuf.st_size;
+	    if (pcap_file_map_window(f, 0, sizeof(file_header)) != status_ok) {
+		printf("%s: could not map read file %s; reading it instead\n", strerror(errno), fname);
+	    }
+	}
+	if (f->map) {
+	    memcpy(&file_header, f->map, sizeof(file_header));
+	    f->read_offset = sizeof(file_header);
+	} else {
+	    // set file i/o buffer
+	    set_file_io_buffer(f, fname);
+	    f->packet_buffer = (uint8_t *)malloc(PCAP_MAX_CAPLEN);
+	    if (f->packet_buffer == NULL) {
+		printf("error: could not allocate packet buffer for read file %s\n", fname);
+		return status_err;
+	    }
+
+	    items_read = fread(&file_header, sizeof(file_header), 1, f->file_ptr);
+	    if (items_read == 0) {
+		perror("could not read file header");
+		return status_err; /* could not read packet header from file */
+	    }
 	}
 	if (file_header.magic_number == magic) {
 	    f->byteswap = 0;
@@ -196,7 +258,7 @@ enum status pcap_file_open(struct pcap_file *f,
 	    if (file_header.magic_number == 0x0a0d0d0a) {
 		printf("error: pcap-ng format found; this format is currently unsupported\n");
 	    }
-	    exit(255);
+	    return status_err;
 	}
 	if (f->byteswap) {
 	    file_header.version_major = htons(file_header.version_major);
@@ -262,61 +324,121 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
 
 #define BUFLEN  16384
 
-enum status pcap_file_read_packet(struct pcap_file *f,
-                  struct pcap_pkthdr *pkthdr, /* output */
-                  void *packet_data           /* output */
-                  ) {
+/*
+ * pcap_file_read_record() reads the next packet record from a file
+ * that is not mapped, through its stdio buffer
+ */
+static enum status pcap_file_read_record(struct pcap_file *f,
+                                         struct pcap_pkthdr *pkthdr,
+                                         uint8_t **packet) {
     ssize_t items_read;
     struct pcap_packet_hdr packet_hdr;
 
-    if (f->file_ptr == NULL) {
-        printf("File not open\n");
-        return status_err;
-    }
-
     items_read = fread(&packet_hdr, sizeof(packet_hdr), 1, f->file_ptr);
     if (items_read == 0) {
         return status_err_no_more_data; /* could not read packet header from file */
     }
+    pcap_pkthdr_init(pkthdr, &packet_hdr, f->byteswap);
+    *packet = f->packet_buffer;
 
-    if (f->byteswap) {
-        pkthdr->ts.tv_sec = ntohl(packet_hdr.ts_sec);
-        pkthdr->ts.tv_usec = ntohl(packet_hdr.ts_usec);
-        pkthdr->caplen = ntohl(packet_hdr.incl_len);
-    } else {
-        pkthdr->ts.tv_sec = packet_hdr.ts_sec;
-        pkthdr->ts.tv_usec = packet_hdr.ts_usec;
-        pkthdr->caplen = packet_hdr.incl_len;
-    }
-
-    if (pkthdr->caplen <= BUFLEN) {
-        items_read = fread(packet_data, pkthdr->caplen, 1, f->file_ptr);
-        if (items_read == 0) {
+    if (pkthdr->caplen <= PCAP_MAX_CAPLEN) {
+        items_read = fread(f->packet_buffer, pkthdr->caplen, 1, f->file_ptr);
+        if (items_read == 0 && pkthdr->caplen > 0) {
             printf("could not read packet from file, caplen: %u\n", pkthdr->caplen);
             return status_err;          /* could not read packet from file */
         }
     } else {
         /*
-         * The packet length is much bigger than BUFLEN.
-         * Read BUFLEN bytes to process the packet and skip the remaining bytes.
+         * The packet is longer than the buffer.
+         * Read what fits to process the packet and skip the remaining bytes.
          */
-        if (fread(packet_data, BUFLEN, 1, f->file_ptr) == 0) {
-            printf("could not read %d bytes of the packet from file\n", (int)BUFLEN);
+        if (fread(f->packet_buffer, PCAP_MAX_CAPLEN, 1, f->file_ptr) == 0) {
+            printf("could not read %d bytes of the packet from file\n", (int)PCAP_MAX_CAPLEN);
             return status_err;          /* could not read packet from file */
         }
 
         // advance the file pointer to skip the large packet
-        if (fseek(f->file_ptr, pkthdr->caplen - BUFLEN, SEEK_CUR) != 0) {
+        if (fseek(f->file_ptr, pkthdr->caplen - PCAP_MAX_CAPLEN, SEEK_CUR) != 0) {
             perror("error: could not advance file pointer\n");
             return status_err;
         }
+        pkthdr->caplen = PCAP_MAX_CAPLEN;
+    }
 
-        // adjust the packet len and caplen
-        pkthdr->len = pkthdr->caplen;
-        pkthdr->caplen = BUFLEN;
-        return status_ok;
+    return status_ok;
+}
+
+enum status pcap_file_next_packet(struct pcap_file *f,
+                                  struct pcap_pkthdr *pkthdr, /* output */
+                                  uint8_t **packet            /* output */
+                                  ) {
+    struct pcap_packet_hdr packet_hdr;
+
+    if (f->file_ptr == NULL) {
+        printf("File not open\n");
+        return status_err;
+    }
+    if (f->map == NULL) {
+        return pcap_file_read_record(f, pkthdr, packet);
     }
 
+    off_t offset = f->read_offset;
+    if (offset + (off_t)sizeof(packet_hdr) > f->file_size) {
+        return status_err_no_more_data; /* no packet header left in file */
+    }
+    if (offset < f->map_offset || offset + (off_t)sizeof(packet_hdr) > f->map_offset + (off_t)f->map_len) {
+        if (pcap_file_map_window(f, offset, sizeof(packet_hdr)) != status_ok) {
+            perror("error: could not map read file");
+            return status_err;
+        }
+    }
+    memcpy(&packet_hdr, f->map + (offset - f->map_offset), sizeof(packet_hdr));
+    pcap_pkthdr_init(pkthdr, &packet_hdr, f->byteswap);
+
+    off_t data = offset + sizeof(packet_hdr);
+    if (data + pkthdr->caplen > f->file_size) {
+        printf("could not read packet from file, caplen: %u\n", pkthdr->caplen);
+        return status_err;          /* packet is truncated */
+    }
+    if (data + pkthdr->caplen > f->map_offset + (off_t)f->map_len) {
+        if (pcap_file_map_window(f, offset, sizeof(packet_hdr) + pkthdr->caplen) != status_ok) {
+            perror("error: could not map read file");
+            return status_err;
+        }
+    }
+    *packet = f->map + (data - f->map_offset);
+    f->read_offset = data + pkthdr->caplen;
+
+    return status_ok;
+}
+
+enum status pcap_file_read_packet(struct pcap_file *f,
+                  struct pcap_pkthdr *pkthdr, /* output */
+                  void *packet_data           /* output */
+                  ) {
+    uint8_t *packet;
+    enum status status = pcap_file_next_packet(f, pkthdr, &packet);
+    if (status == status_ok) {
+        if (pkthdr->caplen > BUFLEN) {
+            pkthdr->caplen = BUFLEN;
+        }
+        memcpy(packet_data, packet, pkthdr->caplen);
+    }
+    return status;
+}
+
+/*
+ * pcap_file_rewind(f) returns to the first packet of the file f
+ */
+static enum status pcap_file_rewind(struct pcap_file *f) {
+    if (f->map) {
+        f->read_offset = sizeof(struct pcap_file_hdr);
+        return status_ok;
+    }
+    if (fseek(f->file_ptr, sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
+        perror("error: could not rewind file pointer\n");
+        return status_err;
+    }
     return status_ok;
 }
 
@@ -327,6 +449,7 @@ void packet_info_init_from_pkthdr(struct packet_info *pi,
     pi->caplen = pkthdr->caplen;
     pi->ts.tv_sec = pkthdr->ts.tv_sec;
     pi->ts.tv_nsec = pkthdr->ts.tv_usec * 1000;
+    pi->flow_hash = 0;
 } 
 
 
@@ -336,14 +459,14 @@ enum status pcap_file_dispatch_frame_handler(struct pcap_file *f,
 					     int loop_count) {
     enum status status = status_ok;
     struct pcap_pkthdr pkthdr;
-    uint8_t packet_data[BUFLEN];
+    uint8_t *packet_data;
     unsigned long total_length = sizeof(struct pcap_file_hdr); // file header is already written
     unsigned long num_packets = 0;
     struct packet_info pi;
 
     for (int i=0; i < loop_count; i++) {
         do {
-            status = pcap_file_read_packet(f, &pkthdr, packet_data);
+            status = pcap_file_next_packet(f, &pkthdr, &packet_data);
             if (status == status_ok) {
                 packet_info_init_from_pkthdr(&pi, &pkthdr);
                 // process the packet that was read
@@ -355,8 +478,7 @@ enum status pcap_file_dispatch_frame_handler(struct pcap_file *f,
         
         if (i < loop_count - 1) {
             // Rewind the file to the first packet after skipping file header.
-            if (fseek(f->file_ptr, sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
-                perror("error: could not rewind file pointer\n");
+            if (pcap_file_rewind(f) != status_ok) {
                 status = status_err;
             }
         }
@@ -376,8 +498,18 @@ enum status pcap_file_close(struct pcap_file *f) {
 	perror("could not close input pcap file");
 	return status_err;
     }
+    f->file_ptr = NULL;
     if (f->buffer) {
 	free(f->buffer);
+	f->buffer = NULL;
+    }
+    if (f->map) {
+	munmap(f->map, f->map_len);
+	f->map = NULL;
+    }
+    if (f->packet_buffer) {
+	free(f->packet_buffer);
+	f->packet_buffer = NULL;
     }
     return status_ok;
 }
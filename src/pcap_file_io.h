@@ -9,6 +9,7 @@
 #define PCAP_FILE_IO_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -31,6 +32,12 @@ struct pcap_file {
     off_t  allocated_size; /* file size allocated using posix_fallocate    */
     u_int64_t bytes_written; /* number of bytes written to this file       */
     u_int64_t packets_written; /* number of packets written to this file   */
+    uint8_t *map;          /* window of the file mapped for reading, or NULL */
+    size_t map_len;        /* length of the mapped window                  */
+    off_t map_offset;      /* offset in the file of the mapped window      */
+    off_t file_size;       /* size of the file being read                  */
+    off_t read_offset;     /* offset in the file of the next packet record */
+    uint8_t *packet_buffer; /* packet buffer, if the file is not mapped    */
 };
 
 #define pcap_file_init() { NULL, 0, 0, 0, NULL, NULL, NULL }
@@ -55,12 +62,88 @@ typedef void (*packet_handler_t)(uint8_t *user,
 
 #endif /* lib_pcap_pcap_h */
 
+#include <arpa/inet.h>
+
+/*
+ * global pcap header (one per file, at beginning)
+ */
+struct pcap_file_hdr {
+    uint32_t magic_number;   /* magic number */
+    uint16_t version_major;  /* major version number */
+    uint16_t version_minor;  /* minor version number */
+    int32_t  thiszone;       /* GMT to local correction */
+    uint32_t sigfigs;        /* accuracy of timestamps */
+    uint32_t snaplen;        /* max length of captured packets, in octets */
+    uint32_t network;        /* data link type */
+};
+
+/*
+ * packet record header (one per packet, right before it in the file)
+ */
+struct pcap_packet_hdr {
+    uint32_t ts_sec;         /* timestamp seconds */
+    uint32_t ts_usec;        /* timestamp microseconds */
+    uint32_t incl_len;       /* number of octets of packet saved in file */
+    uint32_t orig_len;       /* actual length of packet */
+};
+
+#define PCAP_MAX_CAPLEN 262144   /* the largest snaplen that libpcap writes */
+
+/*
+ * pcap_pkthdr_init(pkthdr, packet_hdr, byteswap) sets pkthdr from the
+ * record header packet_hdr, which is byteswapped if byteswap is set
+ */
+static inline void pcap_pkthdr_init(struct pcap_pkthdr *pkthdr,
+                                    const struct pcap_packet_hdr *packet_hdr,
+                                    unsigned int byteswap) {
+    if (byteswap) {
+        pkthdr->ts.tv_sec = ntohl(packet_hdr->ts_sec);
+        pkthdr->ts.tv_usec = ntohl(packet_hdr->ts_usec);
+        pkthdr->caplen = ntohl(packet_hdr->incl_len);
+        pkthdr->len = ntohl(packet_hdr->orig_len);
+    } else {
+        pkthdr->ts.tv_sec = packet_hdr->ts_sec;
+        pkthdr->ts.tv_usec = packet_hdr->ts_usec;
+        pkthdr->caplen = packet_hdr->incl_len;
+        pkthdr->len = packet_hdr->orig_len;
+    }
+}
+
+struct packet_info;
+
+void packet_info_init_from_pkthdr(struct packet_info *pi,
+				  struct pcap_pkthdr *pkthdr);
+
 enum status pcap_file_open(struct pcap_file *f,
 			   const char *fname,
 			   enum io_direction dir,
 			   int flags);
 
 
+/*
+ * pcap_file_next_packet(f, pkthdr, packet) reads the next packet
+ * record from the file f opened for reading, and sets packet to point
+ * to its data, which remains valid until the next call.  A regular
+ * file is memory mapped, in windows of up to PCAP_MAP_WINDOW bytes,
+ * and packet points into the mapping, so no data is copied; other
+ * files (such as pipes) are read into a buffer of PCAP_MAX_CAPLEN
+ * bytes, and longer packets are truncated.  The data may be written
+ * to, but the writes do not reach the file.
+ *
+ * return values are status_ok, status_err_no_more_data at the end of
+ * the file, or status_err if the file is truncated or cannot be read
+ */
+enum status pcap_file_next_packet(struct pcap_file *f,
+				  struct pcap_pkthdr *pkthdr, /* output */
+				  uint8_t **packet            /* output */
+				  );
+
+/*
+ * pcap_file_read_packet(f, pkthdr, packet_data) is like
+ * pcap_file_next_packet(), but copies the packet into packet_data,
+ * which must be at least 16384 bytes long; longer packets are
+ * truncated to that length, and pkthdr->len gives their full length
+ */
 enum status pcap_file_read_packet(struct pcap_file *f,
 				  struct pcap_pkthdr *pkthdr, /* output */
 				  void *packet_data           /* output */
@@ -0,0 +1,214 @@
+/*
+ * pcap_file_merge.c
+ *
+ * reading the files of a file set as one, in timestamp order
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pcap_file_merge.h"
+#include "mercury.h"
+
+/*
+ * The files are merged with a binary heap of cursors, one for each
+ * file, ordered by the timestamp of the packet at the head of each
+ * cursor; the packet at the top of the heap is the next one out.  A
+ * cursor reads its file with pcap_file_next_packet(), so the packet at
+ * its head is in the mapped window of the file, and stays there until
+ * the cursor is advanced.
+ *
+ * The files are read in an interleaved order, which defeats some of
+ * the read-ahead of the kernel, so each cursor asks for the next
+ * PCAP_MERGE_READAHEAD bytes of its file as it reaches them, and
+ * releases the pages that it has passed, so that the memory used
+ * depends on the number of files and not on their size.
+ */
+
+#ifndef PCAP_MERGE_READAHEAD
+#define PCAP_MERGE_READAHEAD (8 * 1024 * 1024)
+#endif
+
+struct pcap_merge_cursor {
+    struct pcap_file f;
+    struct pcap_pkthdr pkthdr;   /* header of the packet at the head    */
+    uint8_t *packet;             /* data of the packet at the head      */
+    unsigned int index;          /* position of the file in the set     */
+    off_t record;                /* offset of the packet at the head    */
+    off_t released;              /* pages below this offset are released */
+};
+
+static inline bool pcap_merge_before(const struct pcap_merge_cursor *a, const struct pcap_merge_cursor *b) {
+    if (a->pkthdr.ts.tv_sec != b->pkthdr.ts.tv_sec) {
+	return a->pkthdr.ts.tv_sec < b->pkthdr.ts.tv_sec;
+    }
+    if (a->pkthdr.ts.tv_usec != b->pkthdr.ts.tv_usec) {
+	return a->pkthdr.ts.tv_usec < b->pkthdr.ts.tv_usec;
+    }
+    return a->index < b->index;
+}
+
+static void pcap_merge_sift_down(struct pcap_merge_cursor **heap, unsigned int n, unsigned int i) {
+    struct pcap_merge_cursor *c = heap[i];
+    while (true) {
+	unsigned int child = 2 * i + 1;
+	if (child >= n) {
+	    break;
+	}
+	if (child + 1 < n && pcap_merge_before(heap[child + 1], heap[child])) {
+	    child++;
+	}
+	if (!pcap_merge_before(heap[child], c)) {
+	    break;
+	}
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = c;
+}
+
+/*
+ * pcap_merge_cursor_advise(c) releases the pages of the mapped window
+ * of c that are before the packet at its head, and asks the kernel to
+ * read the pages after it, once the cursor has moved on by at least
+ * PCAP_MERGE_READAHEAD bytes
+ */
+static void pcap_merge_cursor_advise(struct pcap_merge_cursor *c) {
+    if (c->record - c->released < PCAP_MERGE_READAHEAD) {
+	return;
+    }
+    static off_t page_size = 0;
+    if (page_size == 0) {
+	page_size = sysconf(_SC_PAGESIZE);
+    }
+    off_t window_begin = c->f.map_offset;
+    off_t window_end = c->f.map_offset + c->f.map_len;
+    off_t release_begin = c->released > window_begin ? c->released : window_begin;
+    off_t release_end = c->record - c->record % page_size;
+    if (release_end > release_begin) {
+	madvise(c->f.map + (release_begin - window_begin), release_end - release_begin, MADV_DONTNEED);
+    }
+    off_t ahead_end = release_end + 2 * PCAP_MERGE_READAHEAD;
+    if (ahead_end > window_end) {
+	ahead_end = window_end;
+    }
+    if (ahead_end > release_end && release_end >= window_begin) {
+	madvise(c->f.map + (release_end - window_begin), ahead_end - release_end, MADV_WILLNEED);
+    }
+    c->released = release_end;
+}
+
+static enum status pcap_merge_cursor_advance(struct pcap_merge_cursor *c) {
+    c->record = c->f.read_offset;
+    enum status status = pcap_file_next_packet(&c->f, &c->pkthdr, &c->packet);
+    if (status == status_ok && c->f.map) {
+	pcap_merge_cursor_advise(c);
+    }
+    return status;
+}
+
+enum status pcap_file_merge_dispatch(const char *dirname,
+				     char **names,
+				     unsigned int num_files,
+				     frame_handler_func func,
+				     void *userdata,
+				     uint64_t *packets,
+				     uint64_t *bytes) {
+    enum status result = status_ok;
+    uint64_t num_packets = 0;
+    uint64_t total_length = 0;
+    uint64_t num_earlier = 0;
+    struct packet_info pi;
+
+    struct pcap_merge_cursor *cursor = (struct pcap_merge_cursor *)calloc(num_files, sizeof(struct pcap_merge_cursor));
+    struct pcap_merge_cursor **heap = (struct pcap_merge_cursor **)calloc(num_files, sizeof(struct pcap_merge_cursor *));
+    if (num_files && (cursor == NULL || heap == NULL)) {
+	fprintf(stderr, "error: could not allocate memory for file merge\n");
+	return status_err;
+    }
+
+    /*
+     * open each file, and put its cursor on the heap if it has a packet
+     */
+    unsigned int num_open = 0;
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < num_files; i++) {
+	char path[MAX_FILENAME];
+	struct pcap_merge_cursor *c = &cursor[num_open];
+	if (filename_append(path, dirname, "/", names[i]) != status_ok) {
+	    printf("error: file name %s/%s is too long\n", dirname, names[i]);
+	    result = status_err;
+	    continue;
+	}
+	if (pcap_file_open(&c->f, path, io_direction_reader, 0) != status_ok) {
+	    printf("%s: could not open pcap input file %s\n", strerror(errno), path);
+	    if (c->f.file_ptr) {
+		pcap_file_close(&c->f);   /* the slot is reused for the next file */
+	    }
+	    result = status_err;
+	    continue;
+	}
+	num_open++;
+	c->index = i;
+	c->released = 0;
+	total_length += sizeof(struct pcap_file_hdr);
+	enum status status = pcap_merge_cursor_advance(c);
+	if (status == status_ok) {
+	    heap[n++] = c;
+	} else if (status != status_err_no_more_data) {
+	    result = status_err;
+	}
+    }
+    for (unsigned int i = n / 2; i-- > 0; ) {
+	pcap_merge_sift_down(heap, n, i);
+    }
+
+    /*
+     * pass the packet at the top of the heap to the handler, and put
+     * the next packet of its file in its place
+     */
+    struct timeval last = { 0, 0 };
+    while (n > 0) {
+	struct pcap_merge_cursor *c = heap[0];
+	if (timercmp(&c->pkthdr.ts, &last, <)) {
+	    num_earlier++;
+	} else {
+	    last = c->pkthdr.ts;
+	}
+	packet_info_init_from_pkthdr(&pi, &c->pkthdr);
+	func(userdata, &pi, c->packet);
+	num_packets++;
+	total_length += c->pkthdr.caplen + sizeof(struct pcap_packet_hdr);
+
+	enum status status = pcap_merge_cursor_advance(c);
+	if (status != status_ok) {
+	    if (status != status_err_no_more_data) {
+		result = status_err;
+	    }
+	    heap[0] = heap[--n];
+	}
+	if (n > 0) {
+	    pcap_merge_sift_down(heap, n, 0);
+	}
+    }
+
+    if (num_earlier) {
+	printf("info: %lu packets were earlier than a packet before them in the merged output\n", num_earlier);
+    }
+    for (unsigned int i = 0; i < num_open; i++) {
+	pcap_file_close(&cursor[i].f);
+    }
+    free(cursor);
+    free(heap);
+
+    *packets = num_packets;
+    *bytes = total_length;
+
+    return result;
+}
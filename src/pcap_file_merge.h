@@ -0,0 +1,39 @@
+/*
+ * pcap_file_merge.h
+ *
+ * reading the files of a file set as one, in timestamp order
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef PCAP_FILE_MERGE_H
+#define PCAP_FILE_MERGE_H
+
+#include "pcap_file_io.h"
+#include "pkt_proc.h"
+
+/*
+ * pcap_file_merge_dispatch(dirname, names, num_files, func, userdata,
+ * packets, bytes) reads the num_files pcap files in the directory
+ * dirname, whose names are in the array names, all at once, and
+ * passes their packets to the frame handler function func in order of
+ * their timestamps.  Packets with equal timestamps are passed in the
+ * order of their files in names, and the packets of each file are
+ * passed in the order in which they appear in it, so that a file that
+ * is not in timestamp order is merged as well as it can be.  Each file
+ * is read sequentially, with read-ahead, and the memory used does not
+ * grow with the size of the files.  The number of packets and bytes
+ * read is returned through packets and bytes; as with
+ * pcap_file_dispatch_frame_handler(), the final flush of the handler
+ * is left to the caller.
+ */
+enum status pcap_file_merge_dispatch(const char *dirname,
+                                     char **names,
+                                     unsigned int num_files,
+                                     frame_handler_func func,
+                                     void *userdata,
+                                     uint64_t *packets,
+                                     uint64_t *bytes);
+
+#endif /* PCAP_FILE_MERGE_H */
@@ -0,0 +1,1158 @@
+/*
+ * pcap_file_parallel.c
+ *
+ * processing of a single pcap file by several threads at once
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pcap_file_parallel.h"
+#include "packet.h"
+
+/*
+ * == Chunks ==
+ *
+ * The file is mapped in full, and divided into chunks of equal size;
+ * a chunk holds the packet records that start within it.  A thread
+ * that scans a chunk finds the first record in it by looking for a
+ * run of PCAP_SYNC_RECORDS plausible record headers, each of which
+ * begins where the one before it ends, and then walks from record to
+ * record to the end of the chunk, adding each packet to the list of
+ * the worker that its flow hash selects.
+ *
+ * A plausible header may start at a position that is not a record
+ * boundary, so each chunk is checked before it is processed: the walk
+ * through the chunk before it must end exactly where its scan began.
+ * The first chunk begins right after the file header, so by induction
+ * every chunk that passes the check was scanned from a true boundary.
+ * A chunk that fails is scanned again from the end of the walk through
+ * the chunk before it.  The heuristic therefore affects only the
+ * amount of work, and never the output.
+ *
+ * Each worker processes its list from each chunk, in the order of the
+ * chunks, so the packets of a flow reach its handler in file order.
+ * Every thread is both a scanner and a worker; at most
+ * PCAP_CHUNKS_PER_WORKER chunks per worker are scanned ahead of the
+ * slowest worker, which bounds the memory used for the lists, and the
+ * pages of each chunk are released from the mapping once all of the
+ * workers are done with it.
+ */
+
+#ifndef PCAP_CHUNK_SIZE
+#define PCAP_CHUNK_SIZE        (32 * 1024 * 1024)
+#endif
+#ifndef PCAP_MIN_CHUNK_SIZE
+#define PCAP_MIN_CHUNK_SIZE    (1024 * 1024)
+#endif
+#define PCAP_CHUNKS_PER_WORKER 2
+#define PCAP_SYNC_RECORDS      8
+#define PCAP_SYNC_MAX_TS_STEP  3600   /* seconds between plausible records */
+#define PCAP_SYNC_MIN_CAPLEN   14     /* an Ethernet header; rules out runs of zeros */
+
+struct pcap_packet_ref {
+    uint64_t offset;         /* of the packet record header in the file */
+    uint32_t flow_hash;
+};
+
+struct pcap_ref_list {
+    struct pcap_packet_ref *ref;
+    size_t count;
+    size_t size;
+};
+
+enum pcap_chunk_state {
+    pcap_chunk_free     = 0,
+    pcap_chunk_scanning = 1,
+    pcap_chunk_scanned  = 2,
+    pcap_chunk_final    = 3     /* checked, and ready for the workers */
+};
+
+struct pcap_chunk {
+    off_t begin;             /* records that start in [begin, end) */
+    off_t end;
+    off_t start;             /* first record, or -1 if none was found */
+    off_t next;              /* first record after those in the chunk */
+    uint32_t truncated_caplen; /* caplen of a truncated record at next, or 0 */
+    enum pcap_chunk_state state;
+    unsigned int processed;  /* workers that are done with the chunk */
+    struct pcap_ref_list *list;  /* one per worker */
+};
+
+/*
+ * struct pcap_map is a pcap file mapped in full
+ */
+struct pcap_map {
+    uint8_t *map;
+    off_t file_size;
+    unsigned int byteswap;
+};
+
+struct pcap_parallel {
+    struct pcap_map m;
+    struct frame_handler *handler;
+    unsigned int num_workers;
+    off_t chunk_size;
+    uint64_t num_chunks;
+    struct pcap_chunk *slot; /* chunk n is in slot n % num_slots */
+    unsigned int num_slots;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t next_scan;      /* next chunk to be scanned                   */
+    uint64_t checked;        /* chunks before this one are final           */
+    uint64_t released;       /* chunks before this one are done with       */
+    off_t checked_next;      /* first record after the last final chunk    */
+    bool checking;           /* a thread is checking chunks                */
+    bool truncated;          /* a final chunk ended with a truncated record */
+    bool failed;             /* a scan could not allocate memory */
+    uint64_t rescans;
+};
+
+struct pcap_worker {
+    struct pcap_parallel *pp;
+    unsigned int wnum;
+    pthread_t tid;
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+static inline off_t pcap_page_size() {
+    static off_t page_size = 0;
+    if (page_size == 0) {
+	page_size = sysconf(_SC_PAGESIZE);
+    }
+    return page_size;
+}
+
+static inline struct pcap_chunk *pcap_parallel_chunk(struct pcap_parallel *pp, uint64_t n) {
+    return &pp->slot[n % pp->num_slots];
+}
+
+static inline void pcap_record_hdr(const struct pcap_map *m, off_t offset, struct pcap_pkthdr *pkthdr) {
+    struct pcap_packet_hdr packet_hdr;
+    memcpy(&packet_hdr, m->map + offset, sizeof(packet_hdr));
+    pcap_pkthdr_init(pkthdr, &packet_hdr, m->byteswap);
+}
+
+/*
+ * pcap_record_plausible(m, offset, pkthdr) returns true if the bytes
+ * at offset could be the header of a complete packet record
+ */
+static bool pcap_record_plausible(const struct pcap_map *m, off_t offset, struct pcap_pkthdr *pkthdr) {
+    if (offset + (off_t)sizeof(struct pcap_packet_hdr) > m->file_size) {
+	return false;
+    }
+    pcap_record_hdr(m, offset, pkthdr);
+    return pkthdr->ts.tv_usec < 1000000
+	&& pkthdr->caplen >= PCAP_SYNC_MIN_CAPLEN
+	&& pkthdr->caplen <= PCAP_MAX_CAPLEN
+	&& pkthdr->caplen <= pkthdr->len
+	&& offset + (off_t)sizeof(struct pcap_packet_hdr) + pkthdr->caplen <= m->file_size;
+}
+
+/*
+ * pcap_sync(m, begin, end) returns the first offset in [begin, end)
+ * that starts a run of PCAP_SYNC_RECORDS plausible records (or of
+ * plausible records that end exactly at the end of the file), or -1
+ * if there is none
+ */
+static off_t pcap_sync(const struct pcap_map *m, off_t begin, off_t end) {
+    for (off_t offset = begin; offset < end; offset++) {
+	struct pcap_pkthdr pkthdr;
+	long prev_sec = 0;
+	off_t o = offset;
+	int n;
+	for (n = 0; n < PCAP_SYNC_RECORDS && o < m->file_size; n++) {
+	    if (!pcap_record_plausible(m, o, &pkthdr)) {
+		break;
+	    }
+	    if (n > 0 && labs((long)pkthdr.ts.tv_sec - prev_sec) > PCAP_SYNC_MAX_TS_STEP) {
+		break;
+	    }
+	    prev_sec = pkthdr.ts.tv_sec;
+	    o += sizeof(struct pcap_packet_hdr) + pkthdr.caplen;
+	}
+	if (n == PCAP_SYNC_RECORDS || (n > 0 && o == m->file_size)) {
+	    return offset;
+	}
+    }
+    return -1;
+}
+
+static bool pcap_ref_list_append(struct pcap_ref_list *l, uint64_t offset, uint32_t flow_hash) {
+    if (l->count == l->size) {
+	size_t size = l->size ? 2 * l->size : 1024;
+	struct pcap_packet_ref *ref = (struct pcap_packet_ref *)realloc(l->ref, size * sizeof(struct pcap_packet_ref));
+	if (ref == NULL) {
+	    return false;
+	}
+	l->ref = ref;
+	l->size = size;
+    }
+    l->ref[l->count].offset = offset;
+    l->ref[l->count].flow_hash = flow_hash;
+    l->count++;
+    return true;
+}
+
+/*
+ * pcap_chunk_scan(pp, c) walks through the records of chunk c from
+ * c->start, and adds each packet to the list of its worker; it returns
+ * false if a list could not be extended
+ */
+static bool pcap_chunk_scan(struct pcap_parallel *pp, struct pcap_chunk *c) {
+    for (unsigned int w = 0; w < pp->num_workers; w++) {
+	c->list[w].count = 0;
+    }
+    c->truncated_caplen = 0;
+    off_t offset = c->start;
+    if (offset < 0) {
+	c->next = -1;
+	return true;
+    }
+    while (offset < c->end && offset + (off_t)sizeof(struct pcap_packet_hdr) <= pp->m.file_size) {
+	struct pcap_pkthdr pkthdr;
+	pcap_record_hdr(&pp->m, offset, &pkthdr);
+	off_t data = offset + sizeof(struct pcap_packet_hdr);
+	if (data + pkthdr.caplen > pp->m.file_size) {
+	    c->truncated_caplen = pkthdr.caplen ? pkthdr.caplen : 1;
+	    break;
+	}
+	uint32_t flow_hash = packet_flow_hash(pp->m.map + data, pkthdr.caplen);
+	if (!pcap_ref_list_append(&c->list[flow_hash % pp->num_workers], offset, flow_hash)) {
+	    fprintf(stderr, "error: could not allocate memory for packet list\n");
+	    return false;
+	}
+	offset = data + pkthdr.caplen;
+    }
+    c->next = offset;
+    return true;
+}
+
+/*
+ * pcap_parallel_fail(pp) stops all of the threads after an error; it
+ * is called with pp->mutex held
+ */
+static void pcap_parallel_fail(struct pcap_parallel *pp) {
+    pp->failed = true;
+    pthread_cond_broadcast(&pp->cond);
+}
+
+/*
+ * pcap_parallel_check(pp) makes final each scanned chunk whose
+ * predecessors are all final, scanning it again first if its start is
+ * not where the walk through its predecessor ended; it is called with
+ * pp->mutex held, which it releases during any scan
+ */
+static void pcap_parallel_check(struct pcap_parallel *pp) {
+    if (pp->checking) {
+	return;
+    }
+    pp->checking = true;
+    while (pp->checked < pp->next_scan) {
+	struct pcap_chunk *c = pcap_parallel_chunk(pp, pp->checked);
+	if (c->state != pcap_chunk_scanned) {
+	    break;
+	}
+	if (pp->truncated) {
+	    /*
+	     * the file cannot be read past a truncated record
+	     */
+	    for (unsigned int w = 0; w < pp->num_workers; w++) {
+		c->list[w].count = 0;
+	    }
+	    c->next = pp->checked_next;
+	} else if (c->start != pp->checked_next) {
+	    c->start = pp->checked_next;
+	    c->state = pcap_chunk_scanning;
+	    pp->rescans++;
+	    pthread_mutex_unlock(&pp->mutex);
+	    bool scanned = pcap_chunk_scan(pp, c);
+	    pthread_mutex_lock(&pp->mutex);
+	    if (!scanned) {
+		pcap_parallel_fail(pp);
+		break;
+	    }
+	}
+	if (c->truncated_caplen && !pp->truncated) {
+	    printf("could not read packet from file, caplen: %u\n", c->truncated_caplen);
+	    pp->truncated = true;
+	}
+	c->state = pcap_chunk_final;
+	pp->checked_next = c->next;
+	pp->checked++;
+	pthread_cond_broadcast(&pp->cond);
+    }
+    pp->checking = false;
+}
+
+/*
+ * pcap_parallel_release(pp) frees the slots of the chunks that all of
+ * the workers are done with, in order, and drops their pages from the
+ * mapping; the pages that they share with a chunk still in use are
+ * kept.  It is called with pp->mutex held.
+ */
+static void pcap_parallel_release(struct pcap_parallel *pp) {
+    off_t page_size = pcap_page_size();
+    while (pp->released < pp->checked) {
+	struct pcap_chunk *c = pcap_parallel_chunk(pp, pp->released);
+	if (c->processed < pp->num_workers) {
+	    break;
+	}
+	off_t first = (c->begin + page_size - 1) & ~(off_t)(page_size - 1);
+	off_t last = c->end & ~(off_t)(page_size - 1);
+	if (last > first) {
+	    madvise(pp->m.map + first, last - first, MADV_DONTNEED);
+	}
+	c->state = pcap_chunk_free;
+	pp->released++;
+	pthread_cond_broadcast(&pp->cond);
+    }
+}
+
+static void pcap_worker_process(struct pcap_worker *w, struct pcap_chunk *c) {
+    struct pcap_parallel *pp = w->pp;
+    struct frame_handler *handler = &pp->handler[w->wnum];
+    const struct pcap_ref_list *l = &c->list[w->wnum];
+    struct pcap_pkthdr pkthdr;
+    struct packet_info pi;
+
+    for (size_t i = 0; i < l->count; i++) {
+	off_t offset = l->ref[i].offset;
+	pcap_record_hdr(&pp->m, offset, &pkthdr);
+	packet_info_init_from_pkthdr(&pi, &pkthdr);
+	pi.flow_hash = l->ref[i].flow_hash;
+	handler->func(&handler->context, &pi, pp->m.map + offset + sizeof(struct pcap_packet_hdr));
+	w->bytes += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
+    }
+    w->packets += l->count;
+    frame_handler_flush(handler, false);
+}
+
+/*
+ * each thread processes the next chunk in its sequence when that is
+ * final, and otherwise scans a new chunk if there is room for one
+ */
+static void *pcap_worker_func(void *arg) {
+    struct pcap_worker *w = (struct pcap_worker *)arg;
+    struct pcap_parallel *pp = w->pp;
+    uint64_t processed = 0;
+
+    pthread_mutex_lock(&pp->mutex);
+    while (processed < pp->num_chunks && !pp->failed) {
+	if (processed < pp->checked) {
+	    struct pcap_chunk *c = pcap_parallel_chunk(pp, processed);
+	    pthread_mutex_unlock(&pp->mutex);
+	    pcap_worker_process(w, c);
+	    pthread_mutex_lock(&pp->mutex);
+	    c->processed++;
+	    processed++;
+	    pcap_parallel_release(pp);
+
+	} else if (pp->next_scan < pp->num_chunks && pp->next_scan < pp->released + pp->num_slots) {
+	    uint64_t n = pp->next_scan++;
+	    struct pcap_chunk *c = pcap_parallel_chunk(pp, n);
+	    c->begin = n * pp->chunk_size;
+	    c->end = c->begin + pp->chunk_size < pp->m.file_size ? c->begin + pp->chunk_size : pp->m.file_size;
+	    c->processed = 0;
+	    c->state = pcap_chunk_scanning;
+	    pthread_mutex_unlock(&pp->mutex);
+
+	    off_t page = c->begin & ~(pcap_page_size() - 1);
+	    madvise(pp->m.map + page, c->end - page, MADV_WILLNEED);
+	    c->start = (n == 0) ? pp->checked_next : pcap_sync(&pp->m, c->begin, c->end);
+	    bool scanned = pcap_chunk_scan(pp, c);
+
+	    pthread_mutex_lock(&pp->mutex);
+	    if (!scanned) {
+		pcap_parallel_fail(pp);
+		break;
+	    }
+	    c->state = pcap_chunk_scanned;
+	    pcap_parallel_check(pp);
+
+	} else {
+	    pthread_cond_wait(&pp->cond, &pp->mutex);
+	}
+    }
+    pthread_mutex_unlock(&pp->mutex);
+    return NULL;
+}
+
+/*
+ * pcap_file_dispatch_by_hash() reads f in sequence, for files that
+ * cannot be mapped in full
+ */
+static enum status pcap_file_dispatch_by_hash(struct pcap_file *f,
+					      struct frame_handler *handler,
+					      unsigned int num_workers) {
+    enum status status;
+    struct pcap_pkthdr pkthdr;
+    uint8_t *packet;
+    struct packet_info pi;
+    uint64_t packets = 0;
+    uint64_t bytes = sizeof(struct pcap_file_hdr);
+
+    while ((status = pcap_file_next_packet(f, &pkthdr, &packet)) == status_ok) {
+	packet_info_init_from_pkthdr(&pi, &pkthdr);
+	pi.flow_hash = packet_flow_hash(packet, pkthdr.caplen);
+	struct frame_handler *h = &handler[pi.flow_hash % num_workers];
+	h->func(&h->context, &pi, packet);
+	packets++;
+	bytes += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
+    }
+    f->packets_written = packets;
+    f->bytes_written = bytes;
+
+    return status == status_err_no_more_data ? status_ok : status;
+}
+
+enum status pcap_file_dispatch_parallel(struct pcap_file *f,
+					struct frame_handler *handler,
+					unsigned int num_workers) {
+
+    if (f->map == NULL || sizeof(void *) < 8) {
+	printf("info: the read file cannot be mapped in full, so it is read by one thread\n");
+	return pcap_file_dispatch_by_hash(f, handler, num_workers);
+    }
+    void *map = mmap(NULL, f->file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f->fd, 0);
+    if (map == MAP_FAILED) {
+	perror("warning: could not map read file; reading it in sequence");
+	return pcap_file_dispatch_by_hash(f, handler, num_workers);
+    }
+
+    struct pcap_parallel pp;
+    pp.m.map = (uint8_t *)map;
+    pp.m.file_size = f->file_size;
+    pp.m.byteswap = f->byteswap;
+    pp.handler = handler;
+    pp.num_workers = num_workers;
+
+    /*
+     * use at least four chunks per worker, so that the load is spread
+     * evenly, unless that would make the chunks tiny
+     */
+    pp.chunk_size = f->file_size / (4 * num_workers);
+    if (pp.chunk_size > PCAP_CHUNK_SIZE) {
+	pp.chunk_size = PCAP_CHUNK_SIZE;
+    }
+    if (pp.chunk_size < PCAP_MIN_CHUNK_SIZE) {
+	pp.chunk_size = PCAP_MIN_CHUNK_SIZE;
+    }
+    pp.num_chunks = (f->file_size + pp.chunk_size - 1) / pp.chunk_size;
+    pp.num_slots = PCAP_CHUNKS_PER_WORKER * num_workers;
+    pthread_mutex_init(&pp.mutex, NULL);
+    pthread_cond_init(&pp.cond, NULL);
+    pp.next_scan = 0;
+    pp.checked = 0;
+    pp.released = 0;
+    pp.checked_next = sizeof(struct pcap_file_hdr);
+    pp.checking = false;
+    pp.truncated = false;
+    pp.failed = false;
+    pp.rescans = 0;
+
+    enum status status = status_ok;
+    unsigned int num_started = 0;
+    uint64_t packets = 0;
+    uint64_t bytes = sizeof(struct pcap_file_hdr);
+    struct pcap_worker *worker = (struct pcap_worker *)calloc(num_workers, sizeof(struct pcap_worker));
+    pp.slot = (struct pcap_chunk *)calloc(pp.num_slots, sizeof(struct pcap_chunk));
+    if (pp.slot == NULL || worker == NULL) {
+	fprintf(stderr, "error: could not allocate memory for parallel file reader\n");
+	status = status_err;
+	goto cleanup;
+    }
+    for (unsigned int s = 0; s < pp.num_slots; s++) {
+	pp.slot[s].list = (struct pcap_ref_list *)calloc(num_workers, sizeof(struct pcap_ref_list));
+	if (pp.slot[s].list == NULL) {
+	    fprintf(stderr, "error: could not allocate memory for parallel file reader\n");
+	    status = status_err;
+	    goto cleanup;
+	}
+    }
+
+    for (unsigned int i = 0; i < num_workers; i++) {
+	worker[i].pp = &pp;
+	worker[i].wnum = i;
+	int err = pthread_create(&worker[i].tid, NULL, pcap_worker_func, &worker[i]);
+	if (err) {
+	    printf("%s: error creating file reader thread\n", strerror(err));
+	    pthread_mutex_lock(&pp.mutex);
+	    pcap_parallel_fail(&pp);
+	    pthread_mutex_unlock(&pp.mutex);
+	    break;
+	}
+	num_started++;
+    }
+
+    for (unsigned int i = 0; i < num_started; i++) {
+	pthread_join(worker[i].tid, NULL);
+	packets += worker[i].packets;
+	bytes += worker[i].bytes;
+    }
+    f->packets_written = packets;
+    f->bytes_written = bytes;
+    if (pp.rescans) {
+	printf("info: %lu of %lu chunks were scanned again to find their first packet\n", pp.rescans, pp.num_chunks);
+    }
+    if (pp.truncated || pp.failed) {
+	status = status_err;
+    }
+
+ cleanup:
+    if (pp.slot) {
+	for (unsigned int s = 0; s < pp.num_slots; s++) {
+	    if (pp.slot[s].list) {
+		for (unsigned int i = 0; i < num_workers; i++) {
+		    free(pp.slot[s].list[i].ref);
+		}
+		free(pp.slot[s].list);
+	    }
+	}
+    }
+    free(pp.slot);
+    free(worker);
+    pthread_mutex_destroy(&pp.mutex);
+    pthread_cond_destroy(&pp.cond);
+    munmap(map, f->file_size);
+
+    return status;
+}
+
+/*
+ * == File sets ==
+ *
+ * The files of a file set are processed by a fixed pool of workers,
+ * each of which has a deque of tasks.  A worker takes tasks from the
+ * bottom of its own deque, and when that is empty, steals them from
+ * the top of the others'.  The tasks are assigned to the deques at
+ * the start, largest first, each to the deque with the least work.
+ *
+ * Each file is one task, and its output has the name of the file, as
+ * before; but a file larger than twice PCAP_SET_CHUNK_SIZE is split
+ * into chunks, so that one large file does not leave one worker busy
+ * long after the others are done, and the output of chunk k of the
+ * file name goes to name-k (with k in hex).  The chunk boundaries are
+ * found as described above: a scan task for each chunk (other than
+ * the first) finds its first record with pcap_sync(), and walks to its
+ * end, and a chunk is processed when its start has been checked
+ * against the end of the walk through the chunk before it.  The output
+ * thus depends only on the files, and not on the number of workers or
+ * on how they are scheduled.  The deques hold coarse tasks, so a mutex
+ * for each is enough.
+ */
+
+#ifndef PCAP_SET_CHUNK_SIZE
+#define PCAP_SET_CHUNK_SIZE    (256 * 1024 * 1024)
+#endif
+
+enum pcap_task_type {
+    pcap_task_file    = 0,   /* process a whole file                     */
+    pcap_task_scan    = 1,   /* find the records of a chunk              */
+    pcap_task_process = 2    /* process a chunk whose start is checked   */
+};
+
+struct pcap_set_file;
+
+struct pcap_task {
+    enum pcap_task_type type;
+    struct pcap_set_file *file;
+    uint64_t chunk;
+    off_t weight;            /* bytes of the file covered by the task */
+};
+
+struct pcap_set_chunk {
+    off_t begin;             /* records that start in [begin, end) */
+    off_t end;
+    bool scanned;
+    off_t scan_start;        /* found by the scan task, or -1 */
+    off_t scan_next;         /* end of the walk from scan_start */
+    uint32_t scan_truncated_caplen;
+    off_t start;             /* checked first record of the chunk */
+    bool next_known;
+    off_t next;              /* first record after those in the chunk */
+    uint32_t truncated_caplen;
+};
+
+struct pcap_set_file {
+    char *name;
+    char path[MAX_FILENAME];
+    off_t size;
+    struct pcap_file rf;     /* open, and mapped in full, if split */
+    struct pcap_map m;
+    uint64_t num_chunks;     /* 0 if the file is not split */
+    struct pcap_set_chunk *chunk;
+    uint64_t checked;        /* chunks before this one have checked starts */
+    uint64_t tasks_left;     /* chunk tasks not yet done */
+};
+
+struct pcap_deque {
+    pthread_mutex_t mutex;
+    struct pcap_task *task;  /* tasks in [top, bottom) */
+    size_t top;
+    size_t bottom;
+    size_t size;
+};
+
+struct pcap_set_worker {
+    struct pcap_set *set;
+    unsigned int wnum;
+    pthread_t tid;
+    struct pcap_deque deque;
+    uint64_t files;
+    uint64_t chunks;
+    uint64_t scans;
+    uint64_t steals;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t busy_ns;
+};
+
+struct pcap_set {
+    struct pcap_set_worker *worker;
+    unsigned int num_workers;
+    int loop_count;
+    pcap_handler_init_func init;
+    void *init_arg;
+    pthread_mutex_t mutex;   /* protects the fields below, and the chunks */
+    pthread_cond_t cond;
+    uint64_t pending;        /* tasks queued or running */
+    uint64_t generation;     /* incremented on each push */
+    uint64_t rescans;
+    bool failed;             /* a task could not be queued */
+};
+
+static inline uint64_t pcap_set_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool pcap_deque_push(struct pcap_deque *d, const struct pcap_task *t) {
+    pthread_mutex_lock(&d->mutex);
+    if (d->bottom == d->size) {
+	if (d->top > 0) {
+	    memmove(d->task, d->task + d->top, (d->bottom - d->top) * sizeof(struct pcap_task));
+	    d->bottom -= d->top;
+	    d->top = 0;
+	} else {
+	    size_t size = d->size ? 2 * d->size : 64;
+	    struct pcap_task *task = (struct pcap_task *)realloc(d->task, size * sizeof(struct pcap_task));
+	    if (task == NULL) {
+		pthread_mutex_unlock(&d->mutex);
+		fprintf(stderr, "error: could not allocate memory for task queue\n");
+		return false;
+	    }
+	    d->task = task;
+	    d->size = size;
+	}
+    }
+    d->task[d->bottom++] = *t;
+    pthread_mutex_unlock(&d->mutex);
+    return true;
+}
+
+static bool pcap_deque_pop_bottom(struct pcap_deque *d, struct pcap_task *t) {
+    bool found = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->bottom > d->top) {
+	*t = d->task[--d->bottom];
+	found = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+static bool pcap_deque_steal_top(struct pcap_deque *d, struct pcap_task *t) {
+    bool found = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->bottom > d->top) {
+	*t = d->task[d->top++];
+	found = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return found;
+}
+
+/*
+ * pcap_set_push(set, w, t) adds task t to the deque of worker w, or
+ * marks the set as failed if it cannot; it is called with set->mutex
+ * held
+ */
+static void pcap_set_push(struct pcap_set *set, struct pcap_set_worker *w, const struct pcap_task *t) {
+    if (!pcap_deque_push(&w->deque, t)) {
+	set->failed = true;
+	return;
+    }
+    set->pending++;
+    set->generation++;
+    pthread_cond_broadcast(&set->cond);
+}
+
+/*
+ * pcap_set_file_check(set, w, file) checks the starts of the chunks
+ * of file in order, as far as the chunks before them are known, and
+ * gives worker w a task to process each chunk that it checks; it is
+ * called with set->mutex held
+ */
+static void pcap_set_file_check(struct pcap_set *set, struct pcap_set_worker *w, struct pcap_set_file *file) {
+    while (file->checked < file->num_chunks) {
+	struct pcap_set_chunk *prev = &file->chunk[file->checked - 1];
+	struct pcap_set_chunk *c = &file->chunk[file->checked];
+	if (!prev->next_known || !c->scanned) {
+	    break;
+	}
+	c->start = prev->next;
+	if (prev->truncated_caplen) {
+	    /*
+	     * the file cannot be read past a truncated record
+	     */
+	    c->next = prev->next;
+	    c->truncated_caplen = prev->truncated_caplen;
+	    c->next_known = true;
+	    file->tasks_left--;
+	} else {
+	    if (c->scan_start == c->start) {
+		c->next = c->scan_next;
+		c->truncated_caplen = c->scan_truncated_caplen;
+		c->next_known = true;
+	    } else {
+		set->rescans++;
+	    }
+	    struct pcap_task t = { pcap_task_process, file, file->checked, c->end - c->begin };
+	    pcap_set_push(set, w, &t);
+	}
+	file->checked++;
+    }
+}
+
+/*
+ * pcap_set_file_release(file) unmaps and closes a split file once all
+ * of its tasks are done; it is called with set->mutex held
+ */
+static void pcap_set_file_release(struct pcap_set_file *file) {
+    if (file->tasks_left == 0 && file->m.map) {
+	munmap(file->m.map, file->m.file_size);
+	file->m.map = NULL;
+	pcap_file_close(&file->rf);
+    }
+}
+
+static void pcap_set_run_file(struct pcap_set *set, struct pcap_set_worker *w, struct pcap_set_file *file) {
+    struct frame_handler handler;
+    struct pcap_file rf;
+
+    if (set->init(&handler, file->name, set->init_arg) != status_ok) {
+	return;
+    }
+    if (pcap_file_open(&rf, file->path, io_direction_reader, 0) != status_ok) {
+	printf("%s: could not open pcap input file %s\n", strerror(errno), file->path);
+	frame_handler_close(&handler);
+	return;
+    }
+    enum status status = pcap_file_dispatch_frame_handler(&rf, handler.func, &handler.context, set->loop_count);
+    frame_handler_flush(&handler, true);
+    frame_handler_close(&handler);
+    if (status) {
+	printf("error in pcap file dispatch (code: %d)\n", (int)status);
+    }
+    w->files++;
+    w->packets += rf.packets_written;
+    w->bytes += rf.bytes_written;
+    pcap_file_close(&rf);
+}
+
+static void pcap_set_run_scan(struct pcap_set *set, struct pcap_set_worker *w, struct pcap_set_file *file, uint64_t k) {
+    struct pcap_set_chunk *c = &file->chunk[k];
+    const struct pcap_map *m = &file->m;
+
+    off_t offset = pcap_sync(m, c->begin, c->end);
+    off_t start = offset;
+    uint32_t truncated_caplen = 0;
+    while (offset >= 0 && offset < c->end && offset + (off_t)sizeof(struct pcap_packet_hdr) <= m->file_size) {
+	struct pcap_pkthdr pkthdr;
+	pcap_record_hdr(m, offset, &pkthdr);
+	off_t data = offset + sizeof(struct pcap_packet_hdr);
+	if (data + pkthdr.caplen > m->file_size) {
+	    truncated_caplen = pkthdr.caplen ? pkthdr.caplen : 1;
+	    break;
+	}
+	offset = data + pkthdr.caplen;
+    }
+    w->scans++;
+
+    pthread_mutex_lock(&set->mutex);
+    c->scan_start = start;
+    c->scan_next = offset;
+    c->scan_truncated_caplen = truncated_caplen;
+    c->scanned = true;
+    file->tasks_left--;
+    pcap_set_file_check(set, w, file);
+    pcap_set_file_release(file);
+    pthread_mutex_unlock(&set->mutex);
+}
+
+static void pcap_set_run_process(struct pcap_set *set, struct pcap_set_worker *w, struct pcap_set_file *file, uint64_t k) {
+    struct pcap_set_chunk *c = &file->chunk[k];
+    const struct pcap_map *m = &file->m;
+    struct frame_handler handler;
+    char output_id[MAX_FILENAME];
+    struct pcap_pkthdr pkthdr;
+    struct packet_info pi;
+
+    snprintf(output_id, sizeof(output_id), "%s-%lx", file->name, (unsigned long)k);
+    bool have_handler = (set->init(&handler, output_id, set->init_arg) == status_ok);
+
+    off_t offset = c->start;
+    uint32_t truncated_caplen = 0;
+    if (k == 0) {
+	w->bytes += sizeof(struct pcap_file_hdr);  /* as counted for a whole file */
+    }
+    while (offset < c->end && offset + (off_t)sizeof(struct pcap_packet_hdr) <= m->file_size) {
+	pcap_record_hdr(m, offset, &pkthdr);
+	off_t data = offset + sizeof(struct pcap_packet_hdr);
+	if (data + pkthdr.caplen > m->file_size) {
+	    truncated_caplen = pkthdr.caplen ? pkthdr.caplen : 1;
+	    printf("could not read packet from file, caplen: %u\n", pkthdr.caplen);
+	    break;
+	}
+	if (have_handler) {
+	    packet_info_init_from_pkthdr(&pi, &pkthdr);
+	    handler.func(&handler.context, &pi, m->map + data);
+	}
+	w->packets++;
+	w->bytes += sizeof(struct pcap_packet_hdr) + pkthdr.caplen;
+	offset = data + pkthdr.caplen;
+    }
+    if (have_handler) {
+	frame_handler_flush(&handler, true);
+	frame_handler_close(&handler);
+    }
+    w->chunks++;
+
+    pthread_mutex_lock(&set->mutex);
+    if (!c->next_known) {
+	c->next = offset;
+	c->truncated_caplen = truncated_caplen;
+	c->next_known = true;
+    }
+    file->tasks_left--;
+    pcap_set_file_check(set, w, file);
+    pcap_set_file_release(file);
+    pthread_mutex_unlock(&set->mutex);
+}
+
+static bool pcap_set_get_task(struct pcap_set *set, struct pcap_set_worker *w, struct pcap_task *t) {
+    if (pcap_deque_pop_bottom(&w->deque, t)) {
+	return true;
+    }
+    for (unsigned int i = 1; i < set->num_workers; i++) {
+	struct pcap_set_worker *victim = &set->worker[(w->wnum + i) % set->num_workers];
+	if (pcap_deque_steal_top(&victim->deque, t)) {
+	    w->steals++;
+	    return true;
+	}
+    }
+    return false;
+}
+
+static void *pcap_set_worker_func(void *arg) {
+    struct pcap_set_worker *w = (struct pcap_set_worker *)arg;
+    struct pcap_set *set = w->set;
+    struct pcap_task t;
+
+    while (true) {
+	pthread_mutex_lock(&set->mutex);
+	uint64_t generation = set->generation;
+	pthread_mutex_unlock(&set->mutex);
+
+	if (pcap_set_get_task(set, w, &t)) {
+	    uint64_t start = pcap_set_ns();
+	    switch (t.type) {
+	    case pcap_task_file:
+		pcap_set_run_file(set, w, t.file);
+		break;
+	    case pcap_task_scan:
+		pcap_set_run_scan(set, w, t.file, t.chunk);
+		break;
+	    case pcap_task_process:
+		pcap_set_run_process(set, w, t.file, t.chunk);
+		break;
+	    }
+	    w->busy_ns += pcap_set_ns() - start;
+
+	    pthread_mutex_lock(&set->mutex);
+	    if (--set->pending == 0) {
+		pthread_cond_broadcast(&set->cond);
+	    }
+	    pthread_mutex_unlock(&set->mutex);
+	    continue;
+	}
+
+	/*
+	 * there is nothing to take; wait for a push, unless there was one
+	 * while looking, or all of the tasks are done
+	 */
+	pthread_mutex_lock(&set->mutex);
+	while (set->pending > 0 && set->generation == generation) {
+	    pthread_cond_wait(&set->cond, &set->mutex);
+	}
+	bool done = (set->pending == 0);
+	pthread_mutex_unlock(&set->mutex);
+	if (done) {
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * pcap_set_file_split(file) opens and maps a file that is large
+ * enough to split into chunks, and sets up its chunks; the file is to
+ * be processed as one task if file->num_chunks is left at zero.  It
+ * returns status_err if the chunks could not be allocated.
+ */
+static enum status pcap_set_file_split(struct pcap_set_file *file, int loop_count) {
+    if (sizeof(void *) < 8 || loop_count != 1 || file->size <= 2 * (off_t)PCAP_SET_CHUNK_SIZE) {
+	return status_ok;
+    }
+    if (pcap_file_open(&file->rf, file->path, io_direction_reader, 0) != status_ok) {
+	return status_ok;
+    }
+    void *map = file->rf.map ? mmap(NULL, file->rf.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file->rf.fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+	pcap_file_close(&file->rf);
+	return status_ok;
+    }
+    uint64_t num_chunks = (file->rf.file_size + PCAP_SET_CHUNK_SIZE - 1) / PCAP_SET_CHUNK_SIZE;
+    file->chunk = (struct pcap_set_chunk *)calloc(num_chunks, sizeof(struct pcap_set_chunk));
+    if (file->chunk == NULL) {
+	fprintf(stderr, "error: could not allocate memory for file chunks\n");
+	munmap(map, file->rf.file_size);
+	pcap_file_close(&file->rf);
+	return status_err;
+    }
+    file->m.map = (uint8_t *)map;
+    file->m.file_size = file->rf.file_size;
+    file->m.byteswap = file->rf.byteswap;
+    file->num_chunks = num_chunks;
+    for (uint64_t k = 0; k < file->num_chunks; k++) {
+	struct pcap_set_chunk *c = &file->chunk[k];
+	c->begin = k * PCAP_SET_CHUNK_SIZE;
+	c->end = (k + 1) * PCAP_SET_CHUNK_SIZE < (uint64_t)file->m.file_size ? (k + 1) * PCAP_SET_CHUNK_SIZE : file->m.file_size;
+    }
+    file->chunk[0].start = sizeof(struct pcap_file_hdr);
+    file->chunk[0].scanned = true;
+    file->checked = 1;
+    file->tasks_left = 2 * file->num_chunks - 1;
+    return status_ok;
+}
+
+static int pcap_task_cmp(const void *a, const void *b) {
+    const struct pcap_task *ta = (const struct pcap_task *)a;
+    const struct pcap_task *tb = (const struct pcap_task *)b;
+    if (ta->weight != tb->weight) {
+	return ta->weight < tb->weight ? 1 : -1;
+    }
+    int cmp = strcmp(ta->file->name, tb->file->name);
+    if (cmp) {
+	return cmp;
+    }
+    return ta->chunk < tb->chunk ? -1 : ta->chunk > tb->chunk;
+}
+
+enum status pcap_file_set_dispatch(const char *dirname,
+				   char **names,
+				   unsigned int num_files,
+				   unsigned int num_workers,
+				   int loop_count,
+				   pcap_handler_init_func init,
+				   void *init_arg,
+				   uint64_t *packets,
+				   uint64_t *bytes) {
+    enum status status = status_ok;
+    struct pcap_set set;
+    set.num_workers = num_workers;
+    set.loop_count = loop_count;
+    set.init = init;
+    set.init_arg = init_arg;
+    set.pending = 0;
+    set.generation = 0;
+    set.rescans = 0;
+    set.failed = false;
+    pthread_mutex_init(&set.mutex, NULL);
+    pthread_cond_init(&set.cond, NULL);
+
+    *packets = 0;
+    *bytes = 0;
+    uint64_t num_tasks = 0;
+    uint64_t n = 0;
+    unsigned int num_started = 0;
+    uint64_t start;
+    double elapsed;
+    struct pcap_task *task = NULL;
+    uint64_t *load = NULL;
+    unsigned int *owner = NULL;
+    struct pcap_set_file *file = (struct pcap_set_file *)calloc(num_files, sizeof(struct pcap_set_file));
+    set.worker = (struct pcap_set_worker *)calloc(num_workers, sizeof(struct pcap_set_worker));
+    if (set.worker) {
+	for (unsigned int j = 0; j < num_workers; j++) {
+	    set.worker[j].set = &set;
+	    set.worker[j].wnum = j;
+	    pthread_mutex_init(&set.worker[j].deque.mutex, NULL);
+	}
+    }
+    if (file == NULL || set.worker == NULL) {
+	fprintf(stderr, "error: could not allocate memory for file reader pool\n");
+	status = status_err;
+	goto cleanup;
+    }
+
+    /*
+     * make a task for each file, or for each chunk of a large file; a
+     * file that cannot be found is reported and skipped
+     */
+    for (unsigned int i = 0; i < num_files; i++) {
+	struct stat statbuf;
+	file[i].name = names[i];
+	if (filename_append(file[i].path, dirname, "/", names[i]) != status_ok || stat(file[i].path, &statbuf) != 0) {
+	    printf("%s: could not stat %s/%s\n", strerror(errno), dirname, names[i]);
+	    file[i].size = -1;
+	    continue;
+	}
+	file[i].size = statbuf.st_size;
+	if (pcap_set_file_split(&file[i], loop_count) != status_ok) {
+	    status = status_err;
+	    goto cleanup;
+	}
+	num_tasks += file[i].num_chunks ? file[i].num_chunks : 1;
+    }
+    task = (struct pcap_task *)malloc(num_tasks * sizeof(struct pcap_task));
+    if (task == NULL) {
+	fprintf(stderr, "error: could not allocate memory for file reader pool\n");
+	status = status_err;
+	goto cleanup;
+    }
+    for (unsigned int i = 0; i < num_files; i++) {
+	if (file[i].size < 0) {
+	    continue;
+	}
+	if (file[i].num_chunks == 0) {
+	    task[n++] = { pcap_task_file, &file[i], 0, file[i].size };
+	    continue;
+	}
+	for (uint64_t k = 0; k < file[i].num_chunks; k++) {
+	    struct pcap_set_chunk *c = &file[i].chunk[k];
+	    task[n++] = { k ? pcap_task_scan : pcap_task_process, &file[i], k, c->end - c->begin };
+	}
+    }
+
+    /*
+     * deal the tasks out, largest first, to the worker with the least
+     * work; each deque is filled from the top, so that its owner
+     * starts with the largest task, and thieves take the smallest
+     */
+    qsort(task, num_tasks, sizeof(struct pcap_task), pcap_task_cmp);
+    load = (uint64_t *)calloc(num_workers, sizeof(uint64_t));
+    owner = (unsigned int *)malloc(num_tasks * sizeof(unsigned int));
+    if (load == NULL || owner == NULL) {
+	fprintf(stderr, "error: could not allocate memory for file reader pool\n");
+	status = status_err;
+	goto cleanup;
+    }
+    for (uint64_t i = 0; i < num_tasks; i++) {
+	unsigned int least = 0;
+	for (unsigned int j = 1; j < num_workers; j++) {
+	    if (load[j] < load[least]) {
+		least = j;
+	    }
+	}
+	owner[i] = least;
+	load[least] += task[i].weight;
+    }
+    for (uint64_t i = num_tasks; i-- > 0; ) {
+	if (!pcap_deque_push(&set.worker[owner[i]].deque, &task[i])) {
+	    status = status_err;
+	    goto cleanup;
+	}
+    }
+    set.pending = num_tasks;
+
+    /*
+     * each worker steals from the others once its own deque is empty,
+     * so the tasks are all done as long as one worker starts
+     */
+    start = pcap_set_ns();
+    for (unsigned int j = 0; j < num_workers; j++) {
+	int err = pthread_create(&set.worker[j].tid, NULL, pcap_set_worker_func, &set.worker[j]);
+	if (err) {
+	    printf("%s: error creating file reader thread\n", strerror(err));
+	    status = status_err;
+	    break;
+	}
+	num_started++;
+    }
+    for (unsigned int j = 0; j < num_started; j++) {
+	pthread_join(set.worker[j].tid, NULL);
+	*packets += set.worker[j].packets;
+	*bytes += set.worker[j].bytes;
+    }
+    elapsed = (pcap_set_ns() - start) / 1e9;
+
+    /*
+     * report the work done by each worker
+     */
+    for (unsigned int j = 0; j < num_started; j++) {
+	struct pcap_set_worker *w = &set.worker[j];
+	double busy = w->busy_ns / 1e9;
+	printf("worker %u: files %lu, chunks %lu, scans %lu, steals %lu; packets %lu, bytes %lu; busy %.3f s (%.1f%%); %.1f MB/s, %.0f packets/s\n",
+	       j, w->files, w->chunks, w->scans, w->steals, w->packets, w->bytes,
+	       busy, elapsed > 0 ? 100.0 * busy / elapsed : 0.0,
+	       busy > 0 ? w->bytes / busy / 1e6 : 0.0, busy > 0 ? w->packets / busy : 0.0);
+    }
+    printf("all workers: files %u, packets %lu, bytes %lu in %.3f s; %.1f MB/s, %.0f packets/s\n",
+	   num_files, *packets, *bytes, elapsed,
+	   elapsed > 0 ? *bytes / elapsed / 1e6 : 0.0, elapsed > 0 ? *packets / elapsed : 0.0);
+    if (set.rescans) {
+	printf("info: %lu chunks were scanned again to find their first packet\n", set.rescans);
+    }
+    if (set.failed || num_started == 0) {
+	status = status_err;
+    }
+
+ cleanup:
+    if (set.worker) {
+	for (unsigned int j = 0; j < num_workers; j++) {
+	    free(set.worker[j].deque.task);
+	    pthread_mutex_destroy(&set.worker[j].deque.mutex);
+	}
+    }
+    if (file) {
+	for (unsigned int i = 0; i < num_files; i++) {
+	    if (file[i].m.map) {
+		munmap(file[i].m.map, file[i].m.file_size);
+		pcap_file_close(&file[i].rf);
+	    }
+	    free(file[i].chunk);
+	}
+    }
+    free(load);
+    free(owner);
+    free(task);
+    free(file);
+    free(set.worker);
+    pthread_mutex_destroy(&set.mutex);
+    pthread_cond_destroy(&set.cond);
+
+    return status;
+}
@@ -0,0 +1,69 @@
+/*
+ * pcap_file_parallel.h
+ *
+ * processing of a single pcap file by several threads at once
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef PCAP_FILE_PARALLEL_H
+#define PCAP_FILE_PARALLEL_H
+
+#include "pcap_file_io.h"
+#include "pkt_proc.h"
+
+/*
+ * pcap_file_dispatch_parallel(f, handler, num_workers) processes the
+ * packets in the file f, which must be open for reading, with
+ * num_workers threads, each of which runs its own handler from the
+ * array handler.  The file is split into chunks, which the threads
+ * scan for packet records in parallel; each packet is then passed to
+ * the handler selected by its flow hash, so all of the packets in a
+ * flow are processed by the same handler, in the order in which they
+ * appear in the file.  The output does not depend on the number of
+ * chunks or on how the threads are scheduled.
+ *
+ * Files that cannot be mapped in full (on 32-bit systems, or pipes)
+ * are read in sequence by the calling thread instead, with the same
+ * division of packets between the handlers.
+ *
+ * Like pcap_file_dispatch_frame_handler(), it sets f->packets_written
+ * and f->bytes_written to the packets and bytes read, and it does not
+ * make the final flush of the handlers.
+ */
+enum status pcap_file_dispatch_parallel(struct pcap_file *f,
+					struct frame_handler *handler,
+					unsigned int num_workers);
+
+/*
+ * a pcap_handler_init_func sets up handler to write the output for
+ * the input named output_id, using arg; the handler is closed with
+ * frame_handler_close() after its final flush
+ */
+typedef enum status (*pcap_handler_init_func)(struct frame_handler *handler,
+                                              const char *output_id,
+                                              void *arg);
+
+/*
+ * pcap_file_set_dispatch(dirname, names, num_files, num_workers,
+ * loop_count, init, arg, packets, bytes) processes the num_files pcap
+ * files in the directory dirname, whose names are in the array names,
+ * with a pool of num_workers threads that steal work from each other.
+ * The handler for each file, or for each chunk of a large file, is
+ * set up by init; a file is read loop_count times, unless it is split
+ * into chunks, which happens only when loop_count is one.  The number
+ * of packets and bytes read is returned through packets and bytes,
+ * and a summary of the work done by each thread is printed.
+ */
+enum status pcap_file_set_dispatch(const char *dirname,
+                                   char **names,
+                                   unsigned int num_files,
+                                   unsigned int num_workers,
+                                   int loop_count,
+                                   pcap_handler_init_func init,
+                                   void *arg,
+                                   uint64_t *packets,
+                                   uint64_t *bytes);
+
+#endif /* PCAP_FILE_PARALLEL_H */
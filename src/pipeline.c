@@ -0,0 +1,254 @@
+/*
+ * pipeline.c
+ *
+ * hand-off of captured packets to a thread that processes and writes
+ * them out, so that ring blocks can be returned to the kernel as soon
+ * as they have been copied
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <new>
+#include "pipeline.h"
+#include "spsc_ring.h"
+#include "thread_stats.h"
+
+/*
+ * a chunk holds a sequence of records, each of which is a struct
+ * packet_info followed by the packet data, padded to a multiple of
+ * PIPELINE_ALIGN bytes
+ */
+#define PIPELINE_ALIGN 8
+
+struct pipeline_chunk {
+    uint64_t enqueue_ns;     /* when the chunk was handed to the writer */
+    size_t length;           /* bytes of records in data                */
+    uint8_t *data;
+};
+
+struct pipeline {
+    struct spsc_ring full;   /* capture thread to writer */
+    struct spsc_ring empty;  /* writer to capture thread */
+    struct pipeline_chunk *chunk;
+    unsigned int num_chunks;
+    size_t chunk_size;
+    struct pipeline_chunk *current;   /* chunk being filled, or NULL */
+    uint64_t handed_off;              /* chunks handed to the writer */
+    struct frame_handler *handler;    /* run by the writer           */
+    pthread_t writer;
+    alignas(64) std::atomic<uint64_t> completed;  /* chunks processed by the writer */
+    std::atomic<bool> stop;
+};
+
+static inline uint64_t pipeline_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t pipeline_record_length(size_t caplen) {
+    return (sizeof(struct packet_info) + caplen + PIPELINE_ALIGN - 1) & ~(size_t)(PIPELINE_ALIGN - 1);
+}
+
+static void pipeline_process_chunk(struct pipeline *p, struct pipeline_chunk *c) {
+    uint8_t *record = c->data;
+    uint8_t *end = c->data + c->length;
+    while (record < end) {
+	struct packet_info *pi = (struct packet_info *)record;
+	p->handler->func(&p->handler->context, pi, record + sizeof(struct packet_info));
+	record += pipeline_record_length(pi->caplen);
+    }
+    frame_handler_flush(p->handler, false);
+}
+
+/*
+ * pipeline_writer_drain(p, stats) processes all of the chunks that
+ * have been handed to the writer, and returns the number processed
+ */
+static unsigned int pipeline_writer_drain(struct pipeline *p, struct thread_stats *stats) {
+    unsigned int count = 0;
+    struct pipeline_chunk *c;
+    while ((c = (struct pipeline_chunk *)spsc_ring_pop(&p->full)) != NULL) {
+	thread_stats_add(stats, thread_stat_chunks_dequeued, 1);
+	thread_stats_add(stats, thread_stat_queue_ns, pipeline_ns() - c->enqueue_ns);
+	pipeline_process_chunk(p, c);
+	c->length = 0;
+	spsc_ring_push(&p->empty, c);  /* cannot fail; the rings hold all of the chunks */
+	p->completed.fetch_add(1, std::memory_order_release);
+	count++;
+    }
+    return count;
+}
+
+/*
+ * the writer polls for chunks, yielding the processor when there are
+ * none, and sleeping when there have been none for a while
+ */
+#define PIPELINE_SPIN_LIMIT  64
+#define PIPELINE_IDLE_USEC  100
+
+static void *pipeline_writer_func(void *arg) {
+    struct pipeline *p = (struct pipeline *)arg;
+    struct thread_stats *stats = thread_stats_get();
+    unsigned int idle = 0;
+
+    while (true) {
+	if (pipeline_writer_drain(p, stats)) {
+	    idle = 0;
+	    continue;
+	}
+	if (p->stop.load(std::memory_order_acquire)) {
+	    pipeline_writer_drain(p, stats);  /* chunks handed off before stop was set */
+	    break;
+	}
+	if (++idle < PIPELINE_SPIN_LIMIT) {
+	    sched_yield();
+	} else {
+	    usleep(PIPELINE_IDLE_USEC);
+	}
+    }
+    frame_handler_flush(p->handler, true);
+    return NULL;
+}
+
+static void pipeline_free(struct pipeline *p) {
+    if (p->chunk) {
+	for (unsigned int i = 0; i < p->num_chunks; i++) {
+	    free(p->chunk[i].data);
+	}
+	delete[] p->chunk;
+    }
+    spsc_ring_free(&p->full);
+    spsc_ring_free(&p->empty);
+    delete p;
+}
+
+struct pipeline *pipeline_start(struct frame_handler *handler,
+				size_t chunk_size,
+				unsigned int num_chunks) {
+    if (num_chunks == 0 || chunk_size < pipeline_record_length(0)) {
+	return NULL;
+    }
+    struct pipeline *p = new (std::nothrow) struct pipeline;
+    if (p == NULL) {
+	return NULL;
+    }
+    p->num_chunks = num_chunks;
+    p->chunk_size = chunk_size;
+    p->current = NULL;
+    p->handed_off = 0;
+    p->handler = handler;
+    p->completed.store(0);
+    p->stop.store(false);
+    p->chunk = new (std::nothrow) struct pipeline_chunk[num_chunks];
+    bool ok = spsc_ring_init(&p->full, num_chunks) && spsc_ring_init(&p->empty, num_chunks) && p->chunk;
+    if (p->chunk) {
+	for (unsigned int i = 0; i < num_chunks; i++) {
+	    p->chunk[i].length = 0;
+	    p->chunk[i].data = (uint8_t *)malloc(chunk_size);
+	    ok = ok && p->chunk[i].data;
+	}
+    }
+    if (!ok) {
+	fprintf(stderr, "error: could not allocate pipeline memory\n");
+	pipeline_free(p);
+	return NULL;
+    }
+    for (unsigned int i = 0; i < num_chunks; i++) {
+	spsc_ring_push(&p->empty, &p->chunk[i]);
+    }
+
+    int err = pthread_create(&p->writer, NULL, pipeline_writer_func, p);
+    if (err) {
+	fprintf(stderr, "%s: error creating pipeline writer thread\n", strerror(err));
+	pipeline_free(p);
+	return NULL;
+    }
+    return p;
+}
+
+#define PIPELINE_WAIT_USEC 10
+
+/*
+ * pipeline_get_chunk(p) returns an empty chunk, waiting for the writer
+ * to return one if need be
+ */
+static struct pipeline_chunk *pipeline_get_chunk(struct pipeline *p) {
+    struct pipeline_chunk *c = (struct pipeline_chunk *)spsc_ring_pop(&p->empty);
+    if (c == NULL) {
+	thread_stats_add(thread_stats_get(), thread_stat_queue_stalls, 1);
+	while ((c = (struct pipeline_chunk *)spsc_ring_pop(&p->empty)) == NULL) {
+	    usleep(PIPELINE_WAIT_USEC);
+	}
+    }
+    return c;
+}
+
+static void pipeline_hand_off(struct pipeline *p) {
+    struct pipeline_chunk *c = p->current;
+    if (c == NULL || c->length == 0) {
+	return;
+    }
+    c->enqueue_ns = pipeline_ns();
+    spsc_ring_push(&p->full, c);  /* cannot fail; the rings hold all of the chunks */
+    thread_stats_add(thread_stats_get(), thread_stat_chunks_queued, 1);
+    p->handed_off++;
+    p->current = NULL;
+}
+
+static void frame_handler_pipeline(void *userdata,
+				   struct packet_info *pi,
+				   uint8_t *eth) {
+    struct pipeline *p = ((union frame_handler_context *)userdata)->pipeline;
+    size_t length = pipeline_record_length(pi->caplen);
+
+    if (length > p->chunk_size) {
+	return;  /* cannot happen when chunks are as large as the largest ring block */
+    }
+    if (p->current && p->current->length + length > p->chunk_size) {
+	pipeline_hand_off(p);
+    }
+    if (p->current == NULL) {
+	p->current = pipeline_get_chunk(p);
+    }
+    uint8_t *record = p->current->data + p->current->length;
+    memcpy(record, pi, sizeof(struct packet_info));
+    memcpy(record + sizeof(struct packet_info), eth, pi->caplen);
+    p->current->length += length;
+}
+
+static void frame_handler_pipeline_flush(void *userdata, bool final) {
+    struct pipeline *p = ((union frame_handler_context *)userdata)->pipeline;
+
+    pipeline_hand_off(p);
+    if (final) {
+	/* wait until the writer has processed every chunk */
+	while (p->completed.load(std::memory_order_acquire) != p->handed_off) {
+	    usleep(PIPELINE_WAIT_USEC);
+	}
+    }
+}
+
+enum status frame_handler_pipeline_init(struct frame_handler *handler,
+					struct pipeline *p) {
+    handler->func = frame_handler_pipeline;
+    handler->flush = frame_handler_pipeline_flush;
+    handler->close = NULL;
+    handler->context.pipeline = p;
+    return status_ok;
+}
+
+void pipeline_stop(struct pipeline *p) {
+    pipeline_hand_off(p);
+    p->stop.store(true, std::memory_order_release);
+    pthread_join(p->writer, NULL);
+    pipeline_free(p);
+}
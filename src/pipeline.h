@@ -0,0 +1,57 @@
+/*
+ * pipeline.h
+ *
+ * hand-off of captured packets to a thread that processes and writes
+ * them out, so that ring blocks can be returned to the kernel as soon
+ * as they have been copied
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include "pkt_proc.h"
+
+/*
+ * struct pipeline connects a capture thread to a writer thread that
+ * runs a frame handler on its behalf.  The capture thread copies
+ * packets into a chunk of memory, and passes full chunks to the writer
+ * through a single-producer single-consumer ring; the writer runs the
+ * handler on the packets in each chunk, and returns the empty chunk
+ * through a second ring.  When all of the chunks are in use, the
+ * capture thread waits for the writer, so that the ring (and not the
+ * pipeline) absorbs any excess load, and the kernel's drop counters
+ * stay accurate.
+ */
+struct pipeline;
+
+/*
+ * pipeline_start(handler, chunk_size, num_chunks) allocates a pipeline
+ * with num_chunks chunks of chunk_size bytes, and starts a writer
+ * thread that runs handler, which must stay in place until the
+ * pipeline is stopped; it returns NULL on failure
+ */
+struct pipeline *pipeline_start(struct frame_handler *handler,
+				size_t chunk_size,
+				unsigned int num_chunks);
+
+/*
+ * frame_handler_pipeline_init(handler, p) initializes handler to copy
+ * each frame into the pipeline p; flushing handler hands the frames
+ * copied so far to the writer, and a final flush waits until the
+ * writer has processed them
+ */
+enum status frame_handler_pipeline_init(struct frame_handler *handler,
+					struct pipeline *p);
+
+/*
+ * pipeline_stop(p) waits until the writer has processed all of the
+ * chunks handed to it and has flushed its handler, stops the writer,
+ * and frees p
+ */
+void pipeline_stop(struct pipeline *p);
+
+#endif /* PIPELINE_H */
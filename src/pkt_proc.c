@@ -11,6 +11,7 @@
 #include "pcap_file_io.h"
 #include "json_file_io.h"
 #include "packet.h"
+#include "thread_stats.h"
 
 void frame_handler_filter_write_pcap(void *userdata,
 				     struct packet_info *pi,
@@ -27,15 +28,27 @@ void frame_handler_filter_write_pcap(void *userdata,
     extractor_init(&x, extractor_buffer, 2048);
     parser_init(&p, (unsigned char *)packet, length);
     bytes_extracted = parser_extractor_process_packet(&p, &x);
+    struct thread_stats *stats = thread_stats_get();
+    thread_stats_count_extraction(stats, bytes_extracted, x.fingerprint_type);
 
     /*
      * NOTE: 16 is an arbitrary threshold; should probably be raised
      */
     if (bytes_extracted > 16) {
-	pcap_file_write_packet_direct(&fhc->pcap_file, eth_hdr, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
+	uint64_t bytes_before = fhc->pcap_file.bytes_written;
+	if (pcap_file_write_packet_direct(&fhc->pcap_file, eth_hdr, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000) == status_ok) {
+	    thread_stats_add(stats, thread_stat_records_written, 1);
+	    thread_stats_add(stats, thread_stat_bytes_written, fhc->pcap_file.bytes_written - bytes_before);
+	}
     }
 }
 
+void frame_handler_close_pcap(void *userdata) {
+    union frame_handler_context *fhc = (union frame_handler_context *)userdata;
+
+    pcap_file_close(&fhc->pcap_file);
+}
+
 enum status frame_handler_filter_write_pcap_init(struct frame_handler *handler,
 					   const char *outfile,
 					   int flags) {
@@ -43,6 +56,8 @@ enum status frame_handler_filter_write_pcap_init(struct frame_handler *handler,
      * setup output to fingerprint file or PCAP write file
      */
     handler->func = frame_handler_filter_write_pcap;
+    handler->flush = NULL;
+    handler->close = frame_handler_close_pcap;
     enum status status = pcap_file_open(&handler->context.pcap_file, outfile, io_direction_writer, flags);
     
     return status;
@@ -54,8 +69,12 @@ void frame_handler_write_pcap(void *userdata,
 			      uint8_t *eth) {
     union frame_handler_context *fhc = (union frame_handler_context *)userdata;
 
-    pcap_file_write_packet_direct(&fhc->pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
-
+    uint64_t bytes_before = fhc->pcap_file.bytes_written;
+    if (pcap_file_write_packet_direct(&fhc->pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000) == status_ok) {
+	struct thread_stats *stats = thread_stats_get();
+	thread_stats_add(stats, thread_stat_records_written, 1);
+	thread_stats_add(stats, thread_stat_bytes_written, fhc->pcap_file.bytes_written - bytes_before);
+    }
 }
 
 enum status frame_handler_write_pcap_init(struct frame_handler *handler,
@@ -71,6 +90,8 @@ enum status frame_handler_write_pcap_init(struct frame_handler *handler,
 	return status_err;
     }
     handler->func = frame_handler_write_pcap;
+    handler->flush = NULL;
+    handler->close = frame_handler_close_pcap;
 
     return status_ok;
 }
@@ -84,18 +105,33 @@ void frame_handler_write_fingerprints(void *userdata,
     json_file_write(&fhc->json_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
 }
 
+void frame_handler_flush_fingerprints(void *userdata, bool final) {
+    union frame_handler_context *fhc = (union frame_handler_context *)userdata;
+
+    json_file_flush(&fhc->json_file, final);
+}
+
+void frame_handler_close_fingerprints(void *userdata) {
+    union frame_handler_context *fhc = (union frame_handler_context *)userdata;
+
+    json_file_close(&fhc->json_file);
+}
+
 enum status frame_handler_write_fingerprints_init(struct frame_handler *handler,
 						  const char *outfile_name,
 						  const char *mode,
-						  uint64_t max_records) {
+						  uint64_t max_records,
+						  bool may_drop) {
 
     enum status status;
 
-    status = json_file_init(&handler->context.json_file, outfile_name, mode, max_records);
+    status = json_file_init(&handler->context.json_file, outfile_name, mode, max_records, may_drop);
     if (status) {
 	return status;
     }
     handler->func = frame_handler_write_fingerprints;
+    handler->flush = frame_handler_flush_fingerprints;
+    handler->close = frame_handler_close_fingerprints;
 
     return status_ok;
 }
@@ -114,6 +150,8 @@ enum status frame_handler_dump_init(struct frame_handler *handler) {
 
     /* note: we leave handler->context uninitialized */
     handler->func = frame_handler_dump;
+    handler->flush = NULL;
+    handler->close = NULL;
 
     return status_ok;
 }
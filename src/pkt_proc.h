@@ -15,11 +15,22 @@
 #include "json_file_io.h"
 
 
-/* Information about each packet on the wire */
+/*
+ * Information about each packet on the wire.  The flow hash is the
+ * same for all of the packets of a flow, so that flow-level work can
+ * use it instead of hashing the flow key again; when capturing with
+ * TPACKET_V3 it is the rxhash provided by the kernel (which is
+ * computed by the NIC on some devices, and is then not necessarily
+ * the same for both directions of a flow).  Elsewhere it is computed
+ * by packet_flow_hash() only by the readers that divide packets
+ * between threads by flow, and is otherwise zero; a handler that
+ * needs it when it is zero calls packet_flow_hash() itself.
+ */
 struct packet_info {
   struct timespec ts;   /* timestamp */
   uint32_t caplen;     /* length of portion present */
   uint32_t len;        /* length this packet (off wire) */
+  uint32_t flow_hash;  /* hash of the packet's flow, or zero if none or not computed */
 };
 
 
@@ -27,6 +38,21 @@ typedef void (*frame_handler_func)(void *userdata,
 				   struct packet_info *pi,
 				   uint8_t *eth);
 
+/*
+ * a frame_handler_flush_func completes the processing of any frames
+ * that a handler has deferred (e.g. to analyze them as a batch); it
+ * is called after each block of frames, and with final set to true
+ * after the last frame, in which case it must not leave any frames
+ * deferred
+ */
+typedef void (*frame_handler_flush_func)(void *userdata, bool final);
+
+/*
+ * a frame_handler_close_func closes the output of a handler, after
+ * its final flush; the handler must not be used afterwards
+ */
+typedef void (*frame_handler_close_func)(void *userdata);
+
 /*
  * struct frame_handler 'object' includes the function pointer func
  * and the context passed to that function, which may be either a
@@ -36,21 +62,40 @@ typedef void (*frame_handler_func)(void *userdata,
  * to initialize a frame_handler, call one of the frame_handler_*_init
  * functions defined below (or define your own)
  */
+struct pipeline;
+
 union frame_handler_context {
     struct pcap_file pcap_file;
     struct json_file json_file;
+    struct pipeline *pipeline;
 };
 struct frame_handler {
     frame_handler_func func;
+    frame_handler_flush_func flush;   /* NULL if frames are never deferred */
+    frame_handler_close_func close;   /* NULL if there is nothing to close */
     union frame_handler_context context;
 };
 
+static inline void frame_handler_flush(struct frame_handler *handler, bool final) {
+    if (handler->flush) {
+	handler->flush(&handler->context, final);
+    }
+}
+
+static inline void frame_handler_close(struct frame_handler *handler) {
+    if (handler->close) {
+	handler->close(&handler->context);
+    }
+}
+
 
 /*
- * frame_handler_write_fingerprints_init(handler, outfile_name, mode)
- * initializes handler to write (TLS and TCP) fingerprints to the
- * output file with the path outfile_name and mode passed as
- * arguments; that file is opened by this invocation, with that mode.  
+ * frame_handler_write_fingerprints_init(handler, outfile_name, mode,
+ * max_records, may_drop) initializes handler to write (TLS and TCP)
+ * fingerprints to the output file with the path outfile_name and mode
+ * passed as arguments; that file is opened by this invocation, with
+ * that mode.  If may_drop is true, records are dropped when the
+ * analysis threads fall behind, rather than waiting for them.
  * 
  * return values are status_ok (no error), status_err (unspecified error),
  * or other error values
@@ -59,7 +104,8 @@ struct frame_handler {
 enum status frame_handler_write_fingerprints_init(struct frame_handler *handler,
 						  const char *outfile_name,
 						  const char *mode,
-						  uint64_t max_records);
+						  uint64_t max_records,
+						  bool may_drop);
 
 
 /*
@@ -9,9 +9,6 @@
 #include "python_interface.h"
 #include "python-inference/tls_fingerprint_min_api.h"
 
-pthread_mutex_t lock_fp_cache;
-std::unordered_map<std::string,char*> fp_cache;
-
 PyThreadState *main_thread_state = NULL;
 
 int init_python() {
@@ -20,12 +17,6 @@ int init_python() {
         return -1;
     }
   
-    if (pthread_mutex_init(&lock_fp_cache, NULL) != 0) { 
-        printf("\n mutex init has failed\n"); 
-        return 1; 
-    }
-    fp_cache = {};
-
     Py_Initialize();
     PyEval_InitThreads();
     PyRun_SimpleString("import sys");
@@ -84,44 +75,37 @@ int finalize_python() {
 }
 
 
+/*
+ * py_process_detection() returns a result string allocated with
+ * malloc(), which the caller must free; results are cached by the
+ * caller (see analysis_cache.h)
+ */
 void py_process_detection(char **results,
 			  char *fp_string,
 			  char *sni,
 			  char *dst_addr_string,
 			  int dest_port) {
-    
-    std::string fp_str(fp_string);
-    std::string server_name(sni);
-    std::string dest_addr(dst_addr_string);
-	
-    std::stringstream fp_cache_key_;
-    fp_cache_key_ << fp_str << server_name << dest_addr << dest_port;
-    std::string fp_cache_key = fp_cache_key_.str();
-
-    pthread_mutex_lock(&lock_fp_cache);
-    auto it = fp_cache.find(fp_cache_key);
-    pthread_mutex_unlock(&lock_fp_cache);
-    if (it != fp_cache.end()) {
-        *results = it->second;
-    } else {
-        const char *fp_str_ = fp_str.c_str();
-        const char *server_name_ = server_name.c_str();
-        const char *dest_addr_ = dest_addr.c_str();
-
-        PyGILState_STATE cur_state = PyGILState_Ensure();
-        process_identification_embed(results, fp_str_, server_name_, dest_addr_, dest_port);
-        PyGILState_Release(cur_state);
-
-        pthread_mutex_lock(&lock_fp_cache);
-        auto it = fp_cache.find(fp_cache_key);
-        if (it == fp_cache.end()) {
-	    fp_cache.emplace(fp_cache_key, *results);
-        } else {
-            free((*results));
-            *results = it->second;
-        }
-        pthread_mutex_unlock(&lock_fp_cache);
-    }
-}
 
+    PyGILState_STATE cur_state = PyGILState_Ensure();
+    process_identification_embed(results, fp_string, sni, dst_addr_string, dest_port);
+    PyGILState_Release(cur_state);
+}
 
+/*
+ * py_process_detection_batch() is like py_process_detection(), but
+ * computes the n results for the n sets of arguments while holding
+ * the interpreter lock only once
+ */
+void py_process_detection_batch(char **results,
+				char **fp_strings,
+				char **snis,
+				char **dst_addr_strings,
+				int *dest_ports,
+				size_t n) {
+
+    PyGILState_STATE cur_state = PyGILState_Ensure();
+    for (size_t i = 0; i < n; i++) {
+	process_identification_embed(&results[i], fp_strings[i], snis[i], dst_addr_strings[i], dest_ports[i]);
+    }
+    PyGILState_Release(cur_state);
+}
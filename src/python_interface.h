@@ -29,4 +29,11 @@ void py_process_detection(char **results,
 			  char *dst_addr_string,
 			  int dest_port);
 
+void py_process_detection_batch(char **results,
+				char **fp_strings,
+				char **snis,
+				char **dst_addr_strings,
+				int *dest_ports,
+				size_t n);
+
 #endif /* PYTHON_INTERFACE_H */
@@ -0,0 +1,96 @@
+/*
+ * spsc_ring.h
+ *
+ * bounded, lock-free, single-producer single-consumer queue of
+ * pointers
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <atomic>
+
+/*
+ * struct spsc_ring is a circular array of slots with a head index
+ * (the next slot to be read), which is written only by the consumer,
+ * and a tail index (the next slot to be written), which is written
+ * only by the producer.  The indices increase without wrapping, and
+ * are reduced modulo the capacity (a power of two) to find a slot.
+ * Each index is in its own cache line, and each side keeps a cached
+ * copy of the other side's index, so that the shared cache lines are
+ * read only when the ring appears to be full or empty.
+ */
+struct spsc_ring {
+    alignas(64) std::atomic<size_t> head;
+    size_t cached_tail;                     /* consumer's copy of tail */
+    alignas(64) std::atomic<size_t> tail;
+    size_t cached_head;                     /* producer's copy of head */
+    alignas(64) size_t mask;
+    void **slot;
+};
+
+/*
+ * spsc_ring_init(r, capacity) initializes r to hold up to capacity
+ * pointers, rounded up to a power of two; it returns false if memory
+ * could not be allocated
+ */
+static inline bool spsc_ring_init(struct spsc_ring *r, size_t capacity) {
+    size_t n = 1;
+    while (n < capacity) {
+	n *= 2;
+    }
+    r->slot = (void **)calloc(n, sizeof(void *));
+    r->mask = n - 1;
+    r->head.store(0, std::memory_order_relaxed);
+    r->tail.store(0, std::memory_order_relaxed);
+    r->cached_head = 0;
+    r->cached_tail = 0;
+    return r->slot != NULL;
+}
+
+static inline void spsc_ring_free(struct spsc_ring *r) {
+    free(r->slot);
+    r->slot = NULL;
+}
+
+/*
+ * spsc_ring_push(r, p) appends p to the ring, and returns false if
+ * the ring is full; only the producer may call it
+ */
+static inline bool spsc_ring_push(struct spsc_ring *r, void *p) {
+    size_t tail = r->tail.load(std::memory_order_relaxed);
+    if (tail - r->cached_head > r->mask) {
+	r->cached_head = r->head.load(std::memory_order_acquire);
+	if (tail - r->cached_head > r->mask) {
+	    return false;
+	}
+    }
+    r->slot[tail & r->mask] = p;
+    r->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+/*
+ * spsc_ring_pop(r) removes and returns the oldest pointer in the
+ * ring, or returns NULL if the ring is empty; only the consumer may
+ * call it
+ */
+static inline void *spsc_ring_pop(struct spsc_ring *r) {
+    size_t head = r->head.load(std::memory_order_relaxed);
+    if (head == r->cached_tail) {
+	r->cached_tail = r->tail.load(std::memory_order_acquire);
+	if (head == r->cached_tail) {
+	    return NULL;
+	}
+    }
+    void *p = r->slot[head & r->mask];
+    r->head.store(head + 1, std::memory_order_release);
+    return p;
+}
+
+#endif /* SPSC_RING_H */
@@ -0,0 +1,47 @@
+/*
+ * thread_stats.c
+ *
+ * per-thread counters that are written only by their own thread
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "thread_stats.h"
+
+thread_local struct thread_stats *thread_stats_current = NULL;
+
+/*
+ * blocks are pushed onto the front of the list, and never removed, so
+ * readers can walk the list without a lock
+ */
+static std::atomic<struct thread_stats *> thread_stats_list(NULL);
+
+struct thread_stats *thread_stats_register() {
+    void *mem = NULL;
+    if (posix_memalign(&mem, alignof(struct thread_stats), sizeof(struct thread_stats)) != 0) {
+	return NULL;
+    }
+    struct thread_stats *s = (struct thread_stats *)mem;
+    memset(s, 0, sizeof(*s));
+
+    struct thread_stats *head = thread_stats_list.load(std::memory_order_relaxed);
+    do {
+	s->next = head;
+    } while (!thread_stats_list.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+
+    thread_stats_current = s;
+    return s;
+}
+
+void thread_stats_sum(uint64_t total[thread_stat_count]) {
+    memset(total, 0, thread_stat_count * sizeof(uint64_t));
+    for (const struct thread_stats *s = thread_stats_list.load(std::memory_order_acquire); s != NULL; s = s->next) {
+	for (unsigned int i = 0; i < thread_stat_count; i++) {
+	    total[i] += thread_stats_load(s, (enum thread_stat)i);
+	}
+    }
+}
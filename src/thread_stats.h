@@ -0,0 +1,127 @@
+/*
+ * thread_stats.h
+ *
+ * per-thread counters that are written only by their own thread
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef THREAD_STATS_H
+#define THREAD_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "extractor.h"
+
+/*
+ * enum thread_stat identifies a counter in a struct thread_stats
+ */
+enum thread_stat {
+    thread_stat_packets = 0,            /* packets received from the ring       */
+    thread_stat_bytes,                  /* bytes received from the ring         */
+    thread_stat_blocks,                 /* ring blocks processed                */
+    thread_stat_polls,                  /* calls to poll()                      */
+    thread_stat_wait_ns,                /* time spent waiting for a block       */
+    thread_stat_process_ns,             /* time spent processing blocks         */
+    thread_stat_fingerprint_tcp,        /* packets with a TCP fingerprint       */
+    thread_stat_fingerprint_tls,        /* packets with a TLS fingerprint       */
+    thread_stat_fingerprint_tls_server, /* packets with TLS server data         */
+    thread_stat_fingerprint_http,       /* packets with an HTTP fingerprint     */
+    thread_stat_fingerprint_http_server,/* packets with an HTTP server fingerprint */
+    thread_stat_no_fingerprint,         /* packets from which nothing was extracted */
+    thread_stat_records_written,        /* JSON records or packets written      */
+    thread_stat_bytes_written,          /* bytes written to output files        */
+    thread_stat_analysis_hits,          /* analysis results found in the cache  */
+    thread_stat_analysis_misses,        /* analysis results computed            */
+    thread_stat_chunks_queued,          /* pipeline chunks handed to a writer   */
+    thread_stat_chunks_dequeued,        /* pipeline chunks taken by a writer    */
+    thread_stat_queue_ns,               /* time that those chunks were queued   */
+    thread_stat_queue_stalls,           /* waits for a free pipeline chunk      */
+    thread_stat_count
+};
+
+/*
+ * struct thread_stats is a block of counters that is written only by
+ * the thread that owns it, so that counting costs no more than an add
+ * to a cache line that stays with that thread.  Other threads (such as
+ * the stats thread) may read the counters at any time; each counter is
+ * stored and loaded atomically, so a reader sees a recent value, but
+ * the counters of a block are not a consistent snapshot.
+ */
+struct thread_stats {
+    alignas(64) uint64_t counter[thread_stat_count];
+    struct thread_stats *next;   /* next block in the list of all blocks */
+};
+
+/*
+ * thread_stats_get() returns the counter block of the calling thread,
+ * which is allocated (on the NUMA node of the thread) and registered on
+ * the first call; blocks are never freed, so that the counts of
+ * threads that have exited are kept in the totals.  It returns NULL if
+ * memory could not be allocated.
+ */
+extern thread_local struct thread_stats *thread_stats_current;
+
+struct thread_stats *thread_stats_register();
+
+static inline struct thread_stats *thread_stats_get() {
+    struct thread_stats *s = thread_stats_current;
+    return s ? s : thread_stats_register();
+}
+
+/*
+ * thread_stats_add(s, stat, n) adds n to a counter of the block s,
+ * which must belong to the calling thread (or be NULL, in which case
+ * nothing is counted)
+ */
+static inline void thread_stats_add(struct thread_stats *s, enum thread_stat stat, uint64_t n) {
+    if (s) {
+	__atomic_store_n(&s->counter[stat], s->counter[stat] + n, __ATOMIC_RELAXED);
+    }
+}
+
+static inline uint64_t thread_stats_load(const struct thread_stats *s, enum thread_stat stat) {
+    return __atomic_load_n(&s->counter[stat], __ATOMIC_RELAXED);
+}
+
+/*
+ * thread_stats_count_extraction(s, bytes_extracted, type) counts the
+ * outcome of running the extractor on a packet
+ */
+static inline void thread_stats_count_extraction(struct thread_stats *s,
+						 size_t bytes_extracted,
+						 enum fingerprint_type type) {
+    enum thread_stat stat = thread_stat_no_fingerprint;
+    if (bytes_extracted > 16) {
+	switch(type) {
+	case fingerprint_type_tcp:
+	    stat = thread_stat_fingerprint_tcp;
+	    break;
+	case fingerprint_type_tls:
+	case fingerprint_type_tls_sni:
+	    stat = thread_stat_fingerprint_tls;
+	    break;
+	case fingerprint_type_tls_server:
+	    stat = thread_stat_fingerprint_tls_server;
+	    break;
+	case fingerprint_type_http:
+	    stat = thread_stat_fingerprint_http;
+	    break;
+	case fingerprint_type_http_server:
+	    stat = thread_stat_fingerprint_http_server;
+	    break;
+	default:
+	    ;
+	}
+    }
+    thread_stats_add(s, stat, 1);
+}
+
+/*
+ * thread_stats_sum(total) sets total to the sums of the counters of
+ * all of the blocks that have been registered
+ */
+void thread_stats_sum(uint64_t total[thread_stat_count]);
+
+#endif /* THREAD_STATS_H */
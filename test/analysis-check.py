@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# analysis-check.py checks the analysis results in an expected output
+# file (such as data/top_100_fingerprints.analysis) against a plain
+# python port of identify_embed() and its helpers in
+# src/python-inference/tls_fingerprint_min.pyx, which is the scoring
+# that the native analysis engine reproduces
+#
+# usage: analysis-check.py resource_dir analysis_file
+#
+import sys, json, gzip, ipaddress
+from math import log, exp
+R = sys.argv[1] + '/'
+port_mapping = {443: 'https',448 :'database',465:'email',563:'nntp',585:'email',614:'shell',636:'ldap',
+                989:'ftp',990:'ftp',991:'nas',992:'telnet',993:'email',994:'irc',995:'email',1443:'alt-https',
+                2376:'docker',8001:'tor',8443:'alt-https',9000:'tor',9001:'tor',9002:'tor',9101:'tor'}
+tlds = set()
+for line in gzip.open(R+'public_suffix_list.dat.gz', 'rt'):
+    line = str(line.strip())
+    if line.startswith('//') or line == '':
+        continue
+    if line.startswith('*'):
+        line = line[2:]
+    tlds.add(line)
+prefixes = {}
+for line in gzip.open(R+'pyasn.db.gz', 'rt'):
+    if line.startswith(';'):
+        continue
+    p, a = line.split()
+    net = ipaddress.ip_network(p, strict=False)
+    prefixes[(net.version, int(net.network_address), net.prefixlen)] = int(a)
+as_info = {}
+for line in gzip.open(R+'asn_info.db.gz', 'rt'):
+    t = line.split()
+    as_info[int(t[0])] = t[1]
+db = {}
+MALWARE_DB = True
+for line in gzip.open(R+'fingerprint_db.json.gz', 'rt'):
+    fp = json.loads(line)
+    fp['str_repr'] = bytes(fp['str_repr'].replace('()',''), 'utf-8')
+    for p in fp['process_info']:
+        if 'malware' not in p:
+            MALWARE_DB = False
+    db[fp['str_repr']] = fp
+
+def get_asn_info(addr):
+    a = ipaddress.ip_address(addr)
+    bits = 32 if a.version == 4 else 128
+    v = int(a)
+    for plen in range(bits, -1, -1):
+        k = (a.version, (v >> (bits - plen)) << (bits - plen), plen)
+        if k in prefixes:
+            return as_info[prefixes[k]]
+    return 'unknown'
+
+def get_tld_info(hostname):
+    tokens_ = hostname.split('.')
+    N = len(tokens_)
+    tld_ = tokens_[N-1]; tmp_tld_ = tld_; domain_ = tld_; tmp_domain_ = tld_
+    if N > 1:
+        domain_ = f'{tokens_[N-2]}.{domain_}'
+        tmp_domain_ = f'{tokens_[N-2]}.{tmp_domain_}'
+    for i in range(2,7):
+        if N < i:
+            return domain_, tld_
+        if N > i:
+            tmp_domain_ = f'{tokens_[N-(i+1)]}.{tmp_domain_}'
+        tmp_tld_ = f'{tokens_[N-i]}.{tmp_tld_}'
+        if tmp_tld_ in tlds:
+            domain_ = tmp_domain_; tld_ = tmp_tld_
+    return domain_, tld_
+
+def identify_embed(fp_str_, asn, domain, port_app):
+    fp_ = db[fp_str_]; procs_ = fp_['process_info']
+    base_prior_ = -18.42068; prior_ = -4.60517
+    score_sum_ = 0.0; fp_tc_ = fp_['total_count']
+    sec_mal = max_mal = False; max_score = 0.0; max_proc = 'Unknown'; sec_score = 0.0; sec_proc = 'Unknown'; malware_prob = 0.0
+    for p_ in procs_:
+        p_count = p_['count']
+        score_ = max(log(p_count/fp_tc_), base_prior_)*3
+        for feat, cls in ((asn, 'classes_ip_as'), (domain, 'classes_hostname_domains'), (port_app, 'classes_port_applications')):
+            if feat in p_[cls]:
+                score_ += max(log(p_[cls][feat]/p_count), prior_)
+            else:
+                score_ += base_prior_
+        score_ = exp(score_)
+        score_sum_ += score_
+        if MALWARE_DB:
+            if p_['malware'] == True and score_ > 0.0:
+                malware_prob += score_
+            if score_ > max_score:
+                sec_score, sec_proc, sec_mal = max_score, max_proc, max_mal
+                max_score, max_proc, max_mal = score_, p_['process'], p_['malware']
+            elif score_ > sec_score:
+                sec_score, sec_proc, sec_mal = score_, p_['process'], p_['malware']
+        else:
+            if score_ > max_score:
+                max_score, max_proc = score_, p_['process']
+    if MALWARE_DB and max_proc == 'Generic DMZ Traffic' and sec_mal == False:
+        max_proc = sec_proc
+    if score_sum_ > 0.0:
+        max_score /= score_sum_
+        if MALWARE_DB:
+            malware_prob /= score_sum_
+    return (max_proc, max_score, max_mal, malware_prob) if MALWARE_DB else (max_proc, max_score)
+
+n = bad = 0
+for line in open(sys.argv[2]):
+    r = json.loads(line)
+    fp = r['tls'].encode()
+    if fp not in db:
+        py = ('Unknown', 0.0)
+    else:
+        py = identify_embed(fp, get_asn_info(r['da']), get_tld_info(r['sni'] or '')[0], port_mapping.get(r['dp'], 'unknown'))
+    a = r['analysis']
+    n += 1
+    if a['process'] != py[0] or abs(a['score'] - py[1]) > 1e-9 * max(1.0, abs(py[1])):
+        bad += 1
+        print('mismatch:', r['sni'], r['dp'], a, py)
+print(n, 'results,', bad, 'mismatches')
+sys.exit(1 if bad else 0)
@@ -0,0 +1,164 @@
+/*
+ * find_delim_test.c
+ *
+ * test of the delimiter search in extractor.c against memmem(); the
+ * data is placed at the end of a page that is followed by an
+ * inaccessible one, so that a read past the end of the data faults
+ *
+ * The kernel under test is the one selected by the compiler flags:
+ * define FIND_DELIM_SSE2 to test the SSE2 kernel on a machine that
+ * has AVX2, or FIND_DELIM_SCALAR to test the scalar loop alone.
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#if defined(FIND_DELIM_SCALAR)
+#undef __AVX2__
+#undef __SSE2__
+#elif defined(FIND_DELIM_SSE2)
+#undef __AVX2__
+#endif
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../src/extractor.c"   /* for find_delim() */
+
+#if defined(__AVX2__)
+#define KERNEL "avx2"
+#elif defined(__SSE2__)
+#define KERNEL "sse2"
+#else
+#define KERNEL "scalar"
+#endif
+
+#define NUM_CASES    2000000
+#define MAX_DATA_LEN 256
+
+static unsigned char *page_end;   /* first byte of the inaccessible page */
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static inline uint64_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * check(data, len, delim, delim_len) compares find_delim() and
+ * parser_find_delim() with memmem() on the len bytes at data, which
+ * end at page_end, and returns 1 if they disagree
+ */
+static unsigned int check(const unsigned char *data, size_t len, const char *delim, size_t delim_len) {
+    const unsigned char *expected = (const unsigned char *)memmem(data, len, delim, delim_len);
+    const unsigned char *found = find_delim(data, data + len, (const unsigned char *)delim, delim_len);
+
+    struct parser p;
+    parser_init(&p, data, len);
+    int index = parser_find_delim(&p, (const unsigned char *)delim, delim_len);
+    int expected_index = expected ? expected + delim_len - data : -1;
+
+    if (found != expected || index != expected_index) {
+	fprintf(stderr, "error: delimiter of length %zu in data of length %zu found at %zd (index %d), expected %zd\n",
+		delim_len, len, found ? found - data : -1, index, expected ? expected - data : -1);
+	return 1;
+    }
+    return 0;
+}
+
+static unsigned char *place(const void *data, size_t len) {
+    unsigned char *d = page_end - len;
+    memcpy(d, data, len);
+    return d;
+}
+
+/*
+ * check_partial_match() checks "\r\n" in "\r\r\n", at each offset in
+ * data of each length, which crosses the boundaries of the vector
+ * blocks; the old scans resumed after a partial match, and missed it
+ */
+static unsigned int check_partial_match() {
+    unsigned int failures = 0;
+    unsigned char buf[MAX_DATA_LEN];
+
+    for (size_t len = 3; len <= 80; len++) {
+	for (size_t offset = 0; offset + 3 <= len; offset++) {
+	    memset(buf, 'a', len);
+	    memcpy(buf + offset, "\r\r\n", 3);
+	    failures += check(place(buf, len), len, "\r\n", 2);
+	}
+    }
+    return failures;
+}
+
+/*
+ * check_data_end() checks data that ends with the first bytes of the
+ * delimiter; the old append scan read the byte at data_end in that
+ * case, which faults here
+ */
+static unsigned int check_data_end() {
+    unsigned int failures = 0;
+    unsigned char buf[MAX_DATA_LEN];
+    unsigned char output[MAX_DATA_LEN];
+    const unsigned char crlf[2] = { '\r', '\n' };
+
+    for (size_t len = 1; len <= 80; len++) {
+	memset(buf, 'a', len);
+	buf[len - 1] = '\r';
+	unsigned char *data = place(buf, len);
+	failures += check(data, len, "\r\n", 2);
+
+	struct parser p;
+	struct extractor x;
+	parser_init(&p, data, len);
+	extractor_init(&x, output, sizeof(output));
+	if (parser_extractor_copy_append_upto_delim(&p, &x, crlf) != status_err) {
+	    fprintf(stderr, "error: delimiter found in data of length %zu that ends in its first byte\n", len);
+	    failures++;
+	}
+    }
+    return failures;
+}
+
+/*
+ * check_random() checks random data made of the bytes of the
+ * delimiters, so that they and partial matches of them are common
+ */
+static unsigned int check_random() {
+    static const char *delims[] = { "\r\n", "\n", ": ", " ", "\r\n\r\n", "\r\r\n", "a\ra" };
+    static const char data_bytes[] = "\r\n: a";
+    unsigned int failures = 0;
+    unsigned char buf[MAX_DATA_LEN];
+
+    for (unsigned int i = 0; i < NUM_CASES && failures < 10; i++) {
+	size_t len = rng() % MAX_DATA_LEN;
+	unsigned int sparse = rng() % 4;   /* in 1/4 of the cases, delimiter bytes are rare */
+	for (size_t j = 0; j < len; j++) {
+	    buf[j] = (sparse == 0 && rng() % 16) ? 'a' : data_bytes[rng() % (sizeof(data_bytes) - 1)];
+	}
+	const char *delim = delims[rng() % (sizeof(delims) / sizeof(delims[0]))];
+	failures += check(place(buf, len), len, delim, strlen(delim));
+    }
+    return failures;
+}
+
+int main() {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    unsigned char *map = (unsigned char *)mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED || mprotect(map + page_size, page_size, PROT_NONE) != 0) {
+	perror("could not set up guard page");
+	return EXIT_FAILURE;
+    }
+    page_end = map + page_size;
+
+    unsigned int failures = 0;
+    failures += check_partial_match();
+    failures += check_data_end();
+    failures += check_random();
+    printf("find_delim (%s): %u failures\n", KERNEL, failures);
+
+    munmap(map, 2 * page_size);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/*
+ * keyword_matcher_test.c
+ *
+ * differential test of the compiled keyword matchers in extractor.c
+ * against a direct comparison with each keyword, as done by the
+ * keyword_matcher_check() that they replaced
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include "../src/extractor.c"   /* for its static matchers and keyword sets */
+
+#define NUM_CASES     5000000
+#define MAX_NAME_LEN  64
+
+/*
+ * reference_match(k, string, len) returns true if string is one of the
+ * keywords in the list k, which may be NULL
+ */
+static bool reference_match(const keyword_t *k, bool fold_case, const unsigned char *string, size_t len) {
+    for ( ; k && k->len; k++) {
+	if (len != k->len) {
+	    continue;
+	}
+	size_t i;
+	for (i = 0; i < len; i++) {
+	    unsigned char c = fold_case ? tolower(string[i]) : string[i];
+	    if (c != (unsigned char)k->value[i]) {
+		break;
+	    }
+	}
+	if (i == len) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * reference_classify(set, num_sets, string, len) returns the tag of
+ * the first keyword set that holds string, or zero if there is none
+ */
+static unsigned int reference_classify(const struct keyword_set *set, unsigned int num_sets,
+				       const unsigned char *string, size_t len) {
+    for (unsigned int i = 0; i < num_sets; i++) {
+	if (reference_match(set[i].case_insensitive, true, string, len)
+	    || reference_match(set[i].case_sensitive, false, string, len)) {
+	    return set[i].tag;
+	}
+    }
+    return 0;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static inline uint64_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * the bytes that random names are made of, weighted towards those
+ * that appear in header names
+ */
+static const char name_bytes[] = "abcdefghijklmnopqrstuvwxyzACDEGKLNORTUWX-_: \r\n\x80\xff";
+
+/*
+ * random_name(set, num_sets, name) writes a random name into name and
+ * returns its length; most names are keywords from the sets, with
+ * random changes of case and random edits, and the rest are random
+ */
+static size_t random_name(const struct keyword_set *set, unsigned int num_sets, unsigned char *name) {
+    size_t len = 0;
+    const keyword_t *k = NULL;
+    if (num_sets && rng() % 8) {
+	const struct keyword_set *s = &set[rng() % num_sets];
+	const keyword_t *list = (rng() % 4 || s->case_sensitive == NULL) ? s->case_insensitive : s->case_sensitive;
+	size_t n = 0;
+	while (list && list[n].len) {
+	    n++;
+	}
+	if (n) {
+	    k = &list[rng() % n];
+	}
+    }
+    if (k) {
+	len = k->len;
+	memcpy(name, k->value, len);
+	for (size_t i = 0; i < len; i++) {
+	    if (rng() % 3 == 0) {
+		name[i] = isupper(name[i]) ? tolower(name[i]) : toupper(name[i]);
+	    }
+	}
+	switch (rng() % 8) {
+	case 0:   /* change a byte */
+	    if (len) {
+		name[rng() % len] = name_bytes[rng() % (sizeof(name_bytes) - 1)];
+	    }
+	    break;
+	case 1:   /* truncate */
+	    len = len ? rng() % len : 0;
+	    break;
+	case 2:   /* extend */
+	    while (len < MAX_NAME_LEN && rng() % 2) {
+		name[len++] = name_bytes[rng() % (sizeof(name_bytes) - 1)];
+	    }
+	    break;
+	case 3:   /* change a byte to any value */
+	    if (len) {
+		name[rng() % len] = rng();
+	    }
+	    break;
+	default:  /* leave the keyword as it is */
+	    break;
+	}
+    } else {
+	len = rng() % 20;
+	for (size_t i = 0; i < len; i++) {
+	    name[i] = (rng() % 8) ? name_bytes[rng() % (sizeof(name_bytes) - 1)] : rng();
+	}
+    }
+    return len;
+}
+
+/*
+ * check_matcher(name, m, set, num_sets) compares the matcher m with
+ * the reference on NUM_CASES names, and returns the number of names on
+ * which they disagree
+ */
+static unsigned int check_matcher(const char *name,
+				  const keyword_matcher_t *m,
+				  const struct keyword_set *set,
+				  unsigned int num_sets) {
+    unsigned int failures = 0;
+    uint64_t matches = 0;
+    unsigned char string[MAX_NAME_LEN];
+
+    for (unsigned int i = 0; i < NUM_CASES; i++) {
+	size_t len = random_name(set, num_sets, string);
+	unsigned int expected = reference_classify(set, num_sets, string, len);
+	unsigned int tag = keyword_matcher_classify(m, string, len);
+	if (tag != expected) {
+	    if (failures++ < 10) {
+		fprintf(stderr, "%s: \"%.*s\" has tag %u, expected %u\n", name, (int)len, string, tag, expected);
+	    }
+	}
+	matches += (expected != 0);
+    }
+    printf("%s: %u names (%lu in a keyword set), %u failures\n", name, NUM_CASES, matches, failures);
+    return failures;
+}
+
+int main() {
+    unsigned int failures = 0;
+
+    failures += check_matcher("http request headers", http_request_header_matcher,
+			      http_request_header_keywords, 2);
+    failures += check_matcher("http response static headers", parser_spec_http_server_default.static_header_keywords,
+			      http_response_static_header_keywords, 1);
+    failures += check_matcher("no headers", parser_spec_http_server_no_headers.static_header_keywords,
+			      NULL, 0);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*
+ * block-replay.c
+ *
+ * measures the rate at which process_all_packets_in_block() handles
+ * the packets in TPACKET_V3 ring blocks, without a capture socket
+ *
+ * The packets of a capture file are copied, over and over, into
+ * NUM_BLOCKS blocks laid out as the kernel lays them out, which
+ * together are larger than the last level cache, so that (as in a
+ * capture ring) the headers of each packet are not in cache when its
+ * block is processed.  Each packet goes to a handler that runs the
+ * fingerprint extractor on it, as the JSON writer does.  The blocks
+ * are processed num_runs times, and the median rate is reported.
+ *
+ * It is built by 'make block-replay' in the src directory, which also
+ * builds block-replay-no-prefetch, with prefetching turned off
+ * (BLOCK_PREFETCH_LINES=0), for comparison.  To measure small frames,
+ * where prefetching matters most, give a snap length, e.g.
+ *
+ *    ./block-replay ../test/data/top_100_fingerprints.pcap 128
+ *    ./block-replay-no-prefetch ../test/data/top_100_fingerprints.pcap 128
+ *
+ * Copyright (c) 2019 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "../../src/af_packet_v3.h"
+#include "../../src/pcap_file_io.h"
+#include "../../src/extractor.h"
+
+#define NUM_BLOCKS      64
+#define BLOCK_SIZE      (4 * 1024 * 1024)
+#define DEFAULT_RUNS    31
+#define MAC_LEN         14
+
+#if defined(BLOCK_PREFETCH_LINES) && BLOCK_PREFETCH_LINES == 0
+#define PREFETCH "off"
+#else
+#define PREFETCH "on"
+#endif
+
+struct packet {
+    struct pcap_pkthdr pkthdr;
+    uint8_t *data;
+};
+
+/*
+ * the offset of the Ethernet header in a frame, as computed by the
+ * kernel in tpacket_rcv(): the network header is aligned, after room
+ * for the frame header and a struct sockaddr_ll
+ */
+static const unsigned int mac_offset = TPACKET_ALIGN(TPACKET3_HDRLEN + 16) - MAC_LEN;
+
+/*
+ * fill_block(block, packets, next, snaplen) fills block with frames
+ * holding packets, starting with packets[*next] and wrapping around to
+ * the first one, truncated to snaplen bytes if snaplen is nonzero
+ */
+static void fill_block(uint8_t *block, const std::vector<struct packet> &packets, size_t *next, unsigned int snaplen) {
+    struct tpacket_block_desc *desc = (struct tpacket_block_desc *)block;
+    unsigned int offset = TPACKET_ALIGN(sizeof(struct tpacket_block_desc));
+    struct tpacket3_hdr *last = NULL;
+    unsigned int num_pkts = 0;
+
+    memset(desc, 0, sizeof(*desc));
+    desc->version = TPACKET_V3;
+    desc->hdr.bh1.offset_to_first_pkt = offset;
+    while (true) {
+	const struct packet &p = packets[*next];
+	unsigned int caplen = (snaplen && p.pkthdr.caplen > snaplen) ? snaplen : p.pkthdr.caplen;
+	unsigned int frame_len = TPACKET_ALIGN(mac_offset + caplen);
+	if (offset + frame_len > BLOCK_SIZE) {
+	    break;
+	}
+	struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)(block + offset);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->tp_sec = p.pkthdr.ts.tv_sec;
+	hdr->tp_nsec = p.pkthdr.ts.tv_usec * 1000;
+	hdr->tp_snaplen = caplen;
+	hdr->tp_len = p.pkthdr.len;
+	hdr->tp_mac = mac_offset;
+	hdr->tp_net = mac_offset + MAC_LEN;
+	memcpy(block + offset + mac_offset, p.data, caplen);
+	if (last) {
+	    last->tp_next_offset = (uint8_t *)hdr - (uint8_t *)last;
+	}
+	last = hdr;
+	offset += frame_len;
+	num_pkts++;
+	*next = (*next + 1) % packets.size();
+    }
+    desc->hdr.bh1.num_pkts = num_pkts;
+    desc->hdr.bh1.blk_len = offset;
+}
+
+static uint64_t fingerprints;
+
+static void frame_handler_extract(void *userdata, struct packet_info *pi, uint8_t *eth) {
+    (void)userdata;
+    struct parser p;
+    struct extractor x;
+    unsigned char extractor_buffer[2048];
+
+    extractor_init(&x, extractor_buffer, sizeof(extractor_buffer));
+    parser_init(&p, eth, pi->caplen);
+    if (parser_extractor_process_packet(&p, &x) > 16) {
+	fingerprints++;
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+	fprintf(stderr, "usage: %s pcap_file [snaplen [num_runs]]\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    unsigned int snaplen = argc > 2 ? atoi(argv[2]) : 0;
+    unsigned int num_runs = argc > 3 ? atoi(argv[3]) : DEFAULT_RUNS;
+
+    /*
+     * read the packets of the file into memory
+     */
+    struct pcap_file rf;
+    if (pcap_file_open(&rf, argv[1], io_direction_reader, 0) != status_ok) {
+	fprintf(stderr, "error: could not open %s\n", argv[1]);
+	return EXIT_FAILURE;
+    }
+    std::vector<struct packet> packets;
+    struct pcap_pkthdr pkthdr;
+    uint8_t *data;
+    while (pcap_file_next_packet(&rf, &pkthdr, &data) == status_ok) {
+	struct packet p = { pkthdr, (uint8_t *)malloc(pkthdr.caplen) };
+	if (p.data == NULL) {
+	    fprintf(stderr, "error: could not allocate memory for packets\n");
+	    return EXIT_FAILURE;
+	}
+	memcpy(p.data, data, pkthdr.caplen);
+	packets.push_back(p);
+    }
+    pcap_file_close(&rf);
+    if (packets.empty()) {
+	fprintf(stderr, "error: no packets in %s\n", argv[1]);
+	return EXIT_FAILURE;
+    }
+
+    /*
+     * lay the packets out in blocks
+     */
+    uint8_t *blocks = (uint8_t *)aligned_alloc(4096, (size_t)NUM_BLOCKS * BLOCK_SIZE);
+    if (blocks == NULL) {
+	fprintf(stderr, "error: could not allocate memory for blocks\n");
+	return EXIT_FAILURE;
+    }
+    size_t next = 0;
+    uint64_t num_pkts = 0;
+    for (unsigned int b = 0; b < NUM_BLOCKS; b++) {
+	fill_block(blocks + (size_t)b * BLOCK_SIZE, packets, &next, snaplen);
+	num_pkts += ((struct tpacket_block_desc *)(blocks + (size_t)b * BLOCK_SIZE))->hdr.bh1.num_pkts;
+    }
+
+    struct frame_handler handler;
+    memset(&handler, 0, sizeof(handler));
+    handler.func = frame_handler_extract;
+    struct thread_stats *stats = thread_stats_get();
+
+    std::vector<double> rate;
+    for (unsigned int r = 0; r < num_runs; r++) {
+	double start = now();
+	for (unsigned int b = 0; b < NUM_BLOCKS; b++) {
+	    process_all_packets_in_block((struct tpacket_block_desc *)(blocks + (size_t)b * BLOCK_SIZE), stats, &handler);
+	}
+	rate.push_back(num_pkts / (now() - start) / 1e6);
+    }
+    std::sort(rate.begin(), rate.end());
+
+    printf("prefetch %s; snaplen: %u; %u blocks of %u bytes, %lu packets (%lu fingerprints) per run\n",
+	   PREFETCH, snaplen, NUM_BLOCKS, BLOCK_SIZE, num_pkts, fingerprints / num_runs);
+    printf("median of %u runs: %.2f Mpps (min %.2f, max %.2f)\n",
+	   num_runs, rate[rate.size() / 2], rate.front(), rate.back());
+
+    free(blocks);
+    for (struct packet &p : packets) {
+	free(p.data);
+    }
+    return EXIT_SUCCESS;
+}